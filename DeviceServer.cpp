@@ -0,0 +1,888 @@
+#include "Arduino.h"
+#include <WiFiUdp.h>
+#include "DeviceServer.h"
+#include "Persistence.h"
+#include "FirmwareUpdater.h"
+#include "ESPMetrics.h"
+#include "PresetStore.h"
+
+boolean DeviceServer::begin(uint16_t udpPort) {
+	DEBUG_PRINT("DeviceServer::begin port ");DEBUG_PRINTLN(udpPort);
+
+	return udp.begin(udpPort) == 1;
+}
+
+boolean DeviceServer::addController(ESP8266Controller* controller) {
+
+	if (controller->pin > MAX_CONTROLLER_PIN || controllers[controller->pin] != NULL) {
+		DEBUG_PRINT("DeviceServer::addController ***PIN NOT AVAILABLE*** ");DEBUG_PRINTLN(controller->pin);
+		return false;
+	}
+
+	controllers[controller->pin] = controller;
+	return true;
+}
+
+ESP8266Controller* DeviceServer::getController(uint8_t pin) {
+	return pin <= MAX_CONTROLLER_PIN ? controllers[pin] : NULL;
+}
+
+void DeviceServer::usePresets(PresetStore* store) {
+	presets = store;
+	presets->restore(this);
+}
+
+int DeviceServer::loop() {
+
+	int handled = 0;
+	unsigned long start = micros();
+
+	// non-blocking WiFi connect, if ESPConfig::init was asked for it
+	espConfig->loop();
+
+	Metrics.sample();
+
+	if (discoverHeldCount > 0 && (long)(millis() - discoverAt) >= 0) {
+		for (uint8_t i = 0; i < discoverHeldCount; i++) {
+			sendDiscoverReply(discoverHeld[i]._to, discoverHeld[i]._short);
+		}
+		discoverHeldCount = 0;
+	}
+
+	// drain everything pending, but give the controllers their loop() back within the budget
+	while (micros() - start < loopBudget * 1000) {
+
+		int packetSize = udp.parsePacket();
+		if (packetSize <= 0) {
+			break;
+		}
+
+		packetsReceived++;
+		handled++;
+
+		if (packetSize > UDP_PACKET_MAX_SIZE) {
+			DEBUG_PRINT("DeviceServer::loop ***PACKET TOO LARGE*** ");DEBUG_PRINTLN(packetSize);
+			LOG_WARN(LOG_MODULE_SERVER, LOG_EVENT_PACKET_TOO_LARGE, packetSize, 0);
+			udp.flush();
+			packetsDropped++;
+			Metrics.received(DEVICE_COMMAND_NONE);
+			Metrics.dropped(DEVICE_COMMAND_NONE);
+			continue;
+		}
+
+		int len = udp.read(packetBuffer, UDP_PACKET_MAX_SIZE);
+		_request from = { udp.remoteIP(), udp.remotePort(), false, 0 };
+
+		// take the request ID out, the handlers see the untagged packet
+		if (len >= UDP_PACKET_HEADER_SIZE + REQUEST_ID_SIZE && (packetBuffer[2] & REQUEST_ID_FLAG)) {
+			from._tagged = true;
+			from._id = packetBuffer[3] | (packetBuffer[4] << 8);
+			len -= REQUEST_ID_SIZE;
+			memmove(packetBuffer + UDP_PACKET_HEADER_SIZE, packetBuffer + UDP_PACKET_HEADER_SIZE + REQUEST_ID_SIZE, len - UDP_PACKET_HEADER_SIZE);
+			packetBuffer[0] = lowByte(len);
+			packetBuffer[1] = highByte(len);
+			packetBuffer[2] &= ~REQUEST_ID_FLAG;
+		}
+
+		byte command = len >= UDP_PACKET_HEADER_SIZE ? packetBuffer[2] : DEVICE_COMMAND_NONE;
+		Metrics.received(command);
+
+		if (from._tagged && sendRetryReply(from)) {
+			retriesAnswered++;
+			packetsReplied++;
+			Metrics.replied(command);
+			yield();
+			continue;
+		}
+
+		if (command == DEVICE_COMMAND_DISCOVER && len > UDP_PACKET_HEADER_SIZE) {
+			scheduleDiscover(packetBuffer, len, from);
+			yield();
+			continue;
+		}
+
+		if (sendCachedReply(packetBuffer, len, from)) {
+			packetsReplied++;
+			Metrics.replied(command);
+			yield();
+			continue;
+		}
+
+		// anything else overwrites the cached reply
+		cachedCommand = DEVICE_COMMAND_NONE;
+		uint16_t reply_length = dispatch(packetBuffer, len, replyBuffer);
+
+		if (reply_length == 0) {
+			packetsDropped++;
+			Metrics.dropped(command);
+			continue;
+		}
+
+		sendReply(from, replyBuffer, reply_length);
+		packetsReplied++;
+		Metrics.replied(command);
+
+		yield();
+	}
+
+	// fades of the registered controllers, their loop() puts the values out
+	for (uint8_t pin = 0; pin <= MAX_CONTROLLER_PIN; pin++) {
+		if (controllers[pin] != NULL) {
+			controllers[pin]->transitionLoop();
+		}
+	}
+
+	// a change since the last recall leaves the preset
+	if (presets != NULL) {
+		presets->loop(this);
+	}
+
+	// SETs above and controller loop()s since the last call
+	pushChanges();
+
+	// scheduled EEPROM flush
+	Persistence.loop();
+
+	return handled;
+}
+
+// DISCOVER and GET/GETALL replies are kept in replyBuffer, a repeat of the last one (discovery broadcast,
+// polling client) is sent from there as long as the target's changeCount has not moved.
+// Returns false if dispatch() has to handle the packet
+boolean DeviceServer::sendCachedReply(byte* packet, uint16_t packet_length, const _request& to) {
+
+	if (packet_length < UDP_PACKET_HEADER_SIZE) {
+		return false;
+	}
+
+	byte command = packet[2];
+	uint8_t pin = 0;
+	uint16_t changeCount;
+
+	if (command == DEVICE_COMMAND_DISCOVER) {
+		changeCount = espConfig->getChangeCount();
+	} else if (command == DEVICE_COMMAND_GET_CONTROLLER || command == DEVICE_COMMAND_GETALL_CONTROLLER) {
+		ESP8266Controller* controller = packet_length > UDP_PACKET_HEADER_SIZE ? getController(packet[UDP_PACKET_HEADER_SIZE]) : NULL;
+		if (controller == NULL) {
+			return false;
+		}
+		pin = controller->pin;
+		changeCount = controller->changeCount;
+	} else {
+		return false;
+	}
+
+	if (cachedCommand != command || cachedPin != pin || cachedChangeCount != changeCount) {
+
+		cacheMisses++;
+
+		cachedLength = streamReply(to, command, command == DEVICE_COMMAND_DISCOVER ? NULL : controllers[pin]);
+		cachedCommand = command;
+		cachedPin = pin;
+		cachedChangeCount = changeCount;
+		return true;
+	}
+
+	cacheHits++;
+	sendReply(to, replyBuffer, cachedLength);
+
+	return true;
+}
+
+// what a reply writes into its packet, copied into a buffer on the way
+class ReplyCopy : public Print {
+public:
+	ReplyCopy(Print& out, byte* copy) : out(out), copy(copy) {}
+
+	size_t write(uint8_t c) {
+		copy[length++] = c;
+		return out.write(c);
+	}
+
+	size_t write(const uint8_t* buffer, size_t size) {
+		memcpy(copy + length, buffer, size);
+		length += size;
+		return out.write(buffer, size);
+	}
+
+	size_t length = 0;
+
+private:
+	Print& out;
+	byte* copy;
+};
+
+// the fixed layout DISCOVER or GET/GETALL payload goes from writeTo() straight into the packet, replyBuffer gets a
+// copy for the repeats. Returns the reply size
+uint16_t DeviceServer::streamReply(const _request& to, byte command, ESP8266Controller* controller) {
+
+	uint16_t reply_length = UDP_PACKET_HEADER_SIZE + (controller == NULL ? espConfig->sizeOfUDPPayload() : controller->sizeOfUDPPayload());
+	replyBuffer[0] = lowByte(reply_length);
+	replyBuffer[1] = highByte(reply_length);
+	replyBuffer[2] = command;
+
+	beginReply(to, replyBuffer, reply_length);
+	ReplyCopy out(udp, replyBuffer + UDP_PACKET_HEADER_SIZE);
+
+	if (controller == NULL) {
+		espConfig->writeTo(out);
+	} else {
+		unsigned long start = micros();
+		controller->writeTo(out);
+		Metrics.latency(METRICS_LATENCY_CONTROLLER_TO, micros() - start);
+	}
+
+	endReply(to, replyBuffer, reply_length);
+
+	return reply_length;
+}
+
+void DeviceServer::sendReply(const _request& to, byte* reply, uint16_t reply_length) {
+	beginReply(to, reply, reply_length);
+	udp.write(reply + UDP_PACKET_HEADER_SIZE, reply_length - UDP_PACKET_HEADER_SIZE);
+	endReply(to, reply, reply_length);
+}
+
+void DeviceServer::beginReply(const _request& to, const byte* reply, uint16_t reply_length) {
+
+	udp.beginPacket(to._ip, to._port);
+
+	if (!to._tagged) {
+		udp.write(reply, UDP_PACKET_HEADER_SIZE);
+		return;
+	}
+
+	uint16_t length = reply_length + REQUEST_ID_SIZE;
+	byte header[UDP_PACKET_HEADER_SIZE + REQUEST_ID_SIZE] = {
+		lowByte(length), highByte(length), (byte)(reply[2] | REQUEST_ID_FLAG), lowByte(to._id), highByte(to._id)
+	};
+	udp.write(header, sizeof(header));
+}
+
+void DeviceServer::endReply(const _request& to, const byte* reply, uint16_t reply_length) {
+
+	udp.endPacket();
+
+	if (!to._tagged) {
+		return;
+	}
+
+	uint16_t length = reply_length + REQUEST_ID_SIZE;
+	if (length > REQUEST_CACHE_REPLY_SIZE) {
+		DEBUG_PRINT("DeviceServer::sendReply ***NOT CACHED*** ");DEBUG_PRINTLN(length);
+		return;
+	}
+
+	_request_cache_entry& entry = requestCache[requestCacheNext];
+	requestCacheNext = (requestCacheNext + 1) % REQUEST_CACHE_SIZE;
+
+	entry._to = to;
+	entry._length = length;
+	entry._reply[0] = lowByte(length);
+	entry._reply[1] = highByte(length);
+	entry._reply[2] = reply[2] | REQUEST_ID_FLAG;
+	entry._reply[3] = lowByte(to._id);
+	entry._reply[4] = highByte(to._id);
+	memcpy(entry._reply + UDP_PACKET_HEADER_SIZE + REQUEST_ID_SIZE, reply + UDP_PACKET_HEADER_SIZE, reply_length - UDP_PACKET_HEADER_SIZE);
+}
+
+boolean DeviceServer::sendRetryReply(const _request& to) {
+
+	for (uint8_t i = 0; i < REQUEST_CACHE_SIZE; i++) {
+		_request_cache_entry& entry = requestCache[i];
+
+		if (entry._length > 0 && entry._to._id == to._id && entry._to._port == to._port && entry._to._ip == to._ip) {
+			DEBUG_PRINT("DeviceServer::sendRetryReply id ");DEBUG_PRINTLN(to._id);
+			udp.beginPacket(to._ip, to._port);
+			udp.write(entry._reply, entry._length);
+			udp.endPacket();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void DeviceServer::scheduleDiscover(byte* packet, uint16_t packet_length, const _request& from) {
+	byte* payload = packet + UDP_PACKET_HEADER_SIZE;
+	uint16_t payload_length = packet_length - UDP_PACKET_HEADER_SIZE;
+
+	// a retry of a tagged request held back right now, the held reply answers it
+	for (uint8_t i = 0; i < discoverHeldCount && from._tagged; i++) {
+		const _request& to = discoverHeld[i]._to;
+		if (to._tagged && to._id == from._id && to._port == from._port && to._ip == from._ip) {
+			DEBUG_PRINT("DeviceServer::scheduleDiscover retry of pending id ");DEBUG_PRINTLN(from._id);
+			retriesAnswered++;
+			return;
+		}
+	}
+
+	uint16_t window = payload_length >= 2 ? payload[0] | (payload[1] << 8) : 0;
+	byte flags = payload_length >= 3 ? payload[2] : 0;
+	uint8_t suffixes = payload_length >= 4 ? payload[3] : 0;
+
+	// listed by the client, it has heard this device already
+	uint8_t* suffix = espConfig->getMAC() + WL_MAC_ADDR_LENGTH - DISCOVER_MAC_SUFFIX_SIZE;
+	for (uint16_t i = 0; i < suffixes && 4 + (i + 1) * DISCOVER_MAC_SUFFIX_SIZE <= payload_length; i++) {
+		if (memcmp(payload + 4 + i * DISCOVER_MAC_SUFFIX_SIZE, suffix, DISCOVER_MAC_SUFFIX_SIZE) == 0) {
+			discoverSuppressed++;
+			return;
+		}
+	}
+
+	boolean shortReply = (flags & DISCOVER_FLAG_SHORT) != 0;
+
+	if (window == 0) {
+		sendDiscoverReply(from, shortReply);
+		return;
+	}
+
+	// held ones are not sent early: a newcomer joins them, and all go out at the earliest deadline
+	if (discoverHeldCount == DISCOVER_MAX_HELD) {
+		DEBUG_PRINTLN("DeviceServer::scheduleDiscover ***HELD FULL***");
+		packetsDropped++;
+		return;
+	}
+
+	unsigned long at = millis() + jitter(min(window, DISCOVER_MAX_WINDOW));
+	if (discoverHeldCount == 0 || (long)(at - discoverAt) < 0) {
+		discoverAt = at;
+	}
+
+	discoverHeld[discoverHeldCount]._to = from;
+	discoverHeld[discoverHeldCount]._short = shortReply;
+	discoverHeldCount++;
+	discoverDelayed++;
+}
+
+void DeviceServer::sendDiscoverReply(const _request& to, boolean shortReply) {
+
+	if (!shortReply) {
+		byte request[UDP_PACKET_HEADER_SIZE] = { UDP_PACKET_HEADER_SIZE, 0, DEVICE_COMMAND_DISCOVER };
+		if (sendCachedReply(request, sizeof(request), to)) {
+			packetsReplied++;
+			Metrics.replied(DEVICE_COMMAND_DISCOVER);
+		}
+		return;
+	}
+
+	byte reply[UDP_PACKET_HEADER_SIZE + DISCOVER_SHORT_SIZE];
+	reply[0] = sizeof(reply);
+	reply[1] = 0;
+	reply[2] = DEVICE_COMMAND_DISCOVER;
+	memcpy(reply + UDP_PACKET_HEADER_SIZE, espConfig->getMAC(), WL_MAC_ADDR_LENGTH);
+	memcpy(reply + UDP_PACKET_HEADER_SIZE + WL_MAC_ADDR_LENGTH, espConfig->getControllerName(), MAX_LENGTH_NAME);
+
+	sendReply(to, reply, sizeof(reply));
+	packetsReplied++;
+	Metrics.replied(DEVICE_COMMAND_DISCOVER);
+}
+
+// milliseconds in [0, window]
+uint16_t DeviceServer::jitter(uint16_t window) {
+
+	if (window == 0) {
+		return 0;
+	}
+
+	if (jitterState == 0) {
+		// devices of one batch differ in the last MAC bytes only, mix them over the whole word (xorshift keeps
+		// close seeds close). The mix is a bijection, so no two devices share a sequence; micros() is left out
+		// for that reason, devices handling the broadcast in the same microsecond would otherwise collide
+		uint8_t* mac = espConfig->getMAC();
+		uint32_t seed = mac[2] << 24 | mac[3] << 16 | mac[4] << 8 | mac[5];
+		seed = (seed ^ (seed >> 16)) * 0x45D9F3B;
+		seed = (seed ^ (seed >> 16)) * 0x45D9F3B;
+		jitterState = seed ^ (seed >> 16);
+		if (jitterState == 0) {
+			jitterState = 1;
+		}
+	}
+
+	jitterState ^= jitterState << 13;
+	jitterState ^= jitterState >> 17;
+	jitterState ^= jitterState << 5;
+
+	return jitterState % (window + 1);
+}
+
+uint16_t DeviceServer::dispatch(byte* packet, uint16_t packet_length, byte* reply) {
+
+	if (packet_length < UDP_PACKET_HEADER_SIZE) {
+		DEBUG_PRINT("DeviceServer::dispatch ***SHORT PACKET*** ");DEBUG_PRINTLN(packet_length);
+		LOG_WARN(LOG_MODULE_SERVER, LOG_EVENT_SHORT_PACKET, packet_length, 0);
+		return 0;
+	}
+
+	byte command = packet[2];
+	byte* payload = packet + UDP_PACKET_HEADER_SIZE;
+	uint16_t payload_length = packet_length - UDP_PACKET_HEADER_SIZE;
+	byte* reply_payload = reply + UDP_PACKET_HEADER_SIZE;
+	uint16_t reply_payload_length = 0;
+
+	DEBUG_PRINT("DeviceServer::dispatch command ");DEBUG_PRINTLN(command);
+	LOG_DEBUG(LOG_MODULE_SERVER, LOG_EVENT_COMMAND, command, packet_length);
+
+	if (command == DEVICE_COMMAND_DISCOVER) {
+
+		reply_payload_length = espConfig->toByteArray(reply_payload);
+
+	} else if (command == DEVICE_COMMAND_SET_CONFIGURATION) {
+
+		unsigned long start = micros();
+		reply_payload_length = espConfig->set(reply_payload, payload, payload_length);
+		Metrics.latency(METRICS_LATENCY_CONFIG_SET, micros() - start);
+
+	} else if (command == DEVICE_COMMAND_SET_CONFIGURATION_NAME
+			|| command == DEVICE_COMMAND_SET_CONFIGURATION_SSID
+			|| command == DEVICE_COMMAND_SET_CONFIGURATION_AP
+			|| command == DEVICE_COMMAND_SET_CONFIGURATION_LOCATION
+			|| command == DEVICE_COMMAND_FIRMWARE_UPDATE) {
+
+		reply_payload_length = UDP_PACKET_MAX_SIZE - UDP_PACKET_HEADER_SIZE;
+		memset(reply_payload, 0, reply_payload_length);
+		espConfig->fromByteArray(command, payload, payload_length, reply_payload, &reply_payload_length);
+
+	} else if (command == DEVICE_COMMAND_GET_CONTROLLER
+			|| command == DEVICE_COMMAND_GETALL_CONTROLLER
+			|| command == DEVICE_COMMAND_SET_CONTROLLER
+			|| command == DEVICE_COMMAND_SETALL_CONTROLLER) {
+
+		// payload starts with the controller pin
+		ESP8266Controller* controller = packet_length > UDP_PACKET_HEADER_SIZE ? getController(payload[0]) : NULL;
+
+		if (controller == NULL) {
+			DEBUG_PRINT("DeviceServer::dispatch ***NO CONTROLLER*** ");DEBUG_PRINTLN(packet_length > UDP_PACKET_HEADER_SIZE ? payload[0] : 255);
+			LOG_WARN(LOG_MODULE_SERVER, LOG_EVENT_NO_CONTROLLER, packet_length > UDP_PACKET_HEADER_SIZE ? payload[0] : 255, command);
+			return 0;
+		}
+
+		unsigned long start = micros();
+
+		if (command == DEVICE_COMMAND_SET_CONTROLLER || command == DEVICE_COMMAND_SETALL_CONTROLLER) {
+			controller->fromByteArray(payload, payload_length);
+			unsigned long end = micros();
+			Metrics.latency(METRICS_LATENCY_CONTROLLER_FROM, end - start);
+			start = end;
+		}
+
+		reply_payload_length = controller->toByteArray(reply_payload);
+		Metrics.latency(METRICS_LATENCY_CONTROLLER_TO, micros() - start);
+
+	} else if (command == DEVICE_COMMAND_GET_PROTOCOL_VERSION) {
+
+		reply_payload[reply_payload_length++] = PROTOCOL_VERSION;
+
+	} else if (command == DEVICE_COMMAND_FIRMWARE_UPDATE_STATUS) {
+
+		reply_payload_length = FirmwareUpdate.toByteArray(reply_payload);
+
+	} else if (command == DEVICE_COMMAND_GET_LOG) {
+
+		// [since seq (2 bytes)], all records if missing
+		uint16_t since = packet_length >= UDP_PACKET_HEADER_SIZE + 2 ? payload[0] | (payload[1] << 8) : 0;
+		reply_payload_length = Log.toByteArray(since, reply_payload, UDP_PACKET_MAX_SIZE - UDP_PACKET_HEADER_SIZE);
+
+	} else if (command == DEVICE_COMMAND_GET_STATS) {
+
+		// [flags], METRICS_FLAG_RESET starts a new measuring interval after this reply
+		reply_payload_length = Metrics.toByteArray(reply_payload);
+		if (packet_length > UDP_PACKET_HEADER_SIZE && (payload[0] & METRICS_FLAG_RESET)) {
+			Metrics.reset();
+		}
+
+	} else if (command == DEVICE_COMMAND_SET_TRANSACTION) {
+
+		reply_payload_length = setTransaction(payload, payload_length, reply_payload);
+
+	} else if (command == DEVICE_COMMAND_FADE) {
+
+		reply_payload_length = fade(payload, payload_length, reply_payload);
+
+	} else if (command == DEVICE_COMMAND_PRESET_SAVE || command == DEVICE_COMMAND_PRESET_RECALL) {
+
+		// [slot], PRESET_SAVE adds [name (16 bytes)]
+		PacketReader in(payload, payload_length);
+		uint8_t slot = 0;
+		char name[MAX_LENGTH_NAME + 1];
+		memset(name, 0, sizeof(name));
+		uint8_t result;
+
+		if (!in.u8(&slot) || (command == DEVICE_COMMAND_PRESET_SAVE && !in.bytes(name, MAX_LENGTH_NAME))) {
+			result = PRESET_MALFORMED;
+		} else if (presets == NULL) {
+			result = PRESET_NO_SLOT;
+		} else if (command == DEVICE_COMMAND_PRESET_SAVE) {
+			result = presets->save(slot, name, this);
+		} else {
+			result = presets->recall(slot, this);
+		}
+
+		reply_payload[0] = result;
+		reply_payload[1] = presets != NULL ? presets->current() : PRESET_NONE;
+		reply_payload_length = 2;
+
+	} else if (command == DEVICE_COMMAND_SUBSCRIBE) {
+
+		reply_payload_length = subscribe(payload, payload_length, reply_payload);
+
+	} else if (command == DEVICE_COMMAND_GETALL_CONTROLLER_V2
+			|| command == DEVICE_COMMAND_SETALL_CONTROLLER_V2) {
+
+		ESP8266Controller* controller = packet_length > UDP_PACKET_HEADER_SIZE ? getController(payload[0]) : NULL;
+
+		if (controller == NULL) {
+			DEBUG_PRINT("DeviceServer::dispatch ***NO CONTROLLER*** ");DEBUG_PRINTLN(packet_length > UDP_PACKET_HEADER_SIZE ? payload[0] : 255);
+			LOG_WARN(LOG_MODULE_SERVER, LOG_EVENT_NO_CONTROLLER, packet_length > UDP_PACKET_HEADER_SIZE ? payload[0] : 255, command);
+			return 0;
+		}
+
+		byte flags = 0;
+
+		if (command == DEVICE_COMMAND_SETALL_CONTROLLER_V2) {
+			controller->fromByteArrayV2(payload, payload_length);
+		} else if (packet_length > UDP_PACKET_HEADER_SIZE + 1) {
+			// [pin][flags]
+			flags = payload[1];
+		}
+
+		// SET is answered with the values only
+		reply_payload_length = controller->toByteArrayV2(reply_payload, flags);
+
+	} else {
+
+		DEBUG_PRINT("DeviceServer::dispatch ***UNKNOWN COMMAND*** ");DEBUG_PRINTLN(command);
+		return 0;
+	}
+
+	uint16_t reply_length = UDP_PACKET_HEADER_SIZE + reply_payload_length;
+
+	reply[0] = lowByte(reply_length);
+	reply[1] = highByte(reply_length);
+	reply[2] = command;
+
+	return reply_length;
+}
+
+uint16_t DeviceServer::subscribe(byte* payload, uint16_t payload_length, byte* reply_payload) {
+
+	uint8_t pin = payload_length >= 1 ? payload[0] : SUBSCRIBE_ALL_PINS;
+	uint16_t lease = payload_length >= 3 ? payload[1] | (payload[2] << 8) : SUBSCRIBE_MAX_LEASE;
+	if (lease > SUBSCRIBE_MAX_LEASE) {
+		lease = SUBSCRIBE_MAX_LEASE;
+	}
+
+	IPAddress ip = udp.remoteIP();
+	uint16_t remote_port = udp.remotePort();
+	uint8_t result = SUBSCRIBE_OK;
+	int slot = -1;
+	int unused = -1;
+	boolean any = false;
+
+	for (int i = 0; i < SUBSCRIBER_MAX; i++) {
+		if (!subscribers[i]._active) {
+			unused = unused < 0 ? i : unused;
+		} else if (subscribers[i]._ip == ip && subscribers[i]._port == remote_port) {
+			slot = i;
+		} else {
+			any = true;
+		}
+	}
+
+	if (pin != SUBSCRIBE_ALL_PINS && getController(pin) == NULL) {
+		result = SUBSCRIBE_NO_CONTROLLER;
+	} else if (lease == 0) {
+		if (slot >= 0) {
+			subscribers[slot]._active = false;
+		}
+	} else if (slot < 0 && unused < 0) {
+		DEBUG_PRINTLN("DeviceServer::subscribe ***NO FREE SLOT***");
+		result = SUBSCRIBE_FULL;
+	} else {
+		if (slot < 0) {
+			slot = unused;
+			subscribers[slot]._ip = ip;
+			subscribers[slot]._port = remote_port;
+			subscribers[slot]._pins = 0;
+			subscribers[slot]._seq = 0;
+			subscribers[slot]._active = true;
+
+			// changes made while nobody listened are not pushed
+			if (!any) {
+				for (uint8_t p = 0; p <= MAX_CONTROLLER_PIN; p++) {
+					if (controllers[p] != NULL) {
+						pushedChangeCount[p] = controllers[p]->changeCount;
+						controllers[p]->changedMask = 0;
+					}
+				}
+			}
+		}
+		subscribers[slot]._pins |= pin == SUBSCRIBE_ALL_PINS ? 0xFFFFFFFF : 1UL << pin;
+		subscribers[slot]._expires = millis() + lease * 1000UL;
+	}
+
+	uint16_t seq = slot >= 0 ? subscribers[slot]._seq : 0;
+	if (result != SUBSCRIBE_OK || lease == 0) {
+		lease = 0;
+	}
+
+	reply_payload[0] = result;
+	reply_payload[1] = lowByte(lease);
+	reply_payload[2] = highByte(lease);
+	reply_payload[3] = lowByte(seq);
+	reply_payload[4] = highByte(seq);
+
+	return 5;
+}
+
+void DeviceServer::pushChanges() {
+
+	boolean any = false;
+	for (int i = 0; i < SUBSCRIBER_MAX; i++) {
+		if (subscribers[i]._active && (long)(millis() - subscribers[i]._expires) >= 0) {
+			DEBUG_PRINT("DeviceServer::pushChanges lease ended ");DEBUG_PRINTLN(i);
+			subscribers[i]._active = false;
+		}
+		any = any || subscribers[i]._active;
+	}
+
+	if (!any) {
+		return;
+	}
+
+	for (uint8_t pin = 0; pin <= MAX_CONTROLLER_PIN; pin++) {
+		ESP8266Controller* controller = controllers[pin];
+		// a fade is pushed once, when it has ended
+		if (controller == NULL || controller->changeCount == pushedChangeCount[pin] || controller->inTransition()) {
+			continue;
+		}
+
+		// moved without setCapability (capabilities[] written directly): all values
+		uint32_t mask = controller->changedMask != 0 ? controller->changedMask : 0xFFFFFFFF;
+		pushedChangeCount[pin] = controller->changeCount;
+		controller->changedMask = 0;
+
+		byte* payload = packetBuffer + UDP_PACKET_HEADER_SIZE;
+		uint16_t index = 2;
+		payload[index++] = pin;
+
+		uint16_t count = 0;
+		for (int id = 0; id < controller->capabilityCount; id++) {
+			count += (mask >> (id < 31 ? id : 31)) & 1;
+		}
+		index += writeVarint(payload + index, count);
+
+		for (int id = 0; id < controller->capabilityCount; id++) {
+			if ((mask >> (id < 31 ? id : 31)) & 1) {
+				index += writeVarint(payload + index, id);
+				index += writeVarint(payload + index, controller->capabilities[id]._value);
+			}
+		}
+
+		uint16_t length = UDP_PACKET_HEADER_SIZE + index;
+		packetBuffer[0] = lowByte(length);
+		packetBuffer[1] = highByte(length);
+		packetBuffer[2] = DEVICE_COMMAND_CHANGED;
+
+		for (int i = 0; i < SUBSCRIBER_MAX; i++) {
+			if (!subscribers[i]._active || !(subscribers[i]._pins & (1UL << pin))) {
+				continue;
+			}
+			subscribers[i]._seq++;
+			payload[0] = lowByte(subscribers[i]._seq);
+			payload[1] = highByte(subscribers[i]._seq);
+
+			udp.beginPacket(subscribers[i]._ip, subscribers[i]._port);
+			udp.write(packetBuffer, length);
+			udp.endPacket();
+			changesPushed++;
+		}
+	}
+}
+
+uint16_t DeviceServer::setTransaction(byte* payload, uint16_t payload_length, byte* reply_payload) {
+
+	uint8_t result = TRANSACTION_OK;
+	uint8_t failed = 0xFF;
+	uint16_t failedId = 0xFFFF;
+	uint8_t controllerCount = 0;
+	boolean touched[MAX_CONTROLLER_PIN + 1];
+	memset(touched, 0, sizeof(touched));
+
+	// 1st pass checks everything, 2nd pass sets the values
+	for (int pass = 0; pass < 2 && result == TRANSACTION_OK; pass++) {
+		PacketReader in(payload, payload_length);
+
+		if (!in.u8(&controllerCount)) {
+			result = TRANSACTION_MALFORMED;
+			break;
+		}
+
+		for (uint8_t c = 0; c < controllerCount && result == TRANSACTION_OK; c++) {
+			failed = c;
+
+			uint8_t pin;
+			if (!in.u8(&pin)) {
+				result = TRANSACTION_MALFORMED;
+				break;
+			}
+
+			ESP8266Controller* controller = getController(pin);
+			uint16_t no_of_capabilities = 0;
+
+			if (controller == NULL) {
+				result = TRANSACTION_NO_CONTROLLER;
+				break;
+			}
+			if (!in.varint(&no_of_capabilities)) {
+				result = TRANSACTION_MALFORMED;
+				break;
+			}
+
+			for (uint16_t i = 0; i < no_of_capabilities && result == TRANSACTION_OK; i++) {
+				uint16_t id;
+				uint16_t val;
+				uint8_t check;
+
+				if (!in.varint(&id) || !in.varint(&val)) {
+					result = TRANSACTION_MALFORMED;
+				} else if ((check = controller->checkCapability(id, val)) != CAPABILITY_VALID) {
+					result = check == CAPABILITY_UNKNOWN ? TRANSACTION_UNKNOWN_CAPABILITY : TRANSACTION_OUT_OF_RANGE;
+					failedId = id;
+				} else if (pass == 1) {
+					controller->setCapabilityById(id, val);
+				}
+			}
+
+			touched[controller->pin] = true;
+		}
+
+		// bytes after the last controller, the count does not match what was sent
+		if (result == TRANSACTION_OK && in.remaining() > 0) {
+			failed = 0xFF;
+			result = TRANSACTION_MALFORMED;
+		}
+	}
+
+	if (result == TRANSACTION_OK) {
+		failed = 0xFF;
+
+		// outputs in this tick, then one commit for all controllers
+		Persistence.beginBatch();
+		for (uint8_t pin = 0; pin <= MAX_CONTROLLER_PIN; pin++) {
+			if (!touched[pin]) {
+				continue;
+			}
+			controllers[pin]->loop();
+			if (controllers[pin]->eeprom_address != 0) {
+				controllers[pin]->saveCapabilities();
+				controllers[pin]->lastEepromUpdate = millis();
+			}
+		}
+		Persistence.endBatch();
+	} else {
+		DEBUG_PRINT("DeviceServer::setTransaction ***REJECTED*** ");DEBUG_PRINT(result);DEBUG_PRINT(", controller ");DEBUG_PRINTLN(failed);
+	}
+
+	reply_payload[0] = result;
+	reply_payload[1] = failed;
+	reply_payload[2] = lowByte(failedId);
+	reply_payload[3] = highByte(failedId);
+
+	return 4;
+}
+
+// position of id in ids, -1 if it is not there
+static int indexOf(const uint16_t* ids, uint8_t count, uint16_t id) {
+	for (uint8_t i = 0; i < count; i++) {
+		if (ids[i] == id) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+uint16_t DeviceServer::fade(byte* payload, uint16_t payload_length, byte* reply_payload) {
+
+	uint8_t result = FADE_OK;
+	uint16_t failedId = 0xFFFF;
+
+	// 1st pass checks everything, 2nd pass starts the transitions
+	for (int pass = 0; pass < 2 && result == FADE_OK; pass++) {
+		PacketReader in(payload, payload_length);
+		uint8_t pin;
+		uint16_t duration;
+		uint8_t easing;
+		uint16_t no_of_capabilities;
+
+		if (!in.u8(&pin) || !in.u16(&duration) || !in.u8(&easing) || !in.varint(&no_of_capabilities)) {
+			result = FADE_MALFORMED;
+			break;
+		}
+
+		ESP8266Controller* controller = getController(pin);
+
+		if (controller == NULL) {
+			result = FADE_NO_CONTROLLER;
+			break;
+		}
+		if (easing >= EASE_COUNT) {
+			result = FADE_BAD_EASING;
+			break;
+		}
+
+		// the slots startTransition() will take and give back, in order: a target equal to the value ends a running
+		// transition of its ID and takes none, a repeated ID keeps its slot
+		uint16_t taken[CONTROLLER_MAX_TRANSITIONS];
+		uint16_t released[CONTROLLER_MAX_TRANSITIONS];
+		uint8_t takenCount = 0;
+		uint8_t releasedCount = 0;
+
+		for (uint16_t i = 0; i < no_of_capabilities && result == FADE_OK; i++) {
+			uint16_t id;
+			uint16_t val;
+			uint8_t check;
+
+			if (!in.varint(&id) || !in.varint(&val)) {
+				result = FADE_MALFORMED;
+			} else if ((check = controller->checkCapability(id, val)) != CAPABILITY_VALID) {
+				result = check == CAPABILITY_UNKNOWN ? FADE_UNKNOWN_CAPABILITY : FADE_OUT_OF_RANGE;
+				failedId = id;
+			} else if (pass == 0 && duration > 0) {
+				boolean running = controller->inTransition((uint8_t)id);
+				int t = indexOf(taken, takenCount, id);
+				int r = indexOf(released, releasedCount, id);
+				boolean holds = running ? r < 0 : t >= 0;
+
+				if (val == controller->capabilities[id]._value) {
+					if (holds && running) {
+						released[releasedCount++] = id;
+					} else if (holds) {
+						taken[t] = taken[--takenCount];
+					}
+				} else if (!holds) {
+					if (controller->transitionsAvailable() + releasedCount - takenCount == 0) {
+						result = FADE_BUSY;
+						failedId = id;
+					} else if (running) {
+						released[r] = released[--releasedCount];
+					} else {
+						taken[takenCount++] = id;
+					}
+				}
+			} else if (pass == 1) {
+				controller->startTransition((uint8_t)id, val, duration, easing);
+			}
+		}
+	}
+
+	if (result != FADE_OK) {
+		DEBUG_PRINT("DeviceServer::fade ***REJECTED*** ");DEBUG_PRINT(result);DEBUG_PRINT(", capability ");DEBUG_PRINTLN(failedId);
+	}
+
+	reply_payload[0] = result;
+	reply_payload[1] = lowByte(failedId);
+	reply_payload[2] = highByte(failedId);
+
+	return 3;
+}
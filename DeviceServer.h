@@ -0,0 +1,277 @@
+#ifndef DeviceServer_h
+#define DeviceServer_h
+
+#include "Arduino.h"
+#include <WiFiUdp.h>
+#include "ESPConfig.h"
+#include "ESP8266Controller.h"
+
+class PresetStore;
+
+// ESP8266 GPIO 0 to 16
+static const uint8_t MAX_CONTROLLER_PIN = 16;
+
+// [packet size (2 bytes)][command (1 byte)]
+static const uint8_t UDP_PACKET_HEADER_SIZE = 3;
+
+// largest datagram accepted or sent
+static const uint16_t UDP_PACKET_MAX_SIZE = 1024;
+
+// optional request ID: [packet size (2 bytes)][command | REQUEST_ID_FLAG][request ID (2 bytes)][payload], the reply
+// carries the same flag and ID. A client's retry (same ID from the same address and port) is answered from the
+// request cache without running the command again
+static const uint8_t REQUEST_ID_FLAG = 0x80;
+static const uint8_t REQUEST_ID_SIZE = 2;
+static const uint8_t REQUEST_CACHE_SIZE = 4;
+static const uint16_t REQUEST_CACHE_REPLY_SIZE = 256;// longer replies are not kept, a retry runs the command again
+
+// SET_TRANSACTION payload: [no_of_controllers] then per controller the v2 SET payload
+// [pin][no_of_capabilities (varint)] then per capability [ID (varint)][value (varint)]
+// reply: [TRANSACTION_* result][index of the failing controller][failing capability ID (2 bytes)], 0xFF / 0xFFFF where
+// it does not apply. A payload shorter or longer than its no_of_controllers says is TRANSACTION_MALFORMED
+static const uint8_t TRANSACTION_OK = 0;
+static const uint8_t TRANSACTION_MALFORMED = 1;
+static const uint8_t TRANSACTION_NO_CONTROLLER = 2;
+static const uint8_t TRANSACTION_UNKNOWN_CAPABILITY = 3;
+static const uint8_t TRANSACTION_OUT_OF_RANGE = 4;
+
+// FADE payload: [pin][duration ms (2 bytes)][easing][no_of_capabilities (varint)] then per capability
+// [ID (varint)][target value (varint)], every capability of the list or none is started
+// reply: [FADE_* result][failing capability ID (2 bytes)], 0xFFFF where it does not apply
+static const uint8_t FADE_OK = 0;
+static const uint8_t FADE_MALFORMED = 1;
+static const uint8_t FADE_NO_CONTROLLER = 2;
+static const uint8_t FADE_UNKNOWN_CAPABILITY = 3;
+static const uint8_t FADE_OUT_OF_RANGE = 4;
+static const uint8_t FADE_BAD_EASING = 5;
+static const uint8_t FADE_BUSY = 6;// more than CONTROLLER_MAX_TRANSITIONS would run
+
+// sender of a request, and its ID if it was tagged with one
+typedef struct {
+	IPAddress _ip;
+	uint16_t _port;
+	boolean _tagged;
+	uint16_t _id;
+} _request;
+
+// reply to a tagged request as it was sent, ID included
+typedef struct {
+	_request _to;
+	uint16_t _length;
+	byte _reply[REQUEST_CACHE_REPLY_SIZE];
+} _request_cache_entry;
+
+// longest time loop() keeps draining datagrams, in milliseconds
+static const unsigned long DEVICE_SERVER_LOOP_BUDGET = 10;
+
+// DISCOVER payload, all optional: [jitter window ms (2 bytes)][flags][suffix count][suffix count x MAC suffix (3 bytes)]
+// without it the full reply is sent right away, as v1 clients expect
+static const uint8_t DISCOVER_FLAG_SHORT = 0x01;// reply is [MAC (6 bytes)][controller name (16 bytes)] only
+static const uint16_t DISCOVER_MAX_WINDOW = 2000;// jitter window is capped at this many milliseconds
+static const uint8_t DISCOVER_MAC_SUFFIX_SIZE = 3;// last bytes of the MAC a client lists for devices it has seen
+static const uint8_t DISCOVER_SHORT_SIZE = WL_MAC_ADDR_LENGTH + MAX_LENGTH_NAME;
+static const uint8_t DISCOVER_MAX_HELD = 4;// requesters answered together at the held deadline, more are dropped
+
+// a requester whose DISCOVER reply is held back
+typedef struct {
+	_request _to;
+	boolean _short;
+} _discover_requester;
+
+// SUBSCRIBE payload: [pin or SUBSCRIBE_ALL_PINS][lease seconds (2 bytes)], lease 0 ends the subscription of the sender
+// reply: [SUBSCRIBE_OK / _FULL / _NO_CONTROLLER][lease seconds granted (2 bytes)][seq of the last push (2 bytes)]
+static const uint8_t SUBSCRIBER_MAX = 4;
+static const uint8_t SUBSCRIBE_ALL_PINS = 0xFF;
+static const uint16_t SUBSCRIBE_MAX_LEASE = 600;
+static const uint8_t SUBSCRIBE_OK = 0;
+static const uint8_t SUBSCRIBE_FULL = 1;
+static const uint8_t SUBSCRIBE_NO_CONTROLLER = 2;
+
+typedef struct {
+	IPAddress _ip;
+	uint16_t _port;
+
+	// bit per controller pin
+	uint32_t _pins;
+
+	// millis() when the lease runs out
+	unsigned long _expires;
+
+	// sequence number of the last DEVICE_COMMAND_CHANGED sent to this subscriber
+	uint16_t _seq;
+
+	boolean _active;
+} _subscriber;
+
+/***
+*
+*	Owns the UDP socket on <port>, decodes the _udp_packet header and routes DEVICE_COMMAND_* to
+*	ESPConfig and to the ESP8266Controller registered on the pin given in the payload.
+*
+*	Reply: [packet size (2 bytes)][command (1 byte)][payload], packet size includes the header; a request with
+*	REQUEST_ID_FLAG set in the command has the request ID after the header, and so has its reply
+*
+*	DEVICE_COMMAND_DISCOVER                     ESPConfig::toByteArray, or [MAC][name] with DISCOVER_FLAG_SHORT
+*	DEVICE_COMMAND_SET_CONFIGURATION            ESPConfig::set, reply is the error description
+*	DEVICE_COMMAND_SET_CONFIGURATION_* / FIRMWARE_UPDATE
+*	                                            ESPConfig::fromByteArray(command, ...), reply is the error description
+*	DEVICE_COMMAND_FIRMWARE_UPDATE_STATUS       FirmwareUpdater::toByteArray [state][error][bytes written][image size]
+*	DEVICE_COMMAND_GET_LOG                      [since seq (2 bytes)], reply is ESPLog::toByteArray
+*	DEVICE_COMMAND_GET_STATS                    [flags], reply is ESPMetrics::toByteArray
+*	DEVICE_COMMAND_GET_CONTROLLER / GETALL      ESP8266Controller::toByteArray
+*	DEVICE_COMMAND_SET_CONTROLLER / SETALL      ESP8266Controller::fromByteArray, reply is ESP8266Controller::toByteArray
+*	DEVICE_COMMAND_GET_PROTOCOL_VERSION         [PROTOCOL_VERSION], clients use v2 commands only if this is >= 2
+*	DEVICE_COMMAND_GETALL_CONTROLLER_V2         [pin][flags], reply is ESP8266Controller::toByteArrayV2
+*	DEVICE_COMMAND_SETALL_CONTROLLER_V2         ESP8266Controller::fromByteArrayV2, reply is toByteArrayV2 values only
+*	DEVICE_COMMAND_SUBSCRIBE                    [pin][lease seconds (2 bytes)], reply is [result][lease][seq]
+*	DEVICE_COMMAND_SET_TRANSACTION              v2 SET payloads of several controllers, reply is [result][controller][ID]
+*	DEVICE_COMMAND_FADE                         ESP8266Controller::startTransition per capability, reply is [result][ID]
+*	DEVICE_COMMAND_PRESET_SAVE / RECALL         PresetStore::save / recall, reply is [result][current preset]
+*
+*	loop() writes DISCOVER and GET/GETALL replies straight into the outgoing packet with writeTo() and keeps a
+*	copy in replyBuffer. A repeat of the same request is sent from there, without encoding, until
+*	ESPConfig::getChangeCount() or the controller's changeCount moves. dispatch() produces the same bytes through
+*	toByteArray.
+*
+*	A DISCOVER broadcast reaches every device at once. With a jitter window in the request the reply is held back
+*	a random time within it, so the replies of a site do not collide; a device whose MAC suffix is in the request's
+*	list stays quiet, so a second round only hears the devices missed by the first. Requesters arriving while a
+*	reply is held (several phones discovering at once) are answered together at the earliest held deadline.
+*
+*	Instead of polling GETALL a client may subscribe to a controller (or all of them) for a lease and renew it
+*	before it runs out. Once per loop() every controller whose changeCount moved is pushed to its subscribers as
+*	DEVICE_COMMAND_CHANGED [seq (2 bytes)][pin][no_of_capabilities (varint)] then per capability [ID][value]
+*	(varints), the changed capabilities only, or all of them when the change was not made through setCapability.
+*	seq counts per subscriber; a gap means a push was lost and the client reads the controller with GETALL.
+*	A controller is not pushed while it fades, its subscribers get the values it has come to at the end.
+*
+***/
+class DeviceServer {
+public:
+	DeviceServer(ESPConfig* config) {
+		espConfig = config;
+		memset(controllers, 0, sizeof(controllers));
+		memset(pushedChangeCount, 0, sizeof(pushedChangeCount));
+		for (uint8_t i = 0; i < SUBSCRIBER_MAX; i++) {
+			subscribers[i]._active = false;
+		}
+		for (uint8_t i = 0; i < REQUEST_CACHE_SIZE; i++) {
+			requestCache[i]._length = 0;
+		}
+	}
+
+	// open the UDP socket
+	boolean begin(uint16_t udpPort = port);
+
+	// register a controller on its pin, false if the pin is out of range or taken
+	boolean addController(ESP8266Controller* controller);
+
+	// controller registered on this pin, NULL if none
+	ESP8266Controller* getController(uint8_t pin);
+
+	// answer PRESET_SAVE / PRESET_RECALL from presets and restore its current preset, after addController()
+	void usePresets(PresetStore* presets);
+
+	// drain pending datagrams within loopBudget milliseconds, returns number of datagrams handled
+	int loop();
+
+	// handle one datagram, returns reply size (0 = no reply)
+	uint16_t dispatch(byte* packet, uint16_t packet_length, byte* reply);
+
+	// maximum milliseconds spent in one loop()
+	unsigned long loopBudget = DEVICE_SERVER_LOOP_BUDGET;
+
+	unsigned long packetsReceived = 0;
+	unsigned long packetsReplied = 0;
+	unsigned long packetsDropped = 0;
+
+	// DISCOVER / GET / GETALL replies sent from the cache, and rebuilt
+	unsigned long cacheHits = 0;
+	unsigned long cacheMisses = 0;
+
+	// DISCOVER requests answered after a jitter, and not answered because the client listed this device
+	unsigned long discoverDelayed = 0;
+	unsigned long discoverSuppressed = 0;
+
+	// DEVICE_COMMAND_CHANGED datagrams sent
+	unsigned long changesPushed = 0;
+
+	// tagged requests answered from the request cache, or by the DISCOVER reply still held back for them
+	unsigned long retriesAnswered = 0;
+
+	WiFiUDP udp;
+
+private:
+	ESPConfig* espConfig;
+
+	PresetStore* presets = NULL;
+
+	// controllers indexed by pin
+	ESP8266Controller* controllers[MAX_CONTROLLER_PIN + 1];
+
+	// send DISCOVER and GET/GETALL replies from replyBuffer, streaming them again when the target changed
+	boolean sendCachedReply(byte* packet, uint16_t packet_length, const _request& to);
+
+	// write a DISCOVER (controller NULL) or GET/GETALL reply with writeTo(), copied into replyBuffer on the way
+	uint16_t streamReply(const _request& to, byte command, ESP8266Controller* controller);
+
+	// send a reply built by dispatch(), with the request ID inserted and kept in the request cache if to is tagged
+	void sendReply(const _request& to, byte* reply, uint16_t reply_length);
+
+	// open the packet and write the reply header, with the request ID if to is tagged
+	void beginReply(const _request& to, const byte* reply, uint16_t reply_length);
+
+	// send the packet, a reply to a tagged request is kept in the request cache
+	void endReply(const _request& to, const byte* reply, uint16_t reply_length);
+
+	// the reply to a retry of a tagged request, false if it is not in the cache
+	boolean sendRetryReply(const _request& to);
+
+	_request_cache_entry requestCache[REQUEST_CACHE_SIZE];
+
+	// entry overwritten next, oldest first
+	uint8_t requestCacheNext = 0;
+
+	// DISCOVER with a payload: suppress, or schedule the reply within the jitter window
+	void scheduleDiscover(byte* packet, uint16_t packet_length, const _request& from);
+	void sendDiscoverReply(const _request& to, boolean shortReply);
+
+	// replies held back by scheduleDiscover(), all sent at discoverAt
+	_discover_requester discoverHeld[DISCOVER_MAX_HELD];
+	uint8_t discoverHeldCount = 0;
+	unsigned long discoverAt = 0;
+
+	_subscriber subscribers[SUBSCRIBER_MAX];
+
+	// changeCount of every controller when its changes were last pushed
+	uint16_t pushedChangeCount[MAX_CONTROLLER_PIN + 1];
+
+	// add, renew or end the subscription of the sender of the current datagram, returns the reply payload size
+	uint16_t subscribe(byte* payload, uint16_t payload_length, byte* reply_payload);
+
+	// push the controllers changed since the last call to their subscribers, drop expired leases
+	void pushChanges();
+
+	// check every update of a SET_TRANSACTION against its controller first, then apply them all, run the loop() of
+	// the controllers touched and save them with one EEPROM commit (one record append per controller with a
+	// RecordStore). Returns the reply payload size
+	uint16_t setTransaction(byte* payload, uint16_t payload_length, byte* reply_payload);
+
+	// check the capabilities of a FADE first, then start a transition for each. Returns the reply payload size
+	uint16_t fade(byte* payload, uint16_t payload_length, byte* reply_payload);
+
+	// xorshift state for the jitter, seeded from the MAC so devices booted together still spread
+	uint32_t jitterState = 0;
+	uint16_t jitter(uint16_t window);
+
+	// what replyBuffer holds, DEVICE_COMMAND_NONE if nothing reusable
+	byte cachedCommand = DEVICE_COMMAND_NONE;
+	uint8_t cachedPin = 0;
+	uint16_t cachedChangeCount = 0;
+	uint16_t cachedLength = 0;
+
+	byte packetBuffer[UDP_PACKET_MAX_SIZE];
+	byte replyBuffer[UDP_PACKET_MAX_SIZE];
+};
+
+#endif
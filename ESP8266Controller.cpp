@@ -1,26 +1,321 @@
 #include <EepromUtil.h>
 #include <ESPConfig.h>
 #include "ESP8266Controller.h"
+#include "Persistence.h"
+#include "ESPLayout.h"
+#include "ESPMetrics.h"
+#include "DeviceServer.h"
+
+// a controller record must fit in the record store (Persistence::useRecordStore)
+static_assert(CONTROLLER_EEPROM_MAX_SIZE <= RECORD_MAX_LENGTH, "controller record does not fit RECORD_MAX_LENGTH");
+static_assert(CONFIG_EEPROM_SIZE <= RECORD_MAX_LENGTH, "config record does not fit RECORD_MAX_LENGTH");
+
+// the capability table is sent over UDP as it is laid out in memory
+static_assert(sizeof(_unit16_capability) == CAPABILITY_UDP_SIZE, "_unit16_capability size");
+static_assert(offsetof(_unit16_capability, _value_min) == CAPABILITY_UDP_MIN, "_value_min offset");
+static_assert(offsetof(_unit16_capability, _value_max) == CAPABILITY_UDP_MAX, "_value_max offset");
+static_assert(offsetof(_unit16_capability, _value) == CAPABILITY_UDP_VALUE, "_value offset");
+
+ESP8266Controller::ESP8266Controller(const char* nam, uint8_t _pin, uint8_t capCount, int start_address) {
+	DEBUG_PRINTLN("ESP8266Controller::ESP8266Controller");
+
+	pin = _pin;
+	capabilityCount = capCount;
+	eeprom_address = start_address;
+	strcpy(controllerName, nam);
+
+	// storage for all of them, the subclass fills in capCount capabilities
+	capabilities = (_unit16_capability*)Arena.allocateOrHeap(sizeof(_unit16_capability) * capCount);
+	capabilityIndex = (uint8_t*)Arena.allocateOrHeap(capabilityIndexSize(capCount), 1);
+
+	if (capCount > CONTROLLER_MAX_CAPABILITIES) {
+		DEBUG_PRINT("ESP8266Controller::ESP8266Controller ***TOO MANY CAPABILITIES*** ");DEBUG_PRINTLN(capCount);
+		LOG_ERROR(LOG_MODULE_CONTROLLER, LOG_EVENT_TOO_MANY_CAPABILITIES, capCount, pin);
+		capabilityCount = CONTROLLER_MAX_CAPABILITIES;
+	}
+}
 
 // set capability value
 boolean ESP8266Controller::setCapability(char* cname, uint16_t value) {
 
-	for (int i = 0; i < capabilityCount; i++) {
-		if (strcmp(cname, capabilities[i]._name)==0) {
-			if(value <= capabilities[i]._value_max && value >= capabilities[i]._value_min) {
-				capabilities[i]._value = value;
-				DEBUG_PRINT("setCapability ");DEBUG_PRINT(cname);DEBUG_PRINT("=");DEBUG_PRINTLN(value);
-				return true;
-			} else {
-				DEBUG_PRINT("***MISMATCH*** setCapability ");DEBUG_PRINT(capabilities[i]._name);DEBUG_PRINT(", val ");DEBUG_PRINTLN(value);
-				return false;
-			}
+	// setCapabilityById passes the capability's own name, which needs no lookup
+	uintptr_t offset = (uintptr_t)cname - (uintptr_t)capabilities;
+	uint8_t id = offset < capabilityCount * sizeof(_unit16_capability) && offset % sizeof(_unit16_capability) == offsetof(_unit16_capability, _name)
+			? offset / sizeof(_unit16_capability) : capabilityId(cname);
+
+	if (id == CAPABILITY_ID_NONE) {
+		DEBUG_PRINT("***UNKNOWN*** setCapability ");DEBUG_PRINTLN(cname);
+		LOG_WARN(LOG_MODULE_CONTROLLER, LOG_EVENT_CAPABILITY_UNKNOWN, CAPABILITY_ID_NONE, pin);
+		return false;
+	}
+
+	if(value <= capabilities[id]._value_max && value >= capabilities[id]._value_min) {
+		if (capabilities[id]._value != value) {
+			capabilities[id]._value = value;
+			changeCount++;
+			changedMask |= 1UL << (id < 31 ? id : 31);
+		}
+		if (id == steppingId) {
+			return true;
+		}
+		// a value set while fading wins over the fade
+		if (transitionCount > 0) {
+			stopTransition(id);
+		}
+		DEBUG_PRINT("setCapability ");DEBUG_PRINT(capabilities[id]._name);DEBUG_PRINT("=");DEBUG_PRINTLN(value);
+		LOG_DEBUG(LOG_MODULE_CONTROLLER, LOG_EVENT_CAPABILITY_SET, id, value);
+		return true;
+	} else {
+		DEBUG_PRINT("***MISMATCH*** setCapability ");DEBUG_PRINT(capabilities[id]._name);DEBUG_PRINT(", val ");DEBUG_PRINTLN(value);
+		LOG_WARN(LOG_MODULE_CONTROLLER, LOG_EVENT_CAPABILITY_MISMATCH, id, value);
+		return false;
+	}
+}
+
+// set capability value by ID, a subclass overriding setCapability(cname, value) sees it as well
+boolean ESP8266Controller::setCapabilityById(uint8_t id, uint16_t value) {
+
+	if (id >= capabilityCount) {
+		DEBUG_PRINT("***UNKNOWN*** setCapability id ");DEBUG_PRINTLN(id);
+		LOG_WARN(LOG_MODULE_CONTROLLER, LOG_EVENT_CAPABILITY_UNKNOWN, id, pin);
+		return false;
+	}
+
+	return setCapability(capabilities[id]._name, value);
+}
+
+uint8_t ESP8266Controller::checkCapability(uint16_t id, uint16_t value) const {
+
+	if (id >= capabilityCount) {
+		return CAPABILITY_UNKNOWN;
+	}
+	if (value < capabilities[id]._value_min || value > capabilities[id]._value_max) {
+		return CAPABILITY_OUT_OF_RANGE;
+	}
+	return CAPABILITY_VALID;
+}
+
+boolean ESP8266Controller::startTransition(uint8_t id, uint16_t value, uint16_t duration, uint8_t easing) {
+
+	if (easing >= EASE_COUNT || checkCapability(id, value) != CAPABILITY_VALID) {
+		DEBUG_PRINT("***MISMATCH*** startTransition id ");DEBUG_PRINT(id);DEBUG_PRINT(", val ");DEBUG_PRINTLN(value);
+		return false;
+	}
+
+	uint8_t slot = 0;
+	while (slot < transitionCount && transitions[slot]._id != id) {
+		slot++;
+	}
+
+	if (duration == 0 || value == capabilities[id]._value) {
+		setCapabilityById(id, value);
+		eepromUpdatePending = true;
+		return true;
+	}
+
+	if (slot == CONTROLLER_MAX_TRANSITIONS) {
+		DEBUG_PRINT("***BUSY*** startTransition id ");DEBUG_PRINTLN(id);
+		return false;
+	}
+
+	if (slot == transitionCount) {
+		transitionCount++;
+	}
+
+	// from the value reached so far when it replaces a running one
+	transitions[slot]._start = millis();
+	transitions[slot]._from = capabilities[id]._value;
+	transitions[slot]._to = value;
+	transitions[slot]._duration = duration;
+	transitions[slot]._id = id;
+	transitions[slot]._easing = easing;
+
+	DEBUG_PRINT("startTransition ");DEBUG_PRINT(capabilities[id]._name);DEBUG_PRINT("=");DEBUG_PRINT(value);DEBUG_PRINT(" in ");DEBUG_PRINTLN(duration);
+	return true;
+}
+
+void ESP8266Controller::stopTransition(uint8_t id) {
+
+	for (uint8_t i = 0; i < transitionCount; i++) {
+		if (transitions[i]._id == id) {
+			transitions[i] = transitions[--transitionCount];
+			eepromUpdatePending = true;
+			return;
 		}
 	}
+}
+
+boolean ESP8266Controller::inTransition(uint8_t id) const {
 
+	for (uint8_t i = 0; i < transitionCount; i++) {
+		if (transitions[i]._id == id) {
+			return true;
+		}
+	}
 	return false;
 }
 
+uint16_t ESP8266Controller::ease(uint8_t easing, uint16_t progress) {
+
+	const uint32_t one = 32768;
+	uint32_t p = progress;
+
+	switch (easing) {
+	case EASE_IN:
+		return p * p >> 15;
+	case EASE_OUT:
+		return one - ((one - p) * (one - p) >> 15);
+	case EASE_IN_OUT:
+		// 3p^2 - 2p^3
+		return (p * p >> 15) * (3 * one - 2 * p) >> 15;
+	default:
+		return p;
+	}
+}
+
+boolean ESP8266Controller::transitionLoop() {
+
+	if (transitionCount == 0 || millis() - lastTransitionTick < TRANSITION_TICK) {
+		return transitionCount > 0;
+	}
+	lastTransitionTick = millis();
+
+	for (uint8_t i = 0; i < transitionCount;) {
+		_transition& t = transitions[i];
+
+		// from the clock, not the number of ticks: a late tick catches up instead of stretching the fade
+		unsigned long elapsed = millis() - t._start;
+		boolean done = elapsed >= t._duration;
+		uint16_t value = t._to;
+
+		if (!done) {
+			int32_t e = ease(t._easing, (elapsed << 15) / t._duration);
+			value = t._from + (((int32_t)t._to - t._from) * e >> 15);
+		}
+
+		uint8_t id = t._id;
+
+		if (done) {
+			// ended first, the final value is then set as a SET sets it
+			DEBUG_PRINT("transitionLoop done ");DEBUG_PRINT(capabilities[id]._name);DEBUG_PRINT("=");DEBUG_PRINTLN(value);
+			transitions[i] = transitions[--transitionCount];
+			eepromUpdatePending = true;
+			setCapabilityById(id, value);
+		} else {
+			if (capabilities[id]._value != value) {
+				steppingId = id;
+				setCapabilityById(id, value);
+				steppingId = CAPABILITY_ID_NONE;
+			}
+			i++;
+		}
+	}
+
+	return transitionCount > 0;
+}
+
+// FNV-1a over the capability name (at most sizeof(_name) chars)
+uint16_t ESP8266Controller::hashCapabilityName(const char* cname) {
+
+	uint32_t hash = 2166136261UL;
+
+	for (unsigned int i = 0; i < sizeof(capabilities[0]._name) && cname[i] != 0; i++) {
+		hash ^= (uint8_t)cname[i];
+		hash *= 16777619UL;
+	}
+
+	return (uint16_t)(hash ^ (hash >> 16));
+}
+
+void ESP8266Controller::buildCapabilityIndex() {
+
+	uint16_t size = capabilityIndexSize(capabilityCount);
+
+	if (capabilityIndex == NULL) {
+		capabilityIndex = (uint8_t*)Arena.allocateOrHeap(size, 1);
+	}
+	capabilityIndexMask = size - 1;
+	memset(capabilityIndex, CAPABILITY_ID_NONE, size);
+
+	for (int i = 0; i < capabilityCount; i++) {
+		uint16_t slot = hashCapabilityName(capabilities[i]._name) & capabilityIndexMask;
+		while (capabilityIndex[slot] != CAPABILITY_ID_NONE) {
+			slot = (slot + 1) & capabilityIndexMask;
+		}
+		capabilityIndex[slot] = i;
+	}
+}
+
+uint8_t ESP8266Controller::capabilityId(const char* cname) {
+
+	if (capabilityIndexMask == 0) {
+		buildCapabilityIndex();
+	}
+
+	uint16_t slot = hashCapabilityName(cname) & capabilityIndexMask;
+
+	while (capabilityIndex[slot] != CAPABILITY_ID_NONE) {
+		uint8_t id = capabilityIndex[slot];
+		if (strncmp(cname, capabilities[id]._name, sizeof(capabilities[id]._name)) == 0) {
+			return id;
+		}
+		slot = (slot + 1) & capabilityIndexMask;
+	}
+
+	return CAPABILITY_ID_NONE;
+}
+
+// set capabilities from [no_of_capabilities][capability name or ID][value]...
+// no_of_capabilities with CAPABILITY_ID_FLAG set: each capability is addressed by its 1 byte ID
+// otherwise: each capability is addressed by its 16 byte name (older Android clients, older EEPROM records)
+// the whole list is bounds checked once before the first value is set, a truncated list sets nothing
+boolean ESP8266Controller::setCapabilities(PacketReader& in) {
+
+	uint8_t no_of_capabilities;
+	if (!in.u8(&no_of_capabilities)) {
+		return false;
+	}
+	boolean byId = (no_of_capabilities & CAPABILITY_ID_FLAG) != 0;
+	no_of_capabilities &= ~CAPABILITY_ID_FLAG;
+
+	uint8_t itemSize = (byId ? 1 : sizeof(capabilities[0]._name)) + sizeof(capabilities[0]._value);
+	const byte* item = in.take(no_of_capabilities * itemSize);
+	if (item == NULL) {
+		return false;
+	}
+
+	for (int i = 0; i < no_of_capabilities; i++) {
+
+		if (byId) {
+
+			// copy capability ID
+			uint8_t id = item[0];
+
+			// copy capability value
+			short val = toShort((byte*)item + 1);
+
+			setCapabilityById(id, val);
+
+		} else {
+
+			// copy capability name
+			char nme[sizeof(capabilities[0]._name)];
+			memcpy(nme, item, sizeof(nme));
+
+			// skip copying min, max values from Android client (they never change)
+
+			// copy capability value
+			short val = toShort((byte*)item + sizeof(nme));
+
+			setCapability(nme, val);
+		}
+
+		item += itemSize;
+	}
+
+	return true;
+}
+
 void ESP8266Controller::toString() {
 #ifdef IS_DEBUG
 
@@ -35,26 +330,14 @@ void ESP8266Controller::toString() {
 
 // size required for storing this controller capabilities on EEPROM
 int ESP8266Controller::sizeOfEEPROM() {
-
-	int size = 0;
-	size += sizeof (pin);
-	size += sizeof (capabilityCount);
-	size += capabilityCount * (sizeof(capabilities[0]._value) + sizeof(capabilities[0]._name));
-
-	return size;
+	return controllerEEPROMSize(capabilityCount);
 }
 
 // size of the UDP payload for this controller capabilities
-// example 1 : 2 + 16 + (6*30) = 18 + 180 = 198 bytes for LEDController
-// example 2 : 2 + 16 + (4*30) = 18 + 120 = 138 bytes for ACDimmer
+// example 1 : 2 + 16 + (6*22) = 18 + 132 = 150 bytes for LEDController
+// example 2 : 2 + 16 + (4*22) = 18 + 88 = 106 bytes for ACDimmer
 int ESP8266Controller::sizeOfUDPPayload() {
-
-	int size = 0;
-	size += sizeof (pin);
-	size += sizeof (capabilityCount);
-	size += sizeof (controllerName);
-	size += capabilityCount * sizeof(_unit16_capability);
-	return size;
+	return controllerUDPPayloadSize(capabilityCount);
 }
 
 // output this controller capabilities to byte array
@@ -109,95 +392,148 @@ int ESP8266Controller::toByteArray(byte aray[]) {
 
 	DEBUG_PRINTLN("LEDController::toByteArray");
 
-	// [pin][no_of_capabilities][capability name][min value][max value][value]
-	//byte aray[sizeOfUDPPayload()];
-	//memset(aray, 0, sizeof(aray));
-	int index = 0;
+	// [pin][no_of_capabilities][controller name][capability name][min value][max value][value]...
+	aray[CONTROLLER_UDP_PIN] = pin;
+	aray[CONTROLLER_UDP_COUNT] = capabilityCount;
+	memcpy(aray + CONTROLLER_UDP_NAME, controllerName, sizeof(controllerName));
 
-	// pin
-	memcpy(aray + index, &pin, sizeof(pin));
-	index += sizeof(pin);
+	// capabilities are already in wire layout
+	memcpy(aray + CONTROLLER_UDP_CAPABILITIES, capabilities, capabilityCount * CAPABILITY_UDP_SIZE);
 
-	// number of capabilities
-	memcpy(aray + index, &capabilityCount, 1);
-	index += sizeof(capabilityCount);
+	int size = sizeOfUDPPayload();
 
-	// controller name
-	memcpy(aray + index, controllerName, sizeof(controllerName));
-	index += sizeof(controllerName);
-
-	for (int i = 0; i < capabilityCount; i++) {
-
-		// capability name
-		memcpy(aray + index, capabilities[i]._name, sizeof(capabilities[i]._name));
-		index += sizeof(capabilities[i]._name);
-
-		// capability min value
-		aray[index++] = lowByte(capabilities[i]._value_min);
-		aray[index++] = highByte(capabilities[i]._value_min);
+	DEBUG_PRINT_ARRAY(aray, size, false);
+	DEBUG_PRINTLN("LEDController::toByteArray end");
 
-		// capability max value
-		aray[index++] = lowByte(capabilities[i]._value_max);
-		aray[index++] = highByte(capabilities[i]._value_max);
+	return size;
+}
 
-		// capability value
-		aray[index++] = lowByte(capabilities[i]._value);
-		aray[index++] = highByte(capabilities[i]._value);
-	}
+// write the UDP payload straight into out (e.g. the WiFiUDP packet being built), no staging array
+size_t ESP8266Controller::writeTo(Print& out) {
 
-	//printArray(aray, sizeof(aray), false);
-	DEBUG_PRINT_ARRAY(aray, index, false);
-	DEBUG_PRINTLN("LEDController::toByteArray end");
+	size_t written = out.write(pin);
+	written += out.write(capabilityCount);
+	written += out.write((const uint8_t*)controllerName, sizeof(controllerName));
+	written += out.write((const uint8_t*)capabilities, capabilityCount * CAPABILITY_UDP_SIZE);
 
-	return (index);
+	return written;
 }
 
 // set capabilities from a given byte array
 // Android client will generally send one capability at a time to update @device
-boolean ESP8266Controller::fromByteArray(byte aray[])  {
+boolean ESP8266Controller::fromByteArray(byte aray[], uint16_t length)  {
+
+	PacketReader in(aray, length);
+	uint8_t thispin = 0xFF;
 
-	if(aray[0]!=pin) {
-		DEBUG_PRINT("LEDController::fromByteArray end, wrong pin!");DEBUG_PRINT(", thispin ");DEBUG_PRINT(aray[0]);DEBUG_PRINT(", pin ");DEBUG_PRINT(pin);DEBUG_PRINTLN();
+	if(!in.u8(&thispin) || thispin!=pin) {
+		DEBUG_PRINT("LEDController::fromByteArray end, wrong pin!");DEBUG_PRINT(", thispin ");DEBUG_PRINT(thispin);DEBUG_PRINT(", pin ");DEBUG_PRINT(pin);DEBUG_PRINTLN();
+		LOG_WARN(LOG_MODULE_CONTROLLER, LOG_EVENT_CONTROLLER_WRONG_PIN, thispin, pin);
 		return false;
 	}
 
-	int index = 0;
-	byte thispin = aray[index++];
-	int no_of_capabilities = aray[index++];
-
 	DEBUG_PRINT("LEDController::fromByteArray ");DEBUG_PRINT("pin ");DEBUG_PRINTLN(thispin);
 
 	// skip copying controller name from Android client
 	// to change controller name Android client can create a local mapping (_name==new_name)
 
-	for (int i = 0; i < no_of_capabilities; i++) {
+	if (!setCapabilities(in)) {
+		DEBUG_PRINT("LEDController::fromByteArray ***MALFORMED*** length ");DEBUG_PRINTLN(length);
+		LOG_WARN(LOG_MODULE_CONTROLLER, LOG_EVENT_MALFORMED, pin, length);
+		return false;
+	}
 
-		// copy capability name
-		char nme[sizeof(capabilities[i]._name)];
-		memcpy(nme, aray+index, sizeof(capabilities[i]._name));
-		index += sizeof(capabilities[i]._name);
+	eepromUpdatePending = true;
 
-		// copy capability minimum value
-		// skip copying min, max values from Android client (they never change)
-		// capabilities[i]._value_min = toShort(aray + index);
-		//index += sizeof(capabilities[i]._value_min);
+	DEBUG_PRINTLN("LEDController::fromByteArray end");
+	return true;
+}
+
+boolean ESP8266Controller::fromByteArray(byte aray[]) {
+	return fromByteArray(aray, UDP_PACKET_MAX_SIZE);
+}
+
+/*
+	compact v2 encoding (DEVICE_COMMAND_GETALL_CONTROLLER_V2 reply)
+	[pin][flags][no_of_capabilities (varint)] then per capability: [ID (varint)][value (varint)]
+	with CAPABILITY_V2_SCHEMA also: [name length (1 byte)][name][min value (varint)][max value (varint)]
 
-		// copy capability maximum value
-		// skip copying min, max values from Android client (they never change)
-		// capabilities[i]._value_max = toShort(aray + index);
-		//index += sizeof(capabilities[i]._value_max);
+	values-only reply for an LED controller: 3 + 6 x (1 + 1..2) bytes instead of 150 bytes in v1
+*/
+int ESP8266Controller::toByteArrayV2(byte aray[], byte flags) {
+
+	int index = 0;
 
-		// copy capability value
-		short val = toShort(aray + index);
-		index += sizeof(capabilities[i]._value);
+	aray[index++] = pin;
+	aray[index++] = flags;
+	index += writeVarint(aray + index, capabilityCount);
 
-		setCapability(nme, val);
+	for (int i = 0; i < capabilityCount; i++) {
 
+		index += writeVarint(aray + index, i);
+		index += writeVarint(aray + index, capabilities[i]._value);
+
+		if (flags & CAPABILITY_V2_SCHEMA) {
+			byte nameLength = strnlen(capabilities[i]._name, sizeof(capabilities[i]._name));
+			aray[index++] = nameLength;
+			memcpy(aray + index, capabilities[i]._name, nameLength);
+			index += nameLength;
+			index += writeVarint(aray + index, capabilities[i]._value_min);
+			index += writeVarint(aray + index, capabilities[i]._value_max);
+		}
+	}
+
+	DEBUG_PRINT_ARRAY(aray, index, false);
+
+	return index;
+}
+
+/*
+	compact v2 SET (DEVICE_COMMAND_SETALL_CONTROLLER_V2)
+	[pin][no_of_capabilities (varint)] then per capability: [ID (varint)][value (varint)]
+*/
+boolean ESP8266Controller::fromByteArrayV2(byte aray[], uint16_t length) {
+
+	PacketReader in(aray, length);
+	uint8_t thispin = 0xFF;
+
+	if(!in.u8(&thispin) || thispin!=pin) {
+		DEBUG_PRINT("ESP8266Controller::fromByteArrayV2 end, wrong pin!");DEBUG_PRINTLN(thispin);
+		LOG_WARN(LOG_MODULE_CONTROLLER, LOG_EVENT_CONTROLLER_WRONG_PIN, thispin, pin);
+		return false;
+	}
+
+	// every capability takes 2 bytes at least, a count the payload cannot hold fails before the loop
+	uint16_t no_of_capabilities = 0;
+	boolean valid = in.varint(&no_of_capabilities) && in.remaining() >= 2UL * no_of_capabilities;
+
+	// 1st pass checks every varint, 2nd pass sets the values
+	PacketReader check = in;
+	for (int i = 0; valid && i < no_of_capabilities; i++) {
+		uint16_t id;
+		uint16_t val;
+		valid = check.varint(&id) && check.varint(&val);
+	}
+
+	if (!valid) {
+		DEBUG_PRINT("ESP8266Controller::fromByteArrayV2 ***MALFORMED*** length ");DEBUG_PRINTLN(length);
+		LOG_WARN(LOG_MODULE_CONTROLLER, LOG_EVENT_MALFORMED, pin, length);
+		return false;
+	}
+
+	for (int i = 0; i < no_of_capabilities; i++) {
+		uint16_t id = 0;
+		uint16_t val = 0;
+		in.varint(&id);
+		in.varint(&val);
+
+		if (id < capabilityCount) {
+			setCapabilityById(id, val);
+		}
 	}
 
 	eepromUpdatePending = true;
 
-	DEBUG_PRINTLN("LEDController::fromByteArray end");
 	return true;
 }
 
@@ -211,42 +547,37 @@ void ESP8266Controller::loadCapabilities() {
 
 	DEBUG_PRINT(", pin ");DEBUG_PRINT(pin);DEBUG_PRINT(", size ");DEBUG_PRINTLN(sizeOfEEPROM());
 
-	byte aray[sizeOfEEPROM()];
-	memset(aray, 0, sizeof(aray));
+	if (capabilityCount > CONTROLLER_MAX_CAPABILITIES) {
+		DEBUG_PRINT("ESP8266Controller::loadCapabilities ***TOO MANY CAPABILITIES*** ");DEBUG_PRINTLN(capabilityCount);
+		return;
+	}
+
+	// past MAX_CONTROLLER_PIN the record key would be the current preset's, a preset slot's or the config's
+	if (pin > MAX_CONTROLLER_PIN) {
+		DEBUG_PRINT("ESP8266Controller::loadCapabilities ***NO RECORD KEY FOR PIN*** ");DEBUG_PRINTLN(pin);
+		LOG_ERROR(LOG_MODULE_CONTROLLER, LOG_EVENT_CONTROLLER_WRONG_PIN, pin, MAX_CONTROLLER_PIN);
+		return;
+	}
+
+	byte aray[CONTROLLER_EEPROM_MAX_SIZE];
+	memset(aray, 0, sizeOfEEPROM());
 
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
-	EEPROM.begin(1024);
-	EepromUtil::eeprom_read_bytes(eeprom_address, aray, sizeof (aray));
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
-	EEPROM.end();
+	Persistence.load(RECORD_KEY_CONTROLLER + pin, eeprom_address, aray, sizeOfEEPROM());
 
 	//fromByteArray(aray);
 	//readEEPROM(aray);
-	int index = 0;
-	byte thispin = aray[index++];
+	PacketReader in(aray, sizeOfEEPROM());
+	uint8_t thispin = 0;
+	in.u8(&thispin);
 
 	if(thispin!=pin) {
 		return;
 	}
 
-	int no_of_capabilities = aray[index++];
-	DEBUG_PRINT("loadCapabilities no_of_capabilities ");DEBUG_PRINTLN(no_of_capabilities);
-
-	for (int i = 0; i < no_of_capabilities; i++) {
+	DEBUG_PRINT("loadCapabilities no_of_capabilities ");DEBUG_PRINTLN(aray[in.position()] & ~CAPABILITY_ID_FLAG);
 
-		// copy capability name
-		char nme[sizeof(capabilities[i]._name)];
-		memcpy(nme, aray+index, sizeof(capabilities[i]._name));
-		index += sizeof(capabilities[i]._name);
-
-		// copy capability value
-		short val = toShort(aray + index);
-		index += sizeof(capabilities[i]._value);
-
-		setCapability(nme, val);
-	}
+	// a record claiming more capabilities than fit this controller's record is ignored
+	setCapabilities(in);
 
 	toString();
 	DEBUG_PRINTLN("ESP8266Controller::loadCapabilities end");
@@ -266,44 +597,63 @@ void ESP8266Controller::saveCapabilities() {
 
 	DEBUG_PRINT("ESP8266Controller::saveCapabilities at ");DEBUG_PRINT(eeprom_address);DEBUG_PRINT(", pin ");DEBUG_PRINT(pin);
 
-	byte aray[sizeOfEEPROM()];
-	memset(aray, 0, sizeof(aray));
+	if (capabilityCount > CONTROLLER_MAX_CAPABILITIES) {
+		DEBUG_PRINT(" ***TOO MANY CAPABILITIES*** ");DEBUG_PRINTLN(capabilityCount);
+		return;
+	}
+
+	if (pin > MAX_CONTROLLER_PIN) {
+		DEBUG_PRINT(" ***NO RECORD KEY FOR PIN*** ");DEBUG_PRINTLN(pin);
+		LOG_ERROR(LOG_MODULE_CONTROLLER, LOG_EVENT_CONTROLLER_WRONG_PIN, pin, MAX_CONTROLLER_PIN);
+		return;
+	}
+
+	byte aray[CONTROLLER_EEPROM_MAX_SIZE];
+	memset(aray, 0, sizeOfEEPROM());
 	int index = 0;
 
-	DEBUG_PRINT(", size ");DEBUG_PRINTLN(sizeof(aray));
+	DEBUG_PRINT(", size ");DEBUG_PRINTLN(sizeOfEEPROM());
 	// pin
 	memcpy(aray + index, &pin, sizeof(pin));
 	index += sizeof(pin);
 
-	// number of capabilities
-	memcpy(aray + index, &capabilityCount, 1);
-	index += sizeof(capabilityCount);
+	// number of capabilities, flagged when stored by ID
+	aray[index++] = eepromStoreIds ? (capabilityCount | CAPABILITY_ID_FLAG) : capabilityCount;
 
 	for (int i = 0; i < capabilityCount; i++) {
 
-		// capability name
-		memcpy(aray + index, capabilities[i]._name, sizeof(capabilities[i]._name));
-		index += sizeof(capabilities[i]._name);
+		if (eepromStoreIds) {
+			// capability ID
+			aray[index++] = i;
+		} else {
+			// capability name
+			memcpy(aray + index, capabilities[i]._name, sizeof(capabilities[i]._name));
+			index += sizeof(capabilities[i]._name);
+		}
 
-		// value
-		aray[index++] = lowByte(capabilities[i]._value);
-		aray[index++] = highByte(capabilities[i]._value);
+		// value, the target of a running transition: intermediate values are never saved
+		uint16_t value = capabilities[i]._value;
+		for (uint8_t t = 0; t < transitionCount; t++) {
+			if (transitions[t]._id == i) {
+				value = transitions[t]._to;
+			}
+		}
+		aray[index++] = lowByte(value);
+		aray[index++] = highByte(value);
 	}
 
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
-	EEPROM.begin(1024);
-
-	// mark as configured
-	byte b = 1;
-	EepromUtil::eeprom_update_bytes(IS_CONFIGURED_BYTE_ADDRESS, &b, 1);
+	// mark as configured (the record store keeps this flag in the ESPConfig record)
+	if (Persistence.recordStore() == NULL) {
+		byte b = 1;
+		Persistence.write(IS_CONFIGURED_BYTE_ADDRESS, &b, 1);
+	}
 
-	EepromUtil::eeprom_update_bytes(eeprom_address, aray, sizeof(aray));
+	if (Persistence.save(RECORD_KEY_CONTROLLER + pin, eeprom_address, aray, index)) {
+		Metrics.capabilitySaves++;
+	}
 
-	EEPROM.commit();
-	EEPROM.end();
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
+	// single commit, skipped if nothing changed
+	Persistence.requestFlush();
 
 	eepromUpdatePending = false;
 
@@ -1,6 +1,9 @@
 #ifndef ESP8266Controller_h
 #define ESP8266Controller_h
 
+#include "PacketReader.h"
+#include "ESPArena.h"
+
 typedef struct {
 	// packet size
 	uint16_t _size;
@@ -31,18 +34,78 @@ public:
 
 } _unit16_capability;
 
+// compile time description of one capability, kept in flash (PROGMEM) by StaticController
+typedef struct {
+	char _name[16];
+	uint16_t _value_min;
+	uint16_t _value_max;
+	uint16_t _value;
+} _capability_schema;
+
+// set in the no_of_capabilities byte when each capability is addressed by its ID (1 byte) instead of its 16 byte name
+// SET/SETALL payload and EEPROM record: [pin][no_of_capabilities | CAPABILITY_ID_FLAG][capability ID][value]...
+static const uint8_t CAPABILITY_ID_FLAG = 0x80;
+static const uint8_t CAPABILITY_ID_NONE = 0xFF;
+
+// checkCapability() results
+static const uint8_t CAPABILITY_VALID = 0;
+static const uint8_t CAPABILITY_UNKNOWN = 1;// no capability with that ID
+static const uint8_t CAPABILITY_OUT_OF_RANGE = 2;// value outside _value_min to _value_max
+
+// v2 GETALL flag: append the schema (name, min, max) to every capability
+static const uint8_t CAPABILITY_V2_SCHEMA = 0x01;
+
+// easing curve of a transition
+static const uint8_t EASE_LINEAR = 0;
+static const uint8_t EASE_IN = 1;// quadratic, slow start
+static const uint8_t EASE_OUT = 2;// quadratic, slow end
+static const uint8_t EASE_IN_OUT = 3;// smoothstep
+static const uint8_t EASE_COUNT = 4;
+
+// transitions a controller runs at once, and milliseconds between two interpolated values
+static const uint8_t CONTROLLER_MAX_TRANSITIONS = 4;
+static const unsigned long TRANSITION_TICK = 10;
+
+// capability _id moving from _from to _to along _easing, _duration milliseconds from _start
+typedef struct {
+	unsigned long _start;
+	uint16_t _from;
+	uint16_t _to;
+	uint16_t _duration;
+	uint8_t _id;
+	uint8_t _easing;
+} _transition;
+
+// slots in the capability name hash index: at least twice the capability count, power of 2
+static constexpr uint16_t capabilityIndexSize(uint8_t capCount, uint16_t size = 4) {
+	return size >= 2 * capCount ? size : capabilityIndexSize(capCount, size << 1);
+}
+
 class ESP8266Controller {
 
 public:
 
-	ESP8266Controller(const char* nam, uint8_t _pin, uint8_t capCount, int start_address) {
-		DEBUG_PRINTLN("ESP8266Controller::ESP8266Controller");
+	// capabilities and name index from the arena, the heap only if ESP_ARENA_SIZE is too small. A controller is
+	// saved in one record of CONTROLLER_MAX_CAPABILITIES, capabilities after that are kept but not announced or saved
+	ESP8266Controller(const char* nam, uint8_t _pin, uint8_t capCount, int start_address);
+
+	// controllers may be deleted through this class. Arena storage is not given back, controllers live as long as
+	// the firmware
+	virtual ~ESP8266Controller() {}
+
+protected:
+	// capabilities and name index live in storage owned by the subclass (see StaticController), nothing is malloc'd
+	// index must hold capabilityIndexSize(capCount) bytes
+	ESP8266Controller(const char* nam, uint8_t _pin, uint8_t capCount, int start_address, _unit16_capability* storage, uint8_t* index) {
+		DEBUG_PRINTLN("ESP8266Controller::ESP8266Controller static");
 
 		pin = _pin;
 		capabilityCount = capCount;
 		eeprom_address = start_address;
 		strcpy(controllerName, nam);
-		capabilities = (_unit16_capability*)malloc (sizeof(_unit16_capability) *capabilityCount);
+		capabilities = storage;
+		capabilityIndex = index;
+		capabilityIndexMask = 0;
 	}
 
 public:
@@ -72,9 +135,34 @@ public:
 	// e.g. AC DIMMER HAS FOUR(4) CAPABILITIES
 	uint8_t capabilityCount = 0;
 
-	// capabilities of the device which can be controlled by this class
+	// store capabilities in EEPROM by ID instead of name (smaller record, no name lookup at load)
+	boolean eepromStoreIds = false;
+
+	// incremented whenever a capability value changes through setCapability (fromByteArray, loadCapabilities),
+	// cached replies of this controller are stale once it moves. Code writing capabilities[] directly must increment it
+	uint16_t changeCount = 0;
+
+	// capabilities changed since DeviceServer last pushed them to subscribers, bit = ID, bit 31 stands for IDs 31 and up
+	uint32_t changedMask = 0;
+
+	// capabilities of the device which can be controlled by this class. Every value a command sets goes through
+	// here, by name or by ID (SET, v2 SET, SET_TRANSACTION, presets): a subclass which applies its outputs when a
+	// value changes overrides it and calls ESP8266Controller::setCapability(cname, value)
 	virtual boolean setCapability(char* cname, uint16_t value);
 
+	// set capability by ID (index into capabilities), through setCapability(capabilities[id]._name, value)
+	boolean setCapabilityById(uint8_t id, uint16_t value);
+
+	// whether setCapabilityById(id, value) would take value, nothing is set. Commands which check all their values
+	// before applying any (SET_TRANSACTION, FADE, preset recall) use it
+	uint8_t checkCapability(uint16_t id, uint16_t value) const;
+
+	// ID of the capability with this name, CAPABILITY_ID_NONE if there is none
+	uint8_t capabilityId(const char* cname);
+
+	// build the name to ID hash index, called on first name lookup if the subclass does not call it after naming its capabilities
+	void buildCapabilityIndex();
+
 	// load capability data into variables from EEPROM
 	virtual void loadCapabilities();
 
@@ -85,20 +173,80 @@ public:
 	//virtual byte* toByteArray();
 	virtual int toByteArray(byte aray[]);
 
+	// same payload as toByteArray, written to out without a staging array
+	size_t writeTo(Print& out);
+
 	// initialize the capabilities with provided array (capabilities) received over network
+	// false for another pin or a payload shorter than its capabilities, nothing is set then
+	virtual boolean fromByteArray(byte aray[], uint16_t length);
+
+	// aray holds up to UDP_PACKET_MAX_SIZE bytes, kept for sketches written before the length was passed.
+	// DeviceServer calls the one above, a subclass overriding this one alone is not called for SET
 	virtual boolean fromByteArray(byte aray[]);
 
+	// compact v2 encoding of the capabilities, flags CAPABILITY_V2_SCHEMA adds names and ranges
+	int toByteArrayV2(byte aray[], byte flags);
+
+	// set capabilities from a compact v2 SET payload, all or nothing as fromByteArray
+	boolean fromByteArrayV2(byte aray[], uint16_t length);
+
 	// size occupied by this controller capabilities saved in EEPROM
 	int sizeOfEEPROM();
 
 	// size required by this controller capabilities as UDP payload
 	int sizeOfUDPPayload();
 
+	// move capability id to value in duration milliseconds along easing, replacing a transition of id still running;
+	// duration 0 sets it right away. false if id, value or easing is out of range or CONTROLLER_MAX_TRANSITIONS run
+	boolean startTransition(uint8_t id, uint16_t value, uint16_t duration, uint8_t easing = EASE_LINEAR);
+
+	// stop the transition of id at the value it has reached, which is then saved
+	void stopTransition(uint8_t id);
+
+	// step the running transitions, at most once per TRANSITION_TICK. Every value goes through setCapability, so an
+	// override applying outputs follows the fade; intermediate values are neither logged nor saved, the final one
+	// is set as a SET sets it and saved. DeviceServer::loop() and Scheduler call it before loop(). Returns true
+	// while a transition is running
+	boolean transitionLoop();
+
+	// a transition of any capability / of capability id is running
+	boolean inTransition() const {
+		return transitionCount > 0;
+	}
+	boolean inTransition(uint8_t id) const;
+
+	// transitions which can be started besides the running ones
+	uint8_t transitionsAvailable() const {
+		return CONTROLLER_MAX_TRANSITIONS - transitionCount;
+	}
+
 	// loop is called in loop() to reflect the current state of pin (time based changes - blink LED every second)
 	virtual void loop() = 0;
 
 	void toString();
 
+protected:
+	// set capabilities from [no_of_capabilities][name or ID][value]... read from in, false if in is too short for them
+	boolean setCapabilities(PacketReader& in);
+
+private:
+	// open addressing hash table of capability IDs, CAPABILITY_ID_NONE marks an empty slot
+	uint8_t* capabilityIndex = NULL;
+	uint8_t capabilityIndexMask = 0;
+
+	static uint16_t hashCapabilityName(const char* cname);
+
+	// running transitions are transitions[0 .. transitionCount - 1]
+	_transition transitions[CONTROLLER_MAX_TRANSITIONS];
+	uint8_t transitionCount = 0;
+	unsigned long lastTransitionTick = 0;
+
+	// capability transitionLoop() is stepping through setCapability, which must not stop its transition
+	uint8_t steppingId = CAPABILITY_ID_NONE;
+
+	// eased progress, both Q15 (32768 = done)
+	static uint16_t ease(uint8_t easing, uint16_t progress);
+
 };
 
-#endif
+#endif
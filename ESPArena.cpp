@@ -0,0 +1,51 @@
+#include "Arduino.h"
+#include "ESPConfig.h"
+#include "ESPArena.h"
+
+ESPArena Arena;
+
+void* ESPArena::allocate(size_t size, size_t align) {
+
+#if ESP_ARENA_SIZE > 0
+	if (size == 0) {
+		return NULL;
+	}
+
+	size_t start = (top + align - 1) & ~(align - 1);
+	size_t end = start + arenaBlockSize(size);
+
+	if (end > ESP_ARENA_SIZE) {
+		DEBUG_PRINT("ESPArena::allocate ***FULL*** ");DEBUG_PRINT(size);DEBUG_PRINT(", available ");DEBUG_PRINTLN(available());
+		failed++;
+		return NULL;
+	}
+
+	padding += end - top - size;
+	top = end;
+	blocks++;
+
+	return storage + start;
+#else
+	DEBUG_PRINT("ESPArena::allocate ***NO ESP_ARENA_SIZE*** ");DEBUG_PRINTLN(size);
+	failed++;
+	return NULL;
+#endif
+}
+
+void* ESPArena::allocateOrHeap(size_t size, size_t align) {
+	if (ESP_ARENA_SIZE == 0) {
+		return malloc(size);
+	}
+	void* p = allocate(size, align);
+	return p != NULL ? p : malloc(size);
+}
+
+void ESPArena::report(Print& out) {
+	out.print("arena ");out.print(used());out.print("/");out.print(capacity());
+	out.print(" B blocks ");out.print(blocks);
+	out.print(" padding ");out.print(padding);
+	out.print(" failed ");out.print(failed);
+	out.print(" heap free ");out.print(ESP.getFreeHeap());
+	out.print(" max block ");out.print(ESP.getMaxFreeBlockSize());
+	out.print(" fragmentation ");out.print(ESP.getHeapFragmentation());out.println("%");
+}
@@ -0,0 +1,91 @@
+#ifndef ESPArena_h
+#define ESPArena_h
+
+#include "Arduino.h"
+#include <new>
+#include <utility>
+
+// build flag, bytes reserved for the controllers and capability tables of a firmware, e.g. -DESP_ARENA_SIZE=2048.
+// 0, the default, reserves nothing and leaves them on the heap
+#ifndef ESP_ARENA_SIZE
+#define ESP_ARENA_SIZE 0
+#endif
+
+// every block starts on this boundary and is rounded up to it
+static const uint8_t ARENA_ALIGN = 4;
+
+// bytes a block of size takes in the arena, for adding up ESP_ARENA_SIZE at compile time
+static constexpr size_t arenaBlockSize(size_t size) {
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/***
+*
+*	Fixed capacity arena for what a firmware allocates once at startup: controllers and their capability
+*	tables. ESP_ARENA_SIZE bytes are reserved in .bss, blocks are handed out in order and never freed, so the
+*	heap is not touched after setup() and the memory a firmware needs is known when it is built.
+*
+*	LEDController* led;
+*
+*	void setup() {
+*		led = Arena.create<LEDController>("LED", 4, 200);
+*		...
+*	}
+*
+*	The arena is off unless the firmware is built with ESP_ARENA_SIZE: sum arenaBlockSize() of what it creates.
+*	ESP8266Controller's run time sized constructor takes its capabilities and name index from Arena too.
+*	An allocation that does not fit is counted in failed; allocateOrHeap() then falls back to malloc, so an
+*	ESP_ARENA_SIZE that is too small shows in report() and GET_STATS instead of stopping the firmware. With
+*	the arena off allocateOrHeap() is malloc and nothing is counted.
+*
+***/
+class ESPArena {
+public:
+	// size bytes aligned to align, NULL if they do not fit
+	void* allocate(size_t size, size_t align = ARENA_ALIGN);
+
+	// allocate, or malloc once the arena is full
+	void* allocateOrHeap(size_t size, size_t align = ARENA_ALIGN);
+
+	// a T constructed in the arena, NULL if it does not fit
+	template<typename T, typename... Args>
+	T* create(Args&&... args) {
+		void* p = allocate(sizeof(T), alignof(T));
+		return p == NULL ? NULL : new (p) T(std::forward<Args>(args)...);
+	}
+
+	size_t capacity() const {
+		return ESP_ARENA_SIZE;
+	}
+
+	size_t used() const {
+		return top;
+	}
+
+	size_t available() const {
+		return ESP_ARENA_SIZE - top;
+	}
+
+	// bytes of used() lost to alignment, in percent
+	uint8_t fragmentation() const {
+		return top == 0 ? 0 : padding * 100 / top;
+	}
+
+	// arena and heap figures, one line
+	void report(Print& out);
+
+	// blocks handed out, bytes lost to alignment, allocations that did not fit and went to the heap if allowed
+	uint16_t blocks = 0;
+	uint16_t padding = 0;
+	uint16_t failed = 0;
+
+private:
+#if ESP_ARENA_SIZE > 0
+	alignas(8) byte storage[ESP_ARENA_SIZE];
+#endif
+	size_t top = 0;
+};
+
+extern ESPArena Arena;
+
+#endif
@@ -1,10 +1,15 @@
 #include "Arduino.h"
 #include <WiFiUdp.h>
 #include <ESP8266WiFi.h>
-#include <ESP8266httpUpdate.h>
 #include <EepromUtil.h>
 #include <EEPROM.h>
 #include "ESPConfig.h"
+#include "Persistence.h"
+#include "FirmwareUpdater.h"
+#include "PacketReader.h"
+#include "ESPMetrics.h"
+#include "ESPFastBoot.h"
+#include "DeviceServer.h"
 
 /***
 *
@@ -35,19 +40,28 @@
 *
 ***/
 
-void ESPConfig::init(int indicatorPin) {
+/*
+	nonBlocking = false: connect to the router (or fall back to WiFi AP) before returning, up to max_retry_wifi_ap_connect_time
+	nonBlocking = true: start connecting and return, loop() finishes the connection so controllers and UDP are served meanwhile
+	fastBoot = true: after a reset which kept RTC memory, configuration and controllers are loaded from there (see ESPFastBoot.h)
+	and the last access point is joined on its channel with the last address, a scan with DHCP is the fallback
+*/
+void ESPConfig::init(int indicatorPin, boolean nonBlocking, boolean fastBoot) {
 	DEBUG_PRINTLN("ESPConfig::init");
 	//resetEEPROM();
 
-	EEPROM.begin(EEPROM_MAX_ADDR);
+	if (fastBoot) {
+		FastBoot.begin(firmwareVersion);
+	}
+
 	byte rb;
-	EepromUtil::eeprom_read_bytes(IS_CONFIGURED_BYTE_ADDRESS, &rb, 1);
+	Persistence.load(RECORD_KEY_CONFIG, IS_CONFIGURED_BYTE_ADDRESS, &rb, 1);
 	isConf = rb==1?true:false;
-	EEPROM.end();
 
 	// mac id (6 bytes)
 	memset(mac, 0, sizeof(mac));
 	WiFi.macAddress(mac);
+	changeCount++;
 
 	//memset(routerSSID, 0, sizeof(routerSSID));
 	//memset(routerSSIDKey, 0, sizeof(routerSSIDKey));
@@ -85,6 +99,12 @@ void ESPConfig::init(int indicatorPin) {
 		//setupWiFiAP();
 	}
 
+	if (nonBlocking) {
+		beginConnectToAP(indicatorPin);
+		DEBUG_PRINTLN("ESPConfig::init end, connecting");
+		return;
+	}
+
 	// connect to configured AP with credentials
 	if (connectToAP(indicatorPin) == false) {
 
@@ -102,6 +122,8 @@ void ESPConfig::init(int indicatorPin) {
 
 	}
 
+	wifiState = WiFi.status() == WL_CONNECTED ? WIFI_STATE_CONNECTED : WIFI_STATE_AP;
+
 	DEBUG_PRINTLN("ESPConfig::init end");
 }
 /*
@@ -119,14 +141,14 @@ short ESPConfig::discover(byte* replyBuffer) {
 	return _siz;
 }
 */
-short ESPConfig::set(byte* replyBuffer, byte* _payload) {
+short ESPConfig::set(byte* replyBuffer, byte* _payload, uint16_t payload_length) {
 	DEBUG_PRINTLN("ESPConfig::set");
 
-	uint16_t errordesc_length = 100;
-	byte errordesc[errordesc_length];
+	uint16_t errordesc_length = CONFIG_ERROR_MAX_LENGTH;
+	byte errordesc[CONFIG_ERROR_MAX_LENGTH];
 	memset(errordesc, 0, errordesc_length);
 
-	fromByteArray(_payload, errordesc, &errordesc_length);
+	fromByteArray(_payload, payload_length, errordesc, &errordesc_length);
 
 	memcpy(replyBuffer, errordesc, errordesc_length);
 
@@ -134,6 +156,10 @@ short ESPConfig::set(byte* replyBuffer, byte* _payload) {
 	return errordesc_length;
 }
 
+short ESPConfig::set(byte* replyBuffer, byte* _payload) {
+	return set(replyBuffer, _payload, UDP_PACKET_MAX_SIZE);
+}
+
 boolean ESPConfig::isConfigured() {
 	return isConf;
 }
@@ -143,26 +169,13 @@ uint8_t* ESPConfig::getMAC() {
 }
 
 int ESPConfig::sizeOfEEPROM() {
-	// TOTAL SIZE = 1 + (24 x 5) = 1 + 120 = 121
-
-	return sizeof(isConf) // IS_CONFIGURED_BYTE_ADDRESS = 1byte
-	+ sizeof(routerSSID) // 24 bytes
-	+ sizeof(routerSSIDKey) // 24 bytes
-	+ sizeof(controllerName) // 24 bytes
-	+ sizeof(controllerLocation); // 24 bytes
-	//	+ sizeof(firmwareVersion);// 24 bytes, always stored in variable
+	// TOTAL SIZE = 1 + (24 x 2) + (16 x 2) = 81, firmwareVersion is always stored in variable
+	return CONFIG_EEPROM_SIZE;
 }
 
 int ESPConfig::sizeOfUDPPayload() {
-	// TOTAL SIZE = 1 + 6 + (24 x 2) + (16 x 3) = 1 + 6 + 120 = 127
-
-	return sizeof(isConf) // IS_CONFIGURED_BYTE_ADDRESS = 1 byte
-	+ sizeof(mac) // 6 bytes
-	+ sizeof(routerSSID) // 24 bytes
-	+ sizeof(routerSSIDKey) // 24 bytes
-	+ sizeof(controllerName) // 16 bytes
-	+ sizeof(controllerLocation) // 16 bytes
-	+ sizeof(firmwareVersion);// 16 bytes
+	// TOTAL SIZE = 1 + 6 + (24 x 2) + (16 x 3) = 103
+	return CONFIG_UDP_SIZE;
 }
 
 /* 
@@ -171,21 +184,20 @@ int ESPConfig::sizeOfUDPPayload() {
 
 void ESPConfig::load() {
 	DEBUG_PRINTLN("ESPConfig::load");
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
-	EEPROM.begin(EEPROM_MAX_ADDR);
 
-	int readAddress = IS_CONFIGURED_BYTE_ADDRESS;
+	byte aray[CONFIG_EEPROM_SIZE];
+	Persistence.load(RECORD_KEY_CONFIG, IS_CONFIGURED_BYTE_ADDRESS, aray, sizeof(aray));
+
+	int readAddress = 0;
 
 	// 1st byte: is configured
-	byte rb;
-	EepromUtil::eeprom_read_bytes(readAddress++, &rb, 1);
+	byte rb = aray[readAddress++];
 	isConf = rb==1?true:false;
 
 	DEBUG_PRINT("isConfigured ");DEBUG_PRINTLN(isConf);
 
 	// routerSSID
-	EepromUtil::eeprom_read_bytes(readAddress, (byte*)routerSSID, sizeof(routerSSID));
+	memcpy(routerSSID, aray+readAddress, sizeof(routerSSID));
 	readAddress += sizeof(routerSSID);
 	//if(strlen(routerSSID)==0) {
 	//reset to default
@@ -193,11 +205,11 @@ void ESPConfig::load() {
 	//}
 
 	// routerSSIDKey
-	EepromUtil::eeprom_read_bytes(readAddress, (byte*)routerSSIDKey, sizeof(routerSSIDKey));
+	memcpy(routerSSIDKey, aray+readAddress, sizeof(routerSSIDKey));
 	readAddress += sizeof(routerSSIDKey);
 
 	// controller name
-	EepromUtil::eeprom_read_bytes(readAddress, (byte*)controllerName, sizeof(controllerName));
+	memcpy(controllerName, aray+readAddress, sizeof(controllerName));
 	readAddress += sizeof(controllerName);
 	if(strlen(controllerName)==0) {
 		//reset to default
@@ -205,7 +217,7 @@ void ESPConfig::load() {
 	}
 
 	// controller location
-	EepromUtil::eeprom_read_bytes(readAddress, (byte*)controllerLocation, sizeof(controllerLocation));
+	memcpy(controllerLocation, aray+readAddress, sizeof(controllerLocation));
 	readAddress += sizeof(controllerLocation);
 	if(strlen(controllerLocation)==0) {
 		//reset to default
@@ -214,16 +226,15 @@ void ESPConfig::load() {
 
 	// firmware version
 	// 17MAR2020, commented 2 lines below since firmware version is always hardcoded in firmwareVersion variable through a constructor
-	//EepromUtil::eeprom_read_bytes(readAddress, (byte*)firmwareVersion, sizeof(firmwareVersion));
+	//memcpy(firmwareVersion, aray+readAddress, sizeof(firmwareVersion));
 	//readAddress += sizeof(firmwareVersion);
 	if(strlen(firmwareVersion)==0) {
 		//reset to default
 		//strcpy(firmwareVersion, defaultFirmware);
 	}
 
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
-	EEPROM.end();
+	changeCount++;
+	LOG_INFO(LOG_MODULE_CONFIG, LOG_EVENT_CONFIG_LOAD, isConf, 0);
 
 	DEBUG_PRINTLN("ESPConfig::load end");
 	return;
@@ -241,105 +252,111 @@ void ESPConfig::toString() {
 #endif
 }
 
-void ESPConfig::fromByteArray(byte command, byte* aray, byte* errordesc, uint16_t* errordesc_length) {
+// error description of a payload shorter than its fields
+static void describeMalformed(byte* errordesc, uint16_t* errordesc_length) {
+	static const char error[] = "malformed payload";
+	uint16_t length = min((uint16_t)(sizeof(error) - 1), *errordesc_length);
+	memcpy(errordesc, error, length);
+	*errordesc_length = length;
+}
+
+void ESPConfig::fromByteArray(byte command, byte* aray, uint16_t length, byte* errordesc, uint16_t* errordesc_length) {
 	DEBUG_PRINT("ESPConfig::fromByteArray command ");DEBUG_PRINTLN(command);
+	LOG_INFO(LOG_MODULE_CONFIG, LOG_EVENT_CONFIG_SET, command, 0);
 
-	int index = 0;
+	// every field is taken whole before anything is changed, a short payload leaves this object as it is
+	PacketReader in(aray, length);
 	uint8_t retvalue = 255;//default value 255 for all commands except DEVICE_COMMAND_FIRMWARE_UPDATE
 	uint16_t _error_length = 0;
 
 	if(command==DEVICE_COMMAND_SET_CONFIGURATION_NAME) {
-		// controller name (24 bytes)
-		memset(controllerName, 0, sizeof(controllerName));
-		memcpy(controllerName, aray+index, sizeof(controllerName));
-		index += sizeof(controllerName);
+		// controller name (16 bytes)
+		const byte* name = in.take(sizeof(controllerName));
+		if (name != NULL) {
+			memcpy(controllerName, name, sizeof(controllerName));
+		}
 
 	} else if(command==DEVICE_COMMAND_SET_CONFIGURATION_SSID) {
-		// routerSSID (24 bytes)
-		memset(routerSSID, 0, sizeof(routerSSID));
-		memcpy(routerSSID, aray+index, sizeof(routerSSID));
-		index += sizeof(routerSSID);
-
-		// routerSSIDKey (24 bytes) starts after routerSSID
-		memset(routerSSIDKey, 0, sizeof(routerSSIDKey));
-		memcpy(routerSSIDKey, aray+index, sizeof(routerSSIDKey));
-		index += sizeof(routerSSIDKey);
+		// routerSSID (24 bytes), routerSSIDKey (24 bytes) starts after routerSSID
+		const byte* ssid = in.take(sizeof(routerSSID) + sizeof(routerSSIDKey));
+		if (ssid != NULL) {
+			if (memcmp(routerSSID, ssid, sizeof(routerSSID) + sizeof(routerSSIDKey)) != 0) {
+				FastBoot.forgetWiFi();
+			}
+			memcpy(routerSSID, ssid, sizeof(routerSSID));
+			memcpy(routerSSIDKey, ssid + sizeof(routerSSID), sizeof(routerSSIDKey));
+		}
 
 	} else if(command==DEVICE_COMMAND_SET_CONFIGURATION_AP) {
 		//erase routerSSID, routerSSIDKey so that device boot as AP
+		FastBoot.forgetWiFi();
 		memset(routerSSIDKey, 0, sizeof(routerSSIDKey));
 		memset(routerSSID, 0, sizeof(routerSSID));
 
 	} else if(command==DEVICE_COMMAND_SET_CONFIGURATION_LOCATION) {
-		// controller location (24 bytes) starts after controller name
-		memset(controllerLocation, 0, sizeof(controllerLocation));
-		memcpy(controllerLocation, aray+index, sizeof(controllerLocation));
-		index += sizeof(controllerLocation);
+		// controller location (16 bytes)
+		const byte* location = in.take(sizeof(controllerLocation));
+		if (location != NULL) {
+			memcpy(controllerLocation, location, sizeof(controllerLocation));
+		}
 
 	} else if(command==DEVICE_COMMAND_FIRMWARE_UPDATE) {
 
-		byte boot_after_update = 0;
+		uint8_t boot_after_update = 0;
 		uint16_t url_length = 0;
+		in.u8(&boot_after_update);
+		in.u16(&url_length);
+		const byte* url = in.take(url_length);
+
+		if (url == NULL) {
+			DEBUG_PRINT("ESPConfig::fromByteArray ***MALFORMED*** length ");DEBUG_PRINTLN(length);
+			LOG_WARN(LOG_MODULE_CONFIG, LOG_EVENT_MALFORMED, command, length);
+			describeMalformed(errordesc, errordesc_length);
+			return;
+		}
 
-		memcpy(&boot_after_update, aray+index, sizeof(boot_after_update));
-		index += sizeof(boot_after_update);
-		memcpy(&url_length, aray+index, sizeof(url_length));
-		index += sizeof(url_length);
-
-		char firmwareurl[url_length+1];
-		memset(firmwareurl, 0, sizeof(firmwareurl));
-		memcpy(firmwareurl, aray+index, url_length);
-		index += url_length;
-
-		String url = firmwareurl;
-
-		DEBUG_PRINT("ESPConfig::fromByteArray boot_after_update ");DEBUG_PRINT(boot_after_update);DEBUG_PRINT(", url_length ");DEBUG_PRINT(url_length);DEBUG_PRINT(", url ");DEBUG_PRINTLN(url);
-		DEBUG_PRINT("ESPConfig::fromByteArray ESPhttpUpdate.updating ...");
-
-		ESPhttpUpdate.rebootOnUpdate(boot_after_update);
-		WiFiClient wifiClient;
-		//retvalue = ESPhttpUpdate.update(url);//03-APR-2022; based on old lib ESP8266 2.7.4
-		retvalue = ESPhttpUpdate.update(wifiClient, url, firmwareVersion);//03-APR-2022; based on new lib ESP8266 3.0.2
+		// one character over FIRMWARE_UPDATE_MAX_URL is enough for start() to refuse a longer url
+		char firmwareurl[FIRMWARE_UPDATE_MAX_URL + 2];
+		uint16_t copied = min(url_length, (uint16_t)(FIRMWARE_UPDATE_MAX_URL + 1));
+		memcpy(firmwareurl, url, copied);
+		firmwareurl[copied] = 0;
 
-		DEBUG_PRINT(" t_httpUpdate_return ");DEBUG_PRINT(retvalue);DEBUG_PRINTLN(" done");
+		DEBUG_PRINT("ESPConfig::fromByteArray boot_after_update ");DEBUG_PRINT(boot_after_update);DEBUG_PRINT(", url_length ");DEBUG_PRINT(url_length);DEBUG_PRINT(", url ");DEBUG_PRINTLN((char*)firmwareurl);
 
-		String _error = String(ESPhttpUpdate.getLastErrorString());
-		_error.concat(", code: ");
-		_error.concat(ESPhttpUpdate.getLastError());
-		_error.getBytes(errordesc, *errordesc_length);
-		_error_length = _error.length();
-		//sprintf((char*)errordesc, "Error (%d): %s", ESPhttpUpdate.getLastError(), ESPhttpUpdate.getLastErrorString().c_str());
+		// download runs from loop(), progress is queried with DEVICE_COMMAND_FIRMWARE_UPDATE_STATUS
+		retvalue = FirmwareUpdate.start(firmwareurl, boot_after_update, firmwareVersion);
 
+		char _error[32];
 		switch (retvalue) {
 
-		case HTTP_UPDATE_FAILED:
-
-			//			Serial.printf("ESPConfig::fromByteArray HTTP_UPDATE_FAILED Error (%d): %s\n", ESPhttpUpdate.getLastError(), ESPhttpUpdate.getLastErrorString().c_str());DEBUG_PRINTLN();
-			DEBUG_PRINT("ESPConfig::fromByteArray HTTP_UPDATE_FAILED _error_length ");DEBUG_PRINT(_error_length);DEBUG_PRINT(", ");DEBUG_PRINTLN(_error);
+		case FIRMWARE_UPDATE_CONNECTING:
+		case FIRMWARE_UPDATE_DOWNLOADING:
+			strcpy(_error, "update started");
 			break;
 
-		case HTTP_UPDATE_NO_UPDATES:
-			DEBUG_PRINTLN("ESPConfig::fromByteArray HTTP_UPDATE_NO_UPDATES");
+		case FIRMWARE_UPDATE_NO_UPDATES:
+			strcpy(_error, "no update, same version");
 			break;
 
-		case HTTP_UPDATE_OK:
-			DEBUG_PRINTLN("ESPConfig::fromByteArray HTTP_UPDATE_OK");
-
-			url = url.substring(url.lastIndexOf('/')+1);
-			DEBUG_PRINT("ESPConfig::fromByteArray firmwareVersion updated");DEBUG_PRINTLN(url);
-
-			// update firmwareVersion variable (this will write to EEPROM when save() called)
-			// commented 17MAR2020, firmwareVersion is hardcoded in variable, ESPConfig constructor, it will reflect once ESP reboots after this update
-			//memset(firmwareVersion, 0, sizeof(firmwareVersion));
-			//url.toCharArray(firmwareVersion, sizeof(firmwareVersion));
+		default:
+			snprintf(_error, sizeof(_error), "update failed, code: %d", FirmwareUpdate.getError());
+		}
 
-			break;
+		_error_length = min((uint16_t)strlen(_error), *errordesc_length);
+		memcpy(errordesc, _error, _error_length);
+		memcpy(errordesc_length, &_error_length, sizeof(uint16_t));
 
-		default:
-			DEBUG_PRINTLN("Undefined HTTP_UPDATE Code: ");
+		DEBUG_PRINT("ESPConfig::fromByteArray firmware update state ");DEBUG_PRINTLN(retvalue);
 
-		}
+		// nothing of the configuration changed, no save()
+		return;
+	}
 
+	if (in.failed()) {
+		DEBUG_PRINT("ESPConfig::fromByteArray ***MALFORMED*** length ");DEBUG_PRINTLN(length);
+		LOG_WARN(LOG_MODULE_CONFIG, LOG_EVENT_MALFORMED, command, length);
+		describeMalformed(errordesc, errordesc_length);
+		return;
 	}
 
 	// update error length in the variable pointer errordesc_length
@@ -356,38 +373,49 @@ void ESPConfig::fromByteArray(byte command, byte* aray, byte* errordesc, uint16_
 	//return retvalue;
 }
 
+void ESPConfig::fromByteArray(byte command, byte* aray, byte* errordesc, uint16_t* errordesc_length) {
+	fromByteArray(command, aray, UDP_PACKET_MAX_SIZE, errordesc, errordesc_length);
+}
+
 void ESPConfig::fromByteArray(byte* aray, byte* errordesc, uint16_t* errordesc_length) {
-	int index = 0;
+	fromByteArray(aray, UDP_PACKET_MAX_SIZE, errordesc, errordesc_length);
+}
+
+void ESPConfig::fromByteArray(byte* aray, uint16_t length, byte* errordesc, uint16_t* errordesc_length) {
+	PacketReader in(aray, length);
 
-	byte parameter = aray[index++];
+	uint8_t parameter = 0;
+	if (!in.u8(&parameter)) {
+		DEBUG_PRINTLN("ESPConfig::fromByteArray ***MALFORMED*** empty");
+		LOG_WARN(LOG_MODULE_CONFIG, LOG_EVENT_MALFORMED, DEVICE_COMMAND_SET_CONFIGURATION, length);
+		describeMalformed(errordesc, errordesc_length);
+		return;
+	}
 
 	if(parameter!=0) {
 		// byte array contains only one configuration parameters value
 
 		//return fromByteArray(parameter, aray+1, errordesc, errordesc_length);
-		fromByteArray(parameter, aray+1, errordesc, errordesc_length);
+		fromByteArray(parameter, aray+1, length-1, errordesc, errordesc_length);
 		return;
 	}
 
 	DEBUG_PRINTLN("ESPConfig::fromByteArray parameter==0!!!!!!!");
 
 	// byte array contains all configuration parameters value
-
-	// routerSSID (24 bytes)
-	memcpy(routerSSID, aray+index, sizeof(routerSSID));
-	index += sizeof(routerSSID);
-
-	// routerSSIDKey (24 bytes) starts after routerSSID
-	memcpy(routerSSIDKey, aray+index, sizeof(routerSSIDKey));
-	index += sizeof(routerSSIDKey);
-
-	// controller name (24 bytes) starts after routerSSIDKey
-	memcpy(controllerName, aray+index, sizeof(controllerName));
-	index += sizeof(controllerName);
-
-	// controller location (24 bytes) starts after controller name
-	memcpy(controllerLocation, aray+index, sizeof(controllerLocation));
-	index += sizeof(controllerLocation);
+	// routerSSID, routerSSIDKey, controller name and controller location are adjacent in the payload and in this object
+	static_assert(offsetof(ESPConfig, controllerLocation) + sizeof(controllerLocation) - offsetof(ESPConfig, routerSSID) == CONFIG_SET_SIZE - CONFIG_SET_SSID, "SET_CONFIGURATION fields");
+	const byte* fields = in.take(CONFIG_SET_SIZE - CONFIG_SET_SSID);
+	if (fields == NULL) {
+		DEBUG_PRINT("ESPConfig::fromByteArray ***MALFORMED*** length ");DEBUG_PRINTLN(length);
+		LOG_WARN(LOG_MODULE_CONFIG, LOG_EVENT_MALFORMED, DEVICE_COMMAND_SET_CONFIGURATION, length);
+		describeMalformed(errordesc, errordesc_length);
+		return;
+	}
+	if (memcmp(routerSSID, fields, sizeof(routerSSID) + sizeof(routerSSIDKey)) != 0) {
+		FastBoot.forgetWiFi();
+	}
+	memcpy(routerSSID, fields, CONFIG_SET_SIZE - CONFIG_SET_SSID);
 
 	save();
 	printEEPROM(sizeOfEEPROM());
@@ -438,47 +466,34 @@ void ESPConfig::fromByteArray(byte* aray, byte* errordesc, uint16_t* errordesc_l
 	return aray;
 }*/
 
+// the payload is the memory image of isConf..firmwareVersion, copied in one go
 int ESPConfig::toByteArray(byte aray[]) {
 	DEBUG_PRINTLN("ESPConfig::toByteArray");
 
-	//byte aray[sizeOfUDPPayload()];
-
-	//memset(aray, 0, sizeof(aray));
-	int index = 0;
-
-	// 1st byte: is configured
-	memcpy(aray+index, &isConf, 1);
-	index++;
-
-	// mac id
-	memcpy(aray+index, mac, sizeof(mac));
-	index += sizeof(mac);
-
-	// routerSSID
-	memcpy(aray+index, routerSSID, sizeof(routerSSID));
-	index += sizeof(routerSSID);
+	static_assert(sizeof(isConf) == 1, "isConf is sent as 1 byte");
+	static_assert(offsetof(ESPConfig, mac) - offsetof(ESPConfig, isConf) == CONFIG_UDP_MAC, "mac offset");
+	static_assert(offsetof(ESPConfig, routerSSID) - offsetof(ESPConfig, isConf) == CONFIG_UDP_SSID, "routerSSID offset");
+	static_assert(offsetof(ESPConfig, routerSSIDKey) - offsetof(ESPConfig, isConf) == CONFIG_UDP_SSID_KEY, "routerSSIDKey offset");
+	static_assert(offsetof(ESPConfig, controllerName) - offsetof(ESPConfig, isConf) == CONFIG_UDP_NAME, "controllerName offset");
+	static_assert(offsetof(ESPConfig, controllerLocation) - offsetof(ESPConfig, isConf) == CONFIG_UDP_LOCATION, "controllerLocation offset");
+	static_assert(offsetof(ESPConfig, firmwareVersion) - offsetof(ESPConfig, isConf) == CONFIG_UDP_FIRMWARE, "firmwareVersion offset");
+	static_assert(sizeof(firmwareVersion) == CONFIG_UDP_SIZE - CONFIG_UDP_FIRMWARE, "firmwareVersion size");
 
-	// routerSSIDKey
-	memcpy(aray+index, routerSSIDKey, sizeof(routerSSIDKey));
-	index += sizeof(routerSSIDKey);
+	memcpy(aray, &isConf, CONFIG_UDP_SIZE);
 
-	// controller name
-	memcpy(aray+index, controllerName, sizeof(controllerName));
-	index += sizeof(controllerName);
-
-	// controller location
-	memcpy(aray+index, controllerLocation, sizeof(controllerLocation));
-	index += sizeof(controllerLocation);
+	DEBUG_PRINT_ARRAY(aray, CONFIG_UDP_SIZE, false);
+	DEBUG_PRINTLN("ESPConfig::toByteArray end");
 
-	// firmwareVersion
-	memcpy(aray+index, firmwareVersion, sizeof(firmwareVersion));
-	index += sizeof(firmwareVersion);
+	return CONFIG_UDP_SIZE;
+}
 
-	//printArray(aray, sizeof(aray), false);DEBUG_PRINTLN();
-	DEBUG_PRINT_ARRAY(aray, index, false);
-	DEBUG_PRINTLN("ESPConfig::toByteArray end");
+// write the UDP payload straight into out (e.g. the WiFiUDP packet being built), no staging array
+size_t ESPConfig::writeTo(Print& out) {
+	return out.write((const uint8_t*)&isConf, CONFIG_UDP_SIZE);
+}
 
-	return (index);
+uint16_t ESPConfig::getChangeCount() {
+	return changeCount;
 }
 
 /*
@@ -491,42 +506,42 @@ int ESPConfig::toByteArray(byte aray[]) {
 void ESPConfig::save(void) {
 	DEBUG_PRINTLN("ESPConfig::save");
 
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
-	EEPROM.begin(EEPROM_MAX_ADDR);
-
-	int writeAddress = IS_CONFIGURED_BYTE_ADDRESS;
-	byte b = 1;
+	byte aray[CONFIG_EEPROM_SIZE];
+	int writeAddress = 0;
 
-	EepromUtil::eeprom_update_bytes(writeAddress++, &b, 1);
+	aray[writeAddress++] = 1;
 	isConf = true;
+	changeCount++;
 
 	// routerSSID value
-	EepromUtil::eeprom_update_bytes(writeAddress, (byte*)routerSSID, sizeof(routerSSID));
+	memcpy(aray+writeAddress, routerSSID, sizeof(routerSSID));
 	writeAddress += sizeof(routerSSID);
 
 	// routerSSIDKey value
-	EepromUtil::eeprom_update_bytes(writeAddress, (byte*)routerSSIDKey, sizeof(routerSSIDKey));
+	memcpy(aray+writeAddress, routerSSIDKey, sizeof(routerSSIDKey));
 	writeAddress += sizeof(routerSSIDKey);
 
 	// controller name
-	EepromUtil::eeprom_update_bytes(writeAddress, (byte*)controllerName, sizeof(controllerName));
+	memcpy(aray+writeAddress, controllerName, sizeof(controllerName));
 	writeAddress += sizeof(controllerName);
 
 	// controller location
-	EepromUtil::eeprom_update_bytes(writeAddress, (byte*)controllerLocation, sizeof(controllerLocation));
+	memcpy(aray+writeAddress, controllerLocation, sizeof(controllerLocation));
 	writeAddress += sizeof(controllerLocation);
 
 	// firmwareVersion
 	// commented 17MAR2020, firmware version is stored in variable only
-	//EepromUtil::eeprom_update_bytes(writeAddress, (byte*)firmwareVersion, sizeof(firmwareVersion));
+	//memcpy(aray+writeAddress, firmwareVersion, sizeof(firmwareVersion));
 	//writeAddress += sizeof(firmwareVersion);
 
-	EEPROM.commit();
-	EEPROM.end();
+	if (Persistence.save(RECORD_KEY_CONFIG, IS_CONFIGURED_BYTE_ADDRESS, aray, writeAddress)) {
+		LOG_INFO(LOG_MODULE_CONFIG, LOG_EVENT_CONFIG_SAVE, writeAddress, 0);
+		Metrics.configSaves++;
+	}
+
+	// single commit, skipped if nothing changed
+	Persistence.requestFlush();
 
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
 	DEBUG_PRINTLN("ESPConfig::save end");
 }
 
@@ -555,48 +570,37 @@ void ESPConfig::buildUniqueControllerName(char* uniqueName, int sz) {
 	// last three bytes of the MAC (HEX'd) to "controllerName-":
 	DEBUG_PRINT("buildUniqueControllerName ");DEBUG_PRINTLN(controllerName);
 
+	// %x as String(b, HEX) wrote it: lower case, no leading zero
 	memset(uniqueName, 0, sz);
-	strcat(uniqueName, CONTROLLER_UNIQUE_SSID);
-	strcat(uniqueName, String(getMAC()[WL_MAC_ADDR_LENGTH - 3], HEX).c_str());
-	strcat(uniqueName, String(getMAC()[WL_MAC_ADDR_LENGTH - 2], HEX).c_str());
-	strcat(uniqueName, String(getMAC()[WL_MAC_ADDR_LENGTH - 1], HEX).c_str());
+	snprintf(uniqueName, sz, "%s%x%x%x", CONTROLLER_UNIQUE_SSID,
+		getMAC()[WL_MAC_ADDR_LENGTH - 3], getMAC()[WL_MAC_ADDR_LENGTH - 2], getMAC()[WL_MAC_ADDR_LENGTH - 1]);
 	DEBUG_PRINT("buildUniqueControllerName uniqueName ");DEBUG_PRINTLN(uniqueName);
 }
 
 // write zeros at all addresses
 void ESPConfig::clearEEPROM() {
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
-	EEPROM.begin(EEPROM_MAX_ADDR);
-	byte b = 0;
-
-	for (int i = 0; i < EEPROM_MAX_ADDR; i++) {
-		EepromUtil::eeprom_update_bytes(i, &b, 1);
-		//EEPROM.write(i, -1);
-	}
-
-	EEPROM.commit();
-	EEPROM.end();
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
+	// no commit if it was clear already
+	Persistence.fill(0, 0, PERSISTENCE_SIZE);
+	Persistence.flush();
+	formatRecordStore();
+	// every region is gone, so are their mirrors and the connection kept with them
+	FastBoot.invalidate();
 }
 
 // write 0xff at all addresses
 void ESPConfig::resetEEPROM() {
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
-	EEPROM.begin(EEPROM_MAX_ADDR);
-	byte b = -1;
-
-	for (int i = 0; i < EEPROM_MAX_ADDR; i++) {
-		EepromUtil::eeprom_update_bytes(i, &b, 1);
-		//EEPROM.write(i, -1);
-	}
+	Persistence.fill(0, 0xFF, PERSISTENCE_SIZE);
+	Persistence.flush();
+	formatRecordStore();
+	// every region is gone, so are their mirrors and the connection kept with them
+	FastBoot.invalidate();
+}
 
-	EEPROM.commit();
-	EEPROM.end();
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
+// the records of the store would otherwise come back at the next boot
+void ESPConfig::formatRecordStore() {
+	if (Persistence.recordStore() != NULL) {
+		Persistence.recordStore()->format();
+	}
 }
 
 void printArray(byte* aray, int sz, boolean printInHex) {
@@ -619,12 +623,8 @@ void printEEPROM(int sz) {
 	byte aray;
 	DEBUG_PRINT("printEEPROM ");
 
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
-	EEPROM.begin(sz);
-
 	for(int i=0; i<sz; i++) {
-		aray = EEPROM.read(i);
+		Persistence.read(i, &aray, 1);
 
 		if(isPrintable(aray)) {
 			DEBUG_PRINT((char)aray);
@@ -634,9 +634,6 @@ void printEEPROM(int sz) {
 		DEBUG_PRINT(' ');
 	}
 	DEBUG_PRINTLN();
-	// 30JUN19, commented to alleviate WiFi reset
-	//delay(10);
-	EEPROM.end();
 #endif
 }
 
@@ -647,6 +644,38 @@ short toShort(byte aray[]) {
 	return two << 8 | one;
 }
 
+// LEB128: 7 bits per byte, high bit set when more bytes follow. Returns bytes written (1 to 3)
+int writeVarint(byte aray[], uint16_t value) {
+	int index = 0;
+
+	while (value >= 0x80) {
+		aray[index++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	aray[index++] = value;
+
+	return index;
+}
+
+// Returns bytes read (1 to 3), 0 for more than 16 bits or an overlong encoding (as PacketReader::varint)
+int readVarint(byte aray[], uint16_t* value) {
+	uint16_t result = 0;
+
+	for (int index = 0; index < 3; index++) {
+		byte b = aray[index];
+		if ((index == 2 && b > 0x03) || (index > 0 && b == 0)) {
+			return 0;
+		}
+		result |= (uint16_t)(b & 0x7F) << (7 * index);
+		if (!(b & 0x80)) {
+			*value = result;
+			return index + 1;
+		}
+	}
+
+	return 0;
+}
+
 void ESPConfig::setupWiFiAP() {
 
 	char ssd[MAX_LENGTH_SSID];
@@ -657,12 +686,17 @@ void ESPConfig::setupWiFiAP() {
 	DEBUG_PRINT("setupWiFiAP ");DEBUG_PRINT(ssd);DEBUG_PRINT(", ");DEBUG_PRINT(CONTROLLER_UNIQUE_SSID_KEY);DEBUG_PRINTLN(" end");
 }
 
+// the saved access point refused the join or is not on its channel any more, no use waiting for the timeout
+static boolean fastConnectFailed(wl_status_t status) {
+	return status == WL_NO_SSID_AVAIL || status == WL_CONNECT_FAILED;
+}
+
 boolean ESPConfig::connectToAP(int indicatorPin) {
 	if(strlen(getSSID())==0 || strlen(getPassword())==0) {
 		return false;
 	}
 
-	DEBUG_PRINT("connectToAP ");DEBUG_PRINT(String(getSSID()));DEBUG_PRINT(", ");DEBUG_PRINTLN(String(getPassword()));
+	DEBUG_PRINT("connectToAP ");DEBUG_PRINT(getSSID());DEBUG_PRINT(", ");DEBUG_PRINTLN(getPassword());
 
 	int retry_time = 0;
 	int retry_delay = 500;//milliseconds
@@ -670,7 +704,18 @@ boolean ESPConfig::connectToAP(int indicatorPin) {
 	// wifi states: WIFI_AP, WIFI_AP_STA, WIFI_OFF
 	// commented 20AUG2022 as this clashed with NTPClient lib used in DHTSensor_Adafruit project. It should not have impact on other projects
 	//WiFi.mode(WIFI_STA);
-	WiFi.begin(getSSID(), getPassword());
+	beginWiFi();
+	Metrics.wifiConnects++;
+
+	// no scan to wait for, poll often and do not blink
+	while (wifiFastConnect && WiFi.status() != WL_CONNECTED && !fastConnectFailed(WiFi.status()) && retry_time < (int)fast_wifi_connect_timeout) {
+		delay(fast_wifi_connect_poll_interval);
+		retry_time = retry_time + fast_wifi_connect_poll_interval;
+	}
+
+	if (wifiFastConnect && WiFi.status() != WL_CONNECTED) {
+		fallBackToScan(retry_time);
+	}
 
 	while (WiFi.status() != WL_CONNECTED && retry_time < max_retry_wifi_ap_connect_time) {
 		// commented 28-JAN-19, may conflict with PIN state (like in ACDimmer, Switch)
@@ -692,9 +737,155 @@ boolean ESPConfig::connectToAP(int indicatorPin) {
 
 	if (WiFi.status() != WL_CONNECTED) {
 		DEBUG_PRINT("WiFi connect timeout");DEBUG_PRINTLN();
+		LOG_WARN(LOG_MODULE_WIFI, LOG_EVENT_WIFI_AP, retry_time, 0);
 		return false;
 	} else {
 		DEBUG_PRINT("WiFi connected to ");DEBUG_PRINTLN(WiFi.localIP());
+		LOG_INFO(LOG_MODULE_WIFI, LOG_EVENT_WIFI_CONNECTED, retry_time, 0);
+		wifiConnected();
 		return true;
 	}
 }
+
+void ESPConfig::beginConnectToAP(int indicatorPin) {
+
+	wifiIndicatorPin = indicatorPin;
+
+	if(strlen(getSSID())==0 || strlen(getPassword())==0) {
+		DEBUG_PRINTLN("beginConnectToAP no SSID");
+		setupWiFiAP();
+		wifiState = WIFI_STATE_AP;
+		return;
+	}
+
+	DEBUG_PRINT("beginConnectToAP ");DEBUG_PRINT(getSSID());DEBUG_PRINT(", ");DEBUG_PRINTLN(getPassword());
+
+	beginWiFi();
+	Metrics.wifiConnects++;
+	LOG_INFO(LOG_MODULE_WIFI, LOG_EVENT_WIFI_CONNECTING, 0, 0);
+
+	wifiConnectStart = millis();
+	wifiLastBlink = wifiConnectStart;
+	wifiIndicatorOn = false;
+	analogWrite(indicatorPin, 0);
+	wifiState = WIFI_STATE_CONNECTING;
+}
+
+// advance the non-blocking connect started by beginConnectToAP(), call from the sketch loop()
+uint8_t ESPConfig::loop() {
+
+	// OTA download in progress, one budgeted step per loop
+	FirmwareUpdate.loop();
+
+	// DHCP after a fast join gave another address than the reused one, the next boot takes that
+	if (wifiLeaseRenewing && WiFi.status() == WL_CONNECTED && WiFi.localIP() != IPAddress((uint32_t)0) && WiFi.localIP() != IPAddress(wifiFastIP)) {
+		DEBUG_PRINT("ESPConfig::loop new lease ");DEBUG_PRINTLN(WiFi.localIP());
+		wifiLeaseRenewing = false;
+		rememberWiFi();
+	}
+
+	if (wifiState != WIFI_STATE_CONNECTING) {
+		return wifiState;
+	}
+
+	unsigned long now = millis();
+
+	if (WiFi.status() == WL_CONNECTED) {
+
+		DEBUG_PRINT("WiFi connected to ");DEBUG_PRINT(WiFi.localIP());DEBUG_PRINT(" in ");DEBUG_PRINTLN(now - wifiConnectStart);
+		LOG_INFO(LOG_MODULE_WIFI, LOG_EVENT_WIFI_CONNECTED, now - wifiConnectStart, 0);
+
+		// connected to WiFi, indicate with full bright indicator
+		analogWrite(wifiIndicatorPin, 5);
+		wifiState = WIFI_STATE_CONNECTED;
+		wifiConnected();
+
+	} else if (wifiFastConnect && (now - wifiConnectStart >= fast_wifi_connect_timeout || fastConnectFailed(WiFi.status()))) {
+
+		// the overall timeout still counts from beginConnectToAP()
+		fallBackToScan(now - wifiConnectStart);
+
+	} else if (now - wifiConnectStart >= max_retry_wifi_ap_connect_time) {
+
+		DEBUG_PRINTLN("WiFi connect timeout");
+		LOG_WARN(LOG_MODULE_WIFI, LOG_EVENT_WIFI_AP, now - wifiConnectStart, 0);
+
+		// if AP connect failed, setup itself as WiFi AP
+		setupWiFiAP();
+		wifiState = WIFI_STATE_AP;
+
+	} else if (now - wifiLastBlink >= wifi_ap_connect_blink_interval) {
+
+		// blink indicator while connecting
+		wifiIndicatorOn = !wifiIndicatorOn;
+		analogWrite(wifiIndicatorPin, wifiIndicatorOn ? 25 : 0);
+		wifiLastBlink = now;
+	}
+
+	return wifiState;
+}
+
+uint8_t ESPConfig::getWiFiState() {
+	return wifiState;
+}
+
+void ESPConfig::beginWiFi() {
+
+	_fast_boot_wifi last;
+	wifiFastConnect = FastBoot.loadWiFi(&last);
+
+	if (!wifiFastConnect) {
+		WiFi.begin(getSSID(), getPassword());
+		return;
+	}
+
+	DEBUG_PRINT("beginWiFi fast, channel ");DEBUG_PRINTLN(last._channel);
+
+	// the lease of the last connection as a static address until the link is up, wifiConnected() goes back to DHCP
+	wifiFastIP = last._ip;
+	WiFi.config(IPAddress(last._ip), IPAddress(last._gateway), IPAddress(last._subnet), IPAddress(last._dns));
+	WiFi.begin(getSSID(), getPassword(), last._channel, last._bssid);
+}
+
+void ESPConfig::fallBackToScan(unsigned long elapsed) {
+
+	DEBUG_PRINT("fallBackToScan after ");DEBUG_PRINTLN(elapsed);
+	LOG_WARN(LOG_MODULE_WIFI, LOG_EVENT_WIFI_FAST_FALLBACK, elapsed, 0);
+
+	FastBoot.forgetWiFi();
+	wifiFastConnect = false;
+
+	// back to DHCP
+	WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+	WiFi.begin(getSSID(), getPassword());
+}
+
+void ESPConfig::wifiConnected() {
+
+	if (!wifiFastConnect) {
+		rememberWiFi();
+		return;
+	}
+
+	// the reused address is not ours past its lease: DHCP runs again with the link up, the server renews the
+	// lease (mostly on the same address) and the saved connection is kept as it is unless the address changes
+	WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+	wifiLeaseRenewing = true;
+}
+
+void ESPConfig::rememberWiFi() {
+
+	if (!FastBoot.active()) {
+		return;
+	}
+
+	_fast_boot_wifi wifi;
+	memset(&wifi, 0, sizeof(wifi));
+	memcpy(wifi._bssid, WiFi.BSSID(), sizeof(wifi._bssid));
+	wifi._channel = WiFi.channel();
+	wifi._ip = WiFi.localIP();
+	wifi._gateway = WiFi.gatewayIP();
+	wifi._subnet = WiFi.subnetMask();
+	wifi._dns = WiFi.dnsIP();
+	FastBoot.saveWiFi(&wifi);
+}
@@ -3,8 +3,10 @@
 
 #include "Arduino.h"
 #include <ESP8266WiFi.h>
+#include "ESPLayout.h"
+#include "ESPLog.h"
 
-#define IS_DEBUG
+// verbose Serial trace of every call, build with -DIS_DEBUG to get it. Events worth keeping in production go to Log (ESPLog.h)
 #ifdef IS_DEBUG
 #define DEBUG_PRINT(x) Serial.print(x)
 #define DEBUG_PRINTLN(x) Serial.println(x)
@@ -36,10 +38,42 @@ static const uint8_t DEVICE_COMMAND_SET_CONTROLLER = 16;// set 1 capability
 static const uint8_t DEVICE_COMMAND_GETALL_CONTROLLER = 17;// get all capabilities of a controller
 static const uint8_t DEVICE_COMMAND_SETALL_CONTROLLER = 18;// set all capabilities of a controller
 static const uint8_t DEVICE_COMMAND_FIRMWARE_UPDATE = 19;// update ESP8266 firmware version
+static const uint8_t DEVICE_COMMAND_GET_PROTOCOL_VERSION = 20;// highest wire protocol version the device speaks (v1 clients never send it)
+static const uint8_t DEVICE_COMMAND_GETALL_CONTROLLER_V2 = 21;// get all capabilities of a controller, compact v2 encoding
+static const uint8_t DEVICE_COMMAND_SETALL_CONTROLLER_V2 = 22;// set one or more capabilities of a controller, compact v2 encoding
+static const uint8_t DEVICE_COMMAND_FIRMWARE_UPDATE_STATUS = 23;// state and progress of the firmware update started by DEVICE_COMMAND_FIRMWARE_UPDATE
+static const uint8_t DEVICE_COMMAND_GET_LOG = 24;// binary log records from a sequence number on
+static const uint8_t DEVICE_COMMAND_GET_STATS = 25;// command counters, latency histograms, heap and EEPROM figures
+static const uint8_t DEVICE_COMMAND_SUBSCRIBE = 26;// push capability changes of a controller to the sender for a lease time
+static const uint8_t DEVICE_COMMAND_CHANGED = 27;// pushed by the device to subscribers, never sent to it
+static const uint8_t DEVICE_COMMAND_SET_TRANSACTION = 28;// set capabilities of several controllers at once, all or none
+static const uint8_t DEVICE_COMMAND_FADE = 29;// move capabilities of a controller to target values over a duration, on the device
+static const uint8_t DEVICE_COMMAND_PRESET_SAVE = 30;// keep the values of all controllers as a named preset
+static const uint8_t DEVICE_COMMAND_PRESET_RECALL = 31;// set all controllers to a preset at once
+
+// wire protocol versions: v1 = fixed 16 byte names and 2 byte values, v2 = varint capability IDs and values
+static const uint8_t PROTOCOL_VERSION_1 = 1;
+static const uint8_t PROTOCOL_VERSION_2 = 2;
+static const uint8_t PROTOCOL_VERSION = PROTOCOL_VERSION_2;
 
 // maximum retry duration in milliseconds
 static const unsigned int max_retry_wifi_ap_connect_time = 10000;
 
+// indicator blink interval while connecting, in milliseconds
+static const unsigned int wifi_ap_connect_blink_interval = 500;
+
+// fast boot: a join of the saved access point which is not up after this many milliseconds falls back to a scan
+static const unsigned int fast_wifi_connect_timeout = 1500;
+
+// fast boot: status poll interval of the blocking connect while joining the saved access point, in milliseconds
+static const unsigned int fast_wifi_connect_poll_interval = 10;
+
+// WiFi connection states of the non-blocking connect (ESPConfig::loop)
+static const uint8_t WIFI_STATE_IDLE = 0;// not started
+static const uint8_t WIFI_STATE_CONNECTING = 1;// WiFi.begin called, waiting for WL_CONNECTED
+static const uint8_t WIFI_STATE_CONNECTED = 2;// connected to router
+static const uint8_t WIFI_STATE_AP = 3;// connect failed or not configured, running as WiFi AP
+
 // UDP port for listening to App requests
 static const unsigned int port = 2390;
 static unsigned long capabilitiesLastSaved = 0;//last saved time in milliseconds
@@ -47,6 +81,7 @@ static uint8_t pinLastSaved = 10;//last saved pin, same pin capabilities cannot
 static const uint16_t CAPABILITY_SAVE_INTERVAL = 1000;//interval between 2 successive save in milliseconds
 static const char CONTROLLER_UNIQUE_SSID[] = "RCSLEDS";//Controller SSID prefix is "RCSLEDS"
 static const char CONTROLLER_UNIQUE_SSID_KEY[] = "";//Controller SSID key is always "administrator". no password (updated 16MAR20)
+static const uint16_t CONFIG_ERROR_MAX_LENGTH = 100;//error description sent back by ESPConfig::set
 
 // maximum intensity of PIN=PWMRANGE
 //static char defaultName[] = "Controller";
@@ -54,6 +89,8 @@ static const char CONTROLLER_UNIQUE_SSID_KEY[] = "";//Controller SSID key is alw
 //static char defaultFirmware[] = "rgbc.200217.bin";
 
 short toShort(byte aray[]);
+int writeVarint(byte aray[], uint16_t value);
+int readVarint(byte aray[], uint16_t* value);
 void printArray(byte* aray, int sz, boolean printInHex);
 void printEEPROM(int sz);
 
@@ -72,14 +109,23 @@ public:
 public:
 	void setupWiFiAP();
 	boolean connectToAP(int indicatorPin);
+	void beginConnectToAP(int indicatorPin);
+	uint8_t loop();
+	uint8_t getWiFiState();
 	uint8_t* getMAC();
-	void init(int indicatorPin);
+	void init(int indicatorPin, boolean nonBlocking = false, boolean fastBoot = false);
 	void load();
 	void save();
+	// ar holds length bytes, a payload shorter than its fields changes nothing and is described in errordesc
+	void fromByteArray(byte command, byte* ar, uint16_t length, byte* errordesc, uint16_t* errordesc_length);
+	void fromByteArray(byte* ar, uint16_t length, byte* errordesc, uint16_t* errordesc_length);
+	// ar holds up to UDP_PACKET_MAX_SIZE bytes, kept for sketches written before the length was passed
 	void fromByteArray(byte command, byte* ar, byte* errordesc, uint16_t* errordesc_length);
 	void fromByteArray(byte* ar, byte* errordesc, uint16_t* errordesc_length);
 	//byte* toByteArray();
 	int toByteArray(byte aray[]);
+	size_t writeTo(Print& out);
+	uint16_t getChangeCount();
 	char* getSSID();
 	char* getPassword();
 	char* getControllerName();
@@ -93,9 +139,12 @@ public:
 	void clearEEPROM();
 	void toString();
 	//short discover(byte* replyBuffer);
+	short set(byte* replyBuffer, byte* _payload, uint16_t payload_length);
 	short set(byte* replyBuffer, byte* _payload);
 
 private:
+	// isConf through firmwareVersion are laid out exactly as the UDP payload sent to client (see ESPLayout.h)
+
 	// If controller is starting for the first time, IS_CONFIGURED_BYTE_ADDRESS = 0xFF, else IS_CONFIGURED_BYTE_ADDRESS = 1
 	boolean isConf;
 
@@ -118,5 +167,38 @@ private:
 	// format: <4-char device code>.<yymmdd>.bin.
 	// Use this 4-char device code to identify the type of controller: "rgbc" for RGB LED Controller, "acds" for AC Dimmer+Switch, "ac3s" for AC Switch
 	char firmwareVersion[MAX_LENGTH_NAME];
+
+	// non-blocking connect state, driven by loop()
+	uint8_t wifiState = WIFI_STATE_IDLE;
+	int wifiIndicatorPin = -1;
+	unsigned long wifiConnectStart = 0;
+	unsigned long wifiLastBlink = 0;
+	boolean wifiIndicatorOn = false;
+
+	// erase the record store too, if Persistence uses one
+	void formatRecordStore();
+
+	// WiFi.begin went to the access point saved by FastBoot, without a scan
+	boolean wifiFastConnect = false;
+
+	// WiFi.begin, to the saved access point with the saved address if FastBoot has them
+	void beginWiFi();
+
+	// the saved access point did not answer in fast_wifi_connect_timeout, forget it and scan
+	void fallBackToScan(unsigned long elapsed);
+
+	// keep the access point and address of the connection for the next boot
+	void rememberWiFi();
+
+	// connected: remember a scanned connection, restart DHCP after a fast join
+	void wifiConnected();
+
+	// address a fast join reused, and DHCP was restarted after it and has not given another one yet
+	uint32_t wifiFastIP = 0;
+	boolean wifiLeaseRenewing = false;
+
+	// incremented by init, load and save (every fromByteArray that changes state saves), cached DISCOVER replies are stale once it moves
+	// (changes made through the char* getters are not counted)
+	uint16_t changeCount = 0;
 };
-#endif
+#endif
@@ -0,0 +1,175 @@
+#include "Arduino.h"
+#include "ESPConfig.h"
+#include "ESPFastBoot.h"
+
+static_assert(offsetof(_fast_boot_image, _records) == 40, "fast boot header");
+static_assert(sizeof(_fast_boot_image) == ESP_FAST_BOOT_SIZE, "fast boot image size");
+static_assert(ESP_FAST_BOOT_SIZE % 4 == 0, "RTC memory is written in 4-byte blocks");
+static_assert(ESP_FAST_BOOT_RTC_OFFSET * 4 + ESP_FAST_BOOT_SIZE <= FAST_BOOT_RTC_USER_MEMORY, "fast boot cache does not fit in RTC user memory");
+
+ESPFastBoot FastBoot;
+
+// CRC-32 (IEEE, reflected), bitwise: the cache is checked once per boot
+static uint32_t crc32(uint32_t crc, const byte* buf, int len) {
+	crc = ~crc;
+	for (int i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (int b = 0; b < 8; b++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		}
+	}
+	return ~crc;
+}
+
+boolean ESPFastBoot::begin(const char* tag) {
+
+	begun = true;
+	uint32_t tagCrc = crc32(0, (const byte*)tag, strlen(tag));
+	const int header = offsetof(_fast_boot_image, _records);
+
+	// header first, the records only if it claims a sane length
+	warm = ESP.rtcUserMemoryRead(ESP_FAST_BOOT_RTC_OFFSET, (uint32_t*)&image, header)
+		&& image._magic == FAST_BOOT_MAGIC
+		&& image._tag == tagCrc
+		&& image._used <= sizeof(image._records)
+		&& (image._used == 0 || ESP.rtcUserMemoryRead(ESP_FAST_BOOT_RTC_OFFSET + header / 4, (uint32_t*)image._records, (image._used + 3) & ~3))
+		&& image._crc == checksum();
+
+	DEBUG_PRINT("ESPFastBoot::begin warm ");DEBUG_PRINT(warm);DEBUG_PRINT(", used ");DEBUG_PRINTLN(used());
+	LOG_INFO(LOG_MODULE_CONFIG, LOG_EVENT_FAST_BOOT, warm, warm ? used() : 0);
+
+	if (!warm) {
+		memset(&image, 0, sizeof(image));
+		image._magic = FAST_BOOT_MAGIC;
+		image._tag = tagCrc;
+		commit();
+	}
+
+	return warm;
+}
+
+boolean ESPFastBoot::load(uint8_t key, byte* buf, int len) {
+
+	if (!begun) {
+		return false;
+	}
+
+	int offset = find(key);
+	if (offset < 0 || image._records[offset + 1] < len) {
+		misses++;
+		return false;
+	}
+
+	memcpy(buf, image._records + offset + 2, len);
+	hits++;
+	return true;
+}
+
+void ESPFastBoot::save(uint8_t key, const byte* buf, int len) {
+
+	if (!begun) {
+		return;
+	}
+
+	int offset = find(key);
+	if (offset >= 0 && image._records[offset + 1] == len) {
+		if (memcmp(image._records + offset + 2, buf, len) == 0) {
+			return;
+		}
+		memcpy(image._records + offset + 2, buf, len);
+		commit();
+		return;
+	}
+
+	if (offset >= 0) {
+		remove(offset);
+	}
+
+	if (len > FAST_BOOT_MAX_RECORD || image._used + 2 + len > (int)sizeof(image._records)) {
+		// the region is loaded from EEPROM again, an old copy must not be left behind
+		DEBUG_PRINT("ESPFastBoot::save ***DOES NOT FIT*** key ");DEBUG_PRINTLN(key);
+		dropped++;
+		if (offset >= 0) {
+			commit();
+		}
+		return;
+	}
+
+	byte* record = image._records + image._used;
+	record[0] = key;
+	record[1] = len;
+	memcpy(record + 2, buf, len);
+	image._used += 2 + len;
+	commit();
+}
+
+boolean ESPFastBoot::loadWiFi(_fast_boot_wifi* wifi) {
+
+	if (!begun || !(image._flags & FAST_BOOT_FLAG_WIFI)) {
+		return false;
+	}
+
+	memcpy(wifi, &image._wifi, sizeof(image._wifi));
+	return true;
+}
+
+void ESPFastBoot::saveWiFi(const _fast_boot_wifi* wifi) {
+
+	if (!begun || ((image._flags & FAST_BOOT_FLAG_WIFI) && memcmp(&image._wifi, wifi, sizeof(image._wifi)) == 0)) {
+		return;
+	}
+
+	memcpy(&image._wifi, wifi, sizeof(image._wifi));
+	image._flags |= FAST_BOOT_FLAG_WIFI;
+	commit();
+}
+
+void ESPFastBoot::forgetWiFi() {
+
+	if (!begun || !(image._flags & FAST_BOOT_FLAG_WIFI)) {
+		return;
+	}
+
+	image._flags &= ~FAST_BOOT_FLAG_WIFI;
+	commit();
+}
+
+void ESPFastBoot::invalidate() {
+
+	if (!begun || (image._used == 0 && !(image._flags & FAST_BOOT_FLAG_WIFI))) {
+		return;
+	}
+
+	image._used = 0;
+	image._flags = 0;
+	commit();
+}
+
+int ESPFastBoot::find(uint8_t key) {
+
+	for (int offset = 0; offset < image._used; offset += 2 + image._records[offset + 1]) {
+		if (image._records[offset] == key) {
+			return offset;
+		}
+	}
+	return -1;
+}
+
+void ESPFastBoot::remove(int offset) {
+
+	int length = 2 + image._records[offset + 1];
+	memmove(image._records + offset, image._records + offset + length, image._used - offset - length);
+	image._used -= length;
+}
+
+void ESPFastBoot::commit() {
+
+	image._crc = checksum();
+	ESP.rtcUserMemoryWrite(ESP_FAST_BOOT_RTC_OFFSET, (uint32_t*)&image, (used() + 3) & ~3);
+	writes++;
+}
+
+uint32_t ESPFastBoot::checksum() {
+	const int from = offsetof(_fast_boot_image, _tag);
+	return crc32(0, (const byte*)&image + from, used() - from);
+}
@@ -0,0 +1,137 @@
+#ifndef ESPFastBoot_h
+#define ESPFastBoot_h
+
+#include "Arduino.h"
+
+// build flag, first 4-byte block of RTC user memory taken by the cache, e.g. -DESP_FAST_BOOT_RTC_OFFSET=32
+// to leave the first 128 bytes to the sketch
+#ifndef ESP_FAST_BOOT_RTC_OFFSET
+#define ESP_FAST_BOOT_RTC_OFFSET 0
+#endif
+
+// build flag, bytes of RTC user memory (and of RAM, for the copy) taken by the cache, a multiple of 4
+#ifndef ESP_FAST_BOOT_SIZE
+#define ESP_FAST_BOOT_SIZE 384
+#endif
+
+// RTC user memory of the ESP8266, in bytes
+static const uint16_t FAST_BOOT_RTC_USER_MEMORY = 512;
+
+// first word of the cache, the low byte is the layout version
+static const uint32_t FAST_BOOT_MAGIC = 0x46420001;
+
+// _flags: the last connection is kept
+static const uint8_t FAST_BOOT_FLAG_WIFI = 0x01;
+
+// longest record, its length is kept in one byte
+static const uint8_t FAST_BOOT_MAX_RECORD = 255;
+
+// access point and IP lease of the last connection
+typedef struct {
+	uint8_t _bssid[6];
+	uint8_t _channel;
+	uint8_t _reserved;
+	uint32_t _ip;
+	uint32_t _gateway;
+	uint32_t _subnet;
+	uint32_t _dns;
+} _fast_boot_wifi;
+
+// the cache as it is kept in RTC memory, _used bytes of _records are written
+typedef struct {
+	uint32_t _magic;
+	// CRC-32 from _tag to the end of the used records
+	uint32_t _crc;
+	// CRC-32 of the firmware version, the cache of another firmware is not used
+	uint32_t _tag;
+	uint16_t _used;
+	uint8_t _flags;
+	uint8_t _reserved;
+	_fast_boot_wifi _wifi;
+	// [key][length][bytes] per record
+	byte _records[ESP_FAST_BOOT_SIZE - 40];
+} _fast_boot_image;
+
+/***
+*
+*	Warm boot cache in RTC user memory, which the ESP8266 keeps over a watchdog or software reset, a deep
+*	sleep and a brief brown-out, but not over a power loss.
+*
+*	Once begin() ran, every region Persistence loads, or saves with the write taken, is mirrored here by its
+*	record key, and the access point (BSSID, channel) and IP lease of the last connection are kept next to them.
+*	The whole cache is checked with a CRC-32 and the firmware version when it is read back, anything else (power
+*	on garbage, an interrupted write, a new firmware) starts an empty cache and the regions come from EEPROM or
+*	the record store as before.
+*
+*	On a warm boot ESPConfig and the controllers are loaded from here without opening the EEPROM, and
+*	ESPConfig joins the saved access point on its channel with the saved address, without a scan or DHCP.
+*	ESPConfig::init(indicatorPin, nonBlocking, true) calls begin() with the firmware version.
+*
+*	A region that does not fit is not mirrored and always loaded from EEPROM. Persistence::write() and fill()
+*	of raw addresses are not mirrored; clearEEPROM() and resetEEPROM() drop the cache.
+*
+***/
+class ESPFastBoot {
+public:
+	// read the cache back from RTC memory and check it against tag. Returns true if it survived the reset
+	boolean begin(const char* tag);
+
+	// begin() was called
+	boolean active() {
+		return begun;
+	}
+
+	// copy the first len bytes of the record of key into buf. False if there is none or it is shorter
+	boolean load(uint8_t key, byte* buf, int len);
+
+	// keep buf as the record of key and write the cache to RTC memory, nothing is written if it did not change
+	void save(uint8_t key, const byte* buf, int len);
+
+	// the last connection, false if none is kept
+	boolean loadWiFi(_fast_boot_wifi* wifi);
+
+	void saveWiFi(const _fast_boot_wifi* wifi);
+
+	// the saved access point did not answer or the credentials changed
+	void forgetWiFi();
+
+	// drop every record and the connection
+	void invalidate();
+
+	// bytes of RTC memory in use
+	uint16_t used() {
+		return offsetof(_fast_boot_image, _records) + image._used;
+	}
+
+	// begin() found a valid cache
+	boolean warm = false;
+
+	// loads answered from the cache, and not
+	unsigned long hits = 0;
+	unsigned long misses = 0;
+
+	// records which did not fit
+	unsigned long dropped = 0;
+
+	// RTC memory writes
+	unsigned long writes = 0;
+
+private:
+	boolean begun = false;
+	_fast_boot_image image;
+
+	// offset of the record of key in _records, -1 if there is none
+	int find(uint8_t key);
+
+	// take the record at offset out of _records
+	void remove(int offset);
+
+	// update the CRC and write the used part of the image
+	void commit();
+
+	uint32_t checksum();
+};
+
+extern ESPFastBoot FastBoot;
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef ESPLayout_h
+#define ESPLayout_h
+
+#include "Arduino.h"
+
+/***
+*
+*	Byte offsets and sizes of the EEPROM and UDP layouts documented at the top of ESPConfig.cpp,
+*	as compile time constants. ESPConfig and ESP8266Controller check their fields against them with static_assert.
+*
+***/
+
+// 1. ESP configuration stored in EEPROM
+// | is config (1 byte) | routerSSID (24 bytes) | routerSSID key (24 bytes) | device name (16 bytes) | device location (16 bytes) |
+static constexpr uint8_t CONFIG_EEPROM_IS_CONFIG = 0;
+static constexpr uint8_t CONFIG_EEPROM_SSID = 1;
+static constexpr uint8_t CONFIG_EEPROM_SSID_KEY = CONFIG_EEPROM_SSID + 24;
+static constexpr uint8_t CONFIG_EEPROM_NAME = CONFIG_EEPROM_SSID_KEY + 24;
+static constexpr uint8_t CONFIG_EEPROM_LOCATION = CONFIG_EEPROM_NAME + 16;
+static constexpr uint8_t CONFIG_EEPROM_SIZE = CONFIG_EEPROM_LOCATION + 16;
+
+// 2. ESP configuration UDP payload received from client (after the packet header)
+// | config type (1 byte) | routerSSID (24 bytes) | routerSSID key (24 bytes) | device name (16 bytes) | device location (16 bytes) |
+static constexpr uint8_t CONFIG_SET_TYPE = 0;
+static constexpr uint8_t CONFIG_SET_SSID = 1;
+static constexpr uint8_t CONFIG_SET_SSID_KEY = CONFIG_SET_SSID + 24;
+static constexpr uint8_t CONFIG_SET_NAME = CONFIG_SET_SSID_KEY + 24;
+static constexpr uint8_t CONFIG_SET_LOCATION = CONFIG_SET_NAME + 16;
+static constexpr uint8_t CONFIG_SET_SIZE = CONFIG_SET_LOCATION + 16;
+
+// 3. ESP configuration UDP payload sent to client
+// | config (1 byte) | mac (6 bytes) | routerSSID (24 bytes) | routerSSID key (24 bytes) | device name (16 bytes) | device location (16 bytes) | firmware version (16 bytes) |
+static constexpr uint8_t CONFIG_UDP_IS_CONFIG = 0;
+static constexpr uint8_t CONFIG_UDP_MAC = 1;
+static constexpr uint8_t CONFIG_UDP_SSID = CONFIG_UDP_MAC + 6;
+static constexpr uint8_t CONFIG_UDP_SSID_KEY = CONFIG_UDP_SSID + 24;
+static constexpr uint8_t CONFIG_UDP_NAME = CONFIG_UDP_SSID_KEY + 24;
+static constexpr uint8_t CONFIG_UDP_LOCATION = CONFIG_UDP_NAME + 16;
+static constexpr uint8_t CONFIG_UDP_FIRMWARE = CONFIG_UDP_LOCATION + 16;
+static constexpr uint8_t CONFIG_UDP_SIZE = CONFIG_UDP_FIRMWARE + 16;
+
+static_assert(CONFIG_EEPROM_SIZE == 81, "ESPConfig EEPROM layout is 1 + 24 + 24 + 16 + 16 bytes");
+static_assert(CONFIG_SET_SIZE == 81, "ESPConfig SET payload is 1 + 24 + 24 + 16 + 16 bytes");
+static_assert(CONFIG_UDP_SIZE == 103, "ESPConfig UDP payload is 1 + 6 + 24 + 24 + 16 + 16 + 16 bytes");
+
+// 4. controller UDP payload: [pin][no_of_capabilities][controller name (16 bytes)] then per capability
+// [capability name (16 bytes)][min value (2 bytes)][max value (2 bytes)][value (2 bytes)], values little endian
+static constexpr uint8_t CONTROLLER_UDP_PIN = 0;
+static constexpr uint8_t CONTROLLER_UDP_COUNT = 1;
+static constexpr uint8_t CONTROLLER_UDP_NAME = 2;
+static constexpr uint8_t CONTROLLER_UDP_CAPABILITIES = CONTROLLER_UDP_NAME + 16;
+static constexpr uint8_t CAPABILITY_UDP_NAME = 0;
+static constexpr uint8_t CAPABILITY_UDP_MIN = 16;
+static constexpr uint8_t CAPABILITY_UDP_MAX = 18;
+static constexpr uint8_t CAPABILITY_UDP_VALUE = 20;
+static constexpr uint8_t CAPABILITY_UDP_SIZE = 22;
+
+// 5. controller EEPROM record and v1 SET payload: [pin][no_of_capabilities] then per capability [name (16 bytes)][value (2 bytes)]
+static constexpr uint8_t CONTROLLER_EEPROM_CAPABILITIES = 2;
+static constexpr uint8_t CAPABILITY_EEPROM_SIZE = 18;
+
+// capabilities a controller can load and save, sizes the fixed record buffer of loadCapabilities/saveCapabilities
+static constexpr uint8_t CONTROLLER_MAX_CAPABILITIES = 16;
+
+static constexpr int controllerUDPPayloadSize(uint8_t capabilityCount) {
+	return CONTROLLER_UDP_CAPABILITIES + capabilityCount * CAPABILITY_UDP_SIZE;
+}
+
+static constexpr int controllerEEPROMSize(uint8_t capabilityCount) {
+	return CONTROLLER_EEPROM_CAPABILITIES + capabilityCount * CAPABILITY_EEPROM_SIZE;
+}
+
+// largest controller EEPROM record
+static constexpr int CONTROLLER_EEPROM_MAX_SIZE = controllerEEPROMSize(CONTROLLER_MAX_CAPABILITIES);
+
+static_assert(controllerUDPPayloadSize(6) == 150, "LED controller UDP payload is 2 + 16 + 6 x 22 bytes");
+static_assert(controllerEEPROMSize(6) == 110, "LED controller EEPROM record is 2 + 6 x 18 bytes");
+
+// the capability table is sent as it is laid out in memory, which needs a little endian target (ESP8266, x86)
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "capability wire layout assumes a little endian target");
+
+#endif
@@ -0,0 +1,170 @@
+#include "Arduino.h"
+#include "ESPLog.h"
+
+ESPLog Log;
+
+// names used by drain(), indexed by event / level / module bit, kept in flash
+static const char LOG_EVENT_NAMES[LOG_EVENT_COUNT][20] PROGMEM = {
+	"?",
+	"config_load",
+	"config_save",
+	"config_set",
+	"wifi_connecting",
+	"wifi_connected",
+	"wifi_ap",
+	"capability_set",
+	"capability_mismatch",
+	"capability_unknown",
+	"wrong_pin",
+	"command",
+	"short_packet",
+	"packet_too_large",
+	"no_controller",
+	"eeprom_commit",
+	"eeprom_out_of_range",
+	"firmware_start",
+	"firmware_http",
+	"firmware_done",
+	"task_overrun",
+	"malformed",
+	"fast_boot",
+	"wifi_fast_fallback",
+	"too_many_caps"
+};
+
+static const char LOG_LEVEL_NAMES[5][6] PROGMEM = { "NONE", "ERROR", "WARN", "INFO", "DEBUG" };
+
+static const int LOG_MODULE_NAME_COUNT = 7;
+
+static const char LOG_MODULE_NAMES[LOG_MODULE_NAME_COUNT][12] PROGMEM = { "config", "wifi", "controller", "server", "persistence", "firmware", "scheduler" };
+
+void ESPLog::record(uint8_t level, uint8_t module, uint8_t event, int16_t a, int16_t b) {
+
+	if ((module & moduleMask) == 0) {
+		return;
+	}
+
+	uint8_t slot = (head + held) % ESP_LOG_RECORDS;
+
+	if (held == ESP_LOG_RECORDS) {
+		// full, overwrite the oldest
+		head = (head + 1) % ESP_LOG_RECORDS;
+		if (undrained == ESP_LOG_RECORDS) {
+			dropped++;
+		} else {
+			undrained++;
+		}
+	} else {
+		held++;
+		undrained++;
+	}
+
+	_log_record& r = ring[slot];
+	r._time = millis();
+	r._seq = nextSeq++;
+	r._a = a;
+	r._b = b;
+	r._level = level;
+	r._module = module;
+	r._event = event;
+}
+
+uint8_t ESPLog::count() {
+	return held;
+}
+
+size_t ESPLog::printRecord(Print& out, const _log_record& r) {
+	char name[20];
+	size_t n = 0;
+
+	n += out.print(r._time);
+	n += out.print(' ');
+
+	memcpy_P(name, LOG_LEVEL_NAMES[r._level < 5 ? r._level : 0], sizeof(LOG_LEVEL_NAMES[0]));
+	n += out.print(name);
+	n += out.print(' ');
+
+	// lowest module bit set, "?" if none
+	int module = 0;
+	while (module < LOG_MODULE_NAME_COUNT && !(r._module & (1 << module))) {
+		module++;
+	}
+	if (module < LOG_MODULE_NAME_COUNT) {
+		memcpy_P(name, LOG_MODULE_NAMES[module], sizeof(LOG_MODULE_NAMES[0]));
+		n += out.print(name);
+	} else {
+		n += out.print('?');
+	}
+	n += out.print(' ');
+
+	memcpy_P(name, LOG_EVENT_NAMES[r._event < LOG_EVENT_COUNT ? r._event : 0], sizeof(LOG_EVENT_NAMES[0]));
+	n += out.print(name);
+	n += out.print(' ');
+
+	n += out.print((int)r._a);
+	n += out.print(' ');
+	n += out.print((int)r._b);
+	n += out.println();
+
+	return n;
+}
+
+int ESPLog::drain(Print& out, int maxRecords) {
+	int printed = 0;
+
+	while (undrained > 0 && printed < maxRecords) {
+		uint8_t slot = (head + held - undrained) % ESP_LOG_RECORDS;
+		printRecord(out, ring[slot]);
+		undrained--;
+		printed++;
+	}
+
+	return printed;
+}
+
+int ESPLog::toByteArray(uint16_t since, byte aray[], int maxSize) {
+	int index = LOG_REPLY_HEADER_SIZE;
+	uint8_t records = 0;
+	uint16_t first = nextSeq;
+
+	for (uint8_t i = 0; i < held && index + LOG_RECORD_WIRE_SIZE <= maxSize; i++) {
+		_log_record& r = ring[(head + i) % ESP_LOG_RECORDS];
+
+		// seq wraps, compare as a distance
+		if ((int16_t)(r._seq - since) < 0) {
+			continue;
+		}
+
+		if (records == 0) {
+			first = r._seq;
+		}
+
+		aray[index++] = lowByte(r._seq);
+		aray[index++] = highByte(r._seq);
+		for (int b = 0; b < 4; b++) {
+			aray[index++] = (r._time >> (8 * b)) & 0xFF;
+		}
+		aray[index++] = r._level;
+		aray[index++] = r._module;
+		aray[index++] = r._event;
+		aray[index++] = lowByte(r._a);
+		aray[index++] = highByte(r._a);
+		aray[index++] = lowByte(r._b);
+		aray[index++] = highByte(r._b);
+
+		records++;
+	}
+
+	// next seq the client asks for: after the last record copied
+	uint16_t next = records == 0 ? nextSeq : first + records;
+
+	aray[0] = lowByte(first);
+	aray[1] = highByte(first);
+	aray[2] = lowByte(next);
+	aray[3] = highByte(next);
+	aray[4] = lowByte((uint16_t)dropped);
+	aray[5] = highByte((uint16_t)dropped);
+	aray[6] = records;
+
+	return index;
+}
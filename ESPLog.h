@@ -0,0 +1,145 @@
+#ifndef ESPLog_h
+#define ESPLog_h
+
+#include "Arduino.h"
+
+// levels, a record is kept only if its level <= ESP_LOG_LEVEL (compile time) and its module is enabled
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// build flag, e.g. -DESP_LOG_LEVEL=LOG_LEVEL_DEBUG
+#ifndef ESP_LOG_LEVEL
+#define ESP_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// modules, bits of ESP_LOG_MODULES (compile time) and ESPLog::moduleMask (run time)
+#define LOG_MODULE_CONFIG 0x01
+#define LOG_MODULE_WIFI 0x02
+#define LOG_MODULE_CONTROLLER 0x04
+#define LOG_MODULE_SERVER 0x08
+#define LOG_MODULE_PERSISTENCE 0x10
+#define LOG_MODULE_FIRMWARE 0x20
+#define LOG_MODULE_SCHEDULER 0x40
+
+#ifndef ESP_LOG_MODULES
+#define ESP_LOG_MODULES 0xFF
+#endif
+
+// records kept in RAM, the oldest is overwritten when full
+#ifndef ESP_LOG_RECORDS
+#define ESP_LOG_RECORDS 64
+#endif
+
+// events, arguments a and b in brackets
+static const uint8_t LOG_EVENT_CONFIG_LOAD = 1;// [isConf]
+static const uint8_t LOG_EVENT_CONFIG_SAVE = 2;// [bytes], only when something changed
+static const uint8_t LOG_EVENT_CONFIG_SET = 3;// [command]
+static const uint8_t LOG_EVENT_WIFI_CONNECTING = 4;
+static const uint8_t LOG_EVENT_WIFI_CONNECTED = 5;// [milliseconds]
+static const uint8_t LOG_EVENT_WIFI_AP = 6;// [milliseconds]
+static const uint8_t LOG_EVENT_CAPABILITY_SET = 7;// [capability ID][value]
+static const uint8_t LOG_EVENT_CAPABILITY_MISMATCH = 8;// [capability ID][value]
+static const uint8_t LOG_EVENT_CAPABILITY_UNKNOWN = 9;// [capability ID or CAPABILITY_ID_NONE]
+static const uint8_t LOG_EVENT_CONTROLLER_WRONG_PIN = 10;// [pin received][controller pin], or [pin][MAX_CONTROLLER_PIN] for a pin without a record key
+static const uint8_t LOG_EVENT_COMMAND = 11;// [command][packet length]
+static const uint8_t LOG_EVENT_SHORT_PACKET = 12;// [packet length]
+static const uint8_t LOG_EVENT_PACKET_TOO_LARGE = 13;// [packet length]
+static const uint8_t LOG_EVENT_NO_CONTROLLER = 14;// [pin]
+static const uint8_t LOG_EVENT_EEPROM_COMMIT = 15;// [dirty ranges][bytes]
+static const uint8_t LOG_EVENT_EEPROM_OUT_OF_RANGE = 16;// [address][length]
+static const uint8_t LOG_EVENT_FIRMWARE_START = 17;// [url length]
+static const uint8_t LOG_EVENT_FIRMWARE_HTTP = 18;// [HTTP code][image KB]
+static const uint8_t LOG_EVENT_FIRMWARE_DONE = 19;// [state][error]
+static const uint8_t LOG_EVENT_TASK_OVERRUN = 20;// [task ID][microseconds, clamped]
+static const uint8_t LOG_EVENT_MALFORMED = 21;// [command, or pin for a controller][payload length], payload shorter than its fields
+static const uint8_t LOG_EVENT_FAST_BOOT = 22;// [1 if the RTC cache survived the reset][bytes in use]
+static const uint8_t LOG_EVENT_WIFI_FAST_FALLBACK = 23;// [milliseconds], saved access point did not answer, scanning
+static const uint8_t LOG_EVENT_TOO_MANY_CAPABILITIES = 24;// [capability count][pin], only CONTROLLER_MAX_CAPABILITIES are used
+static const uint8_t LOG_EVENT_COUNT = 25;
+
+// record the event if its level and module are compiled in, arguments are not evaluated otherwise
+#define LOG_EVENT(level, module, event, a, b) do { \
+	if ((level) <= ESP_LOG_LEVEL && ((module) & ESP_LOG_MODULES)) Log.record(level, module, event, a, b); \
+} while (0)
+
+#define LOG_ERROR(module, event, a, b) LOG_EVENT(LOG_LEVEL_ERROR, module, event, a, b)
+#define LOG_WARN(module, event, a, b) LOG_EVENT(LOG_LEVEL_WARN, module, event, a, b)
+#define LOG_INFO(module, event, a, b) LOG_EVENT(LOG_LEVEL_INFO, module, event, a, b)
+#define LOG_DEBUG(module, event, a, b) LOG_EVENT(LOG_LEVEL_DEBUG, module, event, a, b)
+
+typedef struct {
+	// millis() when recorded
+	uint32_t _time;
+
+	// running number, tells a UDP client what it already fetched
+	uint16_t _seq;
+
+	int16_t _a;
+	int16_t _b;
+
+	uint8_t _level;
+	uint8_t _module;
+	uint8_t _event;
+} _log_record;
+
+static_assert(ESP_LOG_RECORDS > 0 && ESP_LOG_RECORDS < 256, "ESP_LOG_RECORDS must fit in a byte");
+
+// record on the wire: [seq (2 bytes)][time (4 bytes)][level][module][event][a (2 bytes)][b (2 bytes)], little endian
+static const uint8_t LOG_RECORD_WIRE_SIZE = 13;
+
+// GET_LOG reply header: [first seq (2 bytes)][next seq (2 bytes)][records dropped (2 bytes)][record count]
+static const uint8_t LOG_REPLY_HEADER_SIZE = 7;
+
+/***
+*
+*	Deferred binary log. Hot paths only store a fixed size record in a RAM ring (no formatting, no Serial);
+*	records are turned into text by drain() when the sketch has time for it, or fetched raw over UDP with
+*	DEVICE_COMMAND_GET_LOG.
+*
+*	Level and module filters are compile time (ESP_LOG_LEVEL, ESP_LOG_MODULES) so disabled events cost nothing;
+*	moduleMask narrows the compiled-in modules at run time.
+*
+*	The verbose DEBUG_PRINT trace of ESPConfig.h is separate and only built with -DIS_DEBUG.
+*
+***/
+class ESPLog {
+public:
+	void record(uint8_t level, uint8_t module, uint8_t event, int16_t a, int16_t b);
+
+	// print up to maxRecords records not drained yet as text lines, returns records printed
+	int drain(Print& out, int maxRecords = ESP_LOG_RECORDS);
+
+	// copy records with seq >= since into aray (at most maxSize bytes) for DEVICE_COMMAND_GET_LOG, returns length
+	int toByteArray(uint16_t since, byte aray[], int maxSize);
+
+	// print one record as text: time level module event a b
+	static size_t printRecord(Print& out, const _log_record& r);
+
+	// records stored in the ring
+	uint8_t count();
+
+	// modules recorded at run time
+	uint8_t moduleMask = 0xFF;
+
+	// records overwritten before they were drained
+	unsigned long dropped = 0;
+
+private:
+	_log_record ring[ESP_LOG_RECORDS];
+
+	// index of the oldest record and number of records held
+	uint8_t head = 0;
+	uint8_t held = 0;
+
+	// records at the end of the ring not drained yet
+	uint8_t undrained = 0;
+
+	uint16_t nextSeq = 0;
+};
+
+extern ESPLog Log;
+
+#endif
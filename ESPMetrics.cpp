@@ -0,0 +1,141 @@
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+#include "ESPMetrics.h"
+#include "Persistence.h"
+#include "ESPArena.h"
+
+ESPMetrics Metrics;
+
+uint8_t ESPMetrics::slot(uint8_t command) {
+	return command < METRICS_COMMAND_SLOTS ? command : 0;
+}
+
+void ESPMetrics::received(uint8_t command) {
+	commands[slot(command)]._received++;
+}
+
+void ESPMetrics::replied(uint8_t command) {
+	commands[slot(command)]._replied++;
+}
+
+void ESPMetrics::dropped(uint8_t command) {
+	commands[slot(command)]._dropped++;
+}
+
+void ESPMetrics::latency(uint8_t operation, unsigned long us) {
+	_latency_histogram& h = latencies[operation];
+
+	// < 16 us, < 64 us, ... the last bucket takes everything above
+	int bucket = 0;
+	for (unsigned long limit = 16; us >= limit && bucket < METRICS_LATENCY_BUCKETS - 1; limit <<= 2) {
+		bucket++;
+	}
+
+	h._count++;
+	h._total_us += us;
+	h._max_us = max(h._max_us, (uint32_t)us);
+	if (h._buckets[bucket] < 0xFFFF) {
+		h._buckets[bucket]++;
+	}
+}
+
+void ESPMetrics::sample() {
+
+	uint32_t heap = ESP.getFreeHeap();
+	if (heap < heapLow) {
+		heapLow = heap;
+	}
+
+	// free bytes of the sketch stack that were never used, a high-water mark already
+	uint32_t stack = ESP.getFreeContStack();
+	if (stack < stackLow) {
+		stackLow = stack;
+	}
+
+	boolean up = WiFi.status() == WL_CONNECTED;
+	if (wifiUp && !up) {
+		wifiDisconnects++;
+	}
+	wifiUp = up;
+}
+
+void ESPMetrics::reset() {
+	memset(commands, 0, sizeof(commands));
+	memset(latencies, 0, sizeof(latencies));
+	configSaves = 0;
+	capabilitySaves = 0;
+	wifiConnects = 0;
+	wifiDisconnects = 0;
+	heapLow = 0xFFFFFFFF;
+	stackLow = 0xFFFFFFFF;
+	commitsBase = Persistence.commits;
+	bytesWrittenBase = Persistence.bytesWritten;
+	commitsSkippedBase = Persistence.commitsSkipped;
+}
+
+// LEB128 as writeVarint(), for 32 bit counters. Returns bytes written (1 to 5)
+static int writeVarint32(byte aray[], uint32_t value) {
+	int index = 0;
+
+	while (value >= 0x80) {
+		aray[index++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	aray[index++] = value;
+
+	return index;
+}
+
+int ESPMetrics::toByteArray(byte aray[]) {
+	int index = 0;
+
+	aray[index++] = METRICS_STATS_VERSION;
+	index += writeVarint32(aray + index, millis() / 1000);
+
+	index += writeVarint32(aray + index, ESP.getFreeHeap());
+	index += writeVarint32(aray + index, heapLow);
+	index += writeVarint32(aray + index, stackLow);
+	index += writeVarint32(aray + index, wifiConnects);
+	index += writeVarint32(aray + index, wifiDisconnects);
+
+	index += writeVarint32(aray + index, Persistence.commits - commitsBase);
+	index += writeVarint32(aray + index, Persistence.bytesWritten - bytesWrittenBase);
+	index += writeVarint32(aray + index, Persistence.commitsSkipped - commitsSkippedBase);
+	index += writeVarint32(aray + index, configSaves);
+	index += writeVarint32(aray + index, capabilitySaves);
+
+	// commands seen only
+	int count_index = index++;
+	uint8_t count = 0;
+	for (uint8_t c = 0; c < METRICS_COMMAND_SLOTS; c++) {
+		_command_counters& counters = commands[c];
+		if (counters._received == 0 && counters._dropped == 0) {
+			continue;
+		}
+		aray[index++] = c;
+		index += writeVarint32(aray + index, counters._received);
+		index += writeVarint32(aray + index, counters._replied);
+		index += writeVarint32(aray + index, counters._dropped);
+		count++;
+	}
+	aray[count_index] = count;
+
+	for (uint8_t op = 0; op < METRICS_LATENCY_COUNT; op++) {
+		_latency_histogram& h = latencies[op];
+		index += writeVarint32(aray + index, h._count);
+		index += writeVarint32(aray + index, h._total_us);
+		index += writeVarint32(aray + index, h._max_us);
+		for (uint8_t b = 0; b < METRICS_LATENCY_BUCKETS; b++) {
+			index += writeVarint32(aray + index, h._buckets[b]);
+		}
+	}
+
+	index += writeVarint32(aray + index, Arena.capacity());
+	index += writeVarint32(aray + index, Arena.used());
+	index += writeVarint32(aray + index, Arena.padding);
+	index += writeVarint32(aray + index, Arena.failed);
+	index += writeVarint32(aray + index, ESP.getMaxFreeBlockSize());
+	index += writeVarint32(aray + index, ESP.getHeapFragmentation());
+
+	return index;
+}
@@ -0,0 +1,94 @@
+#ifndef ESPMetrics_h
+#define ESPMetrics_h
+
+#include "Arduino.h"
+
+// counters are kept per DEVICE_COMMAND_* up to this code, higher and unparsable commands count as DEVICE_COMMAND_NONE
+static const uint8_t METRICS_COMMAND_SLOTS = 32;
+
+// timed operations
+static const uint8_t METRICS_LATENCY_CONFIG_SET = 0;// ESPConfig::set
+static const uint8_t METRICS_LATENCY_CONTROLLER_FROM = 1;// ESP8266Controller::fromByteArray
+static const uint8_t METRICS_LATENCY_CONTROLLER_TO = 2;// ESP8266Controller::toByteArray
+static const uint8_t METRICS_LATENCY_COUNT = 3;
+
+// histogram buckets grow by 4: < 16 us, < 64 us, < 256 us, ... , >= 65536 us
+static const uint8_t METRICS_LATENCY_BUCKETS = 8;
+
+// GET_STATS reply layout version, first byte of the reply
+static const uint8_t METRICS_STATS_VERSION = 2;
+
+// GET_STATS request flag: clear the counters once the reply is built
+static const uint8_t METRICS_FLAG_RESET = 0x01;
+
+typedef struct {
+	uint32_t _received;
+	uint32_t _replied;
+	uint32_t _dropped;
+} _command_counters;
+
+typedef struct {
+	uint32_t _count;
+	uint32_t _total_us;
+	uint32_t _max_us;
+	uint16_t _buckets[METRICS_LATENCY_BUCKETS];
+} _latency_histogram;
+
+/***
+*
+*	Counters and latency histograms for DEVICE_COMMAND_GET_STATS. Recording is a few increments, the reply
+*	is only encoded when asked for.
+*
+*	Reply, counters as LEB128 varints (up to 5 bytes):
+*	[METRICS_STATS_VERSION][uptime seconds]
+*	[free heap][lowest free heap][lowest free stack][WiFi connects][WiFi disconnects]
+*	[EEPROM commits][EEPROM bytes written][flushes skipped][config saves][capability saves]
+*	[command count] command count x [command (1 byte)][received][replied][dropped]       only commands seen
+*	[METRICS_LATENCY_COUNT] x [count][total us][max us][METRICS_LATENCY_BUCKETS x bucket]
+*	[arena capacity][arena used][arena padding][arena failed][largest free heap block][heap fragmentation %]   version 2
+*
+***/
+class ESPMetrics {
+public:
+	void received(uint8_t command);
+	void replied(uint8_t command);
+	void dropped(uint8_t command);
+
+	void latency(uint8_t operation, unsigned long us);
+
+	// heap, stack and WiFi link, called from DeviceServer::loop()
+	void sample();
+
+	// encode the GET_STATS reply, returns length
+	int toByteArray(byte aray[]);
+
+	void reset();
+
+	// ESPConfig::save() / ESP8266Controller::saveCapabilities() calls which changed the stored bytes
+	uint32_t configSaves = 0;
+	uint32_t capabilitySaves = 0;
+
+	// WiFi.begin() calls and connected -> disconnected transitions seen by sample()
+	uint32_t wifiConnects = 0;
+	uint32_t wifiDisconnects = 0;
+
+	uint32_t heapLow = 0xFFFFFFFF;
+	uint32_t stackLow = 0xFFFFFFFF;
+
+	_command_counters commands[METRICS_COMMAND_SLOTS];
+	_latency_histogram latencies[METRICS_LATENCY_COUNT];
+
+private:
+	boolean wifiUp = false;
+
+	// Persistence counters at the last reset
+	unsigned long commitsBase = 0;
+	unsigned long bytesWrittenBase = 0;
+	unsigned long commitsSkippedBase = 0;
+
+	uint8_t slot(uint8_t command);
+};
+
+extern ESPMetrics Metrics;
+
+#endif
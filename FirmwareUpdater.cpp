@@ -0,0 +1,234 @@
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+#include <ESP8266HTTPClient.h>
+#include <Updater.h>
+#include "ESPConfig.h"
+#include "FirmwareUpdater.h"
+
+FirmwareUpdater FirmwareUpdate;
+
+uint8_t FirmwareUpdater::start(const char* _url, boolean rebootAfter, const char* currentVersion) {
+
+	if (isRunning()) {
+		DEBUG_PRINTLN("FirmwareUpdater::start already running");
+		return state;
+	}
+
+	error = FIRMWARE_ERROR_NONE;
+	bytesWritten = 0;
+	imageSize = 0;
+	reboot = rebootAfter;
+
+	size_t url_length = strlen(_url);
+	if (url_length == 0 || url_length > FIRMWARE_UPDATE_MAX_URL) {
+		DEBUG_PRINT("FirmwareUpdater::start ***BAD URL*** length ");DEBUG_PRINTLN(url_length);
+		finish(FIRMWARE_UPDATE_FAILED, FIRMWARE_ERROR_URL);
+		return state;
+	}
+
+	strcpy(url, _url);
+	memset(version, 0, sizeof(version));
+	strncpy(version, currentVersion, sizeof(version) - 1);
+
+	// firmware file name is the version, e.g. http://host/rgbc.200217.bin
+	const char* fileName = strrchr(url, '/');
+	fileName = fileName == NULL ? url : fileName + 1;
+
+	if (strcmp(fileName, version) == 0) {
+		DEBUG_PRINT("FirmwareUpdater::start same version ");DEBUG_PRINTLN(version);
+		finish(FIRMWARE_UPDATE_NO_UPDATES, FIRMWARE_ERROR_NONE);
+		return state;
+	}
+
+	DEBUG_PRINT("FirmwareUpdater::start ");DEBUG_PRINTLN(url);
+	LOG_INFO(LOG_MODULE_FIRMWARE, LOG_EVENT_FIRMWARE_START, url_length, 0);
+
+	state = FIRMWARE_UPDATE_CONNECTING;
+	return state;
+}
+
+uint8_t FirmwareUpdater::loop() {
+
+	if (state == FIRMWARE_UPDATE_CONNECTING) {
+		connect();
+	} else if (state == FIRMWARE_UPDATE_DOWNLOADING) {
+		download();
+	} else if (state == FIRMWARE_UPDATE_OK && reboot && (long)(millis() - rebootAt) >= 0) {
+		DEBUG_PRINTLN("FirmwareUpdater::loop rebooting");
+		reboot = false;
+		ESP.restart();
+	}
+
+	return state;
+}
+
+// send the GET and open the update partition, blocks only until the response headers are in
+void FirmwareUpdater::connect() {
+
+	uint8_t mac[6];
+	WiFi.macAddress(mac);
+	char staMac[18];
+	snprintf(staMac, sizeof(staMac), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+	char freeSpace[11];
+	snprintf(freeSpace, sizeof(freeSpace), "%lu", (unsigned long)ESP.getFreeSketchSpace());
+	char sketchSize[11];
+	snprintf(sketchSize, sizeof(sketchSize), "%lu", (unsigned long)ESP.getSketchSize());
+	const char* collect[] = { "x-MD5" };
+
+	http.begin(client, url);
+	http.setTimeout(FIRMWARE_UPDATE_CONNECT_TIMEOUT);
+	// the headers ESPhttpUpdate sends, a server may pick the image by them
+	http.addHeader("x-ESP8266-STA-MAC", staMac);
+	http.addHeader("x-ESP8266-free-space", freeSpace);
+	http.addHeader("x-ESP8266-sketch-size", sketchSize);
+	http.addHeader("x-ESP8266-mode", "sketch");
+	http.addHeader("x-ESP8266-version", version);
+	http.collectHeaders(collect, 1);
+
+	int code = http.GET();
+
+	DEBUG_PRINT("FirmwareUpdater::connect HTTP ");DEBUG_PRINTLN(code);
+	LOG_INFO(LOG_MODULE_FIRMWARE, LOG_EVENT_FIRMWARE_HTTP, code, http.getSize() / 1024);
+
+	if (code == HTTP_CODE_NOT_MODIFIED) {
+		http.end();
+		finish(FIRMWARE_UPDATE_NO_UPDATES, FIRMWARE_ERROR_NONE);
+		return;
+	}
+
+	if (code != HTTP_CODE_OK) {
+		http.end();
+		finish(FIRMWARE_UPDATE_FAILED, code);
+		return;
+	}
+
+	int size = http.getSize();
+
+	if (size <= 0 || !Update.begin(size)) {
+		DEBUG_PRINT("FirmwareUpdater::connect ***IMAGE SIZE*** ");DEBUG_PRINTLN(size);
+		http.end();
+		finish(FIRMWARE_UPDATE_FAILED, FIRMWARE_ERROR_SIZE);
+		return;
+	}
+
+	String md5 = http.header("x-MD5");
+	if (md5.length() > 0 && !Update.setMD5(md5.c_str())) {
+		DEBUG_PRINT("FirmwareUpdater::connect ***BAD MD5*** ");DEBUG_PRINTLN(md5);
+		Update.end();
+		http.end();
+		finish(FIRMWARE_UPDATE_FAILED, FIRMWARE_ERROR_MD5);
+		return;
+	}
+
+	imageSize = size;
+	lastData = millis();
+	state = FIRMWARE_UPDATE_DOWNLOADING;
+}
+
+// move what the stream has into the update partition, at most FIRMWARE_UPDATE_LOOP_BUDGET milliseconds
+void FirmwareUpdater::download() {
+
+	WiFiClient* stream = http.getStreamPtr();
+	unsigned long start = millis();
+	byte chunk[FIRMWARE_UPDATE_CHUNK_SIZE];
+
+	while (bytesWritten < imageSize && millis() - start < FIRMWARE_UPDATE_LOOP_BUDGET) {
+
+		int available = stream->available();
+		if (available <= 0) {
+			break;
+		}
+
+		int len = stream->read(chunk, min((uint32_t)min(available, (int)sizeof(chunk)), imageSize - bytesWritten));
+
+		if (Update.write(chunk, len) != (size_t)len) {
+			DEBUG_PRINT("FirmwareUpdater::download ***WRITE*** ");DEBUG_PRINTLN(Update.getError());
+			Update.end();
+			http.end();
+			finish(FIRMWARE_UPDATE_FAILED, FIRMWARE_ERROR_WRITE);
+			return;
+		}
+
+		bytesWritten += len;
+		lastData = millis();
+	}
+
+	if (bytesWritten == imageSize) {
+
+		boolean verified = Update.end();
+		http.end();
+
+		DEBUG_PRINT("FirmwareUpdater::download done ");DEBUG_PRINT(bytesWritten);DEBUG_PRINT(" bytes, verified ");DEBUG_PRINTLN(verified);
+
+		rebootAt = millis() + FIRMWARE_UPDATE_REBOOT_DELAY;
+		if (verified) {
+			finish(FIRMWARE_UPDATE_OK, FIRMWARE_ERROR_NONE);
+		} else {
+			finish(FIRMWARE_UPDATE_FAILED, Update.getError() == UPDATE_ERROR_MD5 ? FIRMWARE_ERROR_MD5 : FIRMWARE_ERROR_VERIFY);
+		}
+		return;
+	}
+
+	if (!stream->connected()) {
+		DEBUG_PRINT("FirmwareUpdater::download ***TRUNCATED*** ");DEBUG_PRINTLN(bytesWritten);
+		Update.end();
+		http.end();
+		finish(FIRMWARE_UPDATE_FAILED, FIRMWARE_ERROR_TRUNCATED);
+		return;
+	}
+
+	if (millis() - lastData >= FIRMWARE_UPDATE_TIMEOUT) {
+		DEBUG_PRINT("FirmwareUpdater::download ***TIMEOUT*** ");DEBUG_PRINTLN(bytesWritten);
+		Update.end();
+		http.end();
+		finish(FIRMWARE_UPDATE_FAILED, FIRMWARE_ERROR_TIMEOUT);
+	}
+}
+
+void FirmwareUpdater::finish(uint8_t newState, int16_t newError) {
+	state = newState;
+	error = newError;
+
+	if (newState == FIRMWARE_UPDATE_FAILED) {
+		LOG_ERROR(LOG_MODULE_FIRMWARE, LOG_EVENT_FIRMWARE_DONE, newState, newError);
+	} else {
+		LOG_INFO(LOG_MODULE_FIRMWARE, LOG_EVENT_FIRMWARE_DONE, newState, newError);
+	}
+}
+
+boolean FirmwareUpdater::isRunning() {
+	return state == FIRMWARE_UPDATE_CONNECTING || state == FIRMWARE_UPDATE_DOWNLOADING;
+}
+
+uint8_t FirmwareUpdater::getState() {
+	return state;
+}
+
+int16_t FirmwareUpdater::getError() {
+	return error;
+}
+
+uint32_t FirmwareUpdater::getBytesWritten() {
+	return bytesWritten;
+}
+
+uint32_t FirmwareUpdater::getImageSize() {
+	return imageSize;
+}
+
+int FirmwareUpdater::toByteArray(byte aray[]) {
+	int index = 0;
+
+	aray[index++] = state;
+	aray[index++] = lowByte(error);
+	aray[index++] = highByte(error);
+
+	for (int i = 0; i < 4; i++) {
+		aray[index++] = (bytesWritten >> (8 * i)) & 0xFF;
+	}
+	for (int i = 0; i < 4; i++) {
+		aray[index++] = (imageSize >> (8 * i)) & 0xFF;
+	}
+
+	return index;
+}
@@ -0,0 +1,103 @@
+#ifndef FirmwareUpdater_h
+#define FirmwareUpdater_h
+
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+#include <ESP8266HTTPClient.h>
+
+// update states, reported by DEVICE_COMMAND_FIRMWARE_UPDATE_STATUS
+static const uint8_t FIRMWARE_UPDATE_IDLE = 0;// no update requested since boot
+static const uint8_t FIRMWARE_UPDATE_CONNECTING = 1;// request accepted, HTTP GET is sent from the next loop()
+static const uint8_t FIRMWARE_UPDATE_DOWNLOADING = 2;// image is being written to the update partition
+static const uint8_t FIRMWARE_UPDATE_OK = 3;// image written and verified, device reboots if asked to
+static const uint8_t FIRMWARE_UPDATE_NO_UPDATES = 4;// requested version is the running one (or server answered 304)
+static const uint8_t FIRMWARE_UPDATE_FAILED = 5;// see error
+
+// update errors, negative values are HTTPC_ERROR_*, positive values above 100 are HTTP status codes
+static const int16_t FIRMWARE_ERROR_NONE = 0;
+static const int16_t FIRMWARE_ERROR_URL = 1;// url missing or longer than FIRMWARE_UPDATE_MAX_URL
+static const int16_t FIRMWARE_ERROR_SIZE = 2;// no Content-Length or image does not fit
+static const int16_t FIRMWARE_ERROR_WRITE = 3;// Updater rejected a chunk
+static const int16_t FIRMWARE_ERROR_VERIFY = 4;// Updater rejected the image at the end
+static const int16_t FIRMWARE_ERROR_TIMEOUT = 5;// no data for FIRMWARE_UPDATE_TIMEOUT milliseconds
+static const int16_t FIRMWARE_ERROR_TRUNCATED = 6;// server closed the connection before the whole image was sent
+static const int16_t FIRMWARE_ERROR_MD5 = 7;// x-MD5 header malformed, or the image does not match it
+
+static const uint8_t FIRMWARE_UPDATE_MAX_URL = 128;
+
+// bytes read from the HTTP stream at a time
+static const uint16_t FIRMWARE_UPDATE_CHUNK_SIZE = 512;
+
+// longest time one loop() keeps writing chunks, in milliseconds
+static const unsigned long FIRMWARE_UPDATE_LOOP_BUDGET = 5;
+
+// longest time connect() blocks loop() for the TCP connect and the response headers, in milliseconds
+static const uint16_t FIRMWARE_UPDATE_CONNECT_TIMEOUT = 2000;
+
+// download is abandoned after this many milliseconds without data
+static const unsigned long FIRMWARE_UPDATE_TIMEOUT = 10000;
+
+// delay between a successful update and the reboot, so the last status can still be queried
+static const unsigned long FIRMWARE_UPDATE_REBOOT_DELAY = 1000;
+
+// status reply: [state][error (2 bytes)][bytes written (4 bytes)][image size (4 bytes)], little endian
+static const uint8_t FIRMWARE_UPDATE_STATUS_SIZE = 11;
+
+/***
+*
+*	Incremental OTA update for DEVICE_COMMAND_FIRMWARE_UPDATE.
+*
+*	start() only validates the request and returns; loop() sends the HTTP GET and then moves the image into the
+*	update partition FIRMWARE_UPDATE_CHUNK_SIZE bytes at a time, within FIRMWARE_UPDATE_LOOP_BUDGET milliseconds,
+*	so UDP commands and the controllers keep being served during the download. ESPConfig::loop() drives it.
+*	The GET itself blocks one loop() until the response headers are in, FIRMWARE_UPDATE_CONNECT_TIMEOUT at most.
+*
+*	A request for the firmware already running (the last path segment of the url equals firmwareVersion) is
+*	answered with FIRMWARE_UPDATE_NO_UPDATES without any download. The server also gets the running version
+*	in the x-ESP8266-version header and may answer 304. As with ESPhttpUpdate the STA MAC, free space and sketch
+*	size are sent too, and an x-MD5 header in the reply is checked against the image before it is accepted.
+*
+***/
+class FirmwareUpdater {
+public:
+	// begin an update, returns the new state. A request while one is running is ignored and returns its state
+	uint8_t start(const char* url, boolean rebootAfter, const char* currentVersion);
+
+	// advance the download, returns the state
+	uint8_t loop();
+
+	// state is CONNECTING or DOWNLOADING
+	boolean isRunning();
+
+	uint8_t getState();
+	int16_t getError();
+	uint32_t getBytesWritten();
+	uint32_t getImageSize();
+
+	// status reply, returns FIRMWARE_UPDATE_STATUS_SIZE
+	int toByteArray(byte aray[]);
+
+private:
+	uint8_t state = FIRMWARE_UPDATE_IDLE;
+	int16_t error = FIRMWARE_ERROR_NONE;
+	uint32_t bytesWritten = 0;
+	uint32_t imageSize = 0;
+
+	boolean reboot = false;
+	unsigned long rebootAt = 0;
+	unsigned long lastData = 0;
+
+	char url[FIRMWARE_UPDATE_MAX_URL + 1];
+	char version[16 + 1];
+
+	WiFiClient client;
+	HTTPClient http;
+
+	void connect();
+	void download();
+	void finish(uint8_t newState, int16_t newError);
+};
+
+extern FirmwareUpdater FirmwareUpdate;
+
+#endif
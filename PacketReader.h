@@ -0,0 +1,126 @@
+#ifndef PacketReader_h
+#define PacketReader_h
+
+#include "Arduino.h"
+
+/***
+*
+*	Bounds checked reader over a received payload, no copy and no allocation.
+*
+*	Every read checks the bytes left once and fails instead of reading past the end; a failed read leaves the
+*	output untouched and marks the reader failed, and every read after it fails too, so a decoder can read a
+*	whole record and test failed() once. Multi-byte values are little endian, varints are the LEB128 of
+*	writeVarint/readVarint (at most 3 bytes for 16 bits, the shortest encoding only).
+*
+*	PacketReader in(payload, payload_length);
+*	uint8_t pin;
+*	uint16_t count;
+*	if (!in.u8(&pin) || !in.varint(&count)) {
+*		return false;
+*	}
+*
+***/
+class PacketReader {
+public:
+	PacketReader(const byte* _data, uint16_t _length) {
+		data = _data;
+		length = _length;
+	}
+
+	// bytes not read yet
+	uint16_t remaining() const {
+		return bad ? 0 : length - index;
+	}
+
+	// offset of the next read
+	uint16_t position() const {
+		return index;
+	}
+
+	boolean failed() const {
+		return bad;
+	}
+
+	// true if at least n more bytes can be read
+	boolean has(uint16_t n) const {
+		return !bad && length - index >= n;
+	}
+
+	boolean u8(uint8_t* value) {
+		if (!need(1)) {
+			return false;
+		}
+		*value = data[index++];
+		return true;
+	}
+
+	boolean u16(uint16_t* value) {
+		if (!need(2)) {
+			return false;
+		}
+		*value = data[index] | (data[index + 1] << 8);
+		index += 2;
+		return true;
+	}
+
+	// fails on an encoding of more than 16 bits or an overlong one (a last byte of 0 after the first)
+	boolean varint(uint16_t* value) {
+		uint16_t result = 0;
+		for (uint8_t i = 0; i < 3; i++) {
+			if (!need(1)) {
+				return false;
+			}
+			byte b = data[index++];
+			if ((i == 2 && b > 0x03) || (i > 0 && b == 0)) {
+				bad = true;
+				return false;
+			}
+			result |= (uint16_t)(b & 0x7F) << (7 * i);
+			if (!(b & 0x80)) {
+				*value = result;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// copy n bytes out
+	boolean bytes(void* out, uint16_t n) {
+		if (!need(n)) {
+			return false;
+		}
+		memcpy(out, data + index, n);
+		index += n;
+		return true;
+	}
+
+	// the next n bytes in place, NULL if there are fewer
+	const byte* take(uint16_t n) {
+		if (!need(n)) {
+			return NULL;
+		}
+		const byte* p = data + index;
+		index += n;
+		return p;
+	}
+
+	boolean skip(uint16_t n) {
+		return take(n) != NULL;
+	}
+
+private:
+	const byte* data;
+	uint16_t length;
+	uint16_t index = 0;
+	boolean bad = false;
+
+	boolean need(uint16_t n) {
+		if (bad || length - index < n) {
+			bad = true;
+			return false;
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,290 @@
+#include "Arduino.h"
+#include <EEPROM.h>
+#include "ESPConfig.h"
+#include "Persistence.h"
+#include "ESPFastBoot.h"
+
+PersistenceManager Persistence;
+
+void PersistenceManager::begin() {
+	if (begun) {
+		return;
+	}
+
+	DEBUG_PRINT("PersistenceManager::begin size ");DEBUG_PRINTLN(PERSISTENCE_SIZE);
+
+	EEPROM.begin(PERSISTENCE_SIZE);
+	begun = true;
+	dirtyRangeCount = 0;
+}
+
+void PersistenceManager::read(int address, byte* buf, int len) {
+	begin();
+
+	if (address < 0 || address + len > PERSISTENCE_SIZE) {
+		DEBUG_PRINT("PersistenceManager::read ***OUT OF RANGE*** ");DEBUG_PRINTLN(address);
+		LOG_ERROR(LOG_MODULE_PERSISTENCE, LOG_EVENT_EEPROM_OUT_OF_RANGE, address, len);
+		memset(buf, 0, len);
+		return;
+	}
+
+	memcpy(buf, EEPROM.getConstDataPtr() + address, len);
+}
+
+// the shadow and staged buffers are compared a word at a time
+typedef uint32_t __attribute__((__may_alias__)) persistence_word;
+
+// offset of the first byte from i on where stored and buf differ, len if none. Whole words are compared
+// once both are on a word boundary, which needs them to be equally aligned
+static int skipEqual(const byte* stored, const byte* buf, int i, int len) {
+
+	if ((((uintptr_t)stored ^ (uintptr_t)buf) & 3) == 0) {
+		while (i < len && ((uintptr_t)(stored + i) & 3) != 0 && stored[i] == buf[i]) {
+			i++;
+		}
+		if (((uintptr_t)(stored + i) & 3) == 0) {
+			while (i + 4 <= len && *(const persistence_word*)(stored + i) == *(const persistence_word*)(buf + i)) {
+				i += 4;
+			}
+		}
+	}
+
+	while (i < len && stored[i] == buf[i]) {
+		i++;
+	}
+	return i;
+}
+
+// offset of the first byte from i on where stored and buf are equal again; a word with any change is taken whole
+static int skipChanged(const byte* stored, const byte* buf, int i, int len) {
+
+	if ((((uintptr_t)stored ^ (uintptr_t)buf) & 3) == 0) {
+		while (i < len && ((uintptr_t)(stored + i) & 3) != 0 && stored[i] != buf[i]) {
+			i++;
+		}
+		if (((uintptr_t)(stored + i) & 3) == 0) {
+			while (i + 4 <= len && *(const persistence_word*)(stored + i) != *(const persistence_word*)(buf + i)) {
+				i += 4;
+			}
+		}
+	}
+
+	while (i < len && stored[i] != buf[i]) {
+		i++;
+	}
+	return i;
+}
+
+boolean PersistenceManager::write(int address, const byte* buf, int len) {
+	begin();
+
+	if (address < 0 || address + len > PERSISTENCE_SIZE) {
+		DEBUG_PRINT("PersistenceManager::write ***OUT OF RANGE*** ");DEBUG_PRINTLN(address);
+		LOG_ERROR(LOG_MODULE_PERSISTENCE, LOG_EVENT_EEPROM_OUT_OF_RANGE, address, len);
+		writesRejected++;
+		return false;
+	}
+
+	const byte* stored = EEPROM.getConstDataPtr() + address;
+	boolean changed = false;
+	int i = 0;
+
+	while ((i = skipEqual(stored, buf, i, len)) < len) {
+
+		// copy the changed span
+		int start = i;
+		i = skipChanged(stored, buf, i, len);
+		memcpy(EEPROM.getDataPtr() + address + start, buf + start, i - start);
+
+		markDirty(address + start, address + i);
+		changed = true;
+	}
+
+	return changed;
+}
+
+boolean PersistenceManager::fill(int address, byte value, int len) {
+
+	// a chunk of value with the alignment of address, so write() compares whole words
+	alignas(4) byte chunk[PERSISTENCE_FILL_CHUNK + 3];
+	memset(chunk, value, sizeof(chunk));
+	const byte* src = chunk + (address & 3);
+
+	boolean changed = false;
+	for (int i = 0; i < len; i += PERSISTENCE_FILL_CHUNK) {
+		changed |= write(address + i, src, min(len - i, (int)PERSISTENCE_FILL_CHUNK));
+	}
+
+	return changed;
+}
+
+void PersistenceManager::useRecordStore(RecordStore* recordStore) {
+	store = recordStore;
+}
+
+RecordStore* PersistenceManager::recordStore() {
+	return store;
+}
+
+void PersistenceManager::load(uint8_t key, int address, byte* buf, int len) {
+
+	// warm boot: from RTC memory, the EEPROM is not opened
+	if (FastBoot.load(key, buf, len)) {
+		return;
+	}
+
+	// a region without a record (the store was turned on for a device in the field) is still at its EEPROM
+	// address, the first save() moves it into the store
+	if (store == NULL || store->read(key, buf, len) == 0) {
+		read(address, buf, len);
+	}
+
+	FastBoot.save(key, buf, len);
+}
+
+boolean PersistenceManager::save(uint8_t key, int address, const byte* buf, int len) {
+
+	boolean changed;
+
+	if (store != NULL) {
+		unsigned long before = store->appends;
+		unsigned long unchanged = store->unchanged;
+		if (!store->write(key, buf, len)) {
+			writesRejected++;
+			return false;
+		}
+		// inside a batch it is appended by endBatch()
+		changed = store->unchanged == unchanged;
+		if (changed) {
+			bytesWritten += len;
+		}
+		if (store->appends != before) {
+			commits++;
+		}
+	} else {
+		unsigned long rejected = writesRejected;
+		changed = write(address, buf, len);
+		if (writesRejected != rejected) {
+			return false;
+		}
+	}
+
+	// mirrored once the write was taken, a refused one must not come back on a warm boot
+	FastBoot.save(key, buf, len);
+
+	return changed;
+}
+
+void PersistenceManager::markDirty(uint16_t start, uint16_t end) {
+
+	if (dirtyRangeCount == 0) {
+		dirtySince = millis();
+	}
+
+	// merge into an overlapping or adjacent range
+	for (int r = 0; r < dirtyRangeCount; r++) {
+		if (start <= dirtyRanges[r]._end && end >= dirtyRanges[r]._start) {
+			dirtyRanges[r]._start = min(start, dirtyRanges[r]._start);
+			dirtyRanges[r]._end = max(end, dirtyRanges[r]._end);
+			return;
+		}
+	}
+
+	if (dirtyRangeCount < PERSISTENCE_MAX_DIRTY_RANGES) {
+		dirtyRanges[dirtyRangeCount]._start = start;
+		dirtyRanges[dirtyRangeCount]._end = end;
+		dirtyRangeCount++;
+		return;
+	}
+
+	// no free slot, grow the nearest range over the gap
+	int nearest = 0;
+	uint16_t nearestGap = 0xFFFF;
+
+	for (int r = 0; r < dirtyRangeCount; r++) {
+		uint16_t gap = start > dirtyRanges[r]._end ? start - dirtyRanges[r]._end : dirtyRanges[r]._start - end;
+		if (gap < nearestGap) {
+			nearestGap = gap;
+			nearest = r;
+		}
+	}
+
+	dirtyRanges[nearest]._start = min(start, dirtyRanges[nearest]._start);
+	dirtyRanges[nearest]._end = max(end, dirtyRanges[nearest]._end);
+}
+
+boolean PersistenceManager::isDirty() {
+	return dirtyRangeCount > 0;
+}
+
+boolean PersistenceManager::flush() {
+
+	flushPending = false;
+
+	if (dirtyRangeCount == 0) {
+		commitsSkipped++;
+		return false;
+	}
+
+	uint16_t dirtyBytes = 0;
+	for (int r = 0; r < dirtyRangeCount; r++) {
+		dirtyBytes += dirtyRanges[r]._end - dirtyRanges[r]._start;
+	}
+	bytesWritten += dirtyBytes;
+
+	DEBUG_PRINT("PersistenceManager::flush ranges ");DEBUG_PRINTLN(dirtyRangeCount);
+	LOG_INFO(LOG_MODULE_PERSISTENCE, LOG_EVENT_EEPROM_COMMIT, dirtyRangeCount, dirtyBytes);
+
+	EEPROM.commit();
+	commits++;
+	dirtyRangeCount = 0;
+
+	return true;
+}
+
+void PersistenceManager::requestFlush() {
+
+	if (batchDepth > 0) {
+		batchFlush = true;
+	} else if (flushInterval == 0) {
+		flush();
+	} else {
+		flushPending = true;
+	}
+}
+
+void PersistenceManager::beginBatch() {
+	if (batchDepth++ == 0 && store != NULL) {
+		store->beginBatch();
+	}
+}
+
+void PersistenceManager::endBatch() {
+
+	if (batchDepth == 0 || --batchDepth > 0) {
+		return;
+	}
+
+	// everything saved in the batch, one record
+	if (store != NULL) {
+		unsigned long before = store->appends;
+		if (!store->endBatch()) {
+			writesRejected++;
+		}
+		if (store->appends != before) {
+			commits++;
+		}
+	}
+
+	if (batchFlush) {
+		batchFlush = false;
+		requestFlush();
+	}
+}
+
+void PersistenceManager::loop() {
+
+	if (flushPending && (dirtyRangeCount == 0 || millis() - dirtySince >= flushInterval)) {
+		flush();
+	}
+}
@@ -0,0 +1,118 @@
+#ifndef Persistence_h
+#define Persistence_h
+
+#include "Arduino.h"
+#include "RecordStore.h"
+
+// EEPROM bytes kept in the RAM shadow, covers ESPConfig and every controller region
+static const uint16_t PERSISTENCE_SIZE = 1024;
+
+// bytes fill() compares and writes per write() call
+static const uint8_t PERSISTENCE_FILL_CHUNK = 64;
+
+// dirty byte ranges tracked between commits, more are merged into the nearest one
+static const uint8_t PERSISTENCE_MAX_DIRTY_RANGES = 8;
+
+typedef struct {
+	// first dirty address
+	uint16_t _start;
+
+	// one past the last dirty address
+	uint16_t _end;
+} _dirty_range;
+
+/***
+*
+*	One long-lived RAM shadow of the EEPROM for ESPConfig and all controllers.
+*
+*	EEPROM.begin() is called once and never ended: on the ESP8266 core every begin() copies the flash sector
+*	into RAM and every commit() erases and rewrites the sector, so save()/saveCapabilities() only update the
+*	shadow and mark dirty ranges. Everything pending is flushed with a single EEPROM.commit(), either right
+*	away (flushInterval = 0) or from loop() flushInterval milliseconds after the first pending change.
+*	A flush with nothing changed does not commit.
+*
+*	load()/save() address a region both by key and by its fixed EEPROM address. After useRecordStore() they go
+*	to the wear-leveled RecordStore by key instead of the fixed EEPROM addresses. Once FastBoot (ESPFastBoot.h) is
+*	begun, both keep a copy of the region in RTC memory, and load() takes it from there on a warm boot.
+*
+***/
+class PersistenceManager {
+public:
+	// open the shadow, called on first use if the sketch does not
+	void begin();
+
+	// copy from the shadow
+	void read(int address, byte* buf, int len);
+
+	// update the shadow: compared with buf a 32-bit word at a time, only the changed spans are copied and marked
+	// dirty. Returns false if nothing changed, and flush() then has nothing to commit
+	boolean write(int address, const byte* buf, int len);
+
+	// set len bytes from address to value, as write(). Returns false if they all had that value already
+	boolean fill(int address, byte value, int len);
+
+	// read the region stored under key (record store) or at address (EEPROM). A key the record store has no record
+	// of yet is read from address
+	void load(uint8_t key, int address, byte* buf, int len);
+
+	// store the region under key (record store) or at address (EEPROM). Returns true if anything changed
+	boolean save(uint8_t key, int address, const byte* buf, int len);
+
+	// keep regions in this record store instead of fixed EEPROM addresses, NULL to go back to EEPROM
+	void useRecordStore(RecordStore* store);
+
+	RecordStore* recordStore();
+
+	// commit everything pending now. Returns true if EEPROM was committed
+	boolean flush();
+
+	// flush now or schedule it, depending on flushInterval
+	void requestFlush();
+
+	// flush when a scheduled flush is due
+	void loop();
+
+	// hold back requestFlush() until the matching endBatch(), which requests one flush for all of them. With the
+	// record store, what save() stores in between is appended as one record (RecordStore::beginBatch). Batches nest
+	void beginBatch();
+	void endBatch();
+
+	// changes not yet committed
+	boolean isDirty();
+
+	// milliseconds between the first pending change and its commit, 0 = commit on every requestFlush()
+	unsigned long flushInterval = 0;
+
+	// EEPROM.commit() calls
+	unsigned long commits = 0;
+
+	// bytes changed and committed
+	unsigned long bytesWritten = 0;
+
+	// flushes which had nothing to commit
+	unsigned long commitsSkipped = 0;
+
+	// save() and write() calls refused, out of range or not taken by the record store. save() returns false for
+	// these as for an unchanged region, a caller which has to tell them apart compares this before and after
+	unsigned long writesRejected = 0;
+
+private:
+	RecordStore* store = NULL;
+
+	boolean begun = false;
+	boolean flushPending = false;
+	unsigned long dirtySince = 0;
+
+	// open beginBatch() calls, and whether requestFlush() was called inside them
+	uint8_t batchDepth = 0;
+	boolean batchFlush = false;
+
+	_dirty_range dirtyRanges[PERSISTENCE_MAX_DIRTY_RANGES];
+	uint8_t dirtyRangeCount = 0;
+
+	void markDirty(uint16_t start, uint16_t end);
+};
+
+extern PersistenceManager Persistence;
+
+#endif
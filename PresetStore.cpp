@@ -0,0 +1,226 @@
+#include "Arduino.h"
+#include "ESPConfig.h"
+#include "PresetStore.h"
+#include "Persistence.h"
+
+static_assert(RECORD_KEY_PRESET + PRESET_MAX <= RECORD_STORE_MAX_KEYS, "preset record keys");
+static_assert(PRESET_RECORD_SIZE <= RECORD_MAX_LENGTH, "preset record size");
+static_assert(RECORD_KEY_CONTROLLER + MAX_CONTROLLER_PIN < RECORD_KEY_PRESET_CURRENT, "controller and preset record keys overlap");
+
+uint8_t PresetStore::save(uint8_t slot, const char* name, DeviceServer* server) {
+
+	if (slot >= PRESET_MAX) {
+		return PRESET_NO_SLOT;
+	}
+
+	if (Persistence.recordStore() == NULL && (eeprom_address < 0 || eeprom_address + presetStoreSize() > PERSISTENCE_SIZE)) {
+		DEBUG_PRINT("PresetStore::save ***OUT OF RANGE*** ");DEBUG_PRINTLN(eeprom_address);
+		return PRESET_WRITE_FAILED;
+	}
+
+	byte aray[PRESET_RECORD_SIZE];
+	memset(aray, 0, sizeof(aray));
+	uint16_t index = 0;
+
+	aray[index++] = PRESET_MAGIC;
+	strncpy((char*)aray + index, name, MAX_LENGTH_NAME - 1);
+	index += MAX_LENGTH_NAME;
+
+	uint16_t countIndex = index++;
+	uint8_t controllerCount = 0;
+
+	for (uint8_t pin = 0; pin <= MAX_CONTROLLER_PIN; pin++) {
+		ESP8266Controller* controller = server->getController(pin);
+		if (controller == NULL) {
+			continue;
+		}
+
+		// [pin][no_of_capabilities] and the values, 3 bytes each at most
+		if (index + 2 + 3 * (controller->capabilityCount + 1) > PRESET_RECORD_SIZE) {
+			DEBUG_PRINT("PresetStore::save ***TOO LARGE*** ");DEBUG_PRINTLN(slot);
+			return PRESET_TOO_LARGE;
+		}
+
+		aray[index++] = pin;
+		index += writeVarint(aray + index, controller->capabilityCount);
+		for (uint8_t id = 0; id < controller->capabilityCount; id++) {
+			index += writeVarint(aray + index, controller->capabilities[id]._value);
+		}
+		controllerCount++;
+	}
+	aray[countIndex] = controllerCount;
+
+	DEBUG_PRINT("PresetStore::save ");DEBUG_PRINT(slot);DEBUG_PRINT(", size ");DEBUG_PRINTLN(index);
+
+	unsigned long rejected = Persistence.writesRejected;
+	Persistence.save(RECORD_KEY_PRESET + slot, slotAddress(slot), aray, index);
+	if (Persistence.writesRejected != rejected) {
+		DEBUG_PRINT("PresetStore::save ***WRITE FAILED*** ");DEBUG_PRINTLN(slot);
+		return PRESET_WRITE_FAILED;
+	}
+	Persistence.requestFlush();
+
+	return PRESET_OK;
+}
+
+uint8_t PresetStore::recall(uint8_t slot, DeviceServer* server) {
+
+	if (slot >= PRESET_MAX) {
+		return PRESET_NO_SLOT;
+	}
+
+	byte aray[PRESET_RECORD_SIZE];
+	uint16_t length = load(slot, aray);
+
+	if (length == 0) {
+		return PRESET_EMPTY;
+	}
+
+	uint8_t result = apply(aray, length, server);
+	if (result == PRESET_OK) {
+		currentPreset = slot;
+		saveCurrent();
+	}
+	return result;
+}
+
+uint8_t PresetStore::restore(DeviceServer* server) {
+
+	byte b = 0;
+	Persistence.load(RECORD_KEY_PRESET_CURRENT, eeprom_address, &b, 1);
+
+	// stored as index + 1, so an erased EEPROM (0xFF) and a missing record (0) are both none
+	if (b == 0 || b > PRESET_MAX) {
+		currentPreset = PRESET_NONE;
+		return PRESET_EMPTY;
+	}
+
+	byte aray[PRESET_RECORD_SIZE];
+	uint16_t length = load(b - 1, aray);
+	uint8_t result = length == 0 ? PRESET_EMPTY : apply(aray, length, server);
+
+	currentPreset = result == PRESET_OK ? b - 1 : PRESET_NONE;
+	DEBUG_PRINT("PresetStore::restore ");DEBUG_PRINT(b - 1);DEBUG_PRINT(", result ");DEBUG_PRINTLN(result);
+	return result;
+}
+
+void PresetStore::loop(DeviceServer* server) {
+
+	if (currentPreset == PRESET_NONE) {
+		return;
+	}
+
+	boolean changed = false;
+	for (uint8_t pin = 0; pin <= MAX_CONTROLLER_PIN && !changed; pin++) {
+		ESP8266Controller* controller = server->getController(pin);
+		changed = controller != NULL && controller->changeCount != recalledChangeCount[pin];
+	}
+
+	if (!changed) {
+		return;
+	}
+
+	DEBUG_PRINT("PresetStore::loop left preset ");DEBUG_PRINTLN(currentPreset);
+
+	// the blocks of untouched controllers still hold their values from before the recall
+	for (uint8_t pin = 0; pin <= MAX_CONTROLLER_PIN; pin++) {
+		ESP8266Controller* controller = server->getController(pin);
+		if (controller != NULL) {
+			controller->eepromUpdatePending = true;
+		}
+	}
+
+	currentPreset = PRESET_NONE;
+	saveCurrent();
+}
+
+boolean PresetStore::name(uint8_t slot, char* name) {
+
+	byte aray[PRESET_RECORD_SIZE];
+	if (slot >= PRESET_MAX || load(slot, aray) == 0) {
+		return false;
+	}
+
+	memcpy(name, aray + 1, MAX_LENGTH_NAME);
+	name[MAX_LENGTH_NAME - 1] = 0;
+	return true;
+}
+
+uint16_t PresetStore::load(uint8_t slot, byte* aray) {
+
+	Persistence.load(RECORD_KEY_PRESET + slot, slotAddress(slot), aray, PRESET_RECORD_SIZE);
+	return aray[0] == PRESET_MAGIC ? PRESET_RECORD_SIZE : 0;
+}
+
+uint8_t PresetStore::apply(const byte* aray, uint16_t length, DeviceServer* server) {
+
+	uint8_t result = PRESET_OK;
+	boolean touched[MAX_CONTROLLER_PIN + 1];
+	memset(touched, 0, sizeof(touched));
+
+	// 1st pass checks everything, 2nd pass sets the values
+	for (int pass = 0; pass < 2 && result == PRESET_OK; pass++) {
+		PacketReader in(aray, length);
+		uint8_t controllerCount;
+
+		if (!in.skip(1 + MAX_LENGTH_NAME) || !in.u8(&controllerCount)) {
+			result = PRESET_MALFORMED;
+			break;
+		}
+
+		for (uint8_t c = 0; c < controllerCount && result == PRESET_OK; c++) {
+			uint8_t pin;
+			uint16_t no_of_capabilities;
+
+			if (!in.u8(&pin) || !in.varint(&no_of_capabilities)) {
+				result = PRESET_MALFORMED;
+				break;
+			}
+
+			ESP8266Controller* controller = server->getController(pin);
+			if (controller == NULL || controller->capabilityCount != no_of_capabilities) {
+				result = PRESET_MISMATCH;
+				break;
+			}
+
+			for (uint8_t id = 0; id < no_of_capabilities && result == PRESET_OK; id++) {
+				uint16_t val;
+
+				if (!in.varint(&val)) {
+					result = PRESET_MALFORMED;
+				} else if (controller->checkCapability(id, val) != CAPABILITY_VALID) {
+					result = PRESET_MISMATCH;
+				} else if (pass == 1) {
+					controller->setCapabilityById(id, val);
+				}
+			}
+
+			touched[pin] = true;
+		}
+	}
+
+	if (result != PRESET_OK) {
+		DEBUG_PRINT("PresetStore::apply ***REJECTED*** ");DEBUG_PRINTLN(result);
+		return result;
+	}
+
+	// outputs in this tick
+	for (uint8_t pin = 0; pin <= MAX_CONTROLLER_PIN; pin++) {
+		ESP8266Controller* controller = server->getController(pin);
+		if (touched[pin]) {
+			controller->loop();
+		}
+		if (controller != NULL) {
+			recalledChangeCount[pin] = controller->changeCount;
+		}
+	}
+
+	return PRESET_OK;
+}
+
+void PresetStore::saveCurrent() {
+
+	byte b = currentPreset == PRESET_NONE ? 0 : currentPreset + 1;
+	Persistence.save(RECORD_KEY_PRESET_CURRENT, eeprom_address, &b, 1);
+	Persistence.requestFlush();
+}
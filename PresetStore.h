@@ -0,0 +1,106 @@
+#ifndef PresetStore_h
+#define PresetStore_h
+
+#include "Arduino.h"
+#include "DeviceServer.h"
+
+// preset slots, each a RecordStore key (RECORD_KEY_PRESET + slot)
+static const uint8_t PRESET_MAX = 4;
+static const uint8_t PRESET_NONE = 0xFF;
+
+// EEPROM bytes per slot, a preset which does not fit is refused. Must not exceed RECORD_MAX_LENGTH
+static const uint8_t PRESET_RECORD_SIZE = 96;
+
+// first byte of a stored preset, tells a saved slot from an erased one
+static const uint8_t PRESET_MAGIC = 0x50;
+
+// EEPROM bytes from the address given to PresetStore: [current preset + 1] then PRESET_MAX records
+static constexpr int presetStoreSize() {
+	return 1 + PRESET_MAX * PRESET_RECORD_SIZE;
+}
+
+// PRESET_SAVE payload: [slot][name (16 bytes)], PRESET_RECALL payload: [slot]
+// reply: [PRESET_* result][current preset or PRESET_NONE]
+static const uint8_t PRESET_OK = 0;
+static const uint8_t PRESET_MALFORMED = 1;
+static const uint8_t PRESET_NO_SLOT = 2;// slot out of range, or the server has no PresetStore
+static const uint8_t PRESET_EMPTY = 3;// nothing saved in the slot
+static const uint8_t PRESET_TOO_LARGE = 4;// the controllers do not fit in PRESET_RECORD_SIZE
+static const uint8_t PRESET_MISMATCH = 5;// saved for controllers or ranges which are not registered any more
+static const uint8_t PRESET_WRITE_FAILED = 6;// the slot runs past PERSISTENCE_SIZE, or the record store refused it
+
+/***
+*
+*	Named snapshots of the capability values of every controller registered with a DeviceServer.
+*
+*	A preset is stored values only, in registration (pin) order:
+*	[PRESET_MAGIC][name (16 bytes)][no_of_controllers] then per controller [pin][no_of_capabilities][values]
+*	(count and values are varints), a few dozen bytes for a handful of controllers.
+*
+*	recall() checks the whole preset against the controllers first, then sets every value, runs the loop() of
+*	every controller in the same tick and persists only the index of the current preset; the capability blocks
+*	of the controllers are not written. At boot, restore() puts the current preset back over the values the
+*	controllers loaded. Once any controller changes after a recall (SET, fade, sketch) the preset is left: the
+*	index is cleared and every controller is marked eepromUpdatePending, so the blocks catch up on their usual
+*	schedule.
+*
+*	PresetStore presets(500);            // presetStoreSize() bytes, up to PERSISTENCE_SIZE
+*
+*	void setup() {
+*		...
+*		server.addController(&led);
+*		server.usePresets(&presets);     // restores the current preset
+*	}
+*
+***/
+class PresetStore {
+public:
+	// EEPROM address of presetStoreSize() bytes, address + presetStoreSize() must not exceed PERSISTENCE_SIZE.
+	// Ignored with a RecordStore
+	PresetStore(int start_address) {
+		eeprom_address = start_address;
+		memset(recalledChangeCount, 0, sizeof(recalledChangeCount));
+	}
+
+	// snapshot the values of the controllers of server into slot under name. Returns PRESET_*
+	uint8_t save(uint8_t slot, const char* name, DeviceServer* server);
+
+	// apply slot to the controllers of server and make it the current preset. Returns PRESET_*
+	uint8_t recall(uint8_t slot, DeviceServer* server);
+
+	// apply the saved current preset, if there is one, without saving anything. Returns PRESET_*
+	uint8_t restore(DeviceServer* server);
+
+	// leave the current preset once a controller of server changed after recall(), called by DeviceServer::loop()
+	void loop(DeviceServer* server);
+
+	// current preset, PRESET_NONE if the values were changed after the last recall
+	uint8_t current() {
+		return currentPreset;
+	}
+
+	// name of the preset in slot into name (MAX_LENGTH_NAME bytes), false if the slot is empty
+	boolean name(uint8_t slot, char* name);
+
+	int eeprom_address;
+
+private:
+	uint8_t currentPreset = PRESET_NONE;
+
+	// changeCount of every controller right after the last recall
+	uint16_t recalledChangeCount[MAX_CONTROLLER_PIN + 1];
+
+	// read slot, 0 if it is empty
+	uint16_t load(uint8_t slot, byte* aray);
+
+	// set the controllers from a loaded preset, all or none
+	uint8_t apply(const byte* aray, uint16_t length, DeviceServer* server);
+
+	void saveCurrent();
+
+	int slotAddress(uint8_t slot) {
+		return eeprom_address + 1 + slot * PRESET_RECORD_SIZE;
+	}
+};
+
+#endif
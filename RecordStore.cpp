@@ -0,0 +1,451 @@
+#include "Arduino.h"
+extern "C" {
+#include "spi_flash.h"
+}
+#include "ESPConfig.h"
+#include "RecordStore.h"
+
+// latest[] entry of a key without a record
+static const uint32_t RECORD_NONE = 0xFFFFFFFF;
+
+// records are read and programmed through an aligned chunk of this size, never a whole record on the stack
+static const uint16_t RECORD_CHUNK_SIZE = 64;
+
+static_assert(RECORD_STORE_MAX_KEYS <= RECORD_KEY_BATCH, "record keys reach RECORD_KEY_BATCH");
+
+static uint16_t crc16(uint16_t crc, const byte* buf, int len) {
+	// CRC-16/CCITT-FALSE
+	for (int i = 0; i < len; i++) {
+		crc ^= (uint16_t)buf[i] << 8;
+		for (int b = 0; b < 8; b++) {
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+uint32_t RecordStore::sectorAddress(uint8_t sector) {
+	return (uint32_t)(first + sector) * SPI_FLASH_SEC_SIZE;
+}
+
+boolean RecordStore::begin(uint16_t firstSector, uint8_t sectorCount) {
+	DEBUG_PRINT("RecordStore::begin sector ");DEBUG_PRINT(firstSector);DEBUG_PRINT(", count ");DEBUG_PRINTLN(sectorCount);
+
+	if (sectorCount < 2 || sectorCount > RECORD_STORE_MAX_SECTORS) {
+		DEBUG_PRINTLN("RecordStore::begin ***SECTOR COUNT***");
+		return false;
+	}
+
+	first = firstSector;
+	count = sectorCount;
+	head = 0;
+	headOffset = 0;
+	sequence = 0;
+	batching = false;
+	batchLength = 0;
+
+	uint32_t latestSeq[RECORD_STORE_MAX_KEYS];
+	for (int k = 0; k < RECORD_STORE_MAX_KEYS; k++) {
+		latest[k] = RECORD_NONE;
+		latestSeq[k] = 0;
+	}
+
+	uint16_t used[RECORD_STORE_MAX_SECTORS];
+
+	for (uint8_t s = 0; s < count; s++) {
+
+		uint16_t offset = 0;
+
+		while (offset + RECORD_HEADER_SIZE <= SPI_FLASH_SEC_SIZE) {
+
+			uint32_t header[RECORD_HEADER_SIZE / 4];
+			spi_flash_read(sectorAddress(s) + offset, header, sizeof(header));
+			byte* h = (byte*)header;
+
+			if (header[0] == 0xFFFFFFFF && header[1] == 0xFFFFFFFF && header[2] == 0xFFFFFFFF) {
+				// erased, free space starts here
+				break;
+			}
+
+			uint8_t key;
+			uint16_t length;
+			uint32_t seq;
+			uint16_t crc;
+
+			if (!readHeader(sectorAddress(s) + offset, &key, &length, &seq, &crc)
+					|| length > RECORD_MAX_LENGTH || offset + recordSize(length) > SPI_FLASH_SEC_SIZE) {
+				// torn header or garbage, the rest of this sector cannot be trusted or reused
+				DEBUG_PRINT("RecordStore::begin ***BAD HEADER*** sector ");DEBUG_PRINT(s);DEBUG_PRINT(", offset ");DEBUG_PRINT(offset);DEBUG_PRINT(", magic ");DEBUG_PRINTLN(h[0]);
+				offset = SPI_FLASH_SEC_SIZE;
+				break;
+			}
+
+			if ((key < RECORD_STORE_MAX_KEYS || key == RECORD_KEY_BATCH) && verify(sectorAddress(s) + offset, key, length, seq, crc)) {
+				uint32_t payload = sectorAddress(s) + offset + RECORD_HEADER_SIZE;
+				if (key != RECORD_KEY_BATCH) {
+					take(key, payload, length, seq, latestSeq);
+				}
+				// the entries of a batch are as new as the batch
+				for (uint16_t e = 0; key == RECORD_KEY_BATCH && e + RECORD_HEADER_SIZE <= length; ) {
+					uint8_t k;
+					uint16_t l;
+					uint32_t unused;
+					uint16_t none;
+					if (!readHeader(payload + e, &k, &l, &unused, &none) || k >= RECORD_STORE_MAX_KEYS || e + recordSize(l) > length) {
+						break;
+					}
+					take(k, payload + e + RECORD_HEADER_SIZE, l, seq, latestSeq);
+					e += recordSize(l);
+				}
+				if (seq > sequence) {
+					sequence = seq;
+					head = s;
+				}
+			} else {
+				// torn payload, skipped; the previous record of this key stays the newest
+				DEBUG_PRINT("RecordStore::begin ***CRC*** sector ");DEBUG_PRINT(s);DEBUG_PRINT(", offset ");DEBUG_PRINTLN(offset);
+			}
+
+			offset += recordSize(length);
+		}
+
+		used[s] = offset;
+	}
+
+	if (sequence == 0) {
+		// nothing valid stored yet
+		format();
+		return true;
+	}
+
+	headOffset = used[head];
+
+	// the sector after the head must be the erased spare, finish a compaction interrupted by a reset
+	uint8_t spare = (head + 1) % count;
+	if (!isErased(spare)) {
+		compact(spare);
+	}
+
+	DEBUG_PRINT("RecordStore::begin head ");DEBUG_PRINT(head);DEBUG_PRINT(", offset ");DEBUG_PRINT(headOffset);DEBUG_PRINT(", sequence ");DEBUG_PRINTLN(sequence);
+	return true;
+}
+
+void RecordStore::take(uint8_t key, uint32_t payload, uint16_t length, uint32_t seq, uint32_t* latestSeq) {
+	if (latest[key] == RECORD_NONE || seq > latestSeq[key]) {
+		latest[key] = payload;
+		latestLength[key] = length;
+		latestSeq[key] = seq;
+	}
+}
+
+void RecordStore::format() {
+	for (uint8_t s = 0; s < count; s++) {
+		eraseSector(s);
+	}
+	for (int k = 0; k < RECORD_STORE_MAX_KEYS; k++) {
+		latest[k] = RECORD_NONE;
+	}
+	head = 0;
+	headOffset = 0;
+	sequence = 0;
+	batchLength = 0;
+}
+
+boolean RecordStore::isErased(uint8_t sector) {
+	uint32_t chunk[16];
+
+	for (uint16_t offset = 0; offset < SPI_FLASH_SEC_SIZE; offset += sizeof(chunk)) {
+		spi_flash_read(sectorAddress(sector) + offset, chunk, sizeof(chunk));
+		for (unsigned int i = 0; i < sizeof(chunk) / 4; i++) {
+			if (chunk[i] != 0xFFFFFFFF) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+void RecordStore::eraseSector(uint8_t sector) {
+	DEBUG_PRINT("RecordStore::eraseSector ");DEBUG_PRINTLN(first + sector);
+
+	spi_flash_erase_sector(first + sector);
+	erases++;
+}
+
+boolean RecordStore::readHeader(uint32_t address, uint8_t* key, uint16_t* length, uint32_t* seq, uint16_t* crc) {
+	uint32_t header[RECORD_HEADER_SIZE / 4];
+	spi_flash_read(address, header, sizeof(header));
+	byte* h = (byte*)header;
+
+	if (h[0] != RECORD_MAGIC) {
+		return false;
+	}
+
+	*key = h[1];
+	*length = h[2] | (h[3] << 8);
+	*seq = (uint32_t)h[4] | ((uint32_t)h[5] << 8) | ((uint32_t)h[6] << 16) | ((uint32_t)h[7] << 24);
+	*crc = h[8] | (h[9] << 8);
+	return true;
+}
+
+// the CRC covers key, length and sequence, then the payload
+static uint16_t crcOfHeader(uint8_t key, uint16_t length, uint32_t seq) {
+	byte h[7] = { key, lowByte(length), highByte(length), (byte)seq, (byte)(seq >> 8), (byte)(seq >> 16), (byte)(seq >> 24) };
+
+	return crc16(0xFFFF, h, sizeof(h));
+}
+
+uint16_t RecordStore::crcOf(uint8_t key, uint16_t length, uint32_t seq, const byte* buf) {
+	return crc16(crcOfHeader(key, length, seq), buf, length);
+}
+
+uint16_t RecordStore::crcOfFlash(uint32_t payload, uint8_t key, uint16_t length, uint32_t seq) {
+	uint16_t crc = crcOfHeader(key, length, seq);
+	uint32_t chunk[RECORD_CHUNK_SIZE / 4];
+
+	for (uint16_t offset = 0; offset < length; offset += sizeof(chunk)) {
+		uint16_t n = min((uint16_t)sizeof(chunk), (uint16_t)(length - offset));
+		spi_flash_read(payload + offset, chunk, (n + 3) & ~3);
+		crc = crc16(crc, (byte*)chunk, n);
+	}
+
+	return crc;
+}
+
+boolean RecordStore::verify(uint32_t address, uint8_t key, uint16_t length, uint32_t seq, uint16_t crc) {
+	return crcOfFlash(address + RECORD_HEADER_SIZE, key, length, seq) == crc;
+}
+
+int RecordStore::read(uint8_t key, byte* buf, int len) {
+
+	if (key >= RECORD_STORE_MAX_KEYS) {
+		return 0;
+	}
+
+	// staged in the open batch, newer than anything in flash
+	int entry = staged(key);
+	if (entry >= 0) {
+		int n = min((int)(batch[entry + 2] | (batch[entry + 3] << 8)), len);
+		memcpy(buf, batch + entry + RECORD_HEADER_SIZE, n);
+		return n;
+	}
+
+	if (latest[key] == RECORD_NONE) {
+		return 0;
+	}
+
+	int n = min((int)latestLength[key], len);
+	uint32_t chunk[RECORD_CHUNK_SIZE / 4];
+
+	for (int offset = 0; offset < n; offset += sizeof(chunk)) {
+		int c = min((int)sizeof(chunk), n - offset);
+		spi_flash_read(latest[key] + offset, chunk, (c + 3) & ~3);
+		memcpy(buf + offset, chunk, c);
+	}
+
+	return n;
+}
+
+boolean RecordStore::equals(uint8_t key, const byte* buf, uint16_t len) {
+
+	if (latest[key] == RECORD_NONE || latestLength[key] != len) {
+		return false;
+	}
+
+	uint32_t chunk[RECORD_CHUNK_SIZE / 4];
+
+	for (uint16_t offset = 0; offset < len; offset += sizeof(chunk)) {
+		uint16_t n = min((uint16_t)sizeof(chunk), (uint16_t)(len - offset));
+		spi_flash_read(latest[key] + offset, chunk, (n + 3) & ~3);
+		if (memcmp(chunk, buf + offset, n) != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+boolean RecordStore::write(uint8_t key, const byte* buf, int len) {
+
+	if (key >= RECORD_STORE_MAX_KEYS || len > RECORD_MAX_LENGTH || count == 0) {
+		DEBUG_PRINT("RecordStore::write ***REJECTED*** key ");DEBUG_PRINT(key);DEBUG_PRINT(", length ");DEBUG_PRINTLN(len);
+		return false;
+	}
+
+	// a newer value of a key already in the batch replaces it
+	int entry = staged(key);
+	if (entry >= 0) {
+		uint16_t size = recordSize(batch[entry + 2] | (batch[entry + 3] << 8));
+		memmove(batch + entry, batch + entry + size, batchLength - entry - size);
+		batchLength -= size;
+	}
+
+	// same as stored, nothing to append
+	if (equals(key, buf, len)) {
+		unchanged++;
+		return true;
+	}
+
+	if (!batching || recordSize(len) > RECORD_MAX_LENGTH) {
+		return commitBatch() && place(key, append(key, buf, 0, len), len);
+	}
+
+	// staged as [header without sequence and crc][payload padded to 4 bytes], laid out as a record of its own
+	if (batchLength + recordSize(len) > RECORD_MAX_LENGTH && !commitBatch()) {
+		return false;
+	}
+
+	byte* e = batch + batchLength;
+	memset(e, 0xFF, recordSize(len));
+	e[0] = RECORD_MAGIC;
+	e[1] = key;
+	e[2] = lowByte(len);
+	e[3] = highByte(len);
+	memcpy(e + RECORD_HEADER_SIZE, buf, len);
+	batchLength += recordSize(len);
+	return true;
+}
+
+void RecordStore::beginBatch() {
+	batching = true;
+}
+
+boolean RecordStore::endBatch() {
+	batching = false;
+	return commitBatch();
+}
+
+int RecordStore::staged(uint8_t key) {
+	for (uint16_t e = 0; e < batchLength; e += recordSize(batch[e + 2] | (batch[e + 3] << 8))) {
+		if (batch[e + 1] == key) {
+			return e;
+		}
+	}
+	return -1;
+}
+
+boolean RecordStore::commitBatch() {
+
+	if (batchLength == 0) {
+		return true;
+	}
+
+	uint16_t length = batchLength;
+	batchLength = 0;
+
+	// a batch of one is a record of its own
+	uint16_t first = batch[2] | (batch[3] << 8);
+	if (recordSize(first) == length) {
+		return place(batch[1], append(batch[1], batch + RECORD_HEADER_SIZE, 0, first), first);
+	}
+
+	uint32_t address = append(RECORD_KEY_BATCH, batch, 0, length);
+	if (address == RECORD_NONE) {
+		return false;
+	}
+
+	for (uint16_t e = 0; e < length; e += recordSize(batch[e + 2] | (batch[e + 3] << 8))) {
+		place(batch[e + 1], address + RECORD_HEADER_SIZE + e, batch[e + 2] | (batch[e + 3] << 8));
+	}
+	return true;
+}
+
+boolean RecordStore::place(uint8_t key, uint32_t address, uint16_t len) {
+
+	if (address == RECORD_NONE) {
+		return false;
+	}
+
+	latest[key] = address + RECORD_HEADER_SIZE;
+	latestLength[key] = len;
+	return true;
+}
+
+uint32_t RecordStore::append(uint8_t key, const byte* buf, uint32_t from, uint16_t len) {
+
+	uint16_t size = recordSize(len);
+
+	// every advance compacts the oldest sector into a fresh head, which may leave too little room for a large record
+	for (uint8_t advances = 0; headOffset + size > SPI_FLASH_SEC_SIZE; advances++) {
+		// a copy is read from the sector an advance would erase, the spare always has room for it
+		if (advances == count || buf == NULL) {
+			DEBUG_PRINT("RecordStore::append ***FULL*** key ");DEBUG_PRINTLN(key);
+			return RECORD_NONE;
+		}
+		advance();
+	}
+
+	uint32_t seq = ++sequence;
+	uint16_t crc = buf != NULL ? crcOf(key, len, seq, buf) : crcOfFlash(from, key, len, seq);
+	byte h[RECORD_HEADER_SIZE] = { RECORD_MAGIC, key, lowByte(len), highByte(len), (byte)seq, (byte)(seq >> 8), (byte)(seq >> 16), (byte)(seq >> 24), lowByte(crc), highByte(crc), 0xFF, 0xFF };
+
+	uint32_t address = sectorAddress(head) + headOffset;
+
+	// the space is consumed even if programming fails, it cannot be rewritten before an erase
+	headOffset += size;
+	appends++;
+
+	// [header][payload padded with 0xFF], a chunk at a time; header and padding keep the payload word-aligned
+	uint32_t chunk[RECORD_CHUNK_SIZE / 4];
+	byte* c = (byte*)chunk;
+
+	for (uint16_t offset = 0; offset < size; offset += sizeof(chunk)) {
+		uint16_t n = min((uint16_t)sizeof(chunk), (uint16_t)(size - offset));
+
+		uint16_t i = 0;
+		for (; i < n && offset + i < RECORD_HEADER_SIZE; i++) {
+			c[i] = h[offset + i];
+		}
+
+		uint16_t p = offset + i - RECORD_HEADER_SIZE;
+		if (i < n && buf != NULL) {
+			uint16_t m = p < len ? min((uint16_t)(n - i), (uint16_t)(len - p)) : 0;
+			memcpy(c + i, buf + p, m);
+			memset(c + i + m, 0xFF, n - i - m);
+		} else if (i < n) {
+			// a copy made by compaction, its padding is already 0xFF
+			spi_flash_read(from + p, (uint32_t*)(c + i), n - i);
+		}
+
+		if (spi_flash_write(address + offset, chunk, n) != SPI_FLASH_RESULT_OK) {
+			DEBUG_PRINT("RecordStore::append ***WRITE FAILED*** ");DEBUG_PRINTLN(address);
+			return RECORD_NONE;
+		}
+	}
+
+	return address;
+}
+
+void RecordStore::advance() {
+
+	// move the head into the spare
+	head = (head + 1) % count;
+	headOffset = 0;
+
+	if (!isErased(head)) {
+		eraseSector(head);
+	}
+
+	// the sector after the new head is the oldest one, it becomes the next spare
+	uint8_t oldest = (head + 1) % count;
+	if (!isErased(oldest)) {
+		compact(oldest);
+	}
+}
+
+void RecordStore::compact(uint8_t sector) {
+	DEBUG_PRINT("RecordStore::compact sector ");DEBUG_PRINTLN(first + sector);
+
+	uint32_t start = sectorAddress(sector);
+
+	// copy the records still current out of the sector before erasing it. An entry of a batch becomes a record of
+	// its own, laid out as it was in the batch, so the copies never take more room than the sector held
+	for (uint8_t k = 0; k < RECORD_STORE_MAX_KEYS; k++) {
+		if (latest[k] != RECORD_NONE && latest[k] >= start && latest[k] < start + SPI_FLASH_SEC_SIZE) {
+			place(k, append(k, NULL, latest[k], latestLength[k]), latestLength[k]);
+		}
+	}
+
+	eraseSector(sector);
+}
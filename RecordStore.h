@@ -0,0 +1,121 @@
+#ifndef RecordStore_h
+#define RecordStore_h
+
+#include "Arduino.h"
+
+// record keys: ESPConfig, then one per controller pin (RECORD_KEY_CONTROLLER + pin), the current preset and
+// one per preset slot (RECORD_KEY_PRESET + slot)
+static const uint8_t RECORD_KEY_CONFIG = 0;
+static const uint8_t RECORD_KEY_CONTROLLER = 1;
+static const uint8_t RECORD_KEY_PRESET_CURRENT = 18;
+static const uint8_t RECORD_KEY_PRESET = 19;
+static const uint8_t RECORD_STORE_MAX_KEYS = 24;
+
+// not a key of its own: a record holding the records of several keys, written by endBatch()
+static const uint8_t RECORD_KEY_BATCH = 0x80;
+
+// largest record payload, a controller with CONTROLLER_MAX_CAPABILITIES stored by name (ESPLayout.h)
+static const uint16_t RECORD_MAX_LENGTH = 292;
+
+// [magic (1 byte)][key (1 byte)][length (2 bytes)][sequence (4 bytes)][crc (2 bytes)][0xFFFF (2 bytes)]
+static const uint8_t RECORD_HEADER_SIZE = 12;
+static const uint8_t RECORD_MAGIC = 0xA5;
+
+// most sectors of one ring, begin() keeps the free offset of each on the stack
+static const uint8_t RECORD_STORE_MAX_SECTORS = 32;
+
+/***
+*
+*	Append-only, wear-leveled record store on a ring of raw flash sectors.
+*
+*	Every write() appends [header][payload padded to 4 bytes] to the head sector with the next sequence number;
+*	the newest record with a valid CRC wins for each key, so a write torn by a reset leaves the previous value
+*	in place. A sector is erased only when the head moves on: the sector after the new head is the oldest,
+*	its live records are copied to the head and it is erased to become the next spare. With the ESP8266
+*	EEPROM emulation every commit erases its sector, here one erase covers a sector's worth of records.
+*	The live records of one sector always fit into the erased spare, so compaction cannot run out of room; a
+*	record that does not fit after the head went once around the ring is refused (the live records of all keys
+*	fill it).
+*
+*	Between beginBatch() and endBatch() writes are staged in RAM and appended as one RECORD_KEY_BATCH record,
+*	whose payload holds each of them laid out as a record (header without sequence and CRC, payload). A reset
+*	while it is written tears the whole batch, so every key keeps its previous value or all take their new
+*	ones. A batch holds RECORD_MAX_LENGTH bytes; what does not fit is appended before the rest, as a record of
+*	its own once it does not fit any batch.
+*
+*	The sectors must be reserved for the store (e.g. from the filesystem area, which must then not be used).
+*
+***/
+class RecordStore {
+public:
+	// use sectorCount (2 to RECORD_STORE_MAX_SECTORS) flash sectors starting at firstSector, scan them and recover the newest records
+	boolean begin(uint16_t firstSector, uint8_t sectorCount);
+
+	// copy the newest record for key into buf (at most len bytes). Returns bytes copied, 0 if there is none
+	int read(uint8_t key, byte* buf, int len);
+
+	// append a record for key unless it equals the newest one, inside a batch stage it. Returns false if it could
+	// not be stored
+	boolean write(uint8_t key, const byte* buf, int len);
+
+	// stage write() until endBatch(), which appends the staged records as one. Returns false if they could not be
+	// stored
+	void beginBatch();
+	boolean endBatch();
+
+	// erase all sectors
+	void format();
+
+	// sector erases done by this store
+	unsigned long erases = 0;
+
+	// records appended (including copies made by compaction)
+	unsigned long appends = 0;
+
+	// records skipped because they equal the stored value
+	unsigned long unchanged = 0;
+
+private:
+	uint16_t first = 0;
+	uint8_t count = 0;
+
+	// head sector (0..count-1) and the next free offset in it
+	uint8_t head = 0;
+	uint16_t headOffset = 0;
+	uint32_t sequence = 0;
+
+	// flash address and length of the newest payload per key, in a record of its own or in a batch
+	uint32_t latest[RECORD_STORE_MAX_KEYS];
+	uint16_t latestLength[RECORD_STORE_MAX_KEYS];
+
+	// records staged by write() while batching
+	boolean batching = false;
+	alignas(4) byte batch[RECORD_MAX_LENGTH];
+	uint16_t batchLength = 0;
+
+	uint32_t sectorAddress(uint8_t sector);
+	boolean isErased(uint8_t sector);
+	void eraseSector(uint8_t sector);
+	boolean readHeader(uint32_t address, uint8_t* key, uint16_t* length, uint32_t* seq, uint16_t* crc);
+	boolean verify(uint32_t address, uint8_t key, uint16_t length, uint32_t seq, uint16_t crc);
+	uint16_t crcOf(uint8_t key, uint16_t length, uint32_t seq, const byte* buf);
+	uint16_t crcOfFlash(uint32_t address, uint8_t key, uint16_t length, uint32_t seq);
+	boolean equals(uint8_t key, const byte* buf, uint16_t len);
+	void take(uint8_t key, uint32_t payload, uint16_t length, uint32_t seq, uint32_t* latestSeq);
+	// offset of key's record in batch, -1 if it is not staged
+	int staged(uint8_t key);
+	boolean commitBatch();
+	// make the record appended at address the newest of key, false if the append failed
+	boolean place(uint8_t key, uint32_t address, uint16_t len);
+	// append buf, or with buf NULL copy the payload at flash address from. Returns the record's address, RECORD_NONE
+	// if it was not stored
+	uint32_t append(uint8_t key, const byte* buf, uint32_t from, uint16_t len);
+	void advance();
+	void compact(uint8_t sector);
+
+	static uint16_t recordSize(uint16_t length) {
+		return RECORD_HEADER_SIZE + ((length + 3) & ~3);
+	}
+};
+
+#endif
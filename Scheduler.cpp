@@ -0,0 +1,287 @@
+#include "Arduino.h"
+#include "ESPConfig.h"
+#include "Scheduler.h"
+#include "Persistence.h"
+
+uint8_t Scheduler::every(unsigned long period, TaskFunction function, void* context, unsigned long budget) {
+	return add(period, period, function, context, budget);
+}
+
+uint8_t Scheduler::after(unsigned long delay, TaskFunction function, void* context, unsigned long budget) {
+	return add(delay, 0, function, context, budget);
+}
+
+uint8_t Scheduler::idle(TaskFunction function, void* context, unsigned long budget) {
+
+	uint8_t id = add(0, 0, function, context, budget);
+	if (id != TASK_NONE) {
+		unlink(id);
+		tasks[id]._idle = true;
+	}
+	return id;
+}
+
+uint8_t Scheduler::add(unsigned long delay, unsigned long period, TaskFunction function, void* context, unsigned long budget) {
+
+	uint8_t id = 0;
+	while (id < SCHEDULER_MAX_TASKS && (tasks[id]._active || tasks[id]._queued)) {
+		id++;
+	}
+
+	if (id == SCHEDULER_MAX_TASKS) {
+		DEBUG_PRINTLN("Scheduler::add ***NO FREE TASK***");
+		return TASK_NONE;
+	}
+
+	_scheduler_task& t = tasks[id];
+	memset(&t, 0, sizeof(t));
+	t._function = function;
+	t._context = context;
+	t._period = period;
+	t._budget = budget;
+	t._deadline = millis() + delay;
+	t._active = true;
+
+	insert(id);
+	return id;
+}
+
+boolean Scheduler::reschedule(uint8_t id, unsigned long delay) {
+
+	if (id >= SCHEDULER_MAX_TASKS || !tasks[id]._active) {
+		return false;
+	}
+
+	unlink(id);
+	tasks[id]._deadline = millis() + delay;
+	insert(id);
+	return true;
+}
+
+boolean Scheduler::cancel(uint8_t id) {
+
+	if (id >= SCHEDULER_MAX_TASKS || !tasks[id]._active) {
+		return false;
+	}
+
+	unlink(id);
+	tasks[id]._active = false;
+
+	if (tasks[id]._function == runDeviceServer) {
+		deviceServer = NULL;
+	}
+	return true;
+}
+
+// push to the front of the slot of its deadline
+void Scheduler::insert(uint8_t id) {
+	uint8_t slot = tasks[id]._deadline % SCHEDULER_WHEEL_SLOTS;
+
+	tasks[id]._next = wheel[slot];
+	tasks[id]._queued = true;
+	wheel[slot] = id;
+}
+
+void Scheduler::unlink(uint8_t id) {
+
+	if (!tasks[id]._queued) {
+		return;
+	}
+
+	uint8_t* link = &wheel[tasks[id]._deadline % SCHEDULER_WHEEL_SLOTS];
+	while (*link != TASK_NONE && *link != id) {
+		link = &tasks[*link]._next;
+	}
+
+	if (*link == id) {
+		*link = tasks[id]._next;
+	}
+	tasks[id]._queued = false;
+}
+
+int Scheduler::loop() {
+
+	unsigned long now = millis();
+	int ran = 0;
+
+	if (!started) {
+		lastTick = now;
+		started = true;
+	}
+
+	// every slot from the last loop() on, the current one included (tasks may have been added since),
+	// each slot once at most if loop() was not called for a whole turn of the wheel
+	unsigned long ticks = now - lastTick;
+	if (ticks >= SCHEDULER_WHEEL_SLOTS) {
+		ticks = SCHEDULER_WHEEL_SLOTS - 1;
+	}
+
+	for (unsigned long tick = now - ticks; tick != now + 1; tick++) {
+
+		// detach the slot, tasks not due yet go back in, due ones run and are put in the slot of their next deadline
+		uint8_t id = wheel[tick % SCHEDULER_WHEEL_SLOTS];
+		wheel[tick % SCHEDULER_WHEEL_SLOTS] = TASK_NONE;
+
+		while (id != TASK_NONE) {
+			uint8_t next = tasks[id]._next;
+			tasks[id]._queued = false;
+
+			if ((long)(now - tasks[id]._deadline) >= 0) {
+				run(id);
+				ran++;
+			} else {
+				insert(id);
+			}
+
+			id = next;
+		}
+	}
+
+	lastTick = now;
+
+	if (ran > 0) {
+		return ran;
+	}
+
+	for (uint8_t id = 0; id < SCHEDULER_MAX_TASKS; id++) {
+		if (tasks[id]._active && tasks[id]._idle) {
+			run(id);
+			ran++;
+		}
+	}
+
+	return ran;
+}
+
+void Scheduler::run(uint8_t id) {
+	_scheduler_task& t = tasks[id];
+
+	unsigned long late = t._idle ? 0 : millis() - t._deadline;
+	if (late > t._latest) {
+		t._latest = late;
+	}
+
+	unsigned long start = micros();
+	t._function(t._context);
+	unsigned long elapsed = micros() - start;
+
+	t._runs++;
+	if (elapsed > t._longest) {
+		t._longest = elapsed;
+	}
+
+	if (t._budget > 0 && elapsed > t._budget) {
+		t._overruns++;
+		overruns++;
+		DEBUG_PRINT("Scheduler::run ***OVERRUN*** task ");DEBUG_PRINT(id);DEBUG_PRINT(", us ");DEBUG_PRINTLN(elapsed);
+		LOG_WARN(LOG_MODULE_SCHEDULER, LOG_EVENT_TASK_OVERRUN, id, min(elapsed, 32767UL));
+	}
+
+	// idle, cancelled or rescheduled by itself
+	if (!t._active || t._queued || t._idle) {
+		return;
+	}
+
+	if (t._period == 0) {
+		t._active = false;
+		return;
+	}
+
+	// next period, or the next one from now if it fell behind
+	t._deadline += t._period;
+	unsigned long now = millis();
+	if ((long)(now - t._deadline) >= 0) {
+		t._deadline = now + t._period - (now - t._deadline) % t._period;
+	}
+
+	insert(id);
+}
+
+unsigned long Scheduler::timeToNext() {
+	unsigned long now = millis();
+	unsigned long next = 0xFFFFFFFF;
+
+	for (uint8_t id = 0; id < SCHEDULER_MAX_TASKS; id++) {
+		if (!tasks[id]._queued) {
+			continue;
+		}
+		if ((long)(tasks[id]._deadline - now) <= 0) {
+			return 0;
+		}
+		next = min(next, tasks[id]._deadline - now);
+	}
+
+	return next;
+}
+
+const _scheduler_task& Scheduler::task(uint8_t id) {
+	return tasks[id < SCHEDULER_MAX_TASKS ? id : 0];
+}
+
+void Scheduler::report(Print& out) {
+	for (uint8_t id = 0; id < SCHEDULER_MAX_TASKS; id++) {
+		_scheduler_task& t = tasks[id];
+		if (!t._active) {
+			continue;
+		}
+		out.print("task ");out.print(id);
+		if (t._idle) {
+			out.print(" idle");
+		} else {
+			out.print(" period ");out.print(t._period);
+		}
+		out.print(" runs ");out.print(t._runs);
+		out.print(" overruns ");out.print(t._overruns);
+		out.print(" longest us ");out.print(t._longest);
+		out.print(" latest ms ");out.println(t._latest);
+	}
+}
+
+void Scheduler::runController(void* context) {
+	ESP8266Controller* controller = (ESP8266Controller*)context;
+
+	// fade steps first, loop() puts them out in the same run
+	controller->transitionLoop();
+	controller->loop();
+
+	// deferred save, what sketches did by hand after every loop()
+	if (controller->eepromUpdatePending && millis() - controller->lastEepromUpdate >= eeprom_update_interval) {
+		controller->saveCapabilities();
+		controller->lastEepromUpdate = millis();
+	}
+}
+
+uint8_t Scheduler::addController(ESP8266Controller* controller, unsigned long period, unsigned long budget) {
+	return every(period, runController, controller, budget);
+}
+
+void Scheduler::runDeviceServer(void* context) {
+	Scheduler* scheduler = (Scheduler*)context;
+
+	// hand back before the next task is due, but always take at least one millisecond of datagrams
+	scheduler->deviceServer->loopBudget = constrain(scheduler->timeToNext(), 1UL, DEVICE_SERVER_LOOP_BUDGET);
+
+	scheduler->deviceServer->loop();
+}
+
+uint8_t Scheduler::addDeviceServer(DeviceServer* server, unsigned long budget) {
+
+	if (deviceServer != NULL) {
+		DEBUG_PRINTLN("Scheduler::addDeviceServer ***ALREADY ADDED***");
+		return TASK_NONE;
+	}
+
+	uint8_t id = idle(runDeviceServer, this, budget);
+	if (id != TASK_NONE) {
+		deviceServer = server;
+	}
+	return id;
+}
+
+void Scheduler::runPersistence(void* context) {
+	Persistence.loop();
+}
+
+uint8_t Scheduler::addPersistence(unsigned long period) {
+	return every(period, runPersistence);
+}
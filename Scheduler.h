@@ -0,0 +1,145 @@
+#ifndef Scheduler_h
+#define Scheduler_h
+
+#include "Arduino.h"
+#include "ESP8266Controller.h"
+#include "DeviceServer.h"
+
+typedef void (*TaskFunction)(void* context);
+
+// tasks registered at a time
+static const uint8_t SCHEDULER_MAX_TASKS = 16;
+
+// timer wheel slots, one per millisecond; deadlines further out stay in their slot until the wheel comes round
+static const uint8_t SCHEDULER_WHEEL_SLOTS = 64;
+
+// returned when no task slot is free, marks the end of a slot list
+static const uint8_t TASK_NONE = 0xFF;
+
+typedef struct {
+	TaskFunction _function;
+	void* _context;
+
+	// millis() when the task is due next
+	unsigned long _deadline;
+
+	// milliseconds between runs, 0 = run once
+	unsigned long _period;
+
+	// microseconds one run may take, 0 = not checked
+	unsigned long _budget;
+
+	// runs, runs over budget, longest run in microseconds, latest start after the deadline in milliseconds
+	unsigned long _runs;
+	unsigned long _overruns;
+	unsigned long _longest;
+	unsigned long _latest;
+
+	// next task in the same wheel slot
+	uint8_t _next;
+
+	boolean _active;
+
+	// in a wheel slot list
+	boolean _queued;
+
+	// runs from every loop() in which no task was due, not on the wheel
+	boolean _idle;
+} _scheduler_task;
+
+/***
+*
+*	Cooperative scheduler for the sketch loop(): periodic and one shot tasks on a timer wheel, each with an
+*	optional time budget. Tasks run to completion; one that takes longer than its budget is counted as an
+*	overrun, logged (LOG_EVENT_TASK_OVERRUN) and shown by report().
+*
+*	Idle tasks fill the time between deadlines. addDeviceServer() adds the UDP server as one and caps
+*	DeviceServer::loopBudget at the time left before the next task is due, so a burst of datagrams does not push
+*	back PWM/blink work of the controllers. A periodic task that falls behind skips the missed periods instead of
+*	running them back to back.
+*
+*	Scheduler scheduler;
+*
+*	void setup() {
+*		...
+*		scheduler.addController(&dimmer, 1);
+*		scheduler.addDeviceServer(&server);
+*		scheduler.addPersistence();
+*	}
+*
+*	void loop() {
+*		scheduler.loop();
+*	}
+*
+***/
+class Scheduler {
+public:
+	Scheduler() {
+		memset(tasks, 0, sizeof(tasks));
+		memset(wheel, TASK_NONE, sizeof(wheel));
+	}
+
+	// run function every period milliseconds, the first time one period from now. Returns the task ID or TASK_NONE
+	uint8_t every(unsigned long period, TaskFunction function, void* context = NULL, unsigned long budget = 0);
+
+	// run function once, delay milliseconds from now
+	uint8_t after(unsigned long delay, TaskFunction function, void* context = NULL, unsigned long budget = 0);
+
+	// run function from every loop() in which no task was due
+	uint8_t idle(TaskFunction function, void* context = NULL, unsigned long budget = 0);
+
+	// move the next run of a task to delay milliseconds from now
+	boolean reschedule(uint8_t id, unsigned long delay);
+
+	// remove a task, may be called from the task itself
+	boolean cancel(uint8_t id);
+
+	// transitionLoop() and controller->loop() every period milliseconds, and saveCapabilities() once eepromUpdatePending has waited
+	// eeprom_update_interval since lastEepromUpdate
+	uint8_t addController(ESP8266Controller* controller, unsigned long period, unsigned long budget = 0);
+
+	// server->loop() as an idle task, bounded by the next deadline
+	uint8_t addDeviceServer(DeviceServer* server, unsigned long budget = DEVICE_SERVER_LOOP_BUDGET * 1000);
+
+	// scheduled EEPROM flush (Persistence.loop())
+	uint8_t addPersistence(unsigned long period = 100);
+
+	// run every task that is due, or the idle tasks if none was. Returns tasks run
+	int loop();
+
+	// milliseconds until the next task is due, 0 if one is due now
+	unsigned long timeToNext();
+
+	// one line per task: ID, period, runs, overruns, longest run, latest start
+	void report(Print& out);
+
+	const _scheduler_task& task(uint8_t id);
+
+	// runs over budget, all tasks
+	unsigned long overruns = 0;
+
+private:
+	_scheduler_task tasks[SCHEDULER_MAX_TASKS];
+
+	// first task of every slot, TASK_NONE if empty
+	uint8_t wheel[SCHEDULER_WHEEL_SLOTS];
+
+	// millis() of the last loop()
+	unsigned long lastTick = 0;
+	boolean started = false;
+
+	// set by addDeviceServer()
+	DeviceServer* deviceServer = NULL;
+
+	static void runController(void* context);
+	static void runDeviceServer(void* context);
+	static void runPersistence(void* context);
+
+	uint8_t add(unsigned long delay, unsigned long period, TaskFunction function, void* context, unsigned long budget);
+	void insert(uint8_t id);
+	void unlink(uint8_t id);
+	void run(uint8_t id);
+	void runSlot(uint8_t slot, unsigned long now);
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef StaticController_h
+#define StaticController_h
+
+#include "Arduino.h"
+#include "ESPLayout.h"
+#include "ESP8266Controller.h"
+
+/***
+*
+*	ESP8266Controller whose capability list is fixed at compile time.
+*
+*	The schema (name, min, max, default value) is a PROGMEM array of N _capability_schema, the capabilities
+*	and the name index are members of the object, so construction does not touch the heap and EEPROM/UDP
+*	sizes are constants. Everything else (setCapability, toByteArray, saveCapabilities, DeviceServer) goes
+*	through the ESP8266Controller API unchanged.
+*
+*	static const _capability_schema LED_CAPABILITIES[6] PROGMEM = {
+*		{"switch", 0, 1, 1}, {"red", 0, PWMRANGE, 512}, ...
+*	};
+*
+*	class LEDController : public StaticController<6> {
+*	public:
+*		LEDController(const char* nam, uint8_t _pin, int start_address)
+*			: StaticController<6>(nam, _pin, start_address, LED_CAPABILITIES) {}
+*		void loop() { ... }
+*	};
+*
+***/
+template<uint8_t N>
+class StaticController : public ESP8266Controller {
+
+	static_assert(N > 0 && N < CAPABILITY_ID_FLAG, "capability count must fit the no_of_capabilities byte");
+	static_assert(N <= CONTROLLER_MAX_CAPABILITIES, "capability count must fit the controller EEPROM record buffer");
+
+public:
+	// size occupied by this controller capabilities saved in EEPROM
+	static constexpr int EEPROM_SIZE = controllerEEPROMSize(N);
+
+	// size required by this controller capabilities as UDP payload
+	static constexpr int UDP_PAYLOAD_SIZE = controllerUDPPayloadSize(N);
+
+	// schema must be a PROGMEM array of exactly N capabilities
+	StaticController(const char* nam, uint8_t _pin, int start_address, const _capability_schema (&_schema)[N])
+		: ESP8266Controller(nam, _pin, N, start_address, storage, index), schema(_schema) {
+
+		for (uint8_t i = 0; i < N; i++) {
+			reset(i);
+		}
+	}
+
+	// set capability i back to its schema default
+	void reset(uint8_t i) {
+		if (i >= N) {
+			return;
+		}
+		memcpy_P(storage[i]._name, schema[i]._name, sizeof(storage[i]._name));
+		storage[i]._value_min = pgm_read_word(&schema[i]._value_min);
+		storage[i]._value_max = pgm_read_word(&schema[i]._value_max);
+		storage[i]._value = pgm_read_word(&schema[i]._value);
+	}
+
+private:
+	const _capability_schema* schema;
+
+	_unit16_capability storage[N];
+	uint8_t index[capabilityIndexSize(N)];
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef BenchUtil_h
+#define BenchUtil_h
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "Arduino.h"
+#include "DeviceServer.h"
+
+/***
+*
+*	What the host benchmarks share: the pass/fail checks they end with, and datagrams built and exchanged
+*	the way a client does it, over loopback to a DeviceServer bound to the bench's port.
+*
+***/
+
+static int failures = 0;
+
+// one line per check, a bench returns non-zero if any failed
+static inline void check(bool ok, const char* what) {
+	printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok) failures++;
+}
+
+// [size (2 bytes)][command][payload]
+static inline std::vector<byte> packet(byte command, const std::vector<byte>& payload) {
+	std::vector<byte> p;
+	uint16_t size = UDP_PACKET_HEADER_SIZE + payload.size();
+	p.push_back(lowByte(size));
+	p.push_back(highByte(size));
+	p.push_back(command);
+	p.insert(p.end(), payload.begin(), payload.end());
+	return p;
+}
+
+static inline void sendPacket(int fd, uint16_t port, const std::vector<byte>& p) {
+	struct sockaddr_in to;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_port = htons(port);
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sendto(fd, p.data(), p.size(), 0, (struct sockaddr*)&to, sizeof(to));
+}
+
+// next datagram on the socket, 0 if none
+static inline int receive(int fd, byte* reply) {
+	int n = recv(fd, reply, UDP_PACKET_MAX_SIZE, MSG_DONTWAIT);
+	return n > 0 ? n : 0;
+}
+
+#endif
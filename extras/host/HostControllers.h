@@ -0,0 +1,90 @@
+#ifndef HostControllers_h
+#define HostControllers_h
+
+#include "ESPConfig.h"
+#include "ESP8266Controller.h"
+#include "StaticController.h"
+
+/***
+*
+*	Controllers shaped like the ones in the firmware projects ("rgbc", "acds"), used by the host tools.
+*	The capability set and ranges follow those sketches; loop() only mirrors values onto the pin.
+*	RelayController keeps one controller on the run time sized constructor.
+*
+***/
+
+static const _capability_schema LED_CAPABILITIES[6] PROGMEM = {
+	{"switch", 0, 1, 1},
+	{"red", 0, PWMRANGE, 512},
+	{"green", 0, PWMRANGE, 512},
+	{"blue", 0, PWMRANGE, 512},
+	{"blink", 0, 1, 0},
+	{"blink_delay", 100, 10000, 1000}
+};
+
+static const _capability_schema AC_DIMMER_CAPABILITIES[4] PROGMEM = {
+	{"switch", 0, 1, 1},
+	{"dim", 0, 100, 50},
+	{"zero_cross", 0, 16, 12},
+	{"timer", 0, 1440, 0}
+};
+
+class LEDController : public StaticController<6> {
+public:
+	LEDController(const char* nam, uint8_t _pin, int start_address) : StaticController<6>(nam, _pin, start_address, LED_CAPABILITIES) {
+	}
+
+	void loop() {
+		pinState = capabilities[0]._value ? HIGH : LOW;
+		analogWrite(pin, pinState == HIGH ? capabilities[1]._value : 0);
+	}
+};
+
+class ACDimmerController : public StaticController<4> {
+public:
+	ACDimmerController(const char* nam, uint8_t _pin, int start_address) : StaticController<4>(nam, _pin, start_address, AC_DIMMER_CAPABILITIES) {
+	}
+
+	void loop() {
+		pinState = capabilities[0]._value ? HIGH : LOW;
+		analogWrite(pin, pinState == HIGH ? (uint32_t)capabilities[1]._value * PWMRANGE / 100 : 0);
+	}
+};
+
+// channels sized at run time through ESP8266Controller's own constructor, its capabilities taken from Arena (the
+// heap once that is full), as firmwares written before StaticController
+class RelayController : public ESP8266Controller {
+public:
+	RelayController(const char* nam, uint8_t _pin, uint8_t channels, int start_address) : ESP8266Controller(nam, _pin, channels, start_address) {
+		for (uint8_t i = 0; i < capabilityCount; i++) {
+			snprintf(capabilities[i]._name, sizeof(capabilities[i]._name), "relay%d", i);
+			capabilities[i]._value_min = 0;
+			capabilities[i]._value_max = 1;
+			capabilities[i]._value = 0;
+		}
+	}
+
+	void loop() {
+		pinState = capabilities[0]._value ? HIGH : LOW;
+		digitalWrite(pin, pinState);
+	}
+};
+
+// drives its output from setCapability(name, value), as firmwares written before capability IDs do
+class OutputLEDController : public LEDController {
+public:
+	OutputLEDController(const char* nam, uint8_t _pin, int start_address) : LEDController(nam, _pin, start_address) {
+	}
+
+	boolean setCapability(char* cname, uint16_t value) {
+		applied++;
+		appliedValue = value;
+		return LEDController::setCapability(cname, value);
+	}
+
+	// calls, and the value of the last one
+	unsigned long applied = 0;
+	uint16_t appliedValue = 0;
+};
+
+#endif
@@ -0,0 +1,669 @@
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "ESP8266WiFi.h"
+#include "WiFiUdp.h"
+#include "ESP8266httpUpdate.h"
+#include "ESP8266HTTPClient.h"
+#include "Updater.h"
+#include <netdb.h>
+#include <poll.h>
+#include <string>
+#include "spi_flash.h"
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+ESP8266WiFiClass WiFi;
+ESP8266HTTPUpdate ESPhttpUpdate;
+UpdaterClass Update;
+EspClass ESP;
+
+// milliseconds "slept" in delay(), added on top of the monotonic clock
+static unsigned long long delayedMicros = 0;
+
+static unsigned long long monotonicMicros() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static const unsigned long long bootMicros = monotonicMicros();
+
+unsigned long micros() {
+	return (unsigned long)(monotonicMicros() - bootMicros + delayedMicros);
+}
+
+unsigned long millis() {
+	return (unsigned long)((monotonicMicros() - bootMicros + delayedMicros) / 1000ULL);
+}
+
+void delay(unsigned long ms) {
+	delayedMicros += (unsigned long long)ms * 1000ULL;
+}
+
+void delayMicroseconds(unsigned int us) {
+	delayedMicros += us;
+}
+
+void yield() {
+}
+
+void pinMode(uint8_t, uint8_t) {
+}
+
+static uint8_t pinLevels[17];
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+	if (pin < sizeof(pinLevels)) pinLevels[pin] = val;
+}
+
+int digitalRead(uint8_t pin) {
+	return pin < sizeof(pinLevels) ? pinLevels[pin] : LOW;
+}
+
+void analogWrite(uint8_t, int) {
+}
+
+long random(long howbig) {
+	return howbig <= 0 ? 0 : rand() % howbig;
+}
+
+long random(long howsmall, long howbig) {
+	return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall);
+}
+
+void randomSeed(unsigned long seed) {
+	srand(seed);
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+	bytesWritten++;
+	if (echo) fputc(c, stdout);
+	return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+	bytesWritten += size;
+	if (echo) fwrite(buffer, 1, size, stdout);
+	return size;
+}
+
+// EEPROM
+
+void EEPROMClass::begin(size_t size) {
+	if (!_formatted) {
+		// erased flash reads back as 0xFF
+		memset(_flash, 0xFF, SPI_FLASH_SEC_SIZE);
+		_formatted = true;
+	}
+	if (_external) {
+		memcpy(_data, _flash, _size);
+		_dirty = false;
+		stats.sectorReads++;
+		return;
+	}
+	if (size == 0 || size > SPI_FLASH_SEC_SIZE) return;
+	size = (size + 3) & ~3;
+
+	if (_data && size != _size) {
+		delete[] _data;
+		_data = nullptr;
+	}
+	if (!_data) _data = new uint8_t[size];
+	_size = size;
+	memcpy(_data, _flash, _size);
+	_dirty = false;
+	stats.sectorReads++;
+}
+
+uint8_t EEPROMClass::read(int address) {
+	if (address < 0 || (size_t)address >= _size || !_data) return 0;
+	return _data[address];
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+	if (address < 0 || (size_t)address >= _size || !_data) return;
+	if (_data[address] != value) {
+		_data[address] = value;
+		_dirty = true;
+		stats.bytesChanged++;
+	}
+}
+
+bool EEPROMClass::commit() {
+	stats.commits++;
+	if (!_size || !_dirty) return true;
+
+	memset(_flash, 0xFF, SPI_FLASH_SEC_SIZE);
+	memcpy(_flash, _data, _size);
+	stats.sectorErases++;
+	stats.flashBytesWritten += _size;
+	_dirty = false;
+	return true;
+}
+
+void EEPROMClass::end() {
+	if (!_size) return;
+	commit();
+	if (_external) return;
+	delete[] _data;
+	_data = nullptr;
+	_size = 0;
+}
+
+uint8_t* EEPROMClass::getDataPtr() {
+	_dirty = true;
+	return _data;
+}
+
+bool EEPROMClass::loadImage(const char* path) {
+	FILE* f = fopen(path, "rb");
+	if (!f) return false;
+	memset(_flash, 0xFF, SPI_FLASH_SEC_SIZE);
+	size_t n = fread(_flash, 1, SPI_FLASH_SEC_SIZE, f);
+	fclose(f);
+	_formatted = true;
+	return n > 0;
+}
+
+bool EEPROMClass::saveImage(const char* path) {
+	FILE* f = fopen(path, "wb");
+	if (!f) return false;
+	size_t n = fwrite(_flash, 1, SPI_FLASH_SEC_SIZE, f);
+	fclose(f);
+	return n == SPI_FLASH_SEC_SIZE;
+}
+
+void EEPROMClass::hostUse(uint8_t* flash, uint8_t* data, size_t size) {
+	if (!_external) {
+		delete[] _data;
+	}
+
+	if (flash == nullptr) {
+		_flash = _ownFlash;
+		_data = nullptr;
+		_size = 0;
+		_external = false;
+		_formatted = false;
+		return;
+	}
+
+	_flash = flash;
+	_data = data;
+	_size = size;
+	_external = true;
+	_formatted = true;
+	_dirty = false;
+}
+
+void EEPROMClass::resetStats() {
+	memset(&stats, 0, sizeof(stats));
+}
+
+// WiFi
+
+String IPAddress::toString() const {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+	return String(buf);
+}
+
+size_t IPAddress::printTo(Print& p) const {
+	return p.print(toString());
+}
+
+uint8_t* ESP8266WiFiClass::macAddress(uint8_t* mac) {
+	memcpy(mac, hostMac, WL_MAC_ADDR_LENGTH);
+	return mac;
+}
+
+bool ESP8266WiFiClass::softAP(const char*, const char*) {
+	_mode = (WiFiMode_t)(_mode | WIFI_AP);
+	return true;
+}
+
+wl_status_t ESP8266WiFiClass::begin(const char*, const char*, int32_t channel, const uint8_t* bssid, bool) {
+	hostBeginCount++;
+	_begun = true;
+	_beginTime = millis();
+
+	// a given BSSID and channel are joined without a scan, or not at all
+	unsigned long saved = 0;
+	_wrongAP = false;
+	if (bssid != NULL && channel > 0) {
+		_wrongAP = memcmp(bssid, hostBSSID, sizeof(hostBSSID)) != 0 || channel != hostChannel;
+		saved += hostScanDelay;
+	}
+	if (_staticIP) {
+		saved += hostDhcpDelay;
+	}
+	_connectDelay = hostConnectDelay > saved ? hostConnectDelay - saved : 0;
+	return status();
+}
+
+// 0.0.0.0 goes back to DHCP, as on the device
+bool ESP8266WiFiClass::config(IPAddress local_ip, IPAddress gateway, IPAddress subnet, IPAddress) {
+	_staticIP = local_ip.isSet();
+	_localIP = _staticIP ? local_ip : hostLeaseIP;
+	if (_staticIP) {
+		_gatewayIP = gateway;
+		_subnetMask = subnet;
+	}
+	return true;
+}
+
+bool ESP8266WiFiClass::disconnect(bool) {
+	_begun = false;
+	return true;
+}
+
+wl_status_t ESP8266WiFiClass::status() {
+	if (!_begun) return WL_DISCONNECTED;
+	if (hostConnectFails) return WL_NO_SSID_AVAIL;
+	if (millis() - _beginTime < _connectDelay) return WL_DISCONNECTED;
+	return _wrongAP ? WL_NO_SSID_AVAIL : WL_CONNECTED;
+}
+
+// WiFiUDP
+
+uint8_t WiFiUDP::begin(uint16_t port) {
+	stop();
+	_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (_fd < 0) return 0;
+
+	int one = 1;
+	setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(_fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+	fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) | O_NONBLOCK);
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = hostBindAddress.isSet() ? (uint32_t)hostBindAddress : htonl(INADDR_ANY);
+	if (bind(_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		stop();
+		return 0;
+	}
+	return 1;
+}
+
+void WiFiUDP::stop() {
+	if (_fd >= 0) close(_fd);
+	_fd = -1;
+	_rxLen = _rxPos = 0;
+}
+
+int WiFiUDP::parsePacket() {
+	_rxLen = _rxPos = 0;
+	if (_fd < 0) return 0;
+
+	struct sockaddr_in from;
+	socklen_t fromlen = sizeof(from);
+	ssize_t n = recvfrom(_fd, _rx, sizeof(_rx), 0, (struct sockaddr*)&from, &fromlen);
+	if (n <= 0) return 0;
+
+	_rxLen = n;
+	delayMicroseconds(hostPacketCost);
+	_remoteIP = IPAddress((uint32_t)from.sin_addr.s_addr);
+	_remotePort = ntohs(from.sin_port);
+	return (int)n;
+}
+
+int WiFiUDP::available() {
+	return (int)(_rxLen - _rxPos);
+}
+
+int WiFiUDP::read() {
+	return _rxPos < _rxLen ? _rx[_rxPos++] : -1;
+}
+
+int WiFiUDP::read(unsigned char* buffer, size_t len) {
+	size_t n = _rxLen - _rxPos;
+	if (n > len) n = len;
+	memcpy(buffer, _rx + _rxPos, n);
+	_rxPos += n;
+	return (int)n;
+}
+
+int WiFiUDP::peek() {
+	return _rxPos < _rxLen ? _rx[_rxPos] : -1;
+}
+
+void WiFiUDP::flush() {
+	_rxPos = _rxLen;
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port) {
+	_txIP = ip;
+	_txPort = port;
+	_txLen = 0;
+	return 1;
+}
+
+int WiFiUDP::beginPacket(const char* host, uint16_t port) {
+	struct in_addr a;
+	if (inet_aton(host, &a) == 0) return 0;
+	return beginPacket(IPAddress((uint32_t)a.s_addr), port);
+}
+
+size_t WiFiUDP::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+size_t WiFiUDP::write(const uint8_t* buffer, size_t size) {
+	if (size > sizeof(_tx) - _txLen) size = sizeof(_tx) - _txLen;
+	memcpy(_tx + _txLen, buffer, size);
+	_txLen += size;
+	return size;
+}
+
+int WiFiUDP::endPacket() {
+	if (_fd < 0) return 0;
+
+	struct sockaddr_in to;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_port = htons(_txPort);
+	to.sin_addr.s_addr = (uint32_t)_txIP;
+	ssize_t n = sendto(_fd, _tx, _txLen, 0, (struct sockaddr*)&to, sizeof(to));
+	_txLen = 0;
+	return n >= 0 ? 1 : 0;
+}
+
+// WiFiClient
+
+int WiFiClient::connect(const char* host, uint16_t port) {
+	stop();
+
+	struct addrinfo hints;
+	struct addrinfo* res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, String((unsigned int)port).c_str(), &hints, &res) != 0 || res == NULL) return 0;
+
+	_fd = socket(AF_INET, SOCK_STREAM, 0);
+	int ok = _fd >= 0 && ::connect(_fd, res->ai_addr, res->ai_addrlen) == 0;
+	freeaddrinfo(res);
+	if (!ok) {
+		stop();
+		return 0;
+	}
+	fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) | O_NONBLOCK);
+	_eof = false;
+	return 1;
+}
+
+void WiFiClient::fill() {
+	if (_fd < 0 || _eof || _rxPos < _rxLen) return;
+	_rxLen = _rxPos = 0;
+	ssize_t n = recv(_fd, _rx, sizeof(_rx), 0);
+	if (n > 0) _rxLen = n;
+	else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) _eof = true;
+}
+
+uint8_t WiFiClient::connected() {
+	fill();
+	return _fd >= 0 && (!_eof || _rxPos < _rxLen);
+}
+
+void WiFiClient::stop() {
+	if (_fd >= 0) close(_fd);
+	_fd = -1;
+	_rxLen = _rxPos = 0;
+}
+
+int WiFiClient::available() {
+	fill();
+	return (int)(_rxLen - _rxPos);
+}
+
+int WiFiClient::read() {
+	fill();
+	return _rxPos < _rxLen ? _rx[_rxPos++] : -1;
+}
+
+int WiFiClient::read(uint8_t* buffer, size_t len) {
+	fill();
+	size_t n = _rxLen - _rxPos;
+	if (n > len) n = len;
+	memcpy(buffer, _rx + _rxPos, n);
+	_rxPos += n;
+	return (int)n;
+}
+
+int WiFiClient::peek() {
+	fill();
+	return _rxPos < _rxLen ? _rx[_rxPos] : -1;
+}
+
+size_t WiFiClient::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+size_t WiFiClient::write(const uint8_t* buffer, size_t size) {
+	size_t sent = 0;
+	while (_fd >= 0 && sent < size) {
+		ssize_t n = send(_fd, buffer + sent, size - sent, MSG_NOSIGNAL);
+		if (n > 0) {
+			sent += n;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd p = { _fd, POLLOUT, 0 };
+			poll(&p, 1, 100);
+		} else {
+			break;
+		}
+	}
+	return sent;
+}
+
+// HTTPClient
+
+bool HTTPClient::begin(WiFiClient& client, const String& url) {
+	std::string u = url.c_str();
+	if (u.compare(0, 7, "http://") != 0) return false;
+	u = u.substr(7);
+
+	size_t slash = u.find('/');
+	std::string hostport = u.substr(0, slash);
+	_path = slash == std::string::npos ? "/" : u.substr(slash).c_str();
+
+	size_t colon = hostport.find(':');
+	_host = hostport.substr(0, colon).c_str();
+	_port = colon == std::string::npos ? 80 : atoi(hostport.substr(colon + 1).c_str());
+
+	_client = &client;
+	_headers = "";
+	_size = -1;
+	_values.assign(_collect.size(), std::string());
+	return true;
+}
+
+void HTTPClient::collectHeaders(const char* headerKeys[], const size_t headerKeysCount) {
+	_collect.assign(headerKeys, headerKeys + headerKeysCount);
+	_values.assign(headerKeysCount, std::string());
+}
+
+String HTTPClient::header(const char* name) {
+	for (size_t i = 0; i < _collect.size(); i++) {
+		if (strcasecmp(_collect[i].c_str(), name) == 0) return String(_values[i]);
+	}
+	return String();
+}
+
+void HTTPClient::addHeader(const String& name, const String& value) {
+	_headers += name;
+	_headers += ": ";
+	_headers += value;
+	_headers += "\r\n";
+}
+
+int HTTPClient::GET() {
+	if (_client == NULL) return HTTPC_ERROR_NOT_CONNECTED;
+	if (!_client->connect(_host.c_str(), _port)) return HTTPC_ERROR_CONNECTION_FAILED;
+
+	std::string request = std::string("GET ") + _path.c_str() + " HTTP/1.0\r\nHost: " + _host.c_str() + "\r\n" + _headers.c_str() + "\r\n";
+	if (_client->write((const uint8_t*)request.data(), request.size()) != request.size()) return HTTPC_ERROR_SEND_HEADER_FAILED;
+
+	// status line and headers, the device core also reads them before GET() returns
+	std::string head;
+	unsigned long long start = monotonicMicros();
+	while (head.size() < 4 || head.compare(head.size() - 4, 4, "\r\n\r\n") != 0) {
+		int c = _client->read();
+		if (c >= 0) {
+			head += (char)c;
+		} else if (!_client->connected() || monotonicMicros() - start > _timeout * 1000ULL) {
+			return HTTPC_ERROR_READ_TIMEOUT;
+		}
+	}
+
+	size_t length = head.find("Content-Length:");
+	if (length == std::string::npos) length = head.find("content-length:");
+	_size = length == std::string::npos ? -1 : atoi(head.c_str() + length + 15);
+
+	// "Name: value" lines, the names compared without case as on the device
+	for (size_t line = head.find("\r\n"); line != std::string::npos && line + 2 < head.size(); line = head.find("\r\n", line + 2)) {
+		size_t colon = head.find(':', line + 2);
+		size_t eol = head.find("\r\n", line + 2);
+		if (colon == std::string::npos || colon > eol) continue;
+		std::string name = head.substr(line + 2, colon - line - 2);
+		size_t value = head.find_first_not_of(' ', colon + 1);
+		for (size_t i = 0; i < _collect.size(); i++) {
+			if (strcasecmp(_collect[i].c_str(), name.c_str()) == 0) _values[i] = head.substr(value, eol - value);
+		}
+	}
+
+	size_t space = head.find(' ');
+	return space == std::string::npos ? HTTPC_ERROR_READ_TIMEOUT : atoi(head.c_str() + space + 1);
+}
+
+void HTTPClient::end() {
+	if (_client != NULL) _client->stop();
+	_client = NULL;
+}
+
+String HTTPClient::errorToString(int error) {
+	switch (error) {
+	case HTTPC_ERROR_CONNECTION_FAILED: return "connection failed";
+	case HTTPC_ERROR_SEND_HEADER_FAILED: return "send header failed";
+	case HTTPC_ERROR_NOT_CONNECTED: return "not connected";
+	case HTTPC_ERROR_READ_TIMEOUT: return "read Timeout";
+	default: return String();
+	}
+}
+
+// MD5 (RFC 1321) for Updater::setMD5
+
+static const uint32_t md5K[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+static const uint8_t md5R[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+std::string hostMD5(const uint8_t* data, size_t len) {
+	std::vector<uint8_t> msg(data, data + len);
+	msg.push_back(0x80);
+	while (msg.size() % 64 != 56) msg.push_back(0);
+	for (int i = 0; i < 8; i++) msg.push_back((uint8_t)(((uint64_t)len * 8) >> (8 * i)));
+
+	uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	for (size_t block = 0; block < msg.size(); block += 64) {
+		uint32_t w[16];
+		for (int i = 0; i < 16; i++) memcpy(&w[i], &msg[block + i * 4], 4);
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+		for (int i = 0; i < 64; i++) {
+			uint32_t f;
+			int g;
+			if (i < 16) { f = (b & c) | (~b & d); g = i; }
+			else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) % 16; }
+			else if (i < 48) { f = b ^ c ^ d; g = (3 * i + 5) % 16; }
+			else { f = c ^ (b | ~d); g = (7 * i) % 16; }
+			uint32_t t = d;
+			d = c;
+			c = b;
+			uint32_t x = a + f + md5K[i] + w[g];
+			int r = md5R[(i / 16) * 4 + i % 4];
+			b = b + ((x << r) | (x >> (32 - r)));
+			a = t;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	}
+
+	char hex[33];
+	for (int i = 0; i < 16; i++) snprintf(hex + i * 2, 3, "%02x", (h[i / 4] >> (8 * (i % 4))) & 0xFF);
+	return hex;
+}
+
+// raw flash
+
+static uint8_t hostFlash[HOST_FLASH_SECTORS * SPI_FLASH_SEC_SIZE];
+static bool hostFlashFormatted = false;
+unsigned long hostFlashErases[HOST_FLASH_SECTORS];
+uint32_t hostFlashTearAfter = 0;
+
+static void hostFlashFormat() {
+	if (!hostFlashFormatted) {
+		memset(hostFlash, 0xFF, sizeof(hostFlash));
+		hostFlashFormatted = true;
+	}
+}
+
+void hostFlashReset() {
+	hostFlashFormatted = false;
+	hostFlashFormat();
+	memset(hostFlashErases, 0, sizeof(hostFlashErases));
+	hostFlashTearAfter = 0;
+}
+
+unsigned long hostFlashTotalErases() {
+	unsigned long total = 0;
+	for (int i = 0; i < HOST_FLASH_SECTORS; i++) total += hostFlashErases[i];
+	return total;
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16_t sec) {
+	hostFlashFormat();
+	if (sec >= HOST_FLASH_SECTORS) return SPI_FLASH_RESULT_ERR;
+	memset(hostFlash + sec * SPI_FLASH_SEC_SIZE, 0xFF, SPI_FLASH_SEC_SIZE);
+	hostFlashErases[sec]++;
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32_t des_addr, uint32_t* src_addr, uint32_t size) {
+	hostFlashFormat();
+	if ((des_addr & 3) || (size & 3) || des_addr + size > sizeof(hostFlash)) return SPI_FLASH_RESULT_ERR;
+
+	uint32_t n = size;
+	if (hostFlashTearAfter) {
+		n = hostFlashTearAfter < size ? hostFlashTearAfter : size;
+		hostFlashTearAfter = 0;
+	}
+
+	const uint8_t* src = (const uint8_t*)src_addr;
+	for (uint32_t i = 0; i < n; i++) {
+		// NOR programming only clears bits
+		hostFlash[des_addr + i] &= src[i];
+	}
+	return n == size ? SPI_FLASH_RESULT_OK : SPI_FLASH_RESULT_ERR;
+}
+
+SpiFlashOpResult spi_flash_read(uint32_t src_addr, uint32_t* des_addr, uint32_t size) {
+	hostFlashFormat();
+	if ((src_addr & 3) || (size & 3) || src_addr + size > sizeof(hostFlash)) return SPI_FLASH_RESULT_ERR;
+	memcpy(des_addr, hostFlash + src_addr, size);
+	return SPI_FLASH_RESULT_OK;
+}
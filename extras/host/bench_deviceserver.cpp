@@ -0,0 +1,367 @@
+/***
+*
+*	Host benchmark for DeviceServer on loopback UDP.
+*	A client socket sends DEVICE_COMMAND_* datagrams to the server; reported are the per-command round trip
+*	latency and the throughput of bursts drained by DeviceServer::loop(), against a sketch style loop
+*	that reads one datagram per tick and offers it to every controller in turn.
+*	Host socket calls dominate the timings here; "serial B/pkt" is the debug output per datagram, which on
+*	the device is written to the UART at 115200 baud (about 87 us per byte once its FIFO is full).
+*
+*	The boot section measures, on the host clock, power-on to controllers restored and to the first served
+*	datagram, sent as soon as the simulated station is connected (WiFi.hostConnectDelay).
+*
+*	The retry section sends SET_CONFIGURATION_LOCATION over a link losing a third of the replies, the client
+*	repeating a request until its reply arrives, with and without a request ID (REQUEST_ID_FLAG).
+*
+*	The scene section changes red/green/blue of SCENE controllers, with a SETALL_CONTROLLER_V2 per controller
+*	and their deferred saves against one DEVICE_COMMAND_SET_TRANSACTION, counting EEPROM commits.
+*
+*	usage: bench_deviceserver [iterations]
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "DeviceServer.h"
+#include "Persistence.h"
+#include "HostControllers.h"
+#include "BenchUtil.h"
+
+static const uint16_t BENCH_PORT = 23900;
+static const int CONTROLLERS = 8;
+static const int BURST = 32;
+
+static int clientSocket() {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct timeval tv = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+static bool receiveReply(int fd) {
+	byte reply[UDP_PACKET_MAX_SIZE];
+	return recv(fd, reply, sizeof(reply), 0) > 0;
+}
+
+// what every sketch did before DeviceServer: one datagram per loop() tick, every controller checks the pin
+static void sketchLoop(WiFiUDP& udp, ESPConfig& config, LEDController** leds, byte* packetBuffer, byte* replyBuffer) {
+	int packetSize = udp.parsePacket();
+	if (!packetSize) return;
+
+	int len = udp.read(packetBuffer, UDP_PACKET_MAX_SIZE);
+	byte command = packetBuffer[2];
+	byte* payload = packetBuffer + UDP_PACKET_HEADER_SIZE;
+	int reply_length = 0;
+
+	if (command == DEVICE_COMMAND_DISCOVER) {
+		reply_length = config.toByteArray(replyBuffer + UDP_PACKET_HEADER_SIZE);
+	} else {
+		for (int i = 0; i < CONTROLLERS; i++) {
+			if (command == DEVICE_COMMAND_SET_CONTROLLER || command == DEVICE_COMMAND_SETALL_CONTROLLER) {
+				if (!leds[i]->fromByteArray(payload, len - UDP_PACKET_HEADER_SIZE)) continue;
+			} else if (payload[0] != leds[i]->pin) {
+				continue;
+			}
+			reply_length = leds[i]->toByteArray(replyBuffer + UDP_PACKET_HEADER_SIZE);
+		}
+	}
+
+	reply_length += UDP_PACKET_HEADER_SIZE;
+	replyBuffer[0] = lowByte(reply_length);
+	replyBuffer[1] = highByte(reply_length);
+	replyBuffer[2] = command;
+	udp.beginPacket(udp.remoteIP(), udp.remotePort());
+	udp.write(replyBuffer, reply_length);
+	udp.endPacket();
+}
+
+// power-on until the controllers are restored and until the first DISCOVER is answered
+static void boot(boolean nonBlocking, int fd) {
+	unsigned long powerOn = millis();
+	WiFi.disconnect();
+
+	ESPConfig config("Controller", "Unknown", "rgbc.200217.bin", "onion", "242374666");
+	config.init(-1, nonBlocking);
+
+	LEDController led("LED", 4, 200);
+	led.loadCapabilities();
+	unsigned long restored = millis() - powerOn;
+
+	DeviceServer server(&config);
+	server.addController(&led);
+	server.begin(BENCH_PORT);
+
+	boolean sent = false;
+	unsigned long served = 0;
+	while (served == 0 && millis() - powerOn < 2 * max_retry_wifi_ap_connect_time) {
+		if (!sent && WiFi.status() == WL_CONNECTED) {
+			sendPacket(fd, BENCH_PORT, packet(DEVICE_COMMAND_DISCOVER, {}));
+			sent = true;
+		}
+		if (server.loop() > 0) {
+			receiveReply(fd);
+			served = millis() - powerOn;
+		}
+		led.loop();
+		delay(1);
+	}
+	server.udp.stop();
+
+	printf("%-14s %22lu %24lu\n", nonBlocking ? "non-blocking" : "blocking", restored, served);
+}
+
+// requests until every one of them got its reply, LOSS_PERCENT of the replies are dropped by the client
+static void retries(DeviceServer& server, int fd, boolean tagged) {
+	static const int REQUESTS = 200;
+	static const int LOSS_PERCENT = 33;
+
+	unsigned long sent = 0;
+	unsigned long answeredBefore = server.retriesAnswered;
+	unsigned long commitsBefore = Persistence.commits;
+	unsigned long skippedBefore = Persistence.commitsSkipped;
+	unsigned long start = micros();
+	randomSeed(3);
+
+	for (int r = 0; r < REQUESTS; r++) {
+		std::vector<byte> location(MAX_LENGTH_SSID, 0);
+		snprintf((char*)location.data(), location.size(), "room %d", r);
+		if (tagged) {
+			location.insert(location.begin(), { lowByte(r), highByte(r) });
+		}
+		std::vector<byte> p = packet(DEVICE_COMMAND_SET_CONFIGURATION_LOCATION | (tagged ? REQUEST_ID_FLAG : 0), location);
+
+		boolean answered = false;
+		while (!answered) {
+			sendPacket(fd, BENCH_PORT, p);
+			sent++;
+			server.loop();
+			answered = receiveReply(fd) && random(100) >= LOSS_PERCENT;
+		}
+	}
+
+	printf("%-18s %10d %10lu %14lu %10lu %16lu %12.1f\n", tagged ? "request ID" : "none", REQUESTS, sent, sent - (server.retriesAnswered - answeredBefore),
+			Persistence.commits - commitsBefore, Persistence.commitsSkipped - skippedBefore, (micros() - start) / 1000.0);
+}
+
+static const int SCENE = 4;
+
+// [pin][3 capabilities] red, green, blue = value
+static std::vector<byte> sceneUpdate(byte pin, uint16_t value) {
+	std::vector<byte> update = { pin, 3 };
+	for (byte id = 1; id <= 3; id++) {
+		byte v[3];
+		int n = writeVarint(v, value);
+		update.push_back(id);
+		update.insert(update.end(), v, v + n);
+	}
+	return update;
+}
+
+static void scene(DeviceServer& server, LEDController** leds, int fd, boolean transaction, uint16_t value) {
+	unsigned long commitsBefore = Persistence.commits;
+	int datagrams = 0, bytes = 0, ticks = 0;
+
+	if (transaction) {
+		std::vector<byte> payload = { SCENE };
+		for (int i = 0; i < SCENE; i++) {
+			std::vector<byte> update = sceneUpdate(leds[i]->pin, value);
+			payload.insert(payload.end(), update.begin(), update.end());
+		}
+		std::vector<byte> p = packet(DEVICE_COMMAND_SET_TRANSACTION, payload);
+		sendPacket(fd, BENCH_PORT, p);
+		datagrams++;
+		bytes += p.size();
+		server.loop();
+		ticks++;
+		receiveReply(fd);
+	} else {
+		// one datagram per controller and loop() tick, each controller saved once its eeprom_update_interval passed
+		for (int i = 0; i < SCENE; i++) {
+			std::vector<byte> p = packet(DEVICE_COMMAND_SETALL_CONTROLLER_V2, sceneUpdate(leds[i]->pin, value));
+			sendPacket(fd, BENCH_PORT, p);
+			datagrams++;
+			bytes += p.size();
+			server.loop();
+			leds[i]->loop();
+			ticks++;
+			receiveReply(fd);
+		}
+		delay(eeprom_update_interval);
+		for (int i = 0; i < SCENE; i++) {
+			if (leds[i]->eepromUpdatePending) {
+				leds[i]->saveCapabilities();
+			}
+		}
+	}
+
+	printf("%-18s %10d %10d %10d %10lu\n", transaction ? "SET_TRANSACTION" : "SETALL_V2 each", datagrams, bytes, ticks, Persistence.commits - commitsBefore);
+}
+
+int main(int argc, char** argv) {
+	long iterations = argc > 1 ? atol(argv[1]) : 5000;
+
+	ESPConfig config("Controller", "Unknown", "rgbc.200217.bin", "onion", "242374666");
+	config.init(-1);
+
+	DeviceServer server(&config);
+	LEDController* leds[CONTROLLERS];
+	for (int i = 0; i < CONTROLLERS; i++) {
+		leds[i] = new LEDController("LED", i + 4, 200 + i * 120);
+		server.addController(leds[i]);
+	}
+
+	byte lastPin = leds[CONTROLLERS - 1]->pin;
+	std::vector<byte> setPayload = { lastPin, (byte)(1 | CAPABILITY_ID_FLAG), 1, 0, 1 };
+
+	struct {
+		const char* name;
+		std::vector<byte> packet;
+	} commands[] = {
+		{ "DISCOVER", packet(DEVICE_COMMAND_DISCOVER, {}) },
+		{ "GETALL_CONTROLLER", packet(DEVICE_COMMAND_GETALL_CONTROLLER, { lastPin }) },
+		{ "SET_CONTROLLER", packet(DEVICE_COMMAND_SET_CONTROLLER, setPayload) },
+	};
+
+	int fd = clientSocket();
+
+	printf("%-14s %22s %24s\n", "init", "controllers restored ms", "first packet served ms");
+	boot(false, fd);
+	boot(true, fd);
+	printf("\n");
+
+	printf("%d controllers, %ld iterations, burst of %d\n\n", CONTROLLERS, iterations, BURST);
+	printf("%-20s %-14s %14s %16s %14s\n", "command", "dispatcher", "latency us", "packets/sec", "serial B/pkt");
+
+	for (int mode = 0; mode < 2; mode++) {
+		const char* dispatcher = mode == 0 ? "sketch loop" : "DeviceServer";
+		WiFiUDP sketchUdp;
+		byte packetBuffer[UDP_PACKET_MAX_SIZE];
+		byte replyBuffer[UDP_PACKET_MAX_SIZE];
+
+		if (mode == 0) {
+			sketchUdp.begin(BENCH_PORT);
+		} else {
+			server.begin(BENCH_PORT);
+		}
+
+		for (auto& c : commands) {
+
+			// round trip latency, one datagram at a time
+			unsigned long serialBefore = Serial.bytesWritten;
+			auto start = std::chrono::steady_clock::now();
+			for (long i = 0; i < iterations; i++) {
+				sendPacket(fd, BENCH_PORT, c.packet);
+				if (mode == 0) {
+					sketchLoop(sketchUdp, config, leds, packetBuffer, replyBuffer);
+				} else {
+					server.loop();
+				}
+				receiveReply(fd);
+			}
+			double latency = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+			double serialBytes = (double)(Serial.bytesWritten - serialBefore) / iterations;
+
+			// throughput, bursts drained by one loop() tick (the sketch loop needs one tick per datagram)
+			long packets = 0;
+			start = std::chrono::steady_clock::now();
+			for (long i = 0; i < iterations / BURST; i++) {
+				for (int b = 0; b < BURST; b++) {
+					sendPacket(fd, BENCH_PORT, c.packet);
+				}
+				if (mode == 0) {
+					for (int b = 0; b < BURST; b++) {
+						sketchLoop(sketchUdp, config, leds, packetBuffer, replyBuffer);
+					}
+				} else {
+					while (server.loop() > 0) {
+					}
+				}
+				for (int b = 0; b < BURST; b++) {
+					packets += receiveReply(fd) ? 1 : 0;
+				}
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			printf("%-20s %-14s %14.2f %16.0f %14.1f\n", c.name, dispatcher, latency, packets / seconds, serialBytes);
+		}
+
+		if (mode == 0) {
+			sketchUdp.stop();
+		} else {
+			server.udp.stop();
+		}
+	}
+
+	printf("\nDeviceServer reply cache: %lu hits, %lu misses\n", server.cacheHits, server.cacheMisses);
+
+	printf("\n%-18s %10s %10s %14s %10s %16s %12s\n", "retries", "requests", "sent", "handler runs", "commits", "commits skipped", "ms");
+	server.begin(BENCH_PORT);
+	retries(server, fd, false);
+	retries(server, fd, true);
+
+	printf("\n%-18s %10s %10s %10s %10s\n", "scene", "datagrams", "bytes", "ticks", "commits");
+	scene(server, leds, fd, false, 100);
+	scene(server, leds, fd, true, 200);
+
+	// out of range on the last controller: nothing is applied
+	std::vector<byte> payload = { SCENE };
+	for (int i = 0; i < SCENE; i++) {
+		std::vector<byte> update = sceneUpdate(leds[i]->pin, i == SCENE - 1 ? PWMRANGE + 1 : 300);
+		payload.insert(payload.end(), update.begin(), update.end());
+	}
+	unsigned long commitsBefore = Persistence.commits;
+	sendPacket(fd, BENCH_PORT, packet(DEVICE_COMMAND_SET_TRANSACTION, payload));
+	server.loop();
+	byte reply[UDP_PACKET_MAX_SIZE];
+	recv(fd, reply, sizeof(reply), 0);
+	printf("rejected transaction: result %d at controller %d, red of the first is %d, %lu commits\n", reply[UDP_PACKET_HEADER_SIZE],
+			reply[UDP_PACKET_HEADER_SIZE + 1], leds[0]->capabilities[1]._value, Persistence.commits - commitsBefore);
+
+	// no controller count, and a byte after the last controller
+	sendPacket(fd, BENCH_PORT, packet(DEVICE_COMMAND_SET_TRANSACTION, {}));
+	server.loop();
+	recv(fd, reply, sizeof(reply), 0);
+	byte emptyResult = reply[UDP_PACKET_HEADER_SIZE];
+	sendPacket(fd, BENCH_PORT, packet(DEVICE_COMMAND_SET_TRANSACTION, { 1, leds[0]->pin, 1, 1, 50, 0 }));
+	server.loop();
+	recv(fd, reply, sizeof(reply), 0);
+	boolean malformed = emptyResult == TRANSACTION_MALFORMED && reply[UDP_PACKET_HEADER_SIZE] == TRANSACTION_MALFORMED && leds[0]->capabilities[1]._value == 200;
+	check(malformed, "empty and trailing transactions are malformed");
+
+	// a cache miss is streamed with writeTo(), a tagged one as well: the same bytes as dispatch() builds
+	leds[0]->setCapabilityById(1, 123);
+	sendPacket(fd, BENCH_PORT, packet(DEVICE_COMMAND_GETALL_CONTROLLER | REQUEST_ID_FLAG, { 7, 0, leds[0]->pin }));
+	server.loop();
+	int n = recv(fd, reply, sizeof(reply), 0);
+	std::vector<byte> get = packet(DEVICE_COMMAND_GETALL_CONTROLLER, { leds[0]->pin });
+	byte built[UDP_PACKET_MAX_SIZE];
+	uint16_t builtLength = server.dispatch(get.data(), get.size(), built);
+	boolean same = n == builtLength + REQUEST_ID_SIZE && reply[3] == 7
+			&& memcmp(reply + UDP_PACKET_HEADER_SIZE + REQUEST_ID_SIZE, built + UDP_PACKET_HEADER_SIZE, builtLength - UDP_PACKET_HEADER_SIZE) == 0;
+	check(same, "streamed GETALL reply matches dispatch()");
+
+	// SET by ID, v2 SET and SET_TRANSACTION reach an override of setCapability(name, value)
+	OutputLEDController output("Output", 14, 0);
+	server.addController(&output);
+	std::vector<byte> sets[] = {
+		packet(DEVICE_COMMAND_SETALL_CONTROLLER, { output.pin, 1 | CAPABILITY_ID_FLAG, 1, 10, 0 }),
+		packet(DEVICE_COMMAND_SETALL_CONTROLLER_V2, { output.pin, 1, 1, 20 }),
+		packet(DEVICE_COMMAND_SET_TRANSACTION, { 1, output.pin, 1, 1, 30 }),
+	};
+	for (std::vector<byte>& p : sets) {
+		server.dispatch(p.data(), p.size(), built);
+	}
+	check(output.applied == 3 && output.capabilities[1]._value == 30, "an override of setCapability(name) sees SETs by ID");
+	server.udp.stop();
+
+	close(fd);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,244 @@
+/***
+*
+*	Discovery of a site of DEVICES devices on 127.2.0.x, all answering one broadcast. Loopback does not lose
+*	datagrams, so the radio is modelled on the client side: a reply is on air for AIRTIME_BASE + AIRTIME_PER_BYTE
+*	per byte microseconds from the moment its device sent it, plus a per device offset of up to STACK_SPREAD
+*	microseconds (WiFi stack, clocks not in step), and replies overlapping on air are both lost.
+*	The client broadcasts rounds until it has heard every device or gives up after MAX_ROUNDS:
+*
+*	plain        v1 DISCOVER without payload, repeated
+*	jitter       DISCOVER with a jitter window
+*	suppressed   jitter window and the MAC suffixes heard so far
+*	short        as suppressed, asking for the short reply
+*
+*	usage: bench_discovery [jitter window ms]
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include "Arduino.h"
+#include "ESPConfig.h"
+#include "DeviceServer.h"
+#include "BenchUtil.h"
+
+static const int DEVICES = 96;
+static const uint16_t UDP_PORT = 23903;
+static const int MAX_ROUNDS = 12;
+static const unsigned long AIRTIME_BASE = 200;
+static const unsigned long AIRTIME_PER_BYTE = 8;
+static const unsigned long STACK_SPREAD = 3000;
+
+struct Device {
+	ESPConfig* config;
+	DeviceServer* server;
+};
+
+struct Reply {
+	unsigned long start;
+	unsigned long end;
+	uint32_t suffix;
+};
+
+struct Result {
+	int rounds;
+	int heard;
+	unsigned long replies;
+	unsigned long bytes;
+	unsigned long milliseconds;
+};
+
+static std::vector<Device> devices;
+
+static uint32_t suffixOf(const byte* mac) {
+	return mac[3] << 16 | mac[4] << 8 | mac[5];
+}
+
+// one discovery, round by round
+static Result discover(int fd, uint16_t window, byte flags, boolean suppress) {
+	std::set<uint32_t> heard;
+	Result result = { 0, 0, 0, 0, 0 };
+	unsigned long begin = millis();
+
+	while (result.rounds < MAX_ROUNDS && (int)heard.size() < DEVICES) {
+		result.rounds++;
+
+		byte packet[UDP_PACKET_MAX_SIZE];
+		uint16_t length = UDP_PACKET_HEADER_SIZE;
+		if (window > 0 || flags != 0) {
+			packet[length++] = window & 0xFF;
+			packet[length++] = window >> 8;
+			packet[length++] = flags;
+			packet[length++] = 0;
+			if (suppress) {
+				for (uint32_t suffix : heard) {
+					if (length + DISCOVER_MAC_SUFFIX_SIZE > UDP_PACKET_MAX_SIZE || packet[3 + UDP_PACKET_HEADER_SIZE] == 0xFF) {
+						break;
+					}
+					packet[length++] = suffix >> 16;
+					packet[length++] = suffix >> 8;
+					packet[length++] = suffix;
+					packet[3 + UDP_PACKET_HEADER_SIZE]++;
+				}
+			}
+		}
+		packet[0] = length & 0xFF;
+		packet[1] = length >> 8;
+		packet[2] = DEVICE_COMMAND_DISCOVER;
+
+		// "broadcast"
+		for (int i = 0; i < DEVICES; i++) {
+			struct sockaddr_in to;
+			memset(&to, 0, sizeof(to));
+			to.sin_family = AF_INET;
+			to.sin_port = htons(UDP_PORT);
+			to.sin_addr.s_addr = htonl(0x7F020001 + i);
+			sendto(fd, packet, length, 0, (struct sockaddr*)&to, sizeof(to));
+		}
+
+		// replies stamped with the time their device sent them, offset by its stack delay
+		std::vector<Reply> air;
+		unsigned long start = millis();
+		while (millis() - start < (unsigned long)window + 20) {
+			for (int i = 0; i < DEVICES; i++) {
+				devices[i].server->loop();
+
+				byte reply[UDP_PACKET_MAX_SIZE];
+				int n;
+				while ((n = recv(fd, reply, sizeof(reply), MSG_DONTWAIT)) > 0) {
+					const byte* mac = reply + UDP_PACKET_HEADER_SIZE + (n == UDP_PACKET_HEADER_SIZE + DISCOVER_SHORT_SIZE ? 0 : CONFIG_UDP_MAC);
+					unsigned long at = micros() + random(STACK_SPREAD);
+					air.push_back({ at, at + AIRTIME_BASE + AIRTIME_PER_BYTE * n, suffixOf(mac) });
+					result.replies++;
+					result.bytes += n;
+				}
+			}
+		}
+
+		// a reply gets through if nothing else was on air at the same time
+		std::sort(air.begin(), air.end(), [](const Reply& a, const Reply& b) { return a.start < b.start; });
+		for (size_t i = 0; i < air.size(); i++) {
+			boolean clear = true;
+			for (size_t j = i; j-- > 0 && clear;) {
+				clear = air[j].end <= air[i].start;
+			}
+			for (size_t j = i + 1; j < air.size() && air[j].start < air[i].end; j++) {
+				clear = false;
+			}
+			if (clear) {
+				heard.insert(air[i].suffix);
+			}
+		}
+	}
+
+	result.heard = heard.size();
+	result.milliseconds = millis() - begin;
+	return result;
+}
+
+static void print(const char* name, const Result& r) {
+	printf("%-12s %8d %8d/%d %10lu %10lu %10lu\n", name, r.rounds, r.heard, DEVICES, r.replies, r.bytes, r.milliseconds);
+}
+
+int main(int argc, char** argv) {
+	uint16_t window = argc > 1 ? atoi(argv[1]) : 500;
+
+	for (int i = 0; i < DEVICES; i++) {
+		WiFi.hostMac[3] = 0x10;
+		WiFi.hostMac[4] = i >> 8;
+		WiFi.hostMac[5] = i;
+		Device device;
+		device.config = new ESPConfig("Controller", "Unknown", "rgbc.200217.bin", "onion", "242374666");
+		device.config->init(-1);
+		device.server = new DeviceServer(device.config);
+		device.server->udp.hostBindAddress = IPAddress(127, 2, 0, 1 + i);
+		if (!device.server->begin(UDP_PORT)) {
+			fprintf(stderr, "cannot bind 127.2.0.%d:%d\n", 1 + i, UDP_PORT);
+			return 1;
+		}
+		devices.push_back(device);
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	randomSeed(1);
+
+	Result plain = discover(fd, 0, 0, false);
+	Result jitter = discover(fd, window, 0, false);
+	Result suppressed = discover(fd, window, 0, true);
+	Result shortReply = discover(fd, window, DISCOVER_FLAG_SHORT, true);
+
+	printf("\n%d devices, jitter window %u ms, airtime %lu us + %lu us/byte\n\n", DEVICES, window, AIRTIME_BASE, AIRTIME_PER_BYTE);
+	printf("%-12s %8s %11s %10s %10s %10s\n", "discovery", "rounds", "heard", "replies", "bytes", "ms");
+	print("plain", plain);
+	print("jitter", jitter);
+	print("suppressed", suppressed);
+	print("short", shortReply);
+	printf("\n");
+
+	unsigned long delayed = 0, suppressedCount = 0;
+	for (Device& device : devices) {
+		delayed += device.server->discoverDelayed;
+		suppressedCount += device.server->discoverSuppressed;
+	}
+
+	check(suppressed.heard == DEVICES, "jitter and suppression find every device");
+	check(suppressed.replies < jitter.replies, "suppression cuts the replies sent");
+	check(shortReply.bytes < suppressed.bytes, "short replies cut the bytes on air");
+	check(shortReply.rounds <= 3, "short suppressed discovery needs at most 3 rounds");
+	check(plain.heard < DEVICES || plain.rounds > suppressed.rounds, "plain rebroadcast does worse");
+	check(delayed > 0 && suppressedCount > 0, "servers count delayed and suppressed requests");
+
+	// a tagged DISCOVER and its retry within the jitter window: one reply, after the jitter
+	Device& device = devices[0];
+	byte tagged[] = { UDP_PACKET_HEADER_SIZE + REQUEST_ID_SIZE + 4, 0, DEVICE_COMMAND_DISCOVER | REQUEST_ID_FLAG, 0x34, 0x12,
+			lowByte(window), highByte(window), DISCOVER_FLAG_SHORT, 0 };
+	struct sockaddr_in to;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_port = htons(UDP_PORT);
+	to.sin_addr.s_addr = htonl(0x7F020001);
+	unsigned long retriesBefore = device.server->retriesAnswered;
+	int replies = 0;
+	sendto(fd, tagged, sizeof(tagged), 0, (struct sockaddr*)&to, sizeof(to));
+	device.server->loop();
+	sendto(fd, tagged, sizeof(tagged), 0, (struct sockaddr*)&to, sizeof(to));
+	for (unsigned long start = millis(); millis() - start < (unsigned long)window + 20;) {
+		device.server->loop();
+		byte reply[UDP_PACKET_MAX_SIZE];
+		while (recv(fd, reply, sizeof(reply), MSG_DONTWAIT) > 0) {
+			replies++;
+		}
+	}
+	check(replies == 1 && device.server->retriesAnswered == retriesBefore + 1, "a retry of a held DISCOVER gets no second reply");
+
+	// two phones discovering at once: the first reply is not sent early, both go out at one deadline
+	int phone = socket(AF_INET, SOCK_DGRAM, 0);
+	byte held[] = { UDP_PACKET_HEADER_SIZE + 4, 0, DEVICE_COMMAND_DISCOVER, lowByte(window), highByte(window), DISCOVER_FLAG_SHORT, 0 };
+	sendto(fd, held, sizeof(held), 0, (struct sockaddr*)&to, sizeof(to));
+	device.server->loop();
+	sendto(phone, held, sizeof(held), 0, (struct sockaddr*)&to, sizeof(to));
+	unsigned long heardAt[2] = { 0, 0 };
+	for (unsigned long start = millis(); millis() - start < (unsigned long)window + 20;) {
+		device.server->loop();
+		byte reply[UDP_PACKET_MAX_SIZE];
+		if (heardAt[0] == 0 && recv(fd, reply, sizeof(reply), MSG_DONTWAIT) > 0) {
+			heardAt[0] = millis() - start + 1;
+		}
+		if (heardAt[1] == 0 && recv(phone, reply, sizeof(reply), MSG_DONTWAIT) > 0) {
+			heardAt[1] = millis() - start + 1;
+		}
+	}
+	check(heardAt[0] > 0 && heardAt[1] > 0 && heardAt[0] + 1 >= heardAt[1] && heardAt[1] + 1 >= heardAt[0],
+			"DISCOVERs held together are answered together");
+	close(phone);
+
+	close(fd);
+	return failures == 0 ? 0 : 1;
+}
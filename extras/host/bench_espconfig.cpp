@@ -0,0 +1,348 @@
+/***
+*
+*	Host benchmark for the ESPConfig / ESP8266Controller serialization and persistence paths.
+*	For every operation it reports time per call and what the call cost in EEPROM terms:
+*	commits, sector erases and bytes programmed into flash.
+*	The memory section places a firmware's controllers in Arena and counts heap allocations (operator new and
+*	bytes in use) while DeviceServer::dispatch serves SET/GET/config datagrams. Last, a run time sized controller
+*	built with the arena full must fall back to the heap, and one with too many capabilities must be clamped.
+*
+*	usage: bench_espconfig [iterations]
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include <new>
+#include <malloc.h>
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "ESPConfig.h"
+#include "ESP8266Controller.h"
+#include "Persistence.h"
+#include "ESPLog.h"
+#include "HostControllers.h"
+#include "DeviceServer.h"
+#include "ESPArena.h"
+#include "BenchUtil.h"
+
+// operator new calls, String and every other C++ allocation goes through it
+static unsigned long heapAllocations = 0;
+
+void* operator new(size_t size) {
+	heapAllocations++;
+	void* p = malloc(size);
+	if (p == NULL) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+typedef struct {
+	const char* name;
+	double nsPerOp;
+	double commitsPerOp;
+	double erasesPerOp;
+	double flashBytesPerOp;
+	double serialBytesPerOp;
+} _bench_result;
+
+// stands in for the WiFiUDP transmit buffer, counts the bytes copied into it
+class PacketPrint : public Print {
+public:
+	byte data[1024];
+	size_t length = 0;
+	unsigned long bytesCopied = 0;
+
+	size_t write(uint8_t c) override {
+		return write(&c, 1);
+	}
+
+	size_t write(const uint8_t* buffer, size_t size) override {
+		memcpy(data + length, buffer, size);
+		length += size;
+		bytesCopied += size;
+		return size;
+	}
+
+	using Print::write;
+};
+
+template<typename F>
+static _bench_result run(const char* name, long iterations, F op) {
+	EEPROM.resetStats();
+	unsigned long serialBefore = Serial.bytesWritten;
+
+	auto start = std::chrono::steady_clock::now();
+	for (long i = 0; i < iterations; i++) {
+		op(i);
+	}
+	auto stop = std::chrono::steady_clock::now();
+
+	_bench_result r;
+	r.name = name;
+	r.nsPerOp = std::chrono::duration<double, std::nano>(stop - start).count() / iterations;
+	r.commitsPerOp = (double)EEPROM.stats.commits / iterations;
+	r.erasesPerOp = (double)EEPROM.stats.sectorErases / iterations;
+	r.flashBytesPerOp = (double)EEPROM.stats.flashBytesWritten / iterations;
+	r.serialBytesPerOp = (double)(Serial.bytesWritten - serialBefore) / iterations;
+	return r;
+}
+
+static void report(const _bench_result& r) {
+	printf("%-52s %12.1f %9.2f %9.2f %12.1f %12.1f\n", r.name, r.nsPerOp, r.commitsPerOp, r.erasesPerOp, r.flashBytesPerOp, r.serialBytesPerOp);
+}
+
+int main(int argc, char** argv) {
+	long iterations = argc > 1 ? atol(argv[1]) : 20000;
+
+	ESPConfig config("Controller", "Unknown", "rgbc.200217.bin", "onion", "242374666");
+	config.init(-1);
+
+	LEDController led("LED", 4, 200);
+	ACDimmerController dimmer("Dimmer", 5, 300);
+	led.saveCapabilities();
+	dimmer.saveCapabilities();
+
+	byte buffer[1024];
+	int configLength = config.toByteArray(buffer);
+	byte configPayload[1 + 24 + 24 + 16 + 16];
+	configPayload[0] = 0;
+	memcpy(configPayload + 1, buffer + 7, sizeof(configPayload) - 1);
+
+	int ledLength = led.toByteArray(buffer);
+
+	// SETALL payload as the Android client sends it: [pin][no_of_capabilities]{[name (16 bytes)][value (2 bytes)]}
+	byte ledPayload[2 + 6 * 18];
+	ledPayload[0] = led.pin;
+	ledPayload[1] = led.capabilityCount;
+	for (int i = 0; i < led.capabilityCount; i++) {
+		memcpy(ledPayload + 2 + i * 18, led.capabilities[i]._name, 16);
+		ledPayload[2 + i * 18 + 16] = lowByte(led.capabilities[i]._value);
+		ledPayload[2 + i * 18 + 17] = highByte(led.capabilities[i]._value);
+	}
+
+	// same SETALL addressed by capability ID: [pin][no_of_capabilities | CAPABILITY_ID_FLAG]{[id][value (2 bytes)]}
+	byte ledIdPayload[2 + 6 * 3];
+	ledIdPayload[0] = led.pin;
+	ledIdPayload[1] = led.capabilityCount | CAPABILITY_ID_FLAG;
+	for (int i = 0; i < led.capabilityCount; i++) {
+		ledIdPayload[2 + i * 3] = i;
+		ledIdPayload[2 + i * 3 + 1] = lowByte(led.capabilities[i]._value);
+		ledIdPayload[2 + i * 3 + 2] = highByte(led.capabilities[i]._value);
+	}
+
+	// v2 SET: [pin][no_of_capabilities (varint)]{[ID (varint)][value (varint)]}
+	byte ledV2Payload[32];
+	int ledV2Length = 0;
+	ledV2Payload[ledV2Length++] = led.pin;
+	ledV2Length += writeVarint(ledV2Payload + ledV2Length, led.capabilityCount);
+	for (int i = 0; i < led.capabilityCount; i++) {
+		ledV2Length += writeVarint(ledV2Payload + ledV2Length, i);
+		ledV2Length += writeVarint(ledV2Payload + ledV2Length, led.capabilities[i]._value);
+	}
+
+	printf("iterations %ld, ESPConfig payload %d bytes, LEDController payload %d bytes\n", iterations, configLength, ledLength);
+	printf("LEDController v2 payload %d bytes (values), %d bytes (with schema), v2 SETALL %d bytes (v1 %d)\n",
+		led.toByteArrayV2(buffer, 0), led.toByteArrayV2(buffer, CAPABILITY_V2_SCHEMA), ledV2Length, (int)sizeof(ledPayload));
+	printf("LEDController object %d bytes, heap 0 bytes (malloc'd capabilities + name index %d bytes), EEPROM %d, UDP %d bytes (constexpr)\n\n",
+		(int)sizeof(LEDController), (int)(6 * sizeof(_unit16_capability) + capabilityIndexSize(6)), LEDController::EEPROM_SIZE, LEDController::UDP_PAYLOAD_SIZE);
+	printf("%-52s %12s %9s %9s %12s %12s\n", "operation", "ns/op", "commits", "erases", "flash B/op", "serial B/op");
+
+	report(run("ESPConfig::toByteArray", iterations, [&](long) {
+		config.toByteArray(buffer);
+	}));
+	report(run("ESPConfig::fromByteArray (SET_CONFIGURATION)", iterations, [&](long) {
+		byte errordesc[100];
+		uint16_t errordesc_length = sizeof(errordesc);
+		config.fromByteArray(configPayload, sizeof(configPayload), errordesc, &errordesc_length);
+	}));
+	report(run("ESPConfig::save (unchanged)", iterations, [&](long) {
+		config.save();
+	}));
+	report(run("ESPConfig::save (changed)", iterations, [&](long i) {
+		config.getControllerLocation()[0] = 'A' + (i & 1);
+		config.save();
+	}));
+	report(run("ESPConfig::load", iterations, [&](long) {
+		config.load();
+	}));
+
+	report(run("ESP8266Controller::toByteArray", iterations, [&](long) {
+		led.toByteArray(buffer);
+	}));
+	PacketPrint packet;
+	report(run("ESPConfig reply, toByteArray + packet write", iterations, [&](long) {
+		packet.length = 0;
+		packet.write(buffer, config.toByteArray(buffer));
+	}));
+	report(run("ESPConfig reply, writeTo packet", iterations, [&](long) {
+		packet.length = 0;
+		config.writeTo(packet);
+	}));
+	report(run("ESP8266Controller reply, toByteArray + packet write", iterations, [&](long) {
+		packet.length = 0;
+		packet.write(buffer, led.toByteArray(buffer));
+	}));
+	report(run("ESP8266Controller reply, writeTo packet", iterations, [&](long) {
+		packet.length = 0;
+		led.writeTo(packet);
+	}));
+	report(run("ESP8266Controller::toByteArrayV2", iterations, [&](long) {
+		led.toByteArrayV2(buffer, 0);
+	}));
+	report(run("ESP8266Controller::fromByteArray (SETALL)", iterations, [&](long i) {
+		// alternate the red value so every call changes state
+		ledPayload[2 + 1 * 18 + 16] = (byte)(i & 0xff);
+		led.fromByteArray(ledPayload, sizeof(ledPayload));
+	}));
+	report(run("ESP8266Controller::fromByteArray (SETALL by ID)", iterations, [&](long i) {
+		ledIdPayload[2 + 1 * 3 + 1] = (byte)(i & 0xff);
+		led.fromByteArray(ledIdPayload, sizeof(ledIdPayload));
+	}));
+	report(run("ESP8266Controller::fromByteArrayV2 (SETALL)", iterations, [&](long) {
+		led.fromByteArrayV2(ledV2Payload, ledV2Length);
+	}));
+	// malformed payloads are refused before any value is set
+	report(run("ESP8266Controller::fromByteArray (truncated, refused)", iterations, [&](long) {
+		led.fromByteArray(ledPayload, sizeof(ledPayload) - 1);
+	}));
+	report(run("ESP8266Controller::fromByteArrayV2 (truncated, refused)", iterations, [&](long) {
+		led.fromByteArrayV2(ledV2Payload, ledV2Length - 1);
+	}));
+	report(run("ESPConfig::fromByteArray (FIRMWARE_UPDATE, url past end)", iterations, [&](long) {
+		// [boot after update][url length = 0xFFFF], no url
+		byte firmwarePayload[3] = { 0, 0xFF, 0xFF };
+		byte errordesc[100];
+		uint16_t errordesc_length = sizeof(errordesc);
+		config.fromByteArray(DEVICE_COMMAND_FIRMWARE_UPDATE, firmwarePayload, sizeof(firmwarePayload), errordesc, &errordesc_length);
+	}));
+	report(run("ESP8266Controller::setCapability (name)", iterations, [&](long i) {
+		led.setCapability((char*)"blink_delay", (uint16_t)(100 + (i & 0xff)));
+	}));
+	report(run("ESP8266Controller::setCapability (ID)", iterations, [&](long i) {
+		led.setCapabilityById(5, (uint16_t)(100 + (i & 0xff)));
+	}));
+	report(run("ESP8266Controller::saveCapabilities (unchanged)", iterations, [&](long) {
+		led.saveCapabilities();
+	}));
+	report(run("ESP8266Controller::saveCapabilities (changed)", iterations, [&](long i) {
+		led.capabilities[1]._value = (uint16_t)(i & 0xff);
+		led.saveCapabilities();
+	}));
+	report(run("ESP8266Controller::loadCapabilities", iterations, [&](long) {
+		led.loadCapabilities();
+	}));
+
+	// factory reset and provisioning: whole EEPROM filled, then filled again with what is already there
+	report(run("ESPConfig::clearEEPROM + resetEEPROM", iterations / 10, [&](long) {
+		config.clearEEPROM();
+		config.resetEEPROM();
+	}));
+	report(run("ESPConfig::resetEEPROM (already reset, no commit)", iterations / 10, [&](long) {
+		config.resetEEPROM();
+	}));
+	config.save();
+	led.saveCapabilities();
+	dimmer.saveCapabilities();
+	Persistence.flush();
+
+	// a scene change touching the config and two controllers, committed once after flushInterval
+	Persistence.flushInterval = 1000;
+	report(run("save + 2x saveCapabilities (coalesced)", iterations, [&](long i) {
+		config.getControllerLocation()[0] = 'A' + (i & 1);
+		config.save();
+		led.capabilities[1]._value = (uint16_t)(i & 0xff);
+		led.saveCapabilities();
+		dimmer.capabilities[1]._value = (uint16_t)(i % 100);
+		dimmer.saveCapabilities();
+		delay(Persistence.flushInterval);
+		Persistence.loop();
+	}));
+	Persistence.flushInterval = 0;
+
+	report(run("LOG_INFO record", iterations, [&](long i) {
+		LOG_INFO(LOG_MODULE_CONTROLLER, LOG_EVENT_CAPABILITY_SET, i, 1);
+	}));
+	report(run("Log.drain one record to Serial", iterations, [&](long i) {
+		LOG_INFO(LOG_MODULE_CONTROLLER, LOG_EVENT_CAPABILITY_SET, i, 1);
+		Log.drain(Serial, 1);
+	}));
+
+	// a firmware's controllers in the arena, then datagrams served without touching the heap
+	LEDController* arenaLed = Arena.create<LEDController>("LED", 12, 400);
+	ACDimmerController* arenaDimmer = Arena.create<ACDimmerController>("Dimmer", 13, 500);
+	size_t heapBeforeRelay = mallinfo2().uordblks;
+	uint16_t blocksBeforeRelay = Arena.blocks;
+	RelayController* arenaRelay = Arena.create<RelayController>("Relay", 14, 8, 600);
+	check(arenaRelay != NULL && Arena.blocks == blocksBeforeRelay + 3 && Arena.failed == 0 && mallinfo2().uordblks == heapBeforeRelay,
+		"run time sized controller and its tables in the arena");
+	DeviceServer server(&config);
+	server.addController(arenaLed);
+	server.addController(arenaDimmer);
+	server.addController(arenaRelay);
+
+	std::vector<std::vector<byte>> datagrams;
+	auto datagram = [&](byte command, std::vector<byte> payload) {
+		uint16_t size = UDP_PACKET_HEADER_SIZE + payload.size();
+		payload.insert(payload.begin(), { lowByte(size), highByte(size), command });
+		datagrams.push_back(payload);
+	};
+	datagram(DEVICE_COMMAND_DISCOVER, {});
+	datagram(DEVICE_COMMAND_GETALL_CONTROLLER, { 12 });
+	datagram(DEVICE_COMMAND_SETALL_CONTROLLER, { 12, 1 | CAPABILITY_ID_FLAG, 1, 0, 2 });
+	datagram(DEVICE_COMMAND_SETALL_CONTROLLER_V2, { 13, 1, 1, 40 });
+	datagram(DEVICE_COMMAND_SETALL_CONTROLLER, { 14, 2 | CAPABILITY_ID_FLAG, 0, 1, 0, 7, 1, 0 });
+	datagram(DEVICE_COMMAND_SET_TRANSACTION, { 2, 12, 1, 2, 0x80, 0x02, 13, 1, 1, 60 });
+	datagram(DEVICE_COMMAND_SET_CONFIGURATION_LOCATION, { 'H', 'a', 'l', 'l', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 });
+	datagram(DEVICE_COMMAND_FIRMWARE_UPDATE, { 0, 4, 0, 'h', 't', 't', 'p' });
+	datagram(DEVICE_COMMAND_GET_STATS, { 0 });
+
+	size_t heapBefore = mallinfo2().uordblks;
+	unsigned long allocationsBefore = heapAllocations;
+	byte reply[UDP_PACKET_MAX_SIZE];
+	for (long i = 0; i < iterations; i++) {
+		std::vector<byte>& d = datagrams[i % datagrams.size()];
+		server.dispatch(d.data(), d.size(), reply);
+	}
+	long heapGrowth = (long)mallinfo2().uordblks - (long)heapBefore;
+	check(arenaRelay->capabilities[0]._value == 1 && arenaRelay->capabilities[7]._value == 1, "run time sized controller set by datagram");
+
+	printf("\nmemory: LEDController %d B, ACDimmerController %d B in the arena\n",
+		(int)arenaBlockSize(sizeof(LEDController)), (int)arenaBlockSize(sizeof(ACDimmerController)));
+	printf("arena %d/%d B, %d blocks, padding %d B, failed %d\n", (int)Arena.used(), (int)Arena.capacity(), Arena.blocks, Arena.padding, Arena.failed);
+	printf("%ld datagrams dispatched: %lu heap allocations, heap in use %+ld B\n", iterations, heapAllocations - allocationsBefore, heapGrowth);
+
+	printf("\nPersistence: %lu commits, %lu skipped, %lu bytes written\n", Persistence.commits, Persistence.commitsSkipped, Persistence.bytesWritten);
+
+	// the arena used up: a run time sized controller takes its tables from the heap, and one past
+	// CONTROLLER_MAX_CAPABILITIES keeps only those and logs it
+	Arena.allocate(Arena.available());
+	uint16_t failedBefore = Arena.failed;
+	// the records logged from here on, header [first seq][next seq]...
+	byte logged[LOG_REPLY_HEADER_SIZE + ESP_LOG_RECORDS * LOG_RECORD_WIRE_SIZE];
+	Log.toByteArray(0, logged, sizeof(logged));
+	uint16_t since = logged[2] | (logged[3] << 8);
+	RelayController heapRelay("Relay", 15, CONTROLLER_MAX_CAPABILITIES + 4, 0);
+	check(Arena.failed == failedBefore + 2 && heapRelay.capabilityId("relay15") == CONTROLLER_MAX_CAPABILITIES - 1
+		&& heapRelay.setCapability((char*)"relay15", 1), "arena full, run time sized controller falls back to the heap");
+
+	int loggedLength = Log.toByteArray(since, logged, sizeof(logged));
+	bool clampLogged = false;
+	for (int r = LOG_REPLY_HEADER_SIZE; r + LOG_RECORD_WIRE_SIZE <= loggedLength; r += LOG_RECORD_WIRE_SIZE) {
+		clampLogged = clampLogged || (logged[r + 8] == LOG_EVENT_TOO_MANY_CAPABILITIES && logged[r + 9] == CONTROLLER_MAX_CAPABILITIES + 4 && logged[r + 11] == 15);
+	}
+	check(heapRelay.capabilityCount == CONTROLLER_MAX_CAPABILITIES && clampLogged, "too many capabilities clamped to CONTROLLER_MAX_CAPABILITIES, logged");
+
+	return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,282 @@
+/***
+*
+*	An app fading the red of an LED controller from 0 to PWMRANGE in FADE_MS, two ways:
+*
+*	stream   DEVICE_COMMAND_SET_CONTROLLER every STREAM_INTERVAL ms with the next value, as apps do today
+*	fade     one DEVICE_COMMAND_FADE, interpolated on the device
+*
+*	Every datagram is delayed by a random 0 to MAX_JITTER ms on its way, as on a busy WiFi, so streamed values
+*	arrive bunched and out of order. The sketch loop runs every TICK ms of simulated time (delay()) and saves like
+*	the firmware sketches, eeprom_update_interval after a change. Reported are datagrams and bytes sent, capability
+*	saves, the largest step of the output between two loops, steps backwards, and the largest distance from the
+*	ideal curve started when the first datagram arrived.
+*	Then: easing curves, a SET during a fade, one push at the end of a fade, and the saved value.
+*
+*	usage: bench_fade
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "DeviceServer.h"
+#include "ESPMetrics.h"
+#include "Persistence.h"
+#include "HostControllers.h"
+#include "BenchUtil.h"
+
+static const uint16_t BENCH_PORT = 23906;
+static const uint16_t FADE_MS = 10000;
+static const unsigned long STREAM_INTERVAL = 20;
+static const unsigned long MAX_JITTER = 80;
+static const unsigned long TICK = 2;
+
+// [pin][duration (2 bytes)][easing][1 capability][ID][target], varints as the device reads them
+static std::vector<byte> fadePayload(uint8_t pin, uint16_t duration, uint8_t easing, uint8_t id, uint16_t target) {
+	std::vector<byte> p = { pin, lowByte(duration), highByte(duration), easing, 1, id };
+	byte varint[3];
+	p.insert(p.end(), varint, varint + writeVarint(varint, target));
+	return p;
+}
+
+struct Delivery {
+	unsigned long at;
+	std::vector<byte> datagram;
+};
+
+struct Run {
+	unsigned long datagrams = 0;
+	unsigned long bytes = 0;
+	unsigned long saves = 0;
+	uint16_t maxStep = 0;
+	unsigned long backwards = 0;
+	uint16_t maxError = 0;
+	uint16_t final = 0;
+};
+
+// send the datagrams of plan (send time relative to the start) through the jitter and sample red every loop
+static Run run(DeviceServer& server, LEDController& led, int app, const std::vector<Delivery>& plan) {
+	Run r;
+	std::vector<Delivery> inFlight;
+	byte reply[UDP_PACKET_MAX_SIZE];
+
+	led.setCapabilityById(1, 0);
+	led.saveCapabilities();
+	led.lastEepromUpdate = millis();
+	Metrics.reset();
+
+	for (const Delivery& d : plan) {
+		inFlight.push_back({ d.at + random(0, MAX_JITTER + 1), d.datagram });
+		r.datagrams++;
+		r.bytes += d.datagram.size();
+	}
+
+	unsigned long start = millis();
+	unsigned long firstArrival = 0;
+	boolean arrived = false;
+	uint16_t last = led.capabilities[1]._value;
+
+	while (millis() - start < FADE_MS + MAX_JITTER + eeprom_update_interval + 100) {
+		unsigned long now = millis() - start;
+		for (size_t i = 0; i < inFlight.size();) {
+			if (inFlight[i].at <= now) {
+				sendPacket(app, BENCH_PORT, inFlight[i].datagram);
+				if (!arrived) {
+					arrived = true;
+					firstArrival = now;
+				}
+				inFlight.erase(inFlight.begin() + i);
+			} else {
+				i++;
+			}
+		}
+
+		server.loop();
+		led.loop();
+		if (led.eepromUpdatePending && millis() - led.lastEepromUpdate >= eeprom_update_interval) {
+			led.saveCapabilities();
+			led.lastEepromUpdate = millis();
+		}
+		while (receive(app, reply) > 0) {
+		}
+
+		uint16_t value = led.capabilities[1]._value;
+		if (arrived) {
+			unsigned long t = min(now - firstArrival, (unsigned long)FADE_MS);
+			uint16_t ideal = (uint32_t)PWMRANGE * t / FADE_MS;
+			r.maxError = max(r.maxError, (uint16_t)abs((int)value - ideal));
+		}
+		r.maxStep = max(r.maxStep, (uint16_t)abs((int)value - last));
+		r.backwards += value < last;
+		last = value;
+
+		delay(TICK);
+	}
+
+	r.saves = Metrics.capabilitySaves;
+	r.final = led.capabilities[1]._value;
+	return r;
+}
+
+static void print(const char* name, const Run& r) {
+	printf("%-8s %10lu %10lu %8lu %10u %10lu %10u\n", name, r.datagrams, r.bytes, r.saves, r.maxStep, r.backwards, r.maxError);
+}
+
+// red after elapsed ms of a 1000 ms fade from 0 to 1000 along easing
+static uint16_t sample(LEDController& led, uint8_t easing, unsigned long elapsed) {
+	led.setCapabilityById(1, 0);
+	led.startTransition(1, 1000, 1000, easing);
+	delay(elapsed);
+	led.transitionLoop();
+	uint16_t value = led.capabilities[1]._value;
+	led.stopTransition(1);
+	return value;
+}
+
+int main(int argc, char** argv) {
+	ESPConfig config("Controller", "Unknown", "rgbc.200217.bin", "onion", "242374666");
+	config.init(-1);
+	OutputLEDController led("LED", 4, 200);
+	led.eepromStoreIds = true;
+	DeviceServer server(&config);
+	server.addController(&led);
+	server.udp.hostBindAddress = IPAddress(127, 0, 0, 1);
+	if (!server.begin(BENCH_PORT)) {
+		fprintf(stderr, "cannot bind port %d\n", BENCH_PORT);
+		return 1;
+	}
+
+	int app = socket(AF_INET, SOCK_DGRAM, 0);
+	byte reply[UDP_PACKET_MAX_SIZE];
+	randomSeed(7);
+
+	// [pin][1 capability by ID][red = value] every STREAM_INTERVAL, the last one exactly PWMRANGE
+	std::vector<Delivery> stream;
+	for (unsigned long t = STREAM_INTERVAL; t <= FADE_MS; t += STREAM_INTERVAL) {
+		uint16_t value = (uint32_t)PWMRANGE * t / FADE_MS;
+		stream.push_back({ t, packet(DEVICE_COMMAND_SET_CONTROLLER, { led.pin, 1 | CAPABILITY_ID_FLAG, 1, lowByte(value), highByte(value) }) });
+	}
+	std::vector<Delivery> fade = { { 0, packet(DEVICE_COMMAND_FADE, fadePayload(led.pin, FADE_MS, EASE_LINEAR, 1, PWMRANGE)) } };
+
+	Run streamed = run(server, led, app, stream);
+	Run faded = run(server, led, app, fade);
+
+	printf("\nred 0 to %d in %u ms, datagrams delayed 0 to %lu ms, loop every %lu ms\n\n", PWMRANGE, FADE_MS, MAX_JITTER, TICK);
+	printf("%-8s %10s %10s %8s %10s %10s %10s\n", "", "datagrams", "bytes", "saves", "max step", "backwards", "max error");
+	print("stream", streamed);
+	print("fade", faded);
+	printf("\n");
+
+	check(faded.final == PWMRANGE, "the fade ends on its target");
+	check(faded.bytes * 50 <= streamed.bytes, "one fade takes a fiftieth of the streamed bytes or less");
+	check(faded.saves == 1 && streamed.saves > 1, "only the final value of the fade is saved");
+	check(faded.backwards == 0 && faded.maxStep < streamed.maxStep, "the fade output is monotonic and smoother");
+	check(faded.maxError < streamed.maxError, "the fade output stays closer to the ideal curve");
+
+	// easing: all end on 0 and the target, in and out bend to opposite sides of linear
+	uint16_t linear = sample(led, EASE_LINEAR, 500);
+	uint16_t in = sample(led, EASE_IN, 500);
+	uint16_t out = sample(led, EASE_OUT, 500);
+	uint16_t inOut = sample(led, EASE_IN_OUT, 250);
+	check(linear >= 490 && linear <= 510 && in < 300 && out > 700 && inOut < 250,
+			"easing: linear halfway, in below, out above, in-out slow start");
+
+	// a SET during a fade stops it, the SET value stays
+	sendPacket(app, BENCH_PORT, packet(DEVICE_COMMAND_FADE, fadePayload(led.pin, FADE_MS, EASE_LINEAR, 1, 0)));
+	for (int i = 0; i < 50; i++) {
+		server.loop();
+		delay(TICK);
+	}
+	sendPacket(app, BENCH_PORT, packet(DEVICE_COMMAND_SET_CONTROLLER, { led.pin, 1 | CAPABILITY_ID_FLAG, 1, 0x00, 0x02 }));
+	for (int i = 0; i < 100; i++) {
+		server.loop();
+		delay(TICK);
+	}
+	check(led.capabilities[1]._value == 512 && !led.inTransition(), "a SET during a fade stops the fade");
+	while (receive(app, reply) > 0) {
+	}
+
+	// subscribers: one push, at the end
+	int subscriber = socket(AF_INET, SOCK_DGRAM, 0);
+	sendPacket(subscriber, BENCH_PORT, packet(DEVICE_COMMAND_SUBSCRIBE, { led.pin, 60, 0 }));
+	server.loop();
+	receive(subscriber, reply);
+	unsigned long appliedBefore = led.applied;
+	sendPacket(app, BENCH_PORT, packet(DEVICE_COMMAND_FADE, fadePayload(led.pin, 500, EASE_OUT, 1, 100)));
+	int pushes = 0;
+	uint16_t pushedRed = 0;
+	unsigned long start = millis();
+	while (millis() - start < 700) {
+		server.loop();
+		int n;
+		while ((n = receive(subscriber, reply)) > 0) {
+			if (reply[2] == DEVICE_COMMAND_CHANGED) {
+				pushes++;
+				// [seq (2 bytes)][pin][count][ID][value (varint)]
+				readVarint(reply + UDP_PACKET_HEADER_SIZE + 5, &pushedRed);
+			}
+		}
+		delay(TICK);
+	}
+	check(pushes == 1 && pushedRed == 100, "a fade is pushed once, with its final value");
+	check(led.applied - appliedBefore > 10 && led.appliedValue == 100, "every step of a fade goes through setCapability");
+
+	// rejected: unknown capability, out of range, unknown easing; nothing starts
+	server.loop();
+	while (receive(app, reply) > 0) {
+	}
+	sendPacket(app, BENCH_PORT, packet(DEVICE_COMMAND_FADE, { led.pin, 0xE8, 0x03, EASE_LINEAR, 2, 1, 10, 9, 10 }));
+	sendPacket(app, BENCH_PORT, packet(DEVICE_COMMAND_FADE, fadePayload(led.pin, 1000, EASE_LINEAR, 5, 50)));
+	sendPacket(app, BENCH_PORT, packet(DEVICE_COMMAND_FADE, fadePayload(led.pin, 1000, EASE_COUNT, 1, 50)));
+	sendPacket(app, BENCH_PORT, packet(DEVICE_COMMAND_FADE, { led.pin, 0xE8, 0x03, EASE_LINEAR, 1, 0xAC, 0x02, 10 }));
+	server.loop();
+	byte results[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+	uint16_t failedIds[4] = { 0, 0, 0, 0 };
+	for (int i = 0; i < 4 && receive(app, reply) > 0; i++) {
+		results[i] = reply[UDP_PACKET_HEADER_SIZE];
+		failedIds[i] = reply[UDP_PACKET_HEADER_SIZE + 1] | (reply[UDP_PACKET_HEADER_SIZE + 2] << 8);
+	}
+	check(results[0] == FADE_UNKNOWN_CAPABILITY && results[1] == FADE_OUT_OF_RANGE && results[2] == FADE_BAD_EASING
+			&& !led.inTransition(), "bad fades are refused, none is started");
+	check(failedIds[0] == 9 && failedIds[2] == 0xFFFF && results[3] == FADE_UNKNOWN_CAPABILITY && failedIds[3] == 300,
+			"the reply names the failing ID in full");
+
+	// three fading, one slot left: a repeated ID takes it once, a target equal to the value takes none
+	led.setCapabilityById(0, 1);
+	led.startTransition(1, 900, 1000);
+	led.startTransition(2, 900, 1000);
+	led.startTransition(3, 900, 1000);
+	std::vector<byte> busy = { led.pin, 0xE8, 0x03, EASE_LINEAR, 3, 5 };
+	byte varint[3];
+	busy.insert(busy.end(), varint, varint + writeVarint(varint, 2000));
+	busy.push_back(5);
+	busy.insert(busy.end(), varint, varint + writeVarint(varint, 3000));
+	busy.insert(busy.end(), { 0, 1 });
+	std::vector<byte> busyFade = packet(DEVICE_COMMAND_FADE, busy);
+	byte built[UDP_PACKET_MAX_SIZE];
+	server.dispatch(busyFade.data(), busyFade.size(), built);
+	check(built[UDP_PACKET_HEADER_SIZE] == FADE_OK && led.inTransition(5) && led.transitionsAvailable() == 0,
+			"repeated IDs and unchanged targets take no extra slot");
+	for (uint8_t id = 1; id <= 5; id++) {
+		led.stopTransition(id);
+	}
+
+	// saved mid-fade: the target, never an intermediate value
+	led.startTransition(1, 900, 1000);
+	delay(300);
+	led.transitionLoop();
+	led.saveCapabilities();
+	Persistence.flush();
+	led.stopTransition(1);
+	led.setCapabilityById(1, 0);
+	led.loadCapabilities();
+	check(led.capabilities[1]._value == 900, "a save during a fade stores its target");
+
+	printf("\n%s\n", failures ? "FAILED" : "all checks passed");
+	return failures ? 1 : 0;
+}
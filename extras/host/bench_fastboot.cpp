@@ -0,0 +1,211 @@
+/***
+*
+*	Boot to WiFi connected of a device with an LED controller and an AC dimmer: a cold boot (power on, RTC memory
+*	random) against warm resets (watchdog, ESP.restart) with and without ESPConfig's fast boot, blocking and
+*	non-blocking. The host WiFi spends hostScanDelay on the scan and hostDhcpDelay on DHCP of its hostConnectDelay.
+*	Reported are milliseconds to WL_CONNECTED, EEPROM sector reads and WiFi.begin() calls.
+*	Then the fallbacks: an access point moved to another channel, a corrupted cache, a new firmware, a power loss,
+*	clearEEPROM() and new credentials.
+*
+*	usage: bench_fastboot
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "ESPConfig.h"
+#include "ESPFastBoot.h"
+#include "Persistence.h"
+#include "HostControllers.h"
+#include "BenchUtil.h"
+
+static const char* FIRMWARE = "rgbc.200217.bin";
+
+struct Device {
+	ESPConfig* config;
+	LEDController* led;
+	ACDimmerController* dimmer;
+};
+
+struct Boot {
+	unsigned long millis = 0;
+	unsigned long sectorReads = 0;
+	unsigned long begins = 0;
+	bool connected = false;
+	bool warm = false;
+};
+
+// what a reset leaves is flash and RTC memory: RAM comes up fresh, the radio forgets its static address
+static void reset() {
+	new (&Persistence) PersistenceManager();
+	new (&FastBoot) ESPFastBoot();
+	WiFi.disconnect();
+	WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+}
+
+static void powerLoss() {
+	reset();
+	ESP.hostPowerLoss();
+}
+
+// the sketch setup(): config, then the controllers; the controllers are left allocated, as in firmware
+static Boot boot(Device& d, bool fast, bool nonBlocking, const char* firmware = FIRMWARE) {
+	Boot b;
+	EEPROM.resetStats();
+	unsigned long begins = WiFi.hostBeginCount;
+	unsigned long start = millis();
+
+	d.config = new ESPConfig("Controller", "Unknown", firmware, "onion", "242374666");
+	d.config->init(-1, nonBlocking, fast);
+	d.led = new LEDController("LED", 4, 100);
+	d.dimmer = new ACDimmerController("Dimmer", 12, 340);
+	d.led->loadCapabilities();
+	d.dimmer->loadCapabilities();
+
+	while (d.config->loop() == WIFI_STATE_CONNECTING) {
+		delay(1);
+	}
+
+	b.millis = millis() - start;
+	b.sectorReads = EEPROM.stats.sectorReads;
+	b.begins = WiFi.hostBeginCount - begins;
+	b.connected = WiFi.status() == WL_CONNECTED;
+	b.warm = FastBoot.warm;
+	return b;
+}
+
+static void print(const char* name, const Boot& b) {
+	printf("%-40s %10lu %14lu %12lu\n", name, b.millis, b.sectorReads, b.begins);
+}
+
+// the values the device was left with
+static void setValues(Device& d, uint16_t red, uint16_t dim) {
+	d.led->setCapabilityById(1, red);
+	d.dimmer->setCapabilityById(1, dim);
+	d.led->saveCapabilities();
+	d.dimmer->saveCapabilities();
+}
+
+static bool hasValues(Device& d, uint16_t red, uint16_t dim) {
+	return d.led->capabilities[1]._value == red && d.dimmer->capabilities[1]._value == dim;
+}
+
+int main() {
+	Device d;
+
+	// first boot of a new device, then a value set by the app
+	powerLoss();
+	boot(d, true, false);
+	setValues(d, 700, 30);
+	Persistence.flush();
+
+	powerLoss();
+	Boot cold = boot(d, true, false);
+	bool coldValues = hasValues(d, 700, 30);
+
+	reset();
+	Boot slowWarm = boot(d, false, false);
+
+	reset();
+	Boot warm = boot(d, true, false);
+	bool warmValues = hasValues(d, 700, 30);
+
+	reset();
+	Boot warmNonBlocking = boot(d, true, true);
+
+	// the access point restarted on another channel: the saved one fails, a scan finds it
+	WiFi.hostChannel = 11;
+	reset();
+	Boot moved = boot(d, true, true);
+	reset();
+	Boot movedAgain = boot(d, true, true);
+
+	printf("\nboot of an LED controller and a dimmer to WiFi connected (%lu ms scan, %lu ms DHCP)\n\n", WiFi.hostScanDelay, WiFi.hostDhcpDelay);
+	printf("%-40s %10s %14s %12s\n", "", "ms", "sector reads", "WiFi.begin");
+	print("power on", cold);
+	print("warm reset, fast boot off", slowWarm);
+	print("warm reset, fast boot", warm);
+	print("warm reset, fast boot, non-blocking", warmNonBlocking);
+	print("access point moved, fallback scan", moved);
+	print("access point moved, next reset", movedAgain);
+	printf("\nRTC cache %u of %u bytes, %lu writes\n\n", FastBoot.used(), (unsigned)ESP_FAST_BOOT_SIZE, FastBoot.writes);
+
+	check(cold.connected && !cold.warm && cold.sectorReads == 1 && coldValues, "power on loads from EEPROM and scans");
+	check(warm.connected && warm.warm && warm.sectorReads == 0 && warmValues, "a warm reset loads from RTC memory, EEPROM is not opened");
+	check(warm.millis * 4 <= slowWarm.millis, "a warm reset connects in a quarter of the time or less");
+	check(warmNonBlocking.connected && warmNonBlocking.millis * 4 <= cold.millis, "the non-blocking connect is as fast");
+	check(moved.connected && moved.begins == 2 && moved.millis <= fast_wifi_connect_timeout + WiFi.hostConnectDelay, "a moved access point falls back to a scan");
+	check(movedAgain.connected && movedAgain.begins == 1 && movedAgain.millis * 4 <= cold.millis, "the next reset joins it on its new channel");
+
+	// a change the deferred flush had not committed yet survives a watchdog reset, not a power loss
+	Persistence.flushInterval = 60000;
+	setValues(d, 222, 77);
+	reset();
+	boot(d, true, false);
+	check(hasValues(d, 222, 77), "a change not yet committed survives a reset");
+	powerLoss();
+	boot(d, true, false);
+	check(hasValues(d, 700, 30), "a power loss falls back to the committed values");
+
+	// one flipped bit of a record
+	reset();
+	ESP.hostRtcMemory[offsetof(_fast_boot_image, _records) / 4 + 3] ^= 0x10;
+	Boot corrupted = boot(d, true, false);
+	check(!corrupted.warm && corrupted.sectorReads == 1 && hasValues(d, 700, 30), "a corrupted cache is not used");
+
+	// the cache of another firmware
+	reset();
+	Boot updated = boot(d, true, false, "rgbc.200301.bin");
+	check(!updated.warm && updated.sectorReads == 1 && hasValues(d, 700, 30), "a new firmware does not use the old cache");
+
+	// filling a range of raw addresses is not a factory reset, the records and the connection stay
+	reset();
+	boot(d, true, false);
+	Persistence.fill(PERSISTENCE_SIZE - 16, 0, 16);
+	reset();
+	Boot filled = boot(d, true, false);
+	check(filled.warm && filled.sectorReads == 0 && filled.begins == 1 && hasValues(d, 700, 30), "filling a range keeps the cache");
+
+	// factory reset
+	reset();
+	boot(d, true, false);
+	d.config->clearEEPROM();
+	reset();
+	Boot cleared = boot(d, true, false);
+	check(cleared.warm && cleared.sectorReads == 1 && cleared.millis >= cold.millis, "clearEEPROM drops the cache");
+
+	// other credentials, the saved access point is no use
+	byte ssid[MAX_LENGTH_SSID * 2] = "other";
+	byte error[CONFIG_ERROR_MAX_LENGTH];
+	uint16_t errorLength = sizeof(error);
+	d.config->fromByteArray(DEVICE_COMMAND_SET_CONFIGURATION_SSID, ssid, sizeof(ssid), error, &errorLength);
+	_fast_boot_wifi wifi;
+	check(!FastBoot.loadWiFi(&wifi), "new credentials forget the access point");
+
+	// a write the EEPROM refuses is not mirrored either, a warm boot would bring back what a power loss drops
+	byte region[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	Persistence.save(RECORD_STORE_MAX_KEYS - 1, PERSISTENCE_SIZE - 4, region, sizeof(region));
+	check(!FastBoot.load(RECORD_STORE_MAX_KEYS - 1, region, sizeof(region)), "a refused write is not mirrored");
+
+	// the reused lease is renewed over DHCP once connected, a new address from it is kept
+	byte credentials[MAX_LENGTH_SSID * 2] = "onion";
+	strcpy((char*)credentials + MAX_LENGTH_SSID, "242374666");
+	errorLength = sizeof(error);
+	d.config->fromByteArray(DEVICE_COMMAND_SET_CONFIGURATION_SSID, credentials, sizeof(credentials), error, &errorLength);
+	reset();
+	boot(d, true, false);
+	reset();
+	Boot renewed = boot(d, true, false);
+	check(renewed.warm && FastBoot.loadWiFi(&wifi) && !WiFi.hostStaticIP(), "a fast join goes back to DHCP once connected");
+	WiFi.hostLeaseIP = IPAddress(192, 168, 1, 77);
+	reset();
+	boot(d, true, true);
+	d.config->loop();
+	check(FastBoot.loadWiFi(&wifi) && wifi._ip == (uint32_t)WiFi.hostLeaseIP, "an address DHCP changed is kept for the next boot");
+
+	printf("\n%s\n", failures ? "FAILED" : "all checks passed");
+	return failures ? 1 : 0;
+}
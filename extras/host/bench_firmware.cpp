@@ -0,0 +1,309 @@
+/***
+*
+*	Firmware update over a local HTTP stand-in. The image is served from a thread at a throttled rate,
+*	the device side is DeviceServer on loopback. While the download runs a client keeps sending GETALL
+*	and FIRMWARE_UPDATE_STATUS, which must be answered; the longest loop() shows how long the device is
+*	unresponsive (the old ESPhttpUpdate path blocked for the whole download).
+*
+*	usage: bench_firmware [image KB] [KB per second]
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+#include "Updater.h"
+#include "ESPConfig.h"
+#include "DeviceServer.h"
+#include "FirmwareUpdater.h"
+#include "HostControllers.h"
+#include "BenchUtil.h"
+
+static const uint16_t UDP_PORT = 23901;
+static const uint16_t HTTP_PORT = 23980;
+static const char* FIRMWARE_VERSION = "rgbc.200217.bin";
+
+// HTTP stand-in: GET /<anything> answers the image, with md5 as x-MD5 if set, or 304 if x-ESP8266-version
+// matches notModifiedVersion
+class ImageServer {
+public:
+	std::vector<uint8_t> image;
+	long bytesPerSecond = 0;
+	std::string notModifiedVersion;
+	std::string md5;
+	std::atomic<int> requests{0};
+	// request headers of the last GET
+	std::string lastHead;
+
+	bool start(uint16_t port) {
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 4) != 0) {
+			return false;
+		}
+		worker = std::thread([this]() { serve(); });
+		return true;
+	}
+
+	void stop() {
+		running = false;
+		shutdown(listener, SHUT_RDWR);
+		close(listener);
+		worker.join();
+	}
+
+private:
+	int listener = -1;
+	std::atomic<bool> running{true};
+	std::thread worker;
+
+	void serve() {
+		while (running) {
+			int fd = accept(listener, NULL, NULL);
+			if (fd < 0) {
+				continue;
+			}
+			requests++;
+
+			std::string head;
+			char c;
+			while (head.find("\r\n\r\n") == std::string::npos && recv(fd, &c, 1, 0) == 1) {
+				head += c;
+			}
+			lastHead = head;
+
+			if (!notModifiedVersion.empty() && head.find("x-ESP8266-version: " + notModifiedVersion) != std::string::npos) {
+				std::string reply = "HTTP/1.0 304 Not Modified\r\n\r\n";
+				send(fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+				close(fd);
+				continue;
+			}
+
+			std::string reply = "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: " + std::to_string(image.size()) + "\r\n";
+			if (!md5.empty()) {
+				reply += "x-MD5: " + md5 + "\r\n";
+			}
+			reply += "\r\n";
+			send(fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+
+			// throttled in 1460 byte segments, roughly what the ESP8266 sees over WiFi
+			size_t sent = 0;
+			auto start = std::chrono::steady_clock::now();
+			while (sent < image.size()) {
+				size_t n = std::min((size_t)1460, image.size() - sent);
+				if (send(fd, image.data() + sent, n, MSG_NOSIGNAL) <= 0) {
+					break;
+				}
+				sent += n;
+				if (bytesPerSecond > 0) {
+					std::this_thread::sleep_until(start + std::chrono::microseconds((long long)sent * 1000000 / bytesPerSecond));
+				}
+			}
+			close(fd);
+		}
+	}
+};
+
+static int client = -1;
+
+static void sendCommand(byte command, const byte* payload, uint16_t length) {
+	byte packet[256];
+	uint16_t size = UDP_PACKET_HEADER_SIZE + length;
+	packet[0] = lowByte(size);
+	packet[1] = highByte(size);
+	packet[2] = command;
+	memcpy(packet + UDP_PACKET_HEADER_SIZE, payload, length);
+
+	struct sockaddr_in to;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_port = htons(UDP_PORT);
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sendto(client, packet, size, 0, (struct sockaddr*)&to, sizeof(to));
+}
+
+static int receiveReply(byte* reply, int size) {
+	return recv(client, reply, size, MSG_DONTWAIT);
+}
+
+static void requestUpdate(const std::string& url, byte bootAfterUpdate) {
+	byte payload[200];
+	uint16_t url_length = url.size();
+	payload[0] = bootAfterUpdate;
+	memcpy(payload + 1, &url_length, 2);
+	memcpy(payload + 3, url.data(), url_length);
+	sendCommand(DEVICE_COMMAND_FIRMWARE_UPDATE, payload, 3 + url_length);
+}
+
+static double nowMs() {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char** argv) {
+	long imageKB = argc > 1 ? atol(argv[1]) : 384;
+	long rateKB = argc > 2 ? atol(argv[2]) : 256;
+
+	ImageServer http;
+	http.image.resize(imageKB * 1024);
+	for (size_t i = 0; i < http.image.size(); i++) {
+		http.image[i] = (uint8_t)(i * 31 + (i >> 8));
+	}
+	http.bytesPerSecond = rateKB * 1024;
+	if (!http.start(HTTP_PORT)) {
+		printf("cannot listen on %d\n", HTTP_PORT);
+		return 1;
+	}
+
+	ESPConfig config("Controller", "Unknown", FIRMWARE_VERSION, "onion", "242374666");
+	config.init(-1);
+	LEDController led("LED", 4, 200);
+	DeviceServer server(&config);
+	server.addController(&led);
+	server.udp.hostBindAddress = IPAddress(127, 0, 0, 1);
+	server.begin(UDP_PORT);
+
+	client = socket(AF_INET, SOCK_DGRAM, 0);
+
+	std::string base = "http://127.0.0.1:" + std::to_string(HTTP_PORT) + "/";
+	byte reply[UDP_PACKET_MAX_SIZE];
+
+	// 1. same version is rejected before any download
+	requestUpdate(base + FIRMWARE_VERSION, 0);
+	server.loop();
+	int n = receiveReply(reply, sizeof(reply));
+	check(n > 0 && FirmwareUpdate.getState() == FIRMWARE_UPDATE_NO_UPDATES && http.requests == 0, "same version is rejected without a download");
+
+	// 2. server answers 304 for the running version
+	http.notModifiedVersion = FIRMWARE_VERSION;
+	requestUpdate(base + "rgbc.200301.bin", 0);
+	server.loop();
+	while (FirmwareUpdate.isRunning()) {
+		server.loop();
+	}
+	receiveReply(reply, sizeof(reply));
+	check(FirmwareUpdate.getState() == FIRMWARE_UPDATE_NO_UPDATES && http.requests == 1, "304 from the server ends as no update");
+	http.notModifiedVersion = "";
+
+	// 3. download while serving UDP
+	http.md5 = hostMD5(http.image.data(), http.image.size());
+	double requested = nowMs();
+	requestUpdate(base + "rgbc.200301.bin", 1);
+
+	double firstReply = 0;
+	while (firstReply == 0) {
+		server.loop();
+		if (receiveReply(reply, sizeof(reply)) > 0) {
+			firstReply = nowMs() - requested;
+		}
+	}
+
+	double start = nowMs();
+	double longestLoop = 0;
+	long loops = 0, sent = 0, answered = 0, statusReplies = 0;
+	uint32_t lastProgress = 0;
+	bool progressMonotonic = true;
+	byte pin = led.pin;
+
+	while (FirmwareUpdate.isRunning()) {
+
+		// one GETALL or status poll per loop, as a busy client would
+		if (loops % 2 == 0) {
+			sendCommand(DEVICE_COMMAND_GETALL_CONTROLLER, &pin, 1);
+		} else {
+			sendCommand(DEVICE_COMMAND_FIRMWARE_UPDATE_STATUS, NULL, 0);
+		}
+		sent++;
+
+		double before = nowMs();
+		server.loop();
+		led.loop();
+		longestLoop = max(longestLoop, nowMs() - before);
+		loops++;
+
+		while ((n = receiveReply(reply, sizeof(reply))) > 0) {
+			answered++;
+			if (reply[2] == DEVICE_COMMAND_FIRMWARE_UPDATE_STATUS && n == UDP_PACKET_HEADER_SIZE + FIRMWARE_UPDATE_STATUS_SIZE) {
+				uint32_t progress;
+				memcpy(&progress, reply + UDP_PACKET_HEADER_SIZE + 3, 4);
+				progressMonotonic = progressMonotonic && progress >= lastProgress;
+				lastProgress = progress;
+				statusReplies++;
+			}
+		}
+
+		// let the image trickle in
+		struct pollfd p = { client, POLLIN, 0 };
+		poll(&p, 1, 1);
+	}
+	double downloadMs = nowMs() - start;
+
+	while ((n = receiveReply(reply, sizeof(reply))) > 0) {
+		answered++;
+	}
+
+	printf("\nimage %ld KB at %ld KB/s\n", imageKB, rateKB);
+	printf("%-44s %10.2f ms\n", "FIRMWARE_UPDATE reply", firstReply);
+	printf("%-44s %10.1f ms\n", "download", downloadMs);
+	printf("%-44s %10.2f ms\n", "longest loop() during download", longestLoop);
+	printf("%-44s %10.1f ms\n", "unresponsive with blocking ESPhttpUpdate", downloadMs);
+	printf("%-44s %7ld / %ld\n", "UDP requests answered during download", answered, sent);
+	printf("%-44s %10ld\n\n", "status replies", statusReplies);
+
+	check(FirmwareUpdate.getState() == FIRMWARE_UPDATE_OK, "download finished");
+	check(Update.hostImage == http.image, "written image matches the served one");
+	check(http.lastHead.find("x-ESP8266-STA-MAC: ") != std::string::npos && http.lastHead.find("x-ESP8266-sketch-size: ") != std::string::npos, "request carries the ESPhttpUpdate headers");
+	check(answered == sent, "every UDP request was answered during the download");
+	check(progressMonotonic && statusReplies > 0, "status reports increasing progress");
+	check(ESP.hostRestarts == 0, "no reboot before the reboot delay");
+
+	delay(FIRMWARE_UPDATE_REBOOT_DELAY);
+	server.loop();
+	check(ESP.hostRestarts == 1, "reboot after the reboot delay");
+
+	// 4. an image which does not match its x-MD5 is refused
+	http.md5 = hostMD5((const uint8_t*)"other", 5);
+	requestUpdate(base + "rgbc.200302.bin", 0);
+	server.loop();
+	while (FirmwareUpdate.isRunning()) {
+		server.loop();
+	}
+	check(FirmwareUpdate.getState() == FIRMWARE_UPDATE_FAILED && FirmwareUpdate.getError() == FIRMWARE_ERROR_MD5, "image not matching its x-MD5 is refused");
+
+	http.md5 = "not a digest";
+	requestUpdate(base + "rgbc.200302.bin", 0);
+	server.loop();
+	while (FirmwareUpdate.isRunning()) {
+		server.loop();
+	}
+	check(FirmwareUpdate.getState() == FIRMWARE_UPDATE_FAILED && FirmwareUpdate.getError() == FIRMWARE_ERROR_MD5, "malformed x-MD5 is refused");
+	http.md5 = "";
+
+	// 5. an image without content is refused
+	http.image.resize(0);
+	requestUpdate(base + "rgbc.200302.bin", 0);
+	server.loop();
+	while (FirmwareUpdate.isRunning()) {
+		server.loop();
+	}
+	check(FirmwareUpdate.getState() == FIRMWARE_UPDATE_FAILED, "empty image is refused");
+
+	http.stop();
+	close(client);
+	return failures == 0 ? 0 : 1;
+}
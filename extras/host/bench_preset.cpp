@@ -0,0 +1,257 @@
+/***
+*
+*	A household switching between three lighting states SWITCHES times, on two LED controllers and two AC
+*	dimmers: the app re-sending every value as one DEVICE_COMMAND_SET_TRANSACTION, against one
+*	DEVICE_COMMAND_PRESET_RECALL of a preset saved once. Both with fixed EEPROM addresses and with the
+*	RecordStore ring. Reported are bytes sent, EEPROM commits, bytes committed and flash sector erases.
+*	Then: the current preset survives a reboot, a change after a recall leaves the preset and survives a reboot
+*	as well, and a preset which no longer matches the controllers is refused.
+*
+*	usage: bench_preset [switches]
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "spi_flash.h"
+#include "DeviceServer.h"
+#include "PresetStore.h"
+#include "Persistence.h"
+#include "RecordStore.h"
+#include "HostControllers.h"
+#include "BenchUtil.h"
+
+static const uint16_t RING_FIRST_SECTOR = 8;
+static const int PRESETS = 3;
+static const int PRESET_ADDRESS = 500;
+
+static void varint(std::vector<byte>& p, uint16_t value) {
+	byte b[3];
+	p.insert(p.end(), b, b + writeVarint(b, value));
+}
+
+struct Device {
+	LEDController* leds[2];
+	ACDimmerController* dimmers[2];
+	ESP8266Controller* all[4];
+	DeviceServer* server;
+	PresetStore* presets;
+};
+
+// controllers at fixed addresses, their values loaded, and the current preset restored
+static Device boot(ESPConfig* config) {
+	Device d;
+	d.all[0] = d.leds[0] = new LEDController("LED", 4, 100);
+	d.all[1] = d.leds[1] = new LEDController("LED", 5, 220);
+	d.all[2] = d.dimmers[0] = new ACDimmerController("Dimmer", 12, 340);
+	d.all[3] = d.dimmers[1] = new ACDimmerController("Dimmer", 13, 420);
+	d.server = new DeviceServer(config);
+	for (ESP8266Controller* c : d.all) {
+		c->eepromStoreIds = true;
+		c->loadCapabilities();
+		d.server->addController(c);
+	}
+	d.presets = new PresetStore(PRESET_ADDRESS);
+	d.server->usePresets(d.presets);
+	return d;
+}
+
+// the controllers are left allocated, firmware never frees them either
+static void shutdown(Device& d) {
+	delete d.presets;
+	delete d.server;
+}
+
+// what the sketch loop() does: serve, then save the controllers whose eeprom_update_interval has passed
+static void sketchLoop(Device& d) {
+	d.server->loop();
+	for (ESP8266Controller* c : d.all) {
+		c->loop();
+		if (c->eepromUpdatePending && millis() - c->lastEepromUpdate >= eeprom_update_interval) {
+			c->saveCapabilities();
+			c->lastEepromUpdate = millis();
+		}
+	}
+}
+
+// lighting state n: switch on, colours and dim levels of its own
+static void setState(Device& d, int n, std::vector<std::vector<uint16_t>>& values) {
+	values.clear();
+	for (ESP8266Controller* c : d.all) {
+		std::vector<uint16_t> v;
+		for (int id = 0; id < c->capabilityCount; id++) {
+			uint16_t range = c->capabilities[id]._value_max - c->capabilities[id]._value_min;
+			v.push_back(id == 0 ? 1 : c->capabilities[id]._value_min + (range * (n + 1) * (id + 2) / 7) % (range + 1));
+		}
+		values.push_back(v);
+	}
+}
+
+// SET_TRANSACTION with every value of every controller
+static std::vector<byte> transaction(Device& d, const std::vector<std::vector<uint16_t>>& values) {
+	std::vector<byte> p = { 4 };
+	for (int c = 0; c < 4; c++) {
+		p.push_back(d.all[c]->pin);
+		varint(p, values[c].size());
+		for (size_t id = 0; id < values[c].size(); id++) {
+			varint(p, id);
+			varint(p, values[c][id]);
+		}
+	}
+	return packet(DEVICE_COMMAND_SET_TRANSACTION, p);
+}
+
+static bool matches(Device& d, const std::vector<std::vector<uint16_t>>& values) {
+	for (int c = 0; c < 4; c++) {
+		for (size_t id = 0; id < values[c].size(); id++) {
+			if (d.all[c]->capabilities[id]._value != values[c][id]) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+struct Cost {
+	unsigned long bytes = 0;
+	unsigned long commits = 0;
+	unsigned long changed = 0;
+	unsigned long erases = 0;
+	bool correct = true;
+};
+
+static Cost measure(Device& d, long switches, bool recall, const std::vector<std::vector<std::vector<uint16_t>>>& states) {
+	Cost cost;
+	byte reply[UDP_PACKET_MAX_SIZE];
+	EEPROM.resetStats();
+	unsigned long commits = Persistence.commits;
+	unsigned long written = Persistence.bytesWritten;
+	unsigned long ringErases = hostFlashTotalErases();
+
+	for (long i = 0; i < switches; i++) {
+		int n = i % PRESETS;
+		std::vector<byte> p = recall ? packet(DEVICE_COMMAND_PRESET_RECALL, { (byte)n }) : transaction(d, states[n]);
+		d.server->dispatch(p.data(), p.size(), reply);
+		cost.bytes += p.size();
+		cost.correct = cost.correct && matches(d, states[n]);
+		sketchLoop(d);
+		delay(eeprom_update_interval);
+		sketchLoop(d);
+	}
+
+	cost.commits = Persistence.recordStore() ? Persistence.commits - commits : EEPROM.stats.sectorErases;
+	cost.changed = Persistence.bytesWritten - written;
+	cost.erases = Persistence.recordStore() ? hostFlashTotalErases() - ringErases : EEPROM.stats.sectorErases;
+	return cost;
+}
+
+static void print(const char* name, const Cost& c) {
+	printf("%-32s %10lu %10lu %14lu %14lu\n", name, c.bytes, c.commits, c.changed, c.erases);
+}
+
+// save the states as presets 0..PRESETS-1
+static void savePresets(Device& d, const std::vector<std::vector<std::vector<uint16_t>>>& states) {
+	byte reply[UDP_PACKET_MAX_SIZE];
+	const char* names[PRESETS] = { "day", "evening", "night" };
+	for (int n = 0; n < PRESETS; n++) {
+		std::vector<byte> t = transaction(d, states[n]);
+		d.server->dispatch(t.data(), t.size(), reply);
+		std::vector<byte> payload(1 + MAX_LENGTH_NAME, 0);
+		payload[0] = n;
+		memcpy(payload.data() + 1, names[n], strlen(names[n]));
+		std::vector<byte> p = packet(DEVICE_COMMAND_PRESET_SAVE, payload);
+		d.server->dispatch(p.data(), p.size(), reply);
+	}
+	Persistence.flush();
+}
+
+int main(int argc, char** argv) {
+	long switches = argc > 1 ? atol(argv[1]) : 300;
+
+	ESPConfig config("Controller", "Unknown", "rgbc.200217.bin", "onion", "242374666");
+	config.init(-1);
+	Device d = boot(&config);
+
+	std::vector<std::vector<std::vector<uint16_t>>> states(PRESETS);
+	for (int n = 0; n < PRESETS; n++) {
+		setState(d, n, states[n]);
+	}
+
+	// fixed EEPROM addresses
+	savePresets(d, states);
+	Cost eepromSet = measure(d, switches, false, states);
+	Cost eepromRecall = measure(d, switches, true, states);
+
+	// record store ring
+	hostFlashReset();
+	RecordStore store;
+	store.begin(RING_FIRST_SECTOR, 4);
+	Persistence.useRecordStore(&store);
+	savePresets(d, states);
+	Cost ringSet = measure(d, switches, false, states);
+	Cost ringRecall = measure(d, switches, true, states);
+	Persistence.useRecordStore(NULL);
+
+	char name[MAX_LENGTH_NAME];
+	d.presets->name(1, name);
+
+	printf("\n%ld switches between %d states (\"%s\", ...) of 2 LED controllers and 2 dimmers\n\n", switches, PRESETS, name);
+	printf("%-32s %10s %10s %14s %14s\n", "", "bytes sent", "commits", "bytes written", "sector erases");
+	print("EEPROM, SET_TRANSACTION", eepromSet);
+	print("EEPROM, PRESET_RECALL", eepromRecall);
+	print("record store, SET_TRANSACTION", ringSet);
+	print("record store, PRESET_RECALL", ringRecall);
+	printf("\n");
+
+	check(eepromRecall.correct && ringRecall.correct, "every recall sets all controllers to the preset");
+	check(eepromRecall.bytes * 10 <= eepromSet.bytes, "a recall takes a tenth of the transaction bytes or less");
+	check(eepromRecall.changed * 10 <= eepromSet.changed, "a recall changes a tenth of the EEPROM bytes or less");
+	check(ringRecall.changed * 10 <= ringSet.changed && ringRecall.erases < ringSet.erases, "with the ring, a recall writes a fraction and erases less");
+	// besides the current preset, left once by the first transaction
+	check(ringSet.commits <= (unsigned long)switches + 1, "with the ring, a SET_TRANSACTION is one record");
+
+	// reboot in a preset: the controller blocks are older, the preset is put back over them
+	byte reply[UDP_PACKET_MAX_SIZE];
+	std::vector<byte> p = packet(DEVICE_COMMAND_PRESET_RECALL, { 2 });
+	d.server->dispatch(p.data(), p.size(), reply);
+	Persistence.flush();
+	shutdown(d);
+	d = boot(&config);
+	check(d.presets->current() == 2 && matches(d, states[2]), "the current preset is restored at boot");
+
+	// a SET leaves the preset, every block catches up and the change survives a reboot
+	p = packet(DEVICE_COMMAND_SET_CONTROLLER, { d.leds[0]->pin, 1 | CAPABILITY_ID_FLAG, 2, 0x2A, 0x00 });
+	d.server->dispatch(p.data(), p.size(), reply);
+	sketchLoop(d);
+	delay(eeprom_update_interval);
+	sketchLoop(d);
+	Persistence.flush();
+	std::vector<std::vector<uint16_t>> changed = states[2];
+	changed[0][2] = 42;
+	check(d.presets->current() == PRESET_NONE, "a change after a recall leaves the preset");
+	shutdown(d);
+	d = boot(&config);
+	check(d.presets->current() == PRESET_NONE && matches(d, changed), "the change, not the preset, is restored at boot");
+
+	// a preset of controllers which are gone
+	shutdown(d);
+	DeviceServer fewer(&config);
+	LEDController led("LED", 4, 100);
+	fewer.addController(&led);
+	PresetStore presets(PRESET_ADDRESS);
+	fewer.usePresets(&presets);
+	p = packet(DEVICE_COMMAND_PRESET_RECALL, { 0 });
+	fewer.dispatch(p.data(), p.size(), reply);
+	check(reply[UDP_PACKET_HEADER_SIZE] == PRESET_MISMATCH, "a preset of other controllers is refused");
+
+	// the last slots of a store too close to the end of the EEPROM
+	PresetStore tooHigh(PERSISTENCE_SIZE - presetStoreSize() + 1);
+	check(presets.save(3, "Evening", &fewer) == PRESET_OK && tooHigh.save(0, "Evening", &fewer) == PRESET_WRITE_FAILED,
+			"a store past the end of the EEPROM reports a failed write");
+
+	printf("\n%s\n", failures ? "FAILED" : "all checks passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,245 @@
+/***
+*
+*	Blink timing of a dimmer while a client floods DeviceServer with GETALL/SET datagrams, with the sketch style
+*	loop() (server, controllers, deferred save and flush one after the other) against the Scheduler. The dimmer
+*	toggles its pin every BLINK_PERIOD milliseconds from its own loop(); reported is how far the gaps between
+*	toggles stray from that period.
+*	Every datagram is charged PACKET_COST microseconds on the clock (WiFiUDP::hostPacketCost), roughly what
+*	receiving, handling and answering one costs on the ESP8266, so the server fills its budget as on the device.
+*
+*	usage: bench_scheduler [milliseconds per run]
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include "Arduino.h"
+#include "ESPConfig.h"
+#include "DeviceServer.h"
+#include "Persistence.h"
+#include "Scheduler.h"
+#include "HostControllers.h"
+#include "BenchUtil.h"
+
+static const uint16_t UDP_PORT = 23902;
+static const unsigned long BLINK_PERIOD = 5;
+static const unsigned int PACKET_COST = 400;
+
+// AC dimmer which blinks its output, toggle times are kept for the report
+class BlinkingDimmer : public ACDimmerController {
+public:
+	BlinkingDimmer(const char* nam, uint8_t _pin, int start_address) : ACDimmerController(nam, _pin, start_address) {
+	}
+
+	void loop() {
+		if (millis() - lastToggle < BLINK_PERIOD) {
+			return;
+		}
+		lastToggle = millis();
+		pinState = pinState == HIGH ? LOW : HIGH;
+		analogWrite(pin, pinState == HIGH ? (uint32_t)capabilities[1]._value * PWMRANGE / 100 : 0);
+		toggles.push_back(micros());
+	}
+
+	unsigned long lastToggle = 0;
+	std::vector<unsigned long> toggles;
+};
+
+// client sending GETALL, and every 64th datagram a SET, as fast as the socket takes them
+class Flood {
+public:
+	std::atomic<bool> running{false};
+	std::atomic<long> sent{0};
+
+	void start(uint8_t pin) {
+		running = true;
+		worker = std::thread([this, pin]() { run(pin); });
+	}
+
+	void stop() {
+		running = false;
+		worker.join();
+	}
+
+private:
+	std::thread worker;
+
+	void run(uint8_t pin) {
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		struct sockaddr_in to;
+		memset(&to, 0, sizeof(to));
+		to.sin_family = AF_INET;
+		to.sin_port = htons(UDP_PORT);
+		to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		byte getall[4] = { 4, 0, DEVICE_COMMAND_GETALL_CONTROLLER, pin };
+		// [pin][1 capability by ID][dim = value]
+		byte set[8] = { 8, 0, DEVICE_COMMAND_SET_CONTROLLER, pin, 1 | CAPABILITY_ID_FLAG, 1, 0, 0 };
+		byte reply[UDP_PACKET_MAX_SIZE];
+
+		for (long i = 0; running; i++) {
+			if (i % 64 == 0) {
+				set[6] = i / 64 % 100;
+				sendto(fd, set, sizeof(set), 0, (struct sockaddr*)&to, sizeof(to));
+			} else {
+				sendto(fd, getall, sizeof(getall), 0, (struct sockaddr*)&to, sizeof(to));
+			}
+			sent++;
+			while (recv(fd, reply, sizeof(reply), MSG_DONTWAIT) > 0) {
+			}
+			if (i % 16 == 0) {
+				usleep(20);
+			}
+		}
+		close(fd);
+	}
+};
+
+// stdout as a Print, for Scheduler::report
+class StdoutPrint : public Print {
+public:
+	size_t write(uint8_t c) override {
+		return fwrite(&c, 1, 1, stdout);
+	}
+	using Print::write;
+};
+
+struct Jitter {
+	double worst;
+	double p99;
+	size_t toggles;
+};
+
+static Jitter measure(const std::vector<unsigned long>& toggles) {
+	std::vector<double> deviation;
+	for (size_t i = 1; i < toggles.size(); i++) {
+		deviation.push_back(fabs((double)(toggles[i] - toggles[i - 1]) / 1000.0 - BLINK_PERIOD));
+	}
+	std::sort(deviation.begin(), deviation.end());
+	Jitter j = { 0, 0, toggles.size() };
+	if (!deviation.empty()) {
+		j.worst = deviation.back();
+		j.p99 = deviation[deviation.size() * 99 / 100];
+	}
+	return j;
+}
+
+static void callCount(void* context) {
+	(*(int*)context)++;
+}
+
+static void busy(void* context) {
+	delayMicroseconds(*(unsigned long*)context);
+}
+
+int main(int argc, char** argv) {
+	unsigned long duration = argc > 1 ? atol(argv[1]) : 2000;
+
+	ESPConfig config("Controller", "Unknown", "acds.200217.bin", "onion", "242374666");
+	config.init(-1);
+	BlinkingDimmer dimmer("Dimmer", 5, 200);
+	LEDController led("LED", 4, 300);
+	DeviceServer server(&config);
+	server.addController(&dimmer);
+	server.addController(&led);
+	server.udp.hostBindAddress = IPAddress(127, 0, 0, 1);
+	server.udp.hostPacketCost = PACKET_COST;
+	server.begin(UDP_PORT);
+	Persistence.flushInterval = 500;
+
+	Flood flood;
+
+	// 1. sketch style loop
+	flood.start(dimmer.pin);
+	unsigned long start = millis();
+	while (millis() - start < duration) {
+		server.loop();
+		dimmer.loop();
+		led.loop();
+		if (dimmer.eepromUpdatePending && millis() - dimmer.lastEepromUpdate >= eeprom_update_interval) {
+			dimmer.saveCapabilities();
+			dimmer.lastEepromUpdate = millis();
+		}
+		Persistence.loop();
+	}
+	flood.stop();
+	long sketchSent = flood.sent;
+	unsigned long sketchReplied = server.packetsReplied;
+	Jitter sketch = measure(dimmer.toggles);
+
+	// 2. scheduler
+	dimmer.toggles.clear();
+	dimmer.lastEepromUpdate = 0;
+	flood.sent = 0;
+	server.packetsReplied = 0;
+
+	Scheduler scheduler;
+	scheduler.addController(&dimmer, 1, 200);
+	scheduler.addController(&led, 10);
+	scheduler.addDeviceServer(&server);
+	scheduler.addPersistence();
+
+	flood.start(dimmer.pin);
+	start = millis();
+	while (millis() - start < duration) {
+		scheduler.loop();
+	}
+	flood.stop();
+	Jitter scheduled = measure(dimmer.toggles);
+
+	printf("\n%lu ms per run, blink every %lu ms\n\n", duration, BLINK_PERIOD);
+	printf("%-16s %10s %14s %14s %12s\n", "loop", "toggles", "worst dev ms", "p99 dev ms", "replied/sent");
+	printf("%-16s %10zu %14.2f %14.2f %5lu/%ld\n", "sketch loop", sketch.toggles, sketch.worst, sketch.p99, sketchReplied, sketchSent);
+	printf("%-16s %10zu %14.2f %14.2f %5lu/%ld\n\n", "Scheduler", scheduled.toggles, scheduled.worst, scheduled.p99, server.packetsReplied, (long)flood.sent);
+	StdoutPrint out;
+	scheduler.report(out);
+	printf("\n");
+
+	check(scheduled.p99 <= sketch.p99, "blink jitter with the scheduler is not worse");
+
+	// wheel basics
+	Scheduler wheel;
+	int once = 0, periodic = 0, cancelled = 0, far = 0;
+	wheel.after(0, callCount, &once);
+	wheel.every(3, callCount, &periodic);
+	uint8_t c = wheel.every(2, callCount, &cancelled);
+	wheel.after(150, callCount, &far);
+	wheel.cancel(c);
+	unsigned long cost = 2000;
+	wheel.after(1, busy, &cost, 500);
+
+	start = millis();
+	while (millis() - start < 100) {
+		wheel.loop();
+	}
+	check(once == 1, "one shot task runs once");
+	check(periodic >= 30 && periodic <= 34, "3 ms task runs about 33 times in 100 ms");
+	check(cancelled == 0, "cancelled task does not run");
+	check(far == 0, "task due after a turn of the wheel waits for its deadline");
+	check(wheel.overruns == 1, "run over budget is counted");
+
+	delay(60);
+	wheel.loop();
+	check(far == 1, "task due after a turn of the wheel runs");
+
+	// late loop(): a periodic task skips the missed periods
+	int late = 0;
+	Scheduler skip;
+	uint8_t t = skip.every(5, callCount, &late);
+	skip.loop();
+	delay(52);
+	skip.loop();
+	skip.loop();
+	check(late == 1 && skip.task(t)._latest >= 47, "missed periods are skipped, lateness is reported");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,202 @@
+/***
+*
+*	Traffic and change latency of a dashboard watching one LED controller for 30 minutes of device time, polling
+*	GETALL every POLL_INTERVAL ms against a DEVICE_COMMAND_SUBSCRIBE subscription renewed at half its lease. An app sets a capability at random intervals of 1 to 20 s. The clock is the simulated one (delay()),
+*	so the run takes a few seconds of real time.
+*	Then: a lost push is found from the seq gap, the subscription ends with its lease, and a value written
+*	to capabilities[] directly is pushed with all capabilities.
+*
+*	usage: bench_subscribe [simulated minutes]
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "DeviceServer.h"
+#include "HostControllers.h"
+#include "BenchUtil.h"
+
+static const uint16_t BENCH_PORT = 23904;
+static const unsigned long POLL_INTERVAL = 2000;
+static const uint16_t LEASE = 60;
+static const unsigned long TICK = 5;
+
+static std::vector<byte> subscribePayload(uint8_t pin, uint16_t lease) {
+	return { pin, lowByte(lease), highByte(lease) };
+}
+
+struct Watcher {
+	int fd;
+	unsigned long sent = 0;
+	unsigned long received = 0;
+	unsigned long bytes = 0;
+	unsigned long detected = 0;
+	unsigned long latency = 0;
+	unsigned long worst = 0;
+};
+
+static void detect(Watcher& w, unsigned long changedAt) {
+	unsigned long latency = millis() - changedAt;
+	w.detected++;
+	w.latency += latency;
+	w.worst = max(w.worst, latency);
+}
+
+int main(int argc, char** argv) {
+	unsigned long minutes = argc > 1 ? atol(argv[1]) : 30;
+
+	ESPConfig config("Controller", "Unknown", "rgbc.200217.bin", "onion", "242374666");
+	config.init(-1);
+	LEDController led("LED", 4, 200);
+	DeviceServer server(&config);
+	server.addController(&led);
+	server.udp.hostBindAddress = IPAddress(127, 0, 0, 1);
+	if (!server.begin(BENCH_PORT)) {
+		fprintf(stderr, "cannot bind port %d\n", BENCH_PORT);
+		return 1;
+	}
+
+	int app = socket(AF_INET, SOCK_DGRAM, 0);
+	Watcher poller, subscriber;
+	poller.fd = socket(AF_INET, SOCK_DGRAM, 0);
+	subscriber.fd = socket(AF_INET, SOCK_DGRAM, 0);
+	byte reply[UDP_PACKET_MAX_SIZE];
+	randomSeed(7);
+
+	sendPacket(subscriber.fd, BENCH_PORT, packet(DEVICE_COMMAND_SUBSCRIBE, subscribePayload(led.pin, LEASE)));
+	subscriber.sent++;
+
+	unsigned long start = millis();
+	unsigned long lastPoll = start - POLL_INTERVAL;
+	unsigned long lastRenew = start;
+	unsigned long nextChange = start + random(1000, 20000);
+	unsigned long changedAt = 0;
+	boolean pollerStale = false, subscriberStale = false;
+	uint16_t lastPolled = led.capabilities[1]._value;
+	uint16_t seq = 0;
+	unsigned long gaps = 0, changes = 0;
+
+	while (millis() - start < minutes * 60000) {
+
+		if ((long)(millis() - nextChange) >= 0) {
+			// [pin][1 capability by ID][red = value]
+			uint16_t value = (led.capabilities[1]._value + random(1, PWMRANGE)) % (PWMRANGE + 1);
+			sendPacket(app, BENCH_PORT, packet(DEVICE_COMMAND_SET_CONTROLLER, { led.pin, 1 | CAPABILITY_ID_FLAG, 1, lowByte(value), highByte(value) }));
+			nextChange = millis() + random(1000, 20000);
+			changedAt = millis();
+			pollerStale = subscriberStale = true;
+			changes++;
+		}
+
+		if (millis() - lastPoll >= POLL_INTERVAL) {
+			sendPacket(poller.fd, BENCH_PORT, packet(DEVICE_COMMAND_GETALL_CONTROLLER, { led.pin }));
+			poller.sent++;
+			lastPoll = millis();
+		}
+
+		if (millis() - lastRenew >= LEASE * 1000UL / 2) {
+			sendPacket(subscriber.fd, BENCH_PORT, packet(DEVICE_COMMAND_SUBSCRIBE, subscribePayload(led.pin, LEASE)));
+			subscriber.sent++;
+			lastRenew = millis();
+		}
+
+		server.loop();
+		led.loop();
+
+		while (receive(app, reply) > 0) {
+		}
+
+		int n;
+		while ((n = receive(poller.fd, reply)) > 0) {
+			poller.received++;
+			poller.bytes += n;
+			// red is the 2nd capability
+			const byte* red = reply + UDP_PACKET_HEADER_SIZE + CONTROLLER_UDP_CAPABILITIES + CAPABILITY_UDP_SIZE + offsetof(_unit16_capability, _value);
+			uint16_t value = red[0] | (red[1] << 8);
+			if (value != lastPolled) {
+				lastPolled = value;
+				if (pollerStale) {
+					detect(poller, changedAt);
+					pollerStale = false;
+				}
+			}
+		}
+
+		while ((n = receive(subscriber.fd, reply)) > 0) {
+			subscriber.received++;
+			subscriber.bytes += n;
+			if (reply[2] != DEVICE_COMMAND_CHANGED) {
+				continue;
+			}
+			uint16_t pushed = reply[3] | (reply[4] << 8);
+			gaps += pushed != (uint16_t)(seq + 1);
+			seq = pushed;
+			if (subscriberStale) {
+				detect(subscriber, changedAt);
+				subscriberStale = false;
+			}
+		}
+
+		delay(TICK);
+	}
+
+	printf("\n%lu simulated minutes, %lu changes, poll every %lu ms, lease %u s\n\n", minutes, changes, POLL_INTERVAL, LEASE);
+	printf("%-12s %8s %10s %10s %10s %14s %14s\n", "watcher", "sent", "received", "bytes in", "detected", "avg latency ms", "worst ms");
+	printf("%-12s %8lu %10lu %10lu %10lu %14lu %14lu\n", "GETALL poll", poller.sent, poller.received, poller.bytes, poller.detected,
+			poller.detected ? poller.latency / poller.detected : 0, poller.worst);
+	printf("%-12s %8lu %10lu %10lu %10lu %14lu %14lu\n\n", "subscribe", subscriber.sent, subscriber.received, subscriber.bytes, subscriber.detected,
+			subscriber.detected ? subscriber.latency / subscriber.detected : 0, subscriber.worst);
+
+	check(subscriber.detected == changes && gaps == 0, "every change is pushed, in sequence");
+	check(subscriber.bytes * 10 < poller.bytes, "subscription takes a tenth of the polling traffic or less");
+	check(subscriber.worst <= 2 * TICK, "pushes arrive within the next loop()");
+
+	// a lost push shows as a gap
+	led.setCapabilityById(1, 10);
+	server.loop();
+	receive(subscriber.fd, reply);
+	led.setCapabilityById(1, 20);
+	server.loop();
+	receive(subscriber.fd, reply);
+	check((uint16_t)(reply[3] | (reply[4] << 8)) == (uint16_t)(seq + 2), "a dropped push shows as a seq gap");
+
+	// capabilities[] written directly: all capabilities are pushed
+	led.capabilities[4]._value = 1;
+	led.changeCount++;
+	server.loop();
+	int pushed = receive(subscriber.fd, reply);
+	check(pushed > 0 && reply[UDP_PACKET_HEADER_SIZE + 3] == led.capabilityCount, "change outside setCapability pushes every capability");
+
+	// lease runs out without a renewal
+	delay(LEASE * 1000UL);
+	led.setCapabilityById(1, 30);
+	server.loop();
+	check(receive(subscriber.fd, reply) == 0, "nothing is pushed once the lease ended");
+
+	// more subscribers than slots
+	int extra[SUBSCRIBER_MAX + 1];
+	uint8_t results[SUBSCRIBER_MAX + 1];
+	for (int i = 0; i <= SUBSCRIBER_MAX; i++) {
+		extra[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		sendPacket(extra[i], BENCH_PORT, packet(DEVICE_COMMAND_SUBSCRIBE, subscribePayload(SUBSCRIBE_ALL_PINS, LEASE)));
+		server.loop();
+		results[i] = receive(extra[i], reply) > UDP_PACKET_HEADER_SIZE ? reply[UDP_PACKET_HEADER_SIZE] : 0xFF;
+	}
+	check(results[0] == SUBSCRIBE_OK && results[SUBSCRIBER_MAX - 1] == SUBSCRIBE_OK && results[SUBSCRIBER_MAX] == SUBSCRIBE_FULL,
+			"subscribers beyond SUBSCRIBER_MAX are refused");
+
+	sendPacket(extra[0], BENCH_PORT, packet(DEVICE_COMMAND_SUBSCRIBE, subscribePayload(SUBSCRIBE_ALL_PINS, 0)));
+	server.loop();
+	receive(extra[0], reply);
+	led.setCapabilityById(1, 40);
+	server.loop();
+	check(receive(extra[0], reply) == 0 && receive(extra[1], reply) > 0, "lease 0 ends the subscription");
+
+	return failures == 0 ? 0 : 1;
+}
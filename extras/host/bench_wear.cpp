@@ -0,0 +1,242 @@
+/***
+*
+*	Flash wear of persisted user changes: fixed EEPROM addresses (one sector erase per commit) against the
+*	RecordStore ring. Each logical write is one controller capability change followed by saveCapabilities().
+*	Afterwards the ring is re-opened from flash to check that every key recovers its newest value, and a write
+*	torn by a simulated reset must leave the previous value readable, and so must a torn batch of two controllers.
+*	Last, the word-wise Persistence::write and fill are checked against a byte-wise reference.
+*
+*	usage: bench_wear [logical writes] [ring sectors]
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "spi_flash.h"
+#include "Persistence.h"
+#include "RecordStore.h"
+#include "HostControllers.h"
+#include "BenchUtil.h"
+
+static const uint16_t RING_FIRST_SECTOR = 8;
+static const int CONTROLLERS = 4;
+
+// CONTROLLER_MAX_CAPABILITIES, the largest record a controller stores by name
+static const _capability_schema WIDE_CAPABILITIES[CONTROLLER_MAX_CAPABILITIES] PROGMEM = {
+	{"c0", 0, 1023, 0}, {"c1", 0, 1023, 0}, {"c2", 0, 1023, 0}, {"c3", 0, 1023, 0},
+	{"c4", 0, 1023, 0}, {"c5", 0, 1023, 0}, {"c6", 0, 1023, 0}, {"c7", 0, 1023, 0},
+	{"c8", 0, 1023, 0}, {"c9", 0, 1023, 0}, {"c10", 0, 1023, 0}, {"c11", 0, 1023, 0},
+	{"c12", 0, 1023, 0}, {"c13", 0, 1023, 0}, {"c14", 0, 1023, 0}, {"c15", 0, 1023, 0}
+};
+
+class WideController : public StaticController<CONTROLLER_MAX_CAPABILITIES> {
+public:
+	WideController(uint8_t _pin, int start_address) : StaticController<CONTROLLER_MAX_CAPABILITIES>("Wide", _pin, start_address, WIDE_CAPABILITIES) {
+	}
+
+	void loop() {
+	}
+};
+
+static void changeAndSave(LEDController** leds, long i) {
+	LEDController* led = leds[i % CONTROLLERS];
+	led->capabilities[1 + (i % 3)]._value = (uint16_t)((i * 7) % PWMRANGE);
+	led->saveCapabilities();
+}
+
+int main(int argc, char** argv) {
+	long writes = argc > 1 ? atol(argv[1]) : 10000;
+	int sectors = argc > 2 ? atoi(argv[2]) : 4;
+
+	LEDController* leds[CONTROLLERS];
+	for (int i = 0; i < CONTROLLERS; i++) {
+		leds[i] = new LEDController("LED", i + 4, 200 + i * 120);
+	}
+
+	// fixed EEPROM addresses
+	EEPROM.resetStats();
+	for (long i = 0; i < writes; i++) {
+		changeAndSave(leds, i);
+	}
+	unsigned long eepromErases = EEPROM.stats.sectorErases;
+
+	// record store ring
+	hostFlashReset();
+	RecordStore store;
+	store.begin(RING_FIRST_SECTOR, sectors);
+	Persistence.useRecordStore(&store);
+	for (long i = 0; i < writes; i++) {
+		changeAndSave(leds, i);
+	}
+	unsigned long ringErases = hostFlashTotalErases();
+	unsigned long maxSectorErases = 0;
+	for (int s = 0; s < HOST_FLASH_SECTORS; s++) {
+		maxSectorErases = max(maxSectorErases, hostFlashErases[s]);
+	}
+
+	printf("%ld logical writes, %d controllers, LEDController record %d bytes\n\n", writes, CONTROLLERS, leds[0]->sizeOfEEPROM());
+	printf("%-24s %14s %18s %22s\n", "scheme", "sector erases", "erases per write", "max erases per sector");
+	printf("%-24s %14lu %18.4f %22lu\n", "fixed EEPROM addresses", eepromErases, (double)eepromErases / writes, eepromErases);
+	printf("%-24s %14lu %18.4f %22lu\n", "record store ring", ringErases, (double)ringErases / writes, maxSectorErases);
+	printf("\nring: %lu appends, %lu unchanged, %lu erases\n\n", store.appends, store.unchanged, store.erases);
+
+	// newest values survive a reboot
+	RecordStore rebooted;
+	rebooted.begin(RING_FIRST_SECTOR, sectors);
+	Persistence.useRecordStore(&rebooted);
+	bool recovered = true;
+	for (int i = 0; i < CONTROLLERS; i++) {
+		LEDController fresh("LED", leds[i]->pin, leds[i]->eeprom_address);
+		fresh.loadCapabilities();
+		for (int c = 0; c < fresh.capabilityCount; c++) {
+			recovered = recovered && fresh.capabilities[c]._value == leds[i]->capabilities[c]._value;
+		}
+	}
+	check(recovered, "reboot recovers the newest record of every controller");
+
+	// a torn write keeps the previous value
+	leds[0]->capabilities[1]._value = 111;
+	leds[0]->saveCapabilities();
+	leds[0]->capabilities[1]._value = 222;
+	hostFlashTearAfter = 20;
+	leds[0]->saveCapabilities();
+
+	RecordStore afterTear;
+	afterTear.begin(RING_FIRST_SECTOR, sectors);
+	Persistence.useRecordStore(&afterTear);
+	LEDController torn("LED", leds[0]->pin, leds[0]->eeprom_address);
+	torn.loadCapabilities();
+	check(torn.capabilities[1]._value == 111, "torn write falls back to the previous record");
+
+	torn.capabilities[1]._value = 333;
+	torn.saveCapabilities();
+	RecordStore afterRewrite;
+	afterRewrite.begin(RING_FIRST_SECTOR, sectors);
+	Persistence.useRecordStore(&afterRewrite);
+	LEDController rewritten("LED", leds[0]->pin, leds[0]->eeprom_address);
+	rewritten.loadCapabilities();
+	check(rewritten.capabilities[1]._value == 333, "store keeps working after a torn write");
+
+	// a batch is one record, compaction splits what is still current out of it
+	unsigned long batchCommits = Persistence.commits;
+	for (long i = 0; i < writes / 2; i++) {
+		Persistence.beginBatch();
+		changeAndSave(leds, 2 * i);
+		changeAndSave(leds, 2 * i + 1);
+		Persistence.endBatch();
+	}
+	bool onePerBatch = Persistence.commits - batchCommits == (unsigned long)(writes / 2);
+	RecordStore afterBatches;
+	afterBatches.begin(RING_FIRST_SECTOR, sectors);
+	Persistence.useRecordStore(&afterBatches);
+	bool batchesRecovered = true;
+	for (int i = 0; i < CONTROLLERS; i++) {
+		LEDController fresh("LED", leds[i]->pin, leds[i]->eeprom_address);
+		fresh.loadCapabilities();
+		for (int c = 0; c < fresh.capabilityCount; c++) {
+			batchesRecovered = batchesRecovered && fresh.capabilities[c]._value == leds[i]->capabilities[c]._value;
+		}
+	}
+	check(onePerBatch && batchesRecovered, "batches of two controllers recovered after the ring wrapped");
+
+	// torn while the batch is written: neither controller takes its new value
+	leds[0]->capabilities[1]._value = 601;
+	leds[1]->capabilities[1]._value = 602;
+	Persistence.beginBatch();
+	leds[0]->saveCapabilities();
+	leds[1]->saveCapabilities();
+	Persistence.endBatch();
+	unsigned long beforeTornBatch = afterBatches.appends;
+	leds[0]->capabilities[1]._value = 701;
+	leds[1]->capabilities[1]._value = 702;
+	Persistence.beginBatch();
+	leds[0]->saveCapabilities();
+	leds[1]->saveCapabilities();
+	hostFlashTearAfter = 40;
+	Persistence.endBatch();
+	bool oneAppend = afterBatches.appends == beforeTornBatch + 1;
+
+	RecordStore afterTornBatch;
+	afterTornBatch.begin(RING_FIRST_SECTOR, sectors);
+	Persistence.useRecordStore(&afterTornBatch);
+	LEDController first("LED", leds[0]->pin, leds[0]->eeprom_address);
+	LEDController second("LED", leds[1]->pin, leds[1]->eeprom_address);
+	first.loadCapabilities();
+	second.loadCapabilities();
+	check(oneAppend && first.capabilities[1]._value == 601 && second.capabilities[1]._value == 602, "a torn batch leaves every controller at its previous values");
+
+	// the largest controller record, stored by name, survives a reboot
+	WideController wide(14, 700);
+	wide.capabilities[15]._value = 555;
+	wide.saveCapabilities();
+	RecordStore afterWide;
+	afterWide.begin(RING_FIRST_SECTOR, sectors);
+	Persistence.useRecordStore(&afterWide);
+	WideController wideAgain(14, 700);
+	wideAgain.loadCapabilities();
+	check(wideAgain.capabilities[15]._value == 555, "a controller of CONTROLLER_MAX_CAPABILITIES fits a record");
+
+	// a pin past MAX_CONTROLLER_PIN has no record key of its own, 17 would land on the current preset's
+	LEDController stray("LED", MAX_CONTROLLER_PIN + 1, 900);
+	unsigned long appendsBefore = afterWide.appends;
+	stray.saveCapabilities();
+	byte presetRecord[RECORD_MAX_LENGTH];
+	check(afterWide.appends == appendsBefore && afterWide.read(RECORD_KEY_PRESET_CURRENT, presetRecord, sizeof(presetRecord)) == 0, "a controller past MAX_CONTROLLER_PIN writes no record");
+
+	Persistence.useRecordStore(NULL);
+
+	// a device in the field turns the store on: its values are still read from EEPROM, the first save moves them
+	leds[1]->capabilities[2]._value = 444;
+	leds[1]->saveCapabilities();
+	Persistence.flush();
+	hostFlashReset();
+	RecordStore migrated;
+	migrated.begin(RING_FIRST_SECTOR, sectors);
+	Persistence.useRecordStore(&migrated);
+	LEDController field("LED", leds[1]->pin, leds[1]->eeprom_address);
+	field.loadCapabilities();
+	bool fromEeprom = field.capabilities[2]._value == 444;
+	field.saveCapabilities();
+	byte record[CONTROLLER_EEPROM_MAX_SIZE];
+	check(fromEeprom && migrated.read(RECORD_KEY_CONTROLLER + field.pin, record, sizeof(record)) == field.sizeOfEEPROM(), "a new store reads EEPROM values until their first save");
+
+	// factory reset erases the store as well
+	ESPConfig config("Controller", "Unknown", "rgbc.200217.bin", "onion", "242374666");
+	config.resetEEPROM();
+	check(migrated.read(RECORD_KEY_CONTROLLER + field.pin, record, sizeof(record)) == 0, "resetEEPROM erases the record store");
+	Persistence.useRecordStore(NULL);
+
+	// word-wise diff against a byte-wise reference: random lengths, alignments and sparse changes
+	byte reference[PERSISTENCE_SIZE];
+	Persistence.read(0, reference, PERSISTENCE_SIZE);
+	bool same = true, reported = true;
+	for (int i = 0; i < 20000; i++) {
+		int address = random(0, PERSISTENCE_SIZE - 1);
+		int len = random(1, min(PERSISTENCE_SIZE - address, 200) + 1);
+		byte staged[200];
+		memcpy(staged, reference + address, len);
+		bool change = random(0, 4) != 0;
+		for (int n = change ? random(1, 6) : 0; n > 0; n--) {
+			staged[random(0, len)] ^= 1 << random(0, 8);
+		}
+		bool differs = memcmp(staged, reference + address, len) != 0;
+		bool changed = Persistence.write(address, staged, len);
+		memcpy(reference + address, staged, len);
+		reported = reported && changed == differs;
+		same = same && memcmp(EEPROM.getConstDataPtr(), reference, PERSISTENCE_SIZE) == 0;
+	}
+	Persistence.flush();
+	check(same && reported, "word-wise write matches a byte-wise update, reports changes");
+
+	bool filled = Persistence.fill(3, 0xA5, 501);
+	bool refilled = Persistence.fill(3, 0xA5, 501);
+	bool spans = true;
+	for (int i = 3; i < 504; i++) {
+		spans = spans && EEPROM.getConstDataPtr()[i] == 0xA5;
+	}
+	check(filled && !refilled && spans, "fill sets an unaligned range, a repeat reports no change");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+/***
+*
+*	Fetch the binary log of a device with DEVICE_COMMAND_GET_LOG and print it as text, formatted by the
+*	same ESPLog::printRecord the device uses for Serial.
+*
+*	usage: esplog <device ip> [port] [-f]      -f keeps polling for new records
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "Arduino.h"
+#include "ESPConfig.h"
+#include "ESPLog.h"
+#include "DeviceServer.h"
+
+// stdout as a Print
+class StdoutPrint : public Print {
+public:
+	size_t write(uint8_t c) override {
+		return fwrite(&c, 1, 1, stdout);
+	}
+	size_t write(const uint8_t* buffer, size_t size) override {
+		return fwrite(buffer, 1, size, stdout);
+	}
+	using Print::write;
+};
+
+static uint16_t readShort(const byte* p) {
+	return p[0] | (p[1] << 8);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: esplog <device ip> [port] [-f]\n");
+		return 2;
+	}
+
+	struct sockaddr_in device;
+	memset(&device, 0, sizeof(device));
+	device.sin_family = AF_INET;
+	device.sin_port = htons(argc > 2 && argv[2][0] != '-' ? atoi(argv[2]) : port);
+	if (inet_aton(argv[1], &device.sin_addr) == 0) {
+		fprintf(stderr, "bad address %s\n", argv[1]);
+		return 2;
+	}
+	bool follow = strcmp(argv[argc - 1], "-f") == 0;
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	StdoutPrint out;
+	uint16_t since = 0;
+
+	do {
+		byte packet[5] = { 5, 0, DEVICE_COMMAND_GET_LOG, lowByte(since), highByte(since) };
+		sendto(fd, packet, sizeof(packet), 0, (struct sockaddr*)&device, sizeof(device));
+
+		struct pollfd p = { fd, POLLIN, 0 };
+		if (poll(&p, 1, 1000) <= 0) {
+			fprintf(stderr, "no reply\n");
+			return 1;
+		}
+
+		byte reply[1500];
+		int n = recv(fd, reply, sizeof(reply), 0);
+		if (n < UDP_PACKET_HEADER_SIZE + LOG_REPLY_HEADER_SIZE || reply[2] != DEVICE_COMMAND_GET_LOG) {
+			fprintf(stderr, "bad reply\n");
+			return 1;
+		}
+
+		const byte* payload = reply + UDP_PACKET_HEADER_SIZE;
+		uint16_t first = readShort(payload);
+		uint16_t next = readShort(payload + 2);
+		uint8_t count = payload[6];
+
+		if (first != since && since != 0) {
+			printf("-- %u records lost\n", (uint16_t)(first - since));
+		}
+
+		const byte* rec = payload + LOG_REPLY_HEADER_SIZE;
+		for (int i = 0; i < count && rec + LOG_RECORD_WIRE_SIZE <= reply + n; i++, rec += LOG_RECORD_WIRE_SIZE) {
+			_log_record r;
+			r._seq = readShort(rec);
+			r._time = rec[2] | (rec[3] << 8) | (rec[4] << 16) | ((uint32_t)rec[5] << 24);
+			r._level = rec[6];
+			r._module = rec[7];
+			r._event = rec[8];
+			r._a = (int16_t)readShort(rec + 9);
+			r._b = (int16_t)readShort(rec + 11);
+			ESPLog::printRecord(out, r);
+		}
+		fflush(stdout);
+
+		since = next;
+		if (follow && count == 0) {
+			sleep(1);
+		}
+	} while (follow);
+
+	close(fd);
+	return 0;
+}
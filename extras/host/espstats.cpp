@@ -0,0 +1,173 @@
+/***
+*
+*	Fetch DEVICE_COMMAND_GET_STATS from a device and print it decoded.
+*
+*	usage: espstats <device ip> [port] [-r]      -r clears the device counters after the reply
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "Arduino.h"
+#include "ESPConfig.h"
+#include "ESPMetrics.h"
+#include "DeviceServer.h"
+
+static const char* commandName(uint8_t command) {
+	switch (command) {
+	case DEVICE_COMMAND_NONE: return "unparsable/other";
+	case DEVICE_COMMAND_DISCOVER: return "DISCOVER";
+	case DEVICE_COMMAND_SET_CONFIGURATION: return "SET_CONFIGURATION";
+	case DEVICE_COMMAND_SET_CONFIGURATION_NAME: return "SET_CONFIGURATION_NAME";
+	case DEVICE_COMMAND_SET_CONFIGURATION_SSID: return "SET_CONFIGURATION_SSID";
+	case DEVICE_COMMAND_SET_CONFIGURATION_AP: return "SET_CONFIGURATION_AP";
+	case DEVICE_COMMAND_SET_CONFIGURATION_LOCATION: return "SET_CONFIGURATION_LOCATION";
+	case DEVICE_COMMAND_GET_CONTROLLER: return "GET_CONTROLLER";
+	case DEVICE_COMMAND_SET_CONTROLLER: return "SET_CONTROLLER";
+	case DEVICE_COMMAND_GETALL_CONTROLLER: return "GETALL_CONTROLLER";
+	case DEVICE_COMMAND_SETALL_CONTROLLER: return "SETALL_CONTROLLER";
+	case DEVICE_COMMAND_FIRMWARE_UPDATE: return "FIRMWARE_UPDATE";
+	case DEVICE_COMMAND_GET_PROTOCOL_VERSION: return "GET_PROTOCOL_VERSION";
+	case DEVICE_COMMAND_GETALL_CONTROLLER_V2: return "GETALL_CONTROLLER_V2";
+	case DEVICE_COMMAND_SETALL_CONTROLLER_V2: return "SETALL_CONTROLLER_V2";
+	case DEVICE_COMMAND_FIRMWARE_UPDATE_STATUS: return "FIRMWARE_UPDATE_STATUS";
+	case DEVICE_COMMAND_GET_LOG: return "GET_LOG";
+	case DEVICE_COMMAND_GET_STATS: return "GET_STATS";
+	case DEVICE_COMMAND_SUBSCRIBE: return "SUBSCRIBE";
+	case DEVICE_COMMAND_SET_TRANSACTION: return "SET_TRANSACTION";
+	case DEVICE_COMMAND_FADE: return "FADE";
+	case DEVICE_COMMAND_PRESET_SAVE: return "PRESET_SAVE";
+	case DEVICE_COMMAND_PRESET_RECALL: return "PRESET_RECALL";
+	}
+	return "?";
+}
+
+static const char* LATENCY_NAMES[METRICS_LATENCY_COUNT] = { "ESPConfig::set", "Controller::fromByteArray", "Controller::toByteArray" };
+
+// reads LEB128 varints up to 32 bits, stops at the end of the reply
+class Reader {
+public:
+	Reader(const byte* _data, int _length) : data(_data), length(_length) {}
+
+	uint8_t byte1() {
+		return index < length ? data[index++] : (failed = true, 0);
+	}
+
+	uint32_t varint() {
+		uint32_t result = 0;
+		for (int shift = 0; shift < 35; shift += 7) {
+			uint8_t b = byte1();
+			result |= (uint32_t)(b & 0x7F) << shift;
+			if (!(b & 0x80)) {
+				break;
+			}
+		}
+		return result;
+	}
+
+	bool failed = false;
+
+private:
+	const byte* data;
+	int length;
+	int index = 0;
+};
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: espstats <device ip> [port] [-r]\n");
+		return 2;
+	}
+
+	struct sockaddr_in device;
+	memset(&device, 0, sizeof(device));
+	device.sin_family = AF_INET;
+	device.sin_port = htons(argc > 2 && argv[2][0] != '-' ? atoi(argv[2]) : port);
+	if (inet_aton(argv[1], &device.sin_addr) == 0) {
+		fprintf(stderr, "bad address %s\n", argv[1]);
+		return 2;
+	}
+	byte flags = strcmp(argv[argc - 1], "-r") == 0 ? METRICS_FLAG_RESET : 0;
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	byte packet[4] = { 4, 0, DEVICE_COMMAND_GET_STATS, flags };
+	sendto(fd, packet, sizeof(packet), 0, (struct sockaddr*)&device, sizeof(device));
+
+	struct pollfd p = { fd, POLLIN, 0 };
+	if (poll(&p, 1, 1000) <= 0) {
+		fprintf(stderr, "no reply\n");
+		return 1;
+	}
+
+	byte reply[UDP_PACKET_MAX_SIZE];
+	int n = recv(fd, reply, sizeof(reply), 0);
+	close(fd);
+	if (n <= UDP_PACKET_HEADER_SIZE || reply[2] != DEVICE_COMMAND_GET_STATS) {
+		fprintf(stderr, "bad reply\n");
+		return 1;
+	}
+
+	Reader in(reply + UDP_PACKET_HEADER_SIZE, n - UDP_PACKET_HEADER_SIZE);
+
+	uint8_t version = in.byte1();
+	// version 1 ends after the latencies
+	if (version < 1 || version > METRICS_STATS_VERSION) {
+		fprintf(stderr, "stats version %d not supported\n", version);
+		return 1;
+	}
+
+	printf("%-28s %10u s\n", "uptime", in.varint());
+	printf("%-28s %10u B\n", "free heap", in.varint());
+	printf("%-28s %10u B\n", "lowest free heap", in.varint());
+	printf("%-28s %10u B\n", "lowest free stack", in.varint());
+	printf("%-28s %10u\n", "WiFi connects", in.varint());
+	printf("%-28s %10u\n", "WiFi disconnects", in.varint());
+	printf("%-28s %10u\n", "EEPROM commits", in.varint());
+	printf("%-28s %10u B\n", "EEPROM bytes written", in.varint());
+	printf("%-28s %10u\n", "flushes with nothing to do", in.varint());
+	printf("%-28s %10u\n", "config saves", in.varint());
+	printf("%-28s %10u\n", "capability saves", in.varint());
+
+	printf("\n%-28s %10s %10s %10s\n", "command", "received", "replied", "dropped");
+	uint8_t commands = in.byte1();
+	for (int i = 0; i < commands && !in.failed; i++) {
+		uint8_t command = in.byte1();
+		uint32_t received = in.varint();
+		uint32_t replied = in.varint();
+		uint32_t dropped = in.varint();
+		printf("%-28s %10u %10u %10u\n", commandName(command), received, replied, dropped);
+	}
+
+	printf("\n%-28s %8s %8s %8s  %s\n", "latency", "count", "avg us", "max us", "<16 <64 <256 <1K <4K <16K <64K >=64K us");
+	for (int op = 0; op < METRICS_LATENCY_COUNT && !in.failed; op++) {
+		uint32_t count = in.varint();
+		uint32_t total = in.varint();
+		uint32_t longest = in.varint();
+		printf("%-28s %8u %8u %8u ", LATENCY_NAMES[op], count, count ? total / count : 0, longest);
+		for (int b = 0; b < METRICS_LATENCY_BUCKETS; b++) {
+			printf(" %u", in.varint());
+		}
+		printf("\n");
+	}
+
+	if (version >= 2) {
+		uint32_t capacity = in.varint();
+		uint32_t used = in.varint();
+		printf("\n%-28s %10u / %u B\n", "arena used", used, capacity);
+		printf("%-28s %10u B\n", "arena padding", in.varint());
+		printf("%-28s %10u\n", "arena allocations failed", in.varint());
+		printf("%-28s %10u B\n", "largest free heap block", in.varint());
+		printf("%-28s %10u %%\n", "heap fragmentation", in.varint());
+	}
+
+	if (in.failed) {
+		fprintf(stderr, "reply truncated\n");
+		return 1;
+	}
+	return 0;
+}
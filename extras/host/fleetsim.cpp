@@ -0,0 +1,618 @@
+/***
+*
+*	Fleet simulator: N virtual devices, each an ESPConfig with its own controllers and DeviceServer bound to
+*	its own loopback address (127.1.0.1, 127.1.0.2, ...) on the device port, speaking the real protocol.
+*
+*	Devices are spread over worker processes (one per core by default). The library keeps its state in
+*	globals (Persistence, EEPROM, WiFi), so a worker switches them to a device before serving it: EEPROM.hostUse()
+*	points at the device's flash image, a memory mapped file <dir>/device-NNNNN.eeprom, and the device's RAM copy.
+*	Persistence commits on every save (flushInterval 0), so nothing is pending across a switch. Images survive the
+*	simulator, a second run boots every device from what the first one saved; -r reboots random devices while
+*	running (objects and RAM copy are dropped and rebuilt from the image).
+*
+*	With -c the simulator also loads the fleet itself: client threads keep one request outstanding per socket
+*	(GETALL, DISCOVER or SET to a random device) and report request rate and latency percentiles. Without -c it
+*	serves until interrupted, e.g. for an app pointed at the addresses.
+*
+*	usage: fleetsim [-n devices] [-w workers] [-k led,dimmer,...] [-d image dir] [-p port]
+*	                [-c client threads] [-s sockets per client] [-t seconds] [-r reboot every ms per worker]
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "ESPConfig.h"
+#include "DeviceServer.h"
+#include "Persistence.h"
+#include "ESPMetrics.h"
+#include "HostControllers.h"
+
+// first device address, 127.1.0.1
+static const uint32_t FLEET_BASE_ADDRESS = (127u << 24) | (1u << 16) | 1u;
+
+// controller pins in the order of -k, and their EEPROM regions after ESPConfig
+static const uint8_t CONTROLLER_PINS[] = { 4, 5, 12, 13, 14, 15 };
+static const int CONTROLLER_EEPROM_FIRST = 100;
+static const int CONTROLLER_EEPROM_STRIDE = 150;
+
+// client: a request without reply after this is counted lost and replaced
+static const long CLIENT_TIMEOUT_US = 500000;
+
+struct Options {
+	int devices = 1000;
+	int workers = 0;
+	std::vector<std::string> kinds = { "led" };
+	std::string dir = "fleet";
+	uint16_t udpPort = port;
+	int clients = 0;
+	int sockets = 64;
+	int seconds = 10;
+	long rebootEvery = 0;
+};
+
+static Options options;
+
+static long long nowUs() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t deviceAddress(int index) {
+	return FLEET_BASE_ADDRESS + index;
+}
+
+// ---- device side -----------------------------------------------------------------------------------------
+
+struct VirtualDevice {
+	int index;
+	char name[16];
+	uint8_t mac[WL_MAC_ADDR_LENGTH];
+
+	// flash sector (memory mapped image file) and the RAM copy EEPROM.begin() would make
+	uint8_t* flash;
+	uint8_t data[PERSISTENCE_SIZE];
+
+	ESPConfig* config = NULL;
+	std::vector<ESP8266Controller*> controllers;
+	DeviceServer* server = NULL;
+
+	boolean savePending = false;
+};
+
+static VirtualDevice* activeDevice = NULL;
+
+// point the library globals at this device
+static void activate(VirtualDevice* device) {
+	if (activeDevice == device) {
+		return;
+	}
+	if (Persistence.isDirty()) {
+		Persistence.flush();
+	}
+	EEPROM.hostUse(device->flash, device->data, PERSISTENCE_SIZE);
+	memcpy(WiFi.hostMac, device->mac, WL_MAC_ADDR_LENGTH);
+	activeDevice = device;
+}
+
+static uint8_t* mapImage(int index) {
+	char path[512];
+	snprintf(path, sizeof(path), "%s/device-%05d.eeprom", options.dir.c_str(), index);
+
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+	boolean fresh = st.st_size < SPI_FLASH_SEC_SIZE;
+	if (fresh && ftruncate(fd, SPI_FLASH_SEC_SIZE) != 0) {
+		perror(path);
+		exit(1);
+	}
+
+	uint8_t* flash = (uint8_t*)mmap(NULL, SPI_FLASH_SEC_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (flash == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	// erased flash reads back as 0xFF
+	if (fresh) {
+		memset(flash, 0xFF, SPI_FLASH_SEC_SIZE);
+	}
+	return flash;
+}
+
+// power on: RAM copy from flash, objects built and restored as a sketch's setup() does
+static void boot(VirtualDevice* device) {
+	activate(device);
+	EEPROM.begin(PERSISTENCE_SIZE);
+
+	device->config = new ESPConfig(device->name, "fleet", "sim.200217.bin", "onion", "242374666");
+	device->config->init(-1, true);
+
+	for (size_t k = 0; k < options.kinds.size(); k++) {
+		uint8_t pin = CONTROLLER_PINS[k];
+		int address = CONTROLLER_EEPROM_FIRST + k * CONTROLLER_EEPROM_STRIDE;
+		ESP8266Controller* controller;
+		if (options.kinds[k] == "dimmer") {
+			controller = new ACDimmerController("Dimmer", pin, address);
+		} else {
+			controller = new LEDController("LED", pin, address);
+		}
+		controller->loadCapabilities();
+		device->controllers.push_back(controller);
+	}
+
+	device->server = new DeviceServer(device->config);
+	for (ESP8266Controller* controller : device->controllers) {
+		device->server->addController(controller);
+	}
+	device->server->udp.hostBindAddress = IPAddress(htonl(deviceAddress(device->index)));
+	if (!device->server->begin(options.udpPort)) {
+		fprintf(stderr, "device %d cannot bind %s:%d\n", device->index, device->server->udp.hostBindAddress.toString().c_str(), options.udpPort);
+		exit(1);
+	}
+}
+
+// power off: whatever was not committed is gone
+static void shutdown(VirtualDevice* device) {
+	delete device->server;
+	for (ESP8266Controller* controller : device->controllers) {
+		delete controller;
+	}
+	device->controllers.clear();
+	delete device->config;
+	device->server = NULL;
+	device->config = NULL;
+	device->savePending = false;
+
+	if (activeDevice == device) {
+		activeDevice = NULL;
+	}
+}
+
+// what the sketch loop() does after the controllers changed: save once eeprom_update_interval has passed
+static boolean deferredSave(VirtualDevice* device) {
+	boolean pending = false;
+
+	for (ESP8266Controller* controller : device->controllers) {
+		if (!controller->eepromUpdatePending) {
+			continue;
+		}
+		if (millis() - controller->lastEepromUpdate >= eeprom_update_interval) {
+			activate(device);
+			controller->saveCapabilities();
+			controller->lastEepromUpdate = millis();
+		} else {
+			pending = true;
+		}
+	}
+	return pending;
+}
+
+static volatile sig_atomic_t stopWorker = 0;
+
+static void onStop(int) {
+	stopWorker = 1;
+}
+
+struct WorkerReport {
+	long long packets;
+	long long busyUs;
+	long long wallUs;
+	long reboots;
+	long capabilitySaves;
+	long configSaves;
+	long devices;
+};
+
+static void watch(int epoll, VirtualDevice* device) {
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = device;
+	epoll_ctl(epoll, EPOLL_CTL_ADD, device->server->udp.hostSocket(), &event);
+}
+
+static void runWorker(int worker, int readyPipe, int reportPipe) {
+	signal(SIGTERM, onStop);
+	signal(SIGINT, SIG_IGN);
+
+	WiFi.hostConnectDelay = 0;
+	Persistence.flushInterval = 0;
+	Serial.echo = false;
+
+	std::vector<VirtualDevice*> devices;
+	for (int i = worker; i < options.devices; i += options.workers) {
+		VirtualDevice* device = new VirtualDevice();
+		device->index = i;
+		snprintf(device->name, sizeof(device->name), "sim-%05d", i);
+		uint8_t mac[WL_MAC_ADDR_LENGTH] = { 0x5C, 0xCF, 0x7F, (uint8_t)(i >> 16), (uint8_t)(i >> 8), (uint8_t)i };
+		memcpy(device->mac, mac, sizeof(mac));
+		device->flash = mapImage(i);
+		boot(device);
+		devices.push_back(device);
+	}
+
+	int epoll = epoll_create1(0);
+	for (VirtualDevice* device : devices) {
+		watch(epoll, device);
+	}
+
+	char ready = 1;
+	if (write(readyPipe, &ready, 1) != 1) {
+		exit(1);
+	}
+	close(readyPipe);
+
+	WorkerReport report = {};
+	report.devices = devices.size();
+	std::vector<VirtualDevice*> pendingSaves;
+	std::mt19937 random(worker + 1);
+	long long start = nowUs();
+	long long nextReboot = start + options.rebootEvery * 1000;
+	long long nextSaveSweep = start;
+	struct epoll_event events[256];
+
+	while (!stopWorker) {
+
+		int n = epoll_wait(epoll, events, 256, 10);
+
+		long long busyStart = nowUs();
+		for (int e = 0; e < n; e++) {
+			VirtualDevice* device = (VirtualDevice*)events[e].data.ptr;
+			activate(device);
+			report.packets += device->server->loop();
+
+			if (!device->savePending) {
+				for (ESP8266Controller* controller : device->controllers) {
+					if (controller->eepromUpdatePending) {
+						device->savePending = true;
+						pendingSaves.push_back(device);
+						break;
+					}
+				}
+			}
+		}
+
+		long long now = nowUs();
+		if (now >= nextSaveSweep) {
+			// keep the ones still waiting for eeprom_update_interval
+			size_t kept = 0;
+			for (VirtualDevice* device : pendingSaves) {
+				if (device->savePending && deferredSave(device)) {
+					pendingSaves[kept++] = device;
+				} else {
+					device->savePending = false;
+				}
+			}
+			pendingSaves.resize(kept);
+			nextSaveSweep = now + 100000;
+		}
+
+		if (options.rebootEvery > 0 && now >= nextReboot && !devices.empty()) {
+			VirtualDevice* device = devices[random() % devices.size()];
+			epoll_ctl(epoll, EPOLL_CTL_DEL, device->server->udp.hostSocket(), NULL);
+			pendingSaves.erase(std::remove(pendingSaves.begin(), pendingSaves.end(), device), pendingSaves.end());
+			shutdown(device);
+			boot(device);
+			watch(epoll, device);
+			report.reboots++;
+			nextReboot = now + options.rebootEvery * 1000;
+		}
+
+		report.busyUs += nowUs() - busyStart;
+	}
+
+	report.wallUs = nowUs() - start;
+	report.capabilitySaves = Metrics.capabilitySaves;
+	report.configSaves = Metrics.configSaves;
+
+	if (write(reportPipe, &report, sizeof(report)) != sizeof(report)) {
+		exit(1);
+	}
+	exit(0);
+}
+
+// ---- client side -----------------------------------------------------------------------------------------
+
+struct ClientSocket {
+	int fd;
+	long long sentAt;
+};
+
+struct ClientResult {
+	long long sent = 0;
+	long long answered = 0;
+	long long lost = 0;
+	std::vector<uint32_t> latencies;
+};
+
+static std::atomic<bool> clientsRunning{true};
+
+static int buildRequest(byte* packet, std::mt19937& random) {
+	int roll = random() % 10;
+	uint8_t pin = CONTROLLER_PINS[random() % options.kinds.size()];
+
+	if (roll < 2) {
+		packet[2] = DEVICE_COMMAND_DISCOVER;
+		packet[0] = UDP_PACKET_HEADER_SIZE;
+	} else if (roll < 9) {
+		packet[2] = DEVICE_COMMAND_GETALL_CONTROLLER;
+		packet[3] = pin;
+		packet[0] = UDP_PACKET_HEADER_SIZE + 1;
+	} else {
+		// [pin][1 capability by ID][switch = 0 or 1]
+		packet[2] = DEVICE_COMMAND_SET_CONTROLLER;
+		packet[3] = pin;
+		packet[4] = 1 | CAPABILITY_ID_FLAG;
+		packet[5] = 0;
+		packet[6] = random() % 2;
+		packet[7] = 0;
+		packet[0] = UDP_PACKET_HEADER_SIZE + 5;
+	}
+	packet[1] = 0;
+	return packet[0];
+}
+
+static void send(ClientSocket& s, std::mt19937& random, ClientResult& result) {
+	byte packet[16];
+	int length = buildRequest(packet, random);
+
+	struct sockaddr_in to;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_port = htons(options.udpPort);
+	to.sin_addr.s_addr = htonl(deviceAddress(random() % options.devices));
+
+	s.sentAt = nowUs();
+	sendto(s.fd, packet, length, 0, (struct sockaddr*)&to, sizeof(to));
+	result.sent++;
+}
+
+static void runClient(int id, ClientResult* result) {
+	std::mt19937 random(1000 + id);
+	std::vector<ClientSocket> sockets(options.sockets);
+	int epoll = epoll_create1(0);
+
+	for (size_t i = 0; i < sockets.size(); i++) {
+		sockets[i].fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.u32 = i;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, sockets[i].fd, &event);
+		send(sockets[i], random, *result);
+	}
+
+	struct epoll_event events[256];
+	byte reply[UDP_PACKET_MAX_SIZE];
+	long long lastTimeoutScan = nowUs();
+
+	while (clientsRunning) {
+		int n = epoll_wait(epoll, events, 256, 50);
+		long long now = nowUs();
+
+		for (int e = 0; e < n; e++) {
+			ClientSocket& s = sockets[events[e].data.u32];
+			while (recv(s.fd, reply, sizeof(reply), 0) > 0) {
+				// a late reply to a request already counted lost is taken for the current one
+				result->answered++;
+				result->latencies.push_back((uint32_t)std::max(0LL, nowUs() - s.sentAt));
+				send(s, random, *result);
+			}
+		}
+
+		if (now - lastTimeoutScan >= 50000) {
+			for (ClientSocket& s : sockets) {
+				if (now - s.sentAt >= CLIENT_TIMEOUT_US) {
+					result->lost++;
+					send(s, random, *result);
+				}
+			}
+			lastTimeoutScan = now;
+		}
+	}
+
+	for (ClientSocket& s : sockets) {
+		close(s.fd);
+	}
+	close(epoll);
+}
+
+// ---- main ------------------------------------------------------------------------------------------------
+
+static void usage() {
+	fprintf(stderr, "usage: fleetsim [-n devices] [-w workers] [-k led,dimmer,...] [-d image dir] [-p port]\n"
+			"                [-c client threads] [-s sockets per client] [-t seconds] [-r reboot every ms per worker]\n");
+	exit(2);
+}
+
+static void parseOptions(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "n:w:k:d:p:c:s:t:r:")) != -1) {
+		switch (opt) {
+		case 'n': options.devices = atoi(optarg); break;
+		case 'w': options.workers = atoi(optarg); break;
+		case 'd': options.dir = optarg; break;
+		case 'p': options.udpPort = atoi(optarg); break;
+		case 'c': options.clients = atoi(optarg); break;
+		case 's': options.sockets = atoi(optarg); break;
+		case 't': options.seconds = atoi(optarg); break;
+		case 'r': options.rebootEvery = atol(optarg); break;
+		case 'k': {
+			options.kinds.clear();
+			std::string list = optarg;
+			size_t from = 0;
+			while (from <= list.size()) {
+				size_t comma = list.find(',', from);
+				std::string kind = list.substr(from, comma == std::string::npos ? std::string::npos : comma - from);
+				if (kind != "led" && kind != "dimmer") {
+					usage();
+				}
+				options.kinds.push_back(kind);
+				if (comma == std::string::npos) {
+					break;
+				}
+				from = comma + 1;
+			}
+			break;
+		}
+		default: usage();
+		}
+	}
+
+	if (options.workers <= 0) {
+		options.workers = std::max(1u, std::thread::hardware_concurrency());
+	}
+	options.workers = std::min(options.workers, options.devices);
+	if (options.devices <= 0 || options.devices > 65000 || options.kinds.empty() || options.kinds.size() > sizeof(CONTROLLER_PINS)) {
+		usage();
+	}
+}
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void onInterrupt(int) {
+	interrupted = 1;
+}
+
+int main(int argc, char** argv) {
+	parseOptions(argc, argv);
+	mkdir(options.dir.c_str(), 0755);
+
+	// a socket per device
+	struct rlimit files;
+	getrlimit(RLIMIT_NOFILE, &files);
+	files.rlim_cur = files.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &files);
+
+	std::vector<pid_t> workers;
+	std::vector<int> reports;
+	long long bootStart = nowUs();
+
+	for (int w = 0; w < options.workers; w++) {
+		int ready[2], report[2];
+		if (pipe(ready) != 0 || pipe(report) != 0) {
+			perror("pipe");
+			return 1;
+		}
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(ready[0]);
+			close(report[0]);
+			runWorker(w, ready[1], report[1]);
+		}
+
+		close(ready[1]);
+		close(report[1]);
+		char c;
+		if (read(ready[0], &c, 1) != 1) {
+			fprintf(stderr, "worker %d failed to start\n", w);
+			return 1;
+		}
+		close(ready[0]);
+		workers.push_back(pid);
+		reports.push_back(report[0]);
+	}
+
+	struct in_addr first, last;
+	first.s_addr = htonl(deviceAddress(0));
+	last.s_addr = htonl(deviceAddress(options.devices - 1));
+	printf("%d devices (%s", options.devices, inet_ntoa(first));
+	printf(" - %s port %d), %d workers, booted in %.0f ms, images in %s/\n", inet_ntoa(last), options.udpPort, options.workers,
+			(nowUs() - bootStart) / 1000.0, options.dir.c_str());
+
+	signal(SIGINT, onInterrupt);
+
+	std::vector<ClientResult> results(options.clients);
+	long long loadStart = nowUs();
+
+	if (options.clients > 0) {
+		std::vector<std::thread> clients;
+		for (int c = 0; c < options.clients; c++) {
+			clients.emplace_back(runClient, c, &results[c]);
+		}
+		for (int s = 0; s < options.seconds * 10 && !interrupted; s++) {
+			usleep(100000);
+		}
+		clientsRunning = false;
+		for (std::thread& t : clients) {
+			t.join();
+		}
+	} else {
+		printf("serving, interrupt to stop\n");
+		while (!interrupted) {
+			pause();
+		}
+	}
+	double loadSeconds = (nowUs() - loadStart) / 1e6;
+
+	WorkerReport total = {};
+	double busiest = 0;
+	for (size_t w = 0; w < workers.size(); w++) {
+		kill(workers[w], SIGTERM);
+		WorkerReport report;
+		if (read(reports[w], &report, sizeof(report)) == sizeof(report)) {
+			total.packets += report.packets;
+			total.reboots += report.reboots;
+			total.capabilitySaves += report.capabilitySaves;
+			total.configSaves += report.configSaves;
+			busiest = std::max(busiest, (double)report.busyUs / report.wallUs);
+		}
+		waitpid(workers[w], NULL, 0);
+	}
+
+	printf("\n%-32s %12lld\n", "datagrams served", total.packets);
+	printf("%-32s %12ld\n", "reboots", total.reboots);
+	printf("%-32s %12ld\n", "capability saves", total.capabilitySaves);
+	printf("%-32s %12.1f %%\n", "busiest worker", busiest * 100);
+
+	if (options.clients > 0) {
+		ClientResult all;
+		for (ClientResult& r : results) {
+			all.sent += r.sent;
+			all.answered += r.answered;
+			all.lost += r.lost;
+			all.latencies.insert(all.latencies.end(), r.latencies.begin(), r.latencies.end());
+		}
+		std::sort(all.latencies.begin(), all.latencies.end());
+		auto percentile = [&](double p) -> double {
+			return all.latencies.empty() ? 0 : all.latencies[std::min(all.latencies.size() - 1, (size_t)(all.latencies.size() * p))] / 1.0;
+		};
+
+		printf("\n%d client threads x %d outstanding, %.1f s\n", options.clients, options.sockets, loadSeconds);
+		printf("%-32s %12lld\n", "requests answered", all.answered);
+		printf("%-32s %12lld\n", "requests lost", all.lost);
+		printf("%-32s %12.0f /s\n", "request rate", all.answered / loadSeconds);
+		printf("%-32s %12.0f us\n", "latency p50", percentile(0.50));
+		printf("%-32s %12.0f us\n", "latency p99", percentile(0.99));
+		printf("%-32s %12.0f us\n", "latency p99.9", percentile(0.999));
+		printf("%-32s %12.0f us\n", "latency max", all.latencies.empty() ? 0.0 : (double)all.latencies.back());
+	}
+
+	return 0;
+}
@@ -0,0 +1,289 @@
+/***
+*
+*	Fuzz target for the packet decoders. Every input is one datagram, handed to the device twice:
+*
+*	dispatch   DeviceServer::dispatch on a copy of exactly the input's size, so AddressSanitizer reports any
+*	           read past the datagram (the receive buffer on the device is larger and would hide it)
+*	loop       sent over loopback to the server and received by DeviceServer::loop(), request ID stripping,
+*	           DISCOVER scheduling and the reply caches included
+*
+*	against an ESPConfig, an LED controller (pin 4), an AC dimmer (pin 5) and a PresetStore.
+*
+*	libFuzzer (clang)   make libfuzzer CXX=clang++ && build/libfuzzer/fuzz_packet [corpus dir]
+*	standalone          build/fuzz_packet [-n inputs] [-s seed] [file...]
+*
+*	Standalone, the library is built with -fsanitize=address,undefined and the inputs are valid datagrams of
+*	every command, truncated, extended and with bytes flipped, or the given files (libFuzzer crash reproducers).
+*	Reported are inputs/s and the slowest input, which has to stay under MAX_INPUT_MICROS: a malformed
+*	datagram must not stall the device.
+*
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <random>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "DeviceServer.h"
+#include "FirmwareUpdater.h"
+#include "HostControllers.h"
+#include "PresetStore.h"
+#include "BenchUtil.h"
+
+static const uint16_t FUZZ_PORT = 23905;
+static const unsigned long MAX_INPUT_MICROS = 50000;
+
+struct Device {
+	ESPConfig* config;
+	LEDController* led;
+	ACDimmerController* dimmer;
+	DeviceServer* server;
+	int fd;
+	struct sockaddr_in to;
+};
+
+static Device* device() {
+	static Device* d = NULL;
+	if (d != NULL) {
+		return d;
+	}
+
+	d = new Device();
+	d->config = new ESPConfig("Controller", "Unknown", "rgbc.200217.bin", "onion", "242374666");
+	d->config->init(-1);
+	d->led = new LEDController("LED", 4, 200);
+	d->dimmer = new ACDimmerController("Dimmer", 5, 300);
+	d->server = new DeviceServer(d->config);
+	d->server->addController(d->led);
+	d->server->addController(d->dimmer);
+	d->server->usePresets(new PresetStore(600));
+	d->server->udp.hostBindAddress = IPAddress(127, 0, 0, 1);
+	if (!d->server->begin(FUZZ_PORT)) {
+		fprintf(stderr, "cannot bind port %d\n", FUZZ_PORT);
+		exit(1);
+	}
+
+	d->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&d->to, 0, sizeof(d->to));
+	d->to.sin_family = AF_INET;
+	d->to.sin_port = htons(FUZZ_PORT);
+	d->to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return d;
+}
+
+// a started update would refuse every later FIRMWARE_UPDATE and connect from the next loop(), start over instead
+static void cancelUpdate() {
+	if (FirmwareUpdate.isRunning()) {
+		FirmwareUpdate = FirmwareUpdater();
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	Device* d = device();
+
+	if (size > UDP_PACKET_MAX_SIZE) {
+		size = UDP_PACKET_MAX_SIZE;
+	}
+
+	// exact size copy, nothing after it to read by accident
+	byte* packet = (byte*)malloc(size ? size : 1);
+	if (size > 0) {
+		memcpy(packet, data, size);
+	}
+	byte reply[UDP_PACKET_MAX_SIZE];
+	d->server->dispatch(packet, size, reply);
+	free(packet);
+	cancelUpdate();
+
+	sendto(d->fd, data, size, 0, (struct sockaddr*)&d->to, sizeof(d->to));
+	d->server->loop();
+	while (recv(d->fd, reply, sizeof(reply), MSG_DONTWAIT) > 0) {
+	}
+	cancelUpdate();
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+static std::vector<byte> text(const char* s, size_t size) {
+	std::vector<byte> field(size, 0);
+	memcpy(field.data(), s, min(strlen(s), size));
+	return field;
+}
+
+static std::vector<byte> join(std::initializer_list<std::vector<byte>> parts) {
+	std::vector<byte> all;
+	for (const std::vector<byte>& part : parts) {
+		all.insert(all.end(), part.begin(), part.end());
+	}
+	return all;
+}
+
+// one valid datagram of every command the device answers
+static std::vector<std::vector<byte>> seeds() {
+	const char* url = "http://192.168.1.2/rgbc.200301.bin";
+	uint16_t urlLength = strlen(url);
+	std::vector<byte> configAll = join({ { 0 }, text("onion", 24), text("242374666", 24), text("Kitchen", 16), text("Home", 16) });
+
+	return {
+		packet(DEVICE_COMMAND_DISCOVER, {}),
+		packet(DEVICE_COMMAND_DISCOVER, { 0xF4, 0x01, DISCOVER_FLAG_SHORT, 1, 0x10, 0x00, 0x01 }),
+		packet(DEVICE_COMMAND_SET_CONFIGURATION, configAll),
+		packet(DEVICE_COMMAND_SET_CONFIGURATION, join({ { DEVICE_COMMAND_SET_CONFIGURATION_NAME }, text("Hall", 16) })),
+		packet(DEVICE_COMMAND_SET_CONFIGURATION_NAME, text("Porch", 16)),
+		packet(DEVICE_COMMAND_SET_CONFIGURATION_SSID, join({ text("onion", 24), text("242374666", 24) })),
+		packet(DEVICE_COMMAND_SET_CONFIGURATION_AP, {}),
+		packet(DEVICE_COMMAND_SET_CONFIGURATION_LOCATION, text("Garden", 16)),
+		packet(DEVICE_COMMAND_FIRMWARE_UPDATE, join({ { 0, lowByte(urlLength), highByte(urlLength) }, text(url, urlLength) })),
+		packet(DEVICE_COMMAND_GET_CONTROLLER, { 4 }),
+		packet(DEVICE_COMMAND_GETALL_CONTROLLER, { 5 }),
+		packet(DEVICE_COMMAND_SET_CONTROLLER, join({ { 4, 1 }, text("red", 16), { 0x00, 0x02 } })),
+		packet(DEVICE_COMMAND_SETALL_CONTROLLER, { 5, 2 | CAPABILITY_ID_FLAG, 0, 1, 0, 1, 40, 0 }),
+		packet(DEVICE_COMMAND_GETALL_CONTROLLER_V2, { 4, CAPABILITY_V2_SCHEMA }),
+		packet(DEVICE_COMMAND_SETALL_CONTROLLER_V2, { 4, 2, 1, 0x80, 0x02, 5, 0xE8, 0x07 }),
+		packet(DEVICE_COMMAND_GET_PROTOCOL_VERSION, {}),
+		packet(DEVICE_COMMAND_FIRMWARE_UPDATE_STATUS, {}),
+		packet(DEVICE_COMMAND_GET_LOG, { 0, 0 }),
+		packet(DEVICE_COMMAND_GET_STATS, { 0 }),
+		packet(DEVICE_COMMAND_SUBSCRIBE, { 4, 60, 0 }),
+		packet(DEVICE_COMMAND_SET_TRANSACTION, { 2, 4, 1, 1, 0x80, 0x02, 5, 1, 1, 40 }),
+		packet(DEVICE_COMMAND_FADE, { 4, 0xE8, 0x03, EASE_IN_OUT, 2, 1, 0x80, 0x02, 2, 10 }),
+		packet(DEVICE_COMMAND_PRESET_SAVE, join({ { 1 }, text("evening", 16) })),
+		packet(DEVICE_COMMAND_PRESET_RECALL, { 1 }),
+		packet(DEVICE_COMMAND_GETALL_CONTROLLER | REQUEST_ID_FLAG, { 0x34, 0x12, 4 }),
+	};
+}
+
+// a seed with 1 to 4 changes: cut, extended, bytes flipped or set to a boundary value, another command
+static std::vector<byte> mutate(std::mt19937& rng, const std::vector<std::vector<byte>>& seeds) {
+	std::vector<byte> input;
+
+	if (rng() % 8 == 0) {
+		input.resize(rng() % 64);
+		for (byte& b : input) {
+			b = rng();
+		}
+		return input;
+	}
+
+	static const byte boundaries[] = { 0x00, 0x01, 0x7F, 0x80, 0xFF };
+	input = seeds[rng() % seeds.size()];
+
+	for (int changes = 1 + rng() % 4; changes > 0; changes--) {
+		switch (rng() % 5) {
+		case 0:
+			input.resize(rng() % (input.size() + 1));
+			break;
+		case 1:
+			for (int n = 1 + rng() % 8; n > 0; n--) {
+				input.push_back(rng());
+			}
+			break;
+		case 2:
+			if (!input.empty()) {
+				input[rng() % input.size()] ^= 1 << (rng() % 8);
+			}
+			break;
+		case 3:
+			if (!input.empty()) {
+				input[rng() % input.size()] = boundaries[rng() % sizeof(boundaries)];
+			}
+			break;
+		case 4:
+			if (input.size() > 2) {
+				input[2] = rng() % (DEVICE_COMMAND_PRESET_RECALL + 2);
+			}
+			break;
+		}
+	}
+	return input;
+}
+
+static unsigned long worst = 0;
+
+// every 16-bit value decodes back from writeVarint, encodings of more than 16 bits and overlong ones are refused
+static bool strictVarints() {
+	bool ok = true;
+	for (uint32_t v = 0; v <= 0xFFFF; v++) {
+		byte b[3];
+		int n = writeVarint(b, v);
+		uint16_t a = 0, r = 0;
+		PacketReader in(b, n);
+		ok = ok && readVarint(b, &a) == n && a == v && in.varint(&r) && r == v && in.remaining() == 0;
+	}
+	const byte refused[][4] = {
+		{ 0x80, 0x80, 0x04, 0 },	// 17 bits
+		{ 0xFF, 0xFF, 0x83, 0x01 },	// continues past 3 bytes
+		{ 0x80, 0x00, 0, 0 },		// overlong 0
+		{ 0x81, 0x80, 0x00, 0 }		// overlong 1
+	};
+	for (const byte* b : refused) {
+		uint16_t v;
+		PacketReader in(b, 4);
+		ok = ok && readVarint((byte*)b, &v) == 0 && !in.varint(&v) && in.failed();
+	}
+	return ok;
+}
+
+static void run(const std::vector<byte>& input) {
+	unsigned long start = micros();
+	LLVMFuzzerTestOneInput(input.data(), input.size());
+	worst = max(worst, micros() - start);
+}
+
+int main(int argc, char** argv) {
+	long inputs = 200000;
+	unsigned long seed = 1;
+	std::vector<const char*> files;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			inputs = atol(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			seed = atol(argv[++i]);
+		} else {
+			files.push_back(argv[i]);
+		}
+	}
+
+	// set up (WiFi connect included) before the clock starts
+	device();
+	unsigned long start = millis();
+
+	if (!files.empty()) {
+		for (const char* file : files) {
+			FILE* f = fopen(file, "rb");
+			if (f == NULL) {
+				fprintf(stderr, "cannot open %s\n", file);
+				return 1;
+			}
+			std::vector<byte> input(UDP_PACKET_MAX_SIZE);
+			input.resize(fread(input.data(), 1, input.size(), f));
+			fclose(f);
+			run(input);
+		}
+		inputs = files.size();
+	} else {
+		std::mt19937 rng(seed);
+		std::vector<std::vector<byte>> valid = seeds();
+		for (const std::vector<byte>& input : valid) {
+			run(input);
+		}
+		for (long i = 0; i < inputs; i++) {
+			run(mutate(rng, valid));
+		}
+	}
+
+	unsigned long elapsed = max(millis() - start, 1UL);
+	printf("\n%ld inputs in %lu ms, %.0f inputs/s, slowest %lu us\n", inputs, elapsed, inputs * 1000.0 / elapsed, worst);
+	printf("%-60s %s\n", "no input stalls the device", worst <= MAX_INPUT_MICROS ? "ok" : "FAILED");
+	bool varints = strictVarints();
+	printf("%-60s %s\n", "varints decode strictly", varints ? "ok" : "FAILED");
+	return worst <= MAX_INPUT_MICROS && varints ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+/***
+*
+*	Host (Linux) stand-in for the ESP8266 Arduino core.
+*	Only what ESPConfig and ESP8266Controller use is provided. Time is real monotonic
+*	time plus whatever delay() has "slept", so blocking code paths run instantly on the host.
+*
+***/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT  0x00
+#define OUTPUT 0x01
+
+#define DEC 10
+#define HEX 16
+
+#define PWMRANGE 1023
+
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+#define strncpy_P strncpy
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void analogWrite(uint8_t pin, int val);
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+template<typename T> inline T min(T a, T b) { return a < b ? a : b; }
+template<typename T> inline T max(T a, T b) { return a > b ? a : b; }
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+inline boolean isPrintable(int c) {
+	return isprint(c) != 0;
+}
+
+class String {
+public:
+	String(const char* cstr = "") : s(cstr ? cstr : "") {}
+	String(const std::string& str) : s(str) {}
+	String(char c) : s(1, c) {}
+	String(unsigned char value, unsigned char base = DEC) { fromNumber(value, base); }
+	String(int value, unsigned char base = DEC) { fromNumber(value, base); }
+	String(unsigned int value, unsigned char base = DEC) { fromNumber(value, base); }
+	String(long value, unsigned char base = DEC) { fromNumber(value, base); }
+	String(unsigned long value, unsigned char base = DEC) { fromNumber(value, base); }
+
+	unsigned int length() const { return s.length(); }
+	const char* c_str() const { return s.c_str(); }
+
+	bool concat(const String& str) { s += str.s; return true; }
+	bool concat(const char* cstr) { s += cstr; return true; }
+	bool concat(char c) { s += c; return true; }
+	bool concat(int value) { return concat(String(value)); }
+	bool concat(unsigned int value) { return concat(String(value)); }
+	bool concat(long value) { return concat(String(value)); }
+	bool concat(unsigned long value) { return concat(String(value)); }
+
+	String& operator+=(const String& rhs) { concat(rhs); return *this; }
+	String& operator+=(const char* cstr) { concat(cstr); return *this; }
+	String& operator+=(char c) { concat(c); return *this; }
+	bool operator==(const String& rhs) const { return s == rhs.s; }
+	bool operator==(const char* cstr) const { return s == cstr; }
+
+	char charAt(unsigned int index) const { return index < s.length() ? s[index] : 0; }
+	int indexOf(char ch) const { size_t p = s.find(ch); return p == std::string::npos ? -1 : (int)p; }
+	int lastIndexOf(char ch) const { size_t p = s.rfind(ch); return p == std::string::npos ? -1 : (int)p; }
+	String substring(unsigned int from) const { return from >= s.length() ? String() : String(s.substr(from)); }
+	String substring(unsigned int from, unsigned int to) const { return from >= s.length() || to <= from ? String() : String(s.substr(from, to - from)); }
+	bool startsWith(const String& prefix) const { return s.compare(0, prefix.s.length(), prefix.s) == 0; }
+	long toInt() const { return atol(s.c_str()); }
+
+	void getBytes(unsigned char* buf, unsigned int bufsize, unsigned int index = 0) const {
+		if (!bufsize || !buf) return;
+		if (index >= s.length()) { buf[0] = 0; return; }
+		unsigned int n = s.length() - index;
+		if (n > bufsize - 1) n = bufsize - 1;
+		memcpy(buf, s.c_str() + index, n);
+		buf[n] = 0;
+	}
+	void toCharArray(char* buf, unsigned int bufsize, unsigned int index = 0) const {
+		getBytes((unsigned char*)buf, bufsize, index);
+	}
+
+private:
+	void fromNumber(unsigned long value, unsigned char base, bool negative = false) {
+		char buf[8 * sizeof(long) + 2];
+		char* p = buf + sizeof(buf) - 1;
+		*p = 0;
+		do {
+			unsigned long d = value % base;
+			*--p = d < 10 ? '0' + d : 'A' + d - 10;
+			value /= base;
+		} while (value);
+		if (negative) *--p = '-';
+		s = p;
+	}
+	void fromNumber(long value, unsigned char base) {
+		if (value < 0 && base == DEC) fromNumber((unsigned long)-value, base, true);
+		else fromNumber((unsigned long)value, base, false);
+	}
+	void fromNumber(int value, unsigned char base) { fromNumber((long)value, base); }
+	void fromNumber(unsigned int value, unsigned char base) { fromNumber((unsigned long)value, base, false); }
+	void fromNumber(unsigned char value, unsigned char base) { fromNumber((unsigned long)value, base, false); }
+
+	std::string s;
+};
+
+class Print;
+
+class Printable {
+public:
+	virtual ~Printable() {}
+	virtual size_t printTo(Print& p) const = 0;
+};
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t* buffer, size_t size) {
+		size_t n = 0;
+		while (size--) n += write(*buffer++);
+		return n;
+	}
+	size_t write(const char* str) { return str ? write((const uint8_t*)str, strlen(str)) : 0; }
+
+	size_t print(const char* str) { return write(str); }
+	size_t print(const String& str) { return write((const uint8_t*)str.c_str(), str.length()); }
+	size_t print(char c) { return write((uint8_t)c); }
+	size_t print(unsigned char value, int base = DEC) { return print(String(value, base)); }
+	size_t print(int value, int base = DEC) { return print(String(value, base)); }
+	size_t print(unsigned int value, int base = DEC) { return print(String(value, base)); }
+	size_t print(long value, int base = DEC) { return print(String(value, base)); }
+	size_t print(unsigned long value, int base = DEC) { return print(String(value, base)); }
+	size_t print(const Printable& x) { return x.printTo(*this); }
+
+	size_t println() { return write((const uint8_t*)"\r\n", 2); }
+	template<typename T> size_t println(const T& x) { size_t n = print(x); return n + println(); }
+	template<typename T> size_t println(const T& x, int base) { size_t n = print(x, base); return n + println(); }
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	virtual void flush() {}
+};
+
+// Serial output is swallowed by default and only counted, so benchmarks measure
+// the library rather than the terminal. Set echo=true to see the debug trace.
+class HardwareSerial : public Stream {
+public:
+	void begin(unsigned long) {}
+	size_t write(uint8_t c) override;
+	size_t write(const uint8_t* buffer, size_t size) override;
+	using Print::write;
+	int available() override { return 0; }
+	int read() override { return -1; }
+	int peek() override { return -1; }
+
+	bool echo = false;
+	unsigned long bytesWritten = 0;
+};
+
+extern HardwareSerial Serial;
+
+#include "Esp.h"
+
+#endif
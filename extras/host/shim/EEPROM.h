@@ -0,0 +1,71 @@
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include "Arduino.h"
+
+/***
+*
+*	Host stand-in for the ESP8266 EEPROM emulation.
+*	Like the real core, begin() copies the flash sector into a RAM buffer, write() marks the buffer
+*	dirty only when a byte changes, and commit() erases and rewrites the whole sector when dirty.
+*	The "flash" is a RAM image that can be loaded from and saved to a file, or buffers of the host's own
+*	(hostUse(), e.g. a memory mapped image file per simulated device).
+*
+***/
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef struct {
+	// EEPROM.commit() calls (including the ones from end())
+	unsigned long commits;
+
+	// commits that actually erased and rewrote the sector
+	unsigned long sectorErases;
+
+	// bytes programmed into flash (a full sector image per erase)
+	unsigned long flashBytesWritten;
+
+	// bytes whose value changed through write()
+	unsigned long bytesChanged;
+
+	// begin() calls, each one copies the sector into RAM
+	unsigned long sectorReads;
+} _eeprom_stats;
+
+class EEPROMClass {
+public:
+	void begin(size_t size);
+	uint8_t read(int address);
+	void write(int address, uint8_t value);
+	bool commit();
+	void end();
+
+	uint8_t* getDataPtr();
+	const uint8_t* getConstDataPtr() const { return _data; }
+	size_t length() { return _size; }
+
+	// host only
+	bool loadImage(const char* path);
+	bool saveImage(const char* path);
+	void resetStats();
+	uint8_t* flashImage() { return _flash; }
+
+	// flash sector (SPI_FLASH_SEC_SIZE bytes) and RAM copy (size bytes) owned by the caller from now on,
+	// nothing is copied; NULL goes back to the built-in flash
+	void hostUse(uint8_t* flash, uint8_t* data, size_t size);
+
+	_eeprom_stats stats = {};
+
+private:
+	uint8_t _ownFlash[SPI_FLASH_SEC_SIZE];
+	uint8_t* _flash = _ownFlash;
+	uint8_t* _data = nullptr;
+	bool _external = false;
+	size_t _size = 0;
+	bool _dirty = false;
+	bool _formatted = false;
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef ESP8266HTTPClient_h
+#define ESP8266HTTPClient_h
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+#include <string>
+#include <vector>
+
+#define HTTPC_ERROR_CONNECTION_FAILED (-1)
+#define HTTPC_ERROR_SEND_HEADER_FAILED (-2)
+#define HTTPC_ERROR_NOT_CONNECTED (-4)
+#define HTTPC_ERROR_READ_TIMEOUT (-11)
+
+#define HTTP_CODE_OK 200
+#define HTTP_CODE_NOT_MODIFIED 304
+
+/***
+*
+*	Host stand-in for HTTPClient: plain http://host[:port]/path, one GET per begin(),
+*	headers are read before GET() returns, within setTimeout(), and the body is left in the WiFiClient.
+*
+***/
+class HTTPClient {
+public:
+	bool begin(WiFiClient& client, const String& url);
+	void addHeader(const String& name, const String& value);
+	void setTimeout(uint16_t timeout) { _timeout = timeout; }
+	void collectHeaders(const char* headerKeys[], const size_t headerKeysCount);
+	// a collected response header, empty if the server did not send it
+	String header(const char* name);
+	int GET();
+	int getSize() { return _size; }
+	WiFiClient* getStreamPtr() { return _client; }
+	void end();
+	static String errorToString(int error);
+
+private:
+	WiFiClient* _client = NULL;
+	String _host;
+	uint16_t _port = 80;
+	String _path;
+	String _headers;
+	int _size = -1;
+	uint16_t _timeout = 5000;
+	std::vector<std::string> _collect;
+	std::vector<std::string> _values;
+};
+
+#endif
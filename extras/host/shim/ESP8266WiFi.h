@@ -0,0 +1,129 @@
+#ifndef ESP8266WiFi_h
+#define ESP8266WiFi_h
+
+#include "Arduino.h"
+
+/***
+*
+*	Host stand-in for the ESP8266WiFi library.
+*	The station "connects" hostConnectDelay milliseconds after begin() unless hostConnectFails is set.
+*	begin() with the BSSID and channel of the access point skips the scan (hostScanDelay less), with any other
+*	BSSID or channel it never connects. A static IP set with config() skips DHCP (hostDhcpDelay less).
+*
+***/
+
+#define WL_MAC_ADDR_LENGTH 6
+
+typedef enum {
+	WL_NO_SHIELD = 255,
+	WL_IDLE_STATUS = 0,
+	WL_NO_SSID_AVAIL = 1,
+	WL_SCAN_COMPLETED = 2,
+	WL_CONNECTED = 3,
+	WL_CONNECT_FAILED = 4,
+	WL_CONNECTION_LOST = 5,
+	WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef enum {
+	WIFI_OFF = 0,
+	WIFI_STA = 1,
+	WIFI_AP = 2,
+	WIFI_AP_STA = 3
+} WiFiMode_t;
+
+class IPAddress : public Printable {
+public:
+	IPAddress() : _address(0) {}
+	IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _address((uint32_t)a | ((uint32_t)b << 8) | ((uint32_t)c << 16) | ((uint32_t)d << 24)) {}
+	IPAddress(uint32_t address) : _address(address) {}
+
+	operator uint32_t() const { return _address; }
+	uint8_t operator[](int index) const { return (_address >> (8 * index)) & 0xff; }
+	bool operator==(const IPAddress& rhs) const { return _address == rhs._address; }
+	bool operator!=(const IPAddress& rhs) const { return _address != rhs._address; }
+	bool isSet() const { return _address != 0; }
+	String toString() const;
+
+	size_t printTo(Print& p) const override;
+
+private:
+	// network byte order, like the lwIP ip4_addr
+	uint32_t _address;
+};
+
+// Host stand-in for the TCP client, a non-blocking POSIX stream socket once connected
+class WiFiClient : public Stream {
+public:
+	WiFiClient() {}
+	~WiFiClient() { stop(); }
+
+	// blocking connect, as on the device
+	int connect(const char* host, uint16_t port);
+	uint8_t connected();
+	void stop();
+
+	int available() override;
+	int read() override;
+	int read(uint8_t* buffer, size_t len);
+	int peek() override;
+	size_t write(uint8_t c) override;
+	size_t write(const uint8_t* buffer, size_t size) override;
+	using Print::write;
+
+private:
+	int _fd = -1;
+	bool _eof = false;
+	uint8_t _rx[1460];
+	size_t _rxLen = 0;
+	size_t _rxPos = 0;
+
+	void fill();
+};
+
+class ESP8266WiFiClass {
+public:
+	uint8_t* macAddress(uint8_t* mac);
+	bool mode(WiFiMode_t m) { _mode = m; return true; }
+	WiFiMode_t getMode() { return _mode; }
+	bool softAP(const char* ssid, const char* passphrase = NULL);
+	wl_status_t begin(const char* ssid, const char* passphrase = NULL, int32_t channel = 0, const uint8_t* bssid = NULL, bool connect = true);
+	bool config(IPAddress local_ip, IPAddress gateway, IPAddress subnet, IPAddress dns1 = (uint32_t)0);
+	bool disconnect(bool wifioff = false);
+	wl_status_t status();
+	IPAddress localIP() { return status() == WL_CONNECTED ? _localIP : IPAddress(); }
+	IPAddress gatewayIP() { return _gatewayIP; }
+	IPAddress subnetMask() { return _subnetMask; }
+	IPAddress dnsIP() { return _gatewayIP; }
+	uint8_t* BSSID() { return hostBSSID; }
+	int32_t channel() { return hostChannel; }
+
+	// host only
+	uint8_t hostMac[WL_MAC_ADDR_LENGTH] = { 0x5C, 0xCF, 0x7F, 0x12, 0x34, 0x56 };
+	unsigned long hostConnectDelay = 1500;
+	unsigned long hostScanDelay = 1000;
+	unsigned long hostDhcpDelay = 300;
+	bool hostConnectFails = false;
+	unsigned long hostBeginCount = 0;
+
+	// the access point, and the address its DHCP server leases
+	uint8_t hostBSSID[6] = { 0xA0, 0xF3, 0xC1, 0x00, 0x11, 0x22 };
+	int32_t hostChannel = 6;
+	IPAddress hostLeaseIP = IPAddress(192, 168, 1, 50);
+	bool hostStaticIP() { return _staticIP; }
+
+private:
+	WiFiMode_t _mode = WIFI_STA;
+	bool _begun = false;
+	unsigned long _beginTime = 0;
+	unsigned long _connectDelay = 0;
+	bool _staticIP = false;
+	bool _wrongAP = false;
+	IPAddress _localIP = IPAddress(192, 168, 1, 50);
+	IPAddress _gatewayIP = IPAddress(192, 168, 1, 1);
+	IPAddress _subnetMask = IPAddress(255, 255, 255, 0);
+};
+
+extern ESP8266WiFiClass WiFi;
+
+#endif
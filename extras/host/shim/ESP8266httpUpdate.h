@@ -0,0 +1,37 @@
+#ifndef ESP8266httpUpdate_h
+#define ESP8266httpUpdate_h
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+
+typedef enum {
+	HTTP_UPDATE_FAILED,
+	HTTP_UPDATE_NO_UPDATES,
+	HTTP_UPDATE_OK
+} HTTPUpdateResult;
+
+typedef HTTPUpdateResult t_httpUpdate_return;
+
+// Host stand-in: never downloads, answers with hostResult.
+class ESP8266HTTPUpdate {
+public:
+	void rebootOnUpdate(bool reboot) { _reboot = reboot; }
+	t_httpUpdate_return update(WiFiClient& client, const String& url, const String& currentVersion = "") {
+		(void)client; (void)url; (void)currentVersion;
+		hostCalls++;
+		return hostResult;
+	}
+	int getLastError() { return hostResult == HTTP_UPDATE_FAILED ? -1 : 0; }
+	String getLastErrorString() { return hostResult == HTTP_UPDATE_FAILED ? "HTTP error" : ""; }
+
+	// host only
+	t_httpUpdate_return hostResult = HTTP_UPDATE_NO_UPDATES;
+	unsigned long hostCalls = 0;
+
+private:
+	bool _reboot = true;
+};
+
+extern ESP8266HTTPUpdate ESPhttpUpdate;
+
+#endif
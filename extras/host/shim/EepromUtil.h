@@ -0,0 +1,51 @@
+#ifndef EepromUtil_h
+#define EepromUtil_h
+
+#include "Arduino.h"
+#include "EEPROM.h"
+
+// same bounds the firmware projects build EepromUtil with
+#define EEPROM_MIN_ADDR 0
+#define EEPROM_MAX_ADDR 1024
+
+class EepromUtil {
+public:
+	static boolean eeprom_is_addr_ok(int addr) {
+		return addr >= EEPROM_MIN_ADDR && addr < EEPROM_MAX_ADDR;
+	}
+
+	static boolean eeprom_read_bytes(int startAddr, byte array[], int numBytes) {
+		if (!eeprom_is_addr_ok(startAddr) || !eeprom_is_addr_ok(startAddr + numBytes - 1)) {
+			return false;
+		}
+		for (int i = 0; i < numBytes; i++) {
+			array[i] = EEPROM.read(startAddr + i);
+		}
+		return true;
+	}
+
+	static boolean eeprom_write_bytes(int startAddr, const byte* array, int numBytes) {
+		if (!eeprom_is_addr_ok(startAddr) || !eeprom_is_addr_ok(startAddr + numBytes - 1)) {
+			return false;
+		}
+		for (int i = 0; i < numBytes; i++) {
+			EEPROM.write(startAddr + i, array[i]);
+		}
+		return true;
+	}
+
+	// write only the bytes which differ from what is stored
+	static boolean eeprom_update_bytes(int startAddr, const byte* array, int numBytes) {
+		if (!eeprom_is_addr_ok(startAddr) || !eeprom_is_addr_ok(startAddr + numBytes - 1)) {
+			return false;
+		}
+		for (int i = 0; i < numBytes; i++) {
+			if (EEPROM.read(startAddr + i) != array[i]) {
+				EEPROM.write(startAddr + i, array[i]);
+			}
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef Esp_h
+#define Esp_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// RTC user memory of the ESP8266, kept over resets and deep sleep, lost on power loss
+#define HOST_RTC_USER_MEMORY_SIZE 512
+
+// Host stand-in for the ESP object: restart() is only counted, heap and stack figures are whatever the host sets.
+// RTC user memory is an array which outlives "reboots" within the process until hostPowerLoss()
+class EspClass {
+public:
+	void restart() { hostRestarts++; }
+
+	// offset in 4-byte blocks, size in bytes, as on the device
+	bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size) {
+		if (offset * 4 + size > HOST_RTC_USER_MEMORY_SIZE || size == 0) return false;
+		memcpy(data, (uint8_t*)hostRtcMemory + offset * 4, size);
+		hostRtcReads++;
+		return true;
+	}
+	bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size) {
+		if (offset * 4 + size > HOST_RTC_USER_MEMORY_SIZE || size == 0) return false;
+		memcpy((uint8_t*)hostRtcMemory + offset * 4, data, size);
+		hostRtcWrites++;
+		hostRtcBytesWritten += size;
+		return true;
+	}
+
+	uint32_t getFreeSketchSpace() { return hostFreeSketchSpace; }
+	uint32_t getSketchSize() { return hostSketchSize; }
+	uint32_t getFreeHeap() { return hostFreeHeap; }
+	uint32_t getFreeContStack() { return hostFreeContStack; }
+	uint32_t getMaxFreeBlockSize() { return hostMaxFreeBlockSize; }
+	uint8_t getHeapFragmentation() { return hostHeapFragmentation; }
+
+	// host only
+	unsigned long hostRestarts = 0;
+	uint32_t hostFreeSketchSpace = 1024 * 1024;
+	uint32_t hostSketchSize = 380 * 1024;
+	uint32_t hostFreeHeap = 45000;
+	uint32_t hostFreeContStack = 3500;
+	uint32_t hostMaxFreeBlockSize = 40000;
+	uint8_t hostHeapFragmentation = 11;
+
+	// RTC memory comes up with random content after power on
+	void hostPowerLoss() {
+		for (size_t i = 0; i < HOST_RTC_USER_MEMORY_SIZE / 4; i++) hostRtcMemory[i] = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+	}
+	uint32_t hostRtcMemory[HOST_RTC_USER_MEMORY_SIZE / 4] = {};
+	unsigned long hostRtcReads = 0;
+	unsigned long hostRtcWrites = 0;
+	unsigned long hostRtcBytesWritten = 0;
+};
+
+extern EspClass ESP;
+
+#endif
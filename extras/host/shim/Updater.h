@@ -0,0 +1,82 @@
+#ifndef Updater_h
+#define Updater_h
+
+#include "Arduino.h"
+#include <string>
+#include <vector>
+
+#define UPDATE_ERROR_OK 0
+#define UPDATE_ERROR_WRITE 1
+#define UPDATE_ERROR_SPACE 4
+#define UPDATE_ERROR_SIZE 5
+#define UPDATE_ERROR_MD5 7
+
+// lower case hex digest, HostShim.cpp
+std::string hostMD5(const uint8_t* data, size_t len);
+
+// Host stand-in for the OTA Updater: the image is kept in hostImage instead of the flash update partition
+class UpdaterClass {
+public:
+	bool begin(size_t size) {
+		if (size == 0 || size > ESP.getFreeSketchSpace()) {
+			_error = UPDATE_ERROR_SPACE;
+			return false;
+		}
+		hostImage.clear();
+		_md5.clear();
+		_size = size;
+		_error = UPDATE_ERROR_OK;
+		_running = true;
+		return true;
+	}
+
+	size_t write(uint8_t* data, size_t len) {
+		if (!_running || hostImage.size() + len > _size) {
+			_error = UPDATE_ERROR_WRITE;
+			return 0;
+		}
+		hostImage.insert(hostImage.end(), data, data + len);
+		return len;
+	}
+
+	bool end(bool evenIfRemaining = false) {
+		_running = false;
+		if (hostImage.size() != _size && !evenIfRemaining) {
+			_error = UPDATE_ERROR_SIZE;
+			return false;
+		}
+		if (!_md5.empty() && hostMD5(hostImage.data(), hostImage.size()) != _md5) {
+			_error = UPDATE_ERROR_MD5;
+		}
+		hostFinished = _error == UPDATE_ERROR_OK;
+		return hostFinished;
+	}
+
+	// 32 hex digits, checked by end()
+	bool setMD5(const char* expected_md5) {
+		if (strlen(expected_md5) != 32) return false;
+		_md5 = expected_md5;
+		for (char& c : _md5) c = tolower(c);
+		return true;
+	}
+
+	bool hasError() { return _error != UPDATE_ERROR_OK; }
+	uint8_t getError() { return _error; }
+	bool isRunning() { return _running; }
+	size_t size() { return _size; }
+	size_t progress() { return hostImage.size(); }
+
+	// host only
+	std::vector<uint8_t> hostImage;
+	bool hostFinished = false;
+
+private:
+	size_t _size = 0;
+	uint8_t _error = UPDATE_ERROR_OK;
+	bool _running = false;
+	std::string _md5;
+};
+
+extern UpdaterClass Update;
+
+#endif
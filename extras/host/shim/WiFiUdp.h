@@ -0,0 +1,61 @@
+#ifndef WiFiUdp_h
+#define WiFiUdp_h
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+
+/***
+*
+*	Host stand-in for WiFiUDP backed by a non-blocking POSIX datagram socket.
+*	IPAddress values are kept in network byte order as on the device.
+*
+***/
+
+class WiFiUDP : public Stream {
+public:
+	WiFiUDP() {}
+	~WiFiUDP() { stop(); }
+
+	uint8_t begin(uint16_t port);
+	void stop();
+
+	int parsePacket();
+	int available() override;
+	int read() override;
+	int read(unsigned char* buffer, size_t len);
+	int read(char* buffer, size_t len) { return read((unsigned char*)buffer, len); }
+	int peek() override;
+	void flush() override;
+
+	IPAddress remoteIP() { return _remoteIP; }
+	uint16_t remotePort() { return _remotePort; }
+
+	int beginPacket(IPAddress ip, uint16_t port);
+	int beginPacket(const char* host, uint16_t port);
+	int endPacket();
+	size_t write(uint8_t c) override;
+	size_t write(const uint8_t* buffer, size_t size) override;
+	using Print::write;
+
+	// host only: bind to this local address instead of INADDR_ANY (e.g. 127.0.0.x)
+	IPAddress hostBindAddress;
+	int hostSocket() { return _fd; }
+
+	// host only: microseconds every received datagram adds to the clock, for the device's per-packet cost
+	unsigned int hostPacketCost = 0;
+
+private:
+	int _fd = -1;
+	uint8_t _rx[1472];
+	size_t _rxLen = 0;
+	size_t _rxPos = 0;
+	IPAddress _remoteIP;
+	uint16_t _remotePort = 0;
+
+	uint8_t _tx[1472];
+	size_t _txLen = 0;
+	IPAddress _txIP;
+	uint16_t _txPort = 0;
+};
+
+#endif
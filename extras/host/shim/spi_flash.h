@@ -0,0 +1,47 @@
+#ifndef spi_flash_h
+#define spi_flash_h
+
+#include <stdint.h>
+
+/***
+*
+*	Host stand-in for the ESP8266 SDK raw flash API.
+*	Behaves like NOR flash: erase sets a 4 KB sector to 0xFF, programming can only clear bits.
+*	Addresses and sizes must be 4-byte aligned, as on the device.
+*
+***/
+
+#ifndef SPI_FLASH_SEC_SIZE
+#define SPI_FLASH_SEC_SIZE 4096
+#endif
+
+// sectors of host flash available to spi_flash_*
+#define HOST_FLASH_SECTORS 64
+
+typedef enum {
+	SPI_FLASH_RESULT_OK,
+	SPI_FLASH_RESULT_ERR,
+	SPI_FLASH_RESULT_TIMEOUT
+} SpiFlashOpResult;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+SpiFlashOpResult spi_flash_erase_sector(uint16_t sec);
+SpiFlashOpResult spi_flash_write(uint32_t des_addr, uint32_t* src_addr, uint32_t size);
+SpiFlashOpResult spi_flash_read(uint32_t src_addr, uint32_t* des_addr, uint32_t size);
+
+// host only
+extern unsigned long hostFlashErases[HOST_FLASH_SECTORS];
+unsigned long hostFlashTotalErases();
+void hostFlashReset();
+
+// the next spi_flash_write stops after this many bytes (simulated power loss), 0 = off
+extern uint32_t hostFlashTearAfter;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif